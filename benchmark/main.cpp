@@ -0,0 +1,334 @@
+#include <core/Scene.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+namespace
+{
+	struct Options
+	{
+		std::vector<std::size_t> sphereCounts{ 10, 100, 1000, 10000, 100000, 1000000 };
+		std::vector<unsigned> threadCounts;
+		int width = 320;
+		int height = 240;
+		int frames = 8;
+		unsigned seed = 1;
+		bool singlePrecision = false;
+		// Builds scenes through Scene::addObject, one allocation per part, instead of emplaceSphere.
+		bool heapObjects = false;
+		const char* outputPath = nullptr;
+	};
+
+	std::uint64_t getPeakRssBytes()
+	{
+#ifdef _WIN32
+		PROCESS_MEMORY_COUNTERS counters;
+		if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+			return 0;
+		return counters.PeakWorkingSetSize;
+#else
+		rusage usage;
+		if (getrusage(RUSAGE_SELF, &usage) != 0)
+			return 0;
+#ifdef __APPLE__
+		return std::uint64_t(usage.ru_maxrss);
+#else
+		return std::uint64_t(usage.ru_maxrss) * 1024;
+#endif
+#endif
+	}
+
+	double secondsSince(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	template<typename T>
+	struct BenchScene
+	{
+		Scene<T> scene;
+		std::vector<Camera<T> > cameraPath;
+		std::size_t lightCount = 0;
+	};
+
+	// Spheres fill a cube whose side grows with the cube root of their count, keeping the density
+	// roughly constant. The camera orbits the cube at random heights, always looking at its center.
+	template<typename T>
+	void buildBenchScene(BenchScene<T>& bench, std::size_t sphereCount, int frames, unsigned seed, bool heapObjects)
+	{
+		std::mt19937 rng(seed);
+		const T halfExtent = std::max(T(1), std::cbrt(T(sphereCount)));
+		std::uniform_real_distribution<T> position(-halfExtent, halfExtent);
+		std::uniform_real_distribution<T> radius(T(0.2), T(1));
+		std::uniform_real_distribution<T> unit(T(0), T(1));
+
+		if (!heapObjects)
+			bench.scene.reserve(sphereCount);
+		for (std::size_t i = 0; i < sphereCount; ++i)
+		{
+			// Same draws in the same order on both paths, so that they build the same scene.
+			const Point3<T> center{ position(rng), position(rng), position(rng) };
+			const T r = radius(rng);
+			const Color<T> color{ unit(rng), unit(rng), unit(rng) };
+			if (heapObjects)
+				bench.scene.addObject(new SphereGeometry<T>{ center, r }, new FlatColorizer<T>{ color }, new OpticalProperties<T>{});
+			else
+			{
+				const OpticalProperties<T> defaults;
+				bench.scene.emplaceSphere(center, r, bench.scene.addMaterial(color, defaults.ambient, defaults.diffusion));
+			}
+		}
+
+		bench.lightCount = 1 + rng() % 4;
+		for (std::size_t i = 0; i < bench.lightCount; ++i)
+		{
+			bench.scene.addLight(new PointLight<T>{ { position(rng), halfExtent * T(2), position(rng) },
+				{ unit(rng), unit(rng), unit(rng) }, T(100) * halfExtent * halfExtent });
+		}
+
+		const T orbitRadius = halfExtent * T(2.5);
+		std::uniform_real_distribution<T> height(-halfExtent * T(0.5), halfExtent);
+		std::uniform_real_distribution<T> jitter(T(-0.1), T(0.1));
+		for (int frame = 0; frame < frames; ++frame)
+		{
+			T angle = T(2) * pi<T>() * T(frame) / T(frames) + jitter(rng);
+			Point3<T> origin{ orbitRadius * std::cos(angle), height(rng), orbitRadius * std::sin(angle) };
+			Vec3<T> direction = Point3<T>{ jitter(rng) * halfExtent, jitter(rng) * halfExtent, jitter(rng) * halfExtent } - origin;
+			bench.cameraPath.push_back(Camera<T>{ origin, direction, deg_to_rad(T(60)) });
+		}
+	}
+
+	struct ThreadRun
+	{
+		unsigned threads;
+		double seconds;
+	};
+
+	template<typename T>
+	void runScene(const Options& options, std::size_t sphereCount, std::FILE* out, bool last)
+	{
+		std::unique_ptr<BenchScene<T> > owner(new BenchScene<T>);
+		BenchScene<T>& bench = *owner;
+		auto start = std::chrono::steady_clock::now();
+		buildBenchScene(bench, sphereCount, options.frames, options.seed, options.heapObjects);
+		double generateSeconds = secondsSince(start);
+
+		start = std::chrono::steady_clock::now();
+		bench.scene.compile();
+		double compileSeconds = secondsSince(start);
+
+		Viewport<T> viewport{ options.width, options.height };
+
+		// Untimed pass counting the primitives each primary ray is tested against. The timed runs divided
+		// by this count give the whole per-test cost, traversal and shading included.
+		std::uint64_t intersectionTests = 0;
+		for (const auto& camera : bench.cameraPath)
+		{
+			PreparedCamera<T> prepared = camera.prepare(viewport);
+			for (int row = 0; row < options.height; ++row)
+			{
+				for (int col = 0; col < options.width; ++col)
+				{
+					std::size_t tests = 0;
+					SurfaceHit<T> hit{ NO_CONTACT<T>(), NO_OBJECT, 0 };
+					bench.scene.getCompiledScene().findClosestHit(prepared.getRay(row, col), hit, &tests);
+					intersectionTests += tests;
+				}
+			}
+		}
+
+		const double rays = double(options.width) * double(options.height) * double(bench.cameraPath.size());
+		std::vector<ThreadRun> runs;
+		for (unsigned threads : options.threadCounts)
+		{
+			ThreadPool pool(threads);
+			start = std::chrono::steady_clock::now();
+			for (const auto& camera : bench.cameraPath)
+				bench.scene.render(camera, viewport, pool);
+			runs.push_back({ threads, secondsSince(start) });
+		}
+
+		const std::size_t lightCount = bench.lightCount;
+		const std::size_t bvhNodes = bench.scene.getBVHNodeCount();
+		const std::size_t compiledBytes = bench.scene.getCompiledMemoryFootprint();
+		start = std::chrono::steady_clock::now();
+		owner.reset();
+		double destroySeconds = secondsSince(start);
+
+		std::fprintf(out, "    {\n");
+		std::fprintf(out, "      \"spheres\": %zu,\n", sphereCount);
+		std::fprintf(out, "      \"lights\": %zu,\n", lightCount);
+		std::fprintf(out, "      \"generateSeconds\": %.6f,\n", generateSeconds);
+		std::fprintf(out, "      \"compileSeconds\": %.6f,\n", compileSeconds);
+		std::fprintf(out, "      \"destroySeconds\": %.6f,\n", destroySeconds);
+		std::fprintf(out, "      \"bvhNodes\": %zu,\n", bvhNodes);
+		std::fprintf(out, "      \"compiledBytes\": %zu,\n", compiledBytes);
+		std::fprintf(out, "      \"primaryRays\": %.0f,\n", rays);
+		std::fprintf(out, "      \"intersectionTests\": %llu,\n", (unsigned long long)intersectionTests);
+		std::fprintf(out, "      \"intersectionTestsPerRay\": %.3f,\n", double(intersectionTests) / rays);
+		std::fprintf(out, "      \"peakRssBytes\": %llu,\n", (unsigned long long)getPeakRssBytes());
+		std::fprintf(out, "      \"runs\": [\n");
+		for (std::size_t i = 0; i < runs.size(); ++i)
+		{
+			const ThreadRun& run = runs[i];
+			std::fprintf(out, "        { \"threads\": %u, \"seconds\": %.6f, \"raysPerSecond\": %.1f, \"nsPerIntersectionTest\": %.4f, \"speedup\": %.3f }%s\n",
+				run.threads, run.seconds, rays / run.seconds,
+				intersectionTests != 0 ? run.seconds * 1e9 / double(intersectionTests) : 0.0,
+				runs.front().seconds / run.seconds, i + 1 < runs.size() ? "," : "");
+		}
+		std::fprintf(out, "      ]\n");
+		std::fprintf(out, "    }%s\n", last ? "" : ",");
+		std::fflush(out);
+	}
+
+	template<typename T>
+	void runAll(const Options& options, std::FILE* out)
+	{
+		std::fprintf(out, "{\n");
+		std::fprintf(out, "  \"precision\": \"%s\",\n", options.singlePrecision ? "float" : "double");
+		std::fprintf(out, "  \"objects\": \"%s\",\n", options.heapObjects ? "addObject" : "emplaceSphere");
+		std::fprintf(out, "  \"simd\": \"%s\",\n", getSimdIsaName(detectSimdIsa()));
+		std::fprintf(out, "  \"hardwareThreads\": %u,\n", std::thread::hardware_concurrency());
+		std::fprintf(out, "  \"width\": %d,\n", options.width);
+		std::fprintf(out, "  \"height\": %d,\n", options.height);
+		std::fprintf(out, "  \"frames\": %d,\n", options.frames);
+		std::fprintf(out, "  \"seed\": %u,\n", options.seed);
+		std::fprintf(out, "  \"scenes\": [\n");
+		for (std::size_t i = 0; i < options.sphereCounts.size(); ++i)
+			runScene<T>(options, options.sphereCounts[i], out, i + 1 == options.sphereCounts.size());
+		std::fprintf(out, "  ],\n");
+		std::fprintf(out, "  \"peakRssBytes\": %llu\n", (unsigned long long)getPeakRssBytes());
+		std::fprintf(out, "}\n");
+	}
+
+	// Comma-separated unsigned integers. Reports the first item that is not one, e.g. "1e3", "-4",
+	// an empty item or a value out of range, and returns false.
+	template<typename U>
+	bool parseList(const char* option, const char* text, std::vector<U>& values)
+	{
+		values.clear();
+		for (const char* item = text;;)
+		{
+			const char* itemEnd = std::strchr(item, ',');
+			const int itemLength = int(itemEnd != nullptr ? itemEnd - item : std::strlen(item));
+			char* end;
+			errno = 0;
+			const unsigned long long value = std::strtoull(item, &end, 10);
+			if (end == item || *item < '0' || *item > '9' || errno == ERANGE || value > std::numeric_limits<U>::max() || end != item + itemLength)
+			{
+				std::fprintf(stderr, "%s: malformed number '%.*s' in '%s'\n", option, itemLength, item, text);
+				return false;
+			}
+			values.push_back(U(value));
+			if (itemEnd == nullptr)
+				return true;
+			item = itemEnd + 1;
+		}
+	}
+
+	void printUsage(const char* program)
+	{
+		std::fprintf(stderr,
+			"usage: %s [--spheres 10,1000,...] [--threads 1,2,4,...] [--size WxH] [--frames N] [--seed N] [--float] [--objects] [--output file.json]\n",
+			program);
+	}
+
+	bool parseOptions(int argc, char** argv, Options& options)
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			const std::string arg = argv[i];
+			const bool hasValue = i + 1 < argc;
+			if (arg == "--spheres" && hasValue)
+			{
+				if (!parseList(argv[i], argv[i + 1], options.sphereCounts))
+					return false;
+				++i;
+			}
+			else if (arg == "--threads" && hasValue)
+			{
+				if (!parseList(argv[i], argv[i + 1], options.threadCounts))
+					return false;
+				++i;
+			}
+			else if (arg == "--size" && hasValue)
+			{
+				if (std::sscanf(argv[++i], "%dx%d", &options.width, &options.height) != 2)
+					return false;
+			}
+			else if (arg == "--frames" && hasValue)
+				options.frames = std::atoi(argv[++i]);
+			else if (arg == "--seed" && hasValue)
+				options.seed = unsigned(std::strtoul(argv[++i], nullptr, 10));
+			else if (arg == "--float")
+				options.singlePrecision = true;
+			else if (arg == "--objects")
+				options.heapObjects = true;
+			else if (arg == "--output" && hasValue)
+				options.outputPath = argv[++i];
+			else
+				return false;
+		}
+
+		if (options.threadCounts.empty())
+		{
+			// Powers of two up to the hardware thread count, which is always measured.
+			const unsigned hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+			for (unsigned threads = 1; threads < hardwareThreads; threads *= 2)
+				options.threadCounts.push_back(threads);
+			options.threadCounts.push_back(hardwareThreads);
+		}
+
+		return options.width > 0 && options.height > 0 && options.frames > 0 && !options.sphereCounts.empty();
+	}
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	if (!parseOptions(argc, argv, options))
+	{
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	std::FILE* out = stdout;
+	if (options.outputPath != nullptr)
+	{
+		out = std::fopen(options.outputPath, "w");
+		if (out == nullptr)
+		{
+			std::fprintf(stderr, "cannot open %s\n", options.outputPath);
+			return 1;
+		}
+	}
+
+	if (options.singlePrecision)
+		runAll<float>(options, out);
+	else
+		runAll<double>(options, out);
+
+	if (out != stdout)
+		std::fclose(out);
+	return 0;
+}
@@ -0,0 +1,223 @@
+#pragma once
+
+#include "Camera.h"
+#include "Scene.h"
+#include "ThreadPool.h"
+#include "Viewport.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+struct AdaptiveSamplingSettings
+{
+	// Average samples per pixel over the frame, the first one included; refinement stops once it is spent.
+	float sampleBudget = 3.f;
+	// Samples a pixel can get, its centre included, from 1 to 17: the centre and one per stratum.
+	int maxSamples = 17;
+	// A pixel is refined when its luminance differs from a neighbour's by more than this, relative to their sum.
+	float contrastThreshold = 0.02f;
+	// A refined pixel keeps sampling while the standard error of its mean luminance, relative to
+	// that mean, is above this.
+	float varianceThreshold = 0.003f;
+	unsigned seed = 0;
+};
+
+// Anti-aliasing that spends samples where the image needs them. Every pixel first gets its centre
+// sample, exactly as Scene::render; pixels contrasting with a neighbour then get 4 jittered samples,
+// one per quadrant, and those whose samples still disagree get 4 more per round from a 4x4
+// stratified pattern, until all 16 strata are covered. Each round refines the highest-priority
+// pixels first, so the sample budget caps the cost.
+template<typename T>
+class AdaptiveSampler
+{
+public:
+	explicit AdaptiveSampler(const AdaptiveSamplingSettings& settings = AdaptiveSamplingSettings{}) : m_settings(settings)
+	{}
+
+	void setSettings(const AdaptiveSamplingSettings& settings) { m_settings = settings; }
+	const AdaptiveSamplingSettings& getSettings() const { return m_settings; }
+
+	// Compiles the scene first if needed.
+	void render(Scene<T>& scene, const Camera<T>& camera, Viewport<T>& viewport, ThreadPool& pool);
+
+	// Samples each pixel used in the last render, row-major.
+	const std::vector<std::uint16_t>& getSampleCounts() const { return m_sampleCounts; }
+	std::size_t getSampleTotal() const { return m_sampleTotal; }
+
+private:
+	static T getLuminance(const Color<T>& c) { return T(0.2126) * c.r + T(0.7152) * c.g + T(0.0722) * c.b; }
+
+	// Adds samples [firstSample, endSample) of the pattern to as many candidates as the budget allows,
+	// highest priority first.
+	void refine(const Scene<T>& scene, const PreparedCamera<T>& camera, Viewport<T>& viewport, ThreadPool& pool, std::size_t budget, int firstSample, int endSample);
+	void addSamples(const Scene<T>& scene, const PreparedCamera<T>& camera, Viewport<T>& viewport, std::uint32_t pixel, int firstSample, int endSample);
+
+	AdaptiveSamplingSettings m_settings;
+	std::vector<std::uint16_t> m_sampleCounts;
+	std::vector<T> m_luminanceMean;
+	std::vector<T> m_luminanceM2;
+	std::vector<std::uint32_t> m_candidates;
+	std::vector<T> m_priorities;
+	std::size_t m_sampleTotal = 0;
+};
+
+namespace detail
+{
+	// Stateless per-sample random numbers, so that the image does not depend on the thread schedule.
+	inline std::uint32_t hashSample(std::uint32_t pixel, std::uint32_t sample, std::uint32_t seed)
+	{
+		std::uint32_t h = pixel * 0x9E3779B1u ^ (sample + 0x7F4A7C15u) * 0x85EBCA77u ^ seed * 0xC2B2AE3Du;
+		h ^= h >> 16;
+		h *= 0x7FEB352Du;
+		h ^= h >> 15;
+		h *= 0x846CA68Bu;
+		h ^= h >> 16;
+		return h;
+	}
+}
+
+template<typename T>
+void AdaptiveSampler<T>::render(Scene<T>& scene, const Camera<T>& camera, Viewport<T>& viewport, ThreadPool& pool)
+{
+	scene.render(camera, viewport, pool);
+
+	const int width = viewport.getWidth(), height = viewport.getHeight();
+	const std::size_t pixelCount = std::size_t(width) * std::size_t(height);
+	m_sampleCounts.assign(pixelCount, 1);
+	m_luminanceMean.resize(pixelCount);
+	m_luminanceM2.assign(pixelCount, T(0));
+	m_sampleTotal = pixelCount;
+
+	T frameLuminance = 0;
+	for (std::size_t i = 0; i < pixelCount; ++i)
+	{
+		m_luminanceMean[i] = getLuminance(viewport(int(i % width), int(i / width)));
+		frameLuminance += std::abs(m_luminanceMean[i]);
+	}
+	frameLuminance = pixelCount != 0 ? frameLuminance / T(pixelCount) : T(0);
+
+	const int maxSamples = std::max(1, std::min(17, m_settings.maxSamples));
+	const std::size_t budget = std::size_t(std::max(1.f, m_settings.sampleBudget) * float(pixelCount));
+	if (maxSamples == 1 || budget <= pixelCount)
+		return;
+
+	// Keeps nearly black pixels from turning tiny absolute differences into large relative ones.
+	const T floor = std::max(T(1e-3) * frameLuminance, std::numeric_limits<T>::min());
+	const PreparedCamera<T> prepared = camera.prepare(viewport);
+
+	// Edges: relative contrast with the four neighbours.
+	m_candidates.clear();
+	m_priorities.clear();
+	for (int row = 0; row < height; ++row)
+	{
+		for (int col = 0; col < width; ++col)
+		{
+			const std::size_t i = std::size_t(row) * width + col;
+			const T l = m_luminanceMean[i];
+			T contrast = 0;
+			auto compare = [&](std::size_t j)
+			{
+				const T other = m_luminanceMean[j];
+				contrast = std::max(contrast, std::abs(l - other) / (std::abs(l) + std::abs(other) + floor));
+			};
+			if (col > 0) compare(i - 1);
+			if (col + 1 < width) compare(i + 1);
+			if (row > 0) compare(i - width);
+			if (row + 1 < height) compare(i + width);
+
+			if (contrast > T(m_settings.contrastThreshold))
+			{
+				m_candidates.push_back(std::uint32_t(i));
+				m_priorities.push_back(contrast);
+			}
+		}
+	}
+	refine(scene, prepared, viewport, pool, budget, 0, std::min(maxSamples - 1, 4));
+
+	// Then rounds of 4 more samples, one per quadrant, for the pixels whose samples still disagree
+	// most, by standard error of their mean luminance.
+	std::vector<std::uint32_t> refined;
+	for (int firstSample = 4; firstSample < maxSamples - 1 && m_sampleTotal < budget && !m_candidates.empty(); firstSample += 4)
+	{
+		refined.swap(m_candidates);
+		m_candidates.clear();
+		m_priorities.clear();
+		for (std::uint32_t i : refined)
+		{
+			const T n = T(m_sampleCounts[i]);
+			const T error = std::sqrt(m_luminanceM2[i] / (n - T(1)) / n) / (std::abs(m_luminanceMean[i]) + T(0.1) * frameLuminance + floor);
+			if (error > T(m_settings.varianceThreshold))
+			{
+				m_candidates.push_back(i);
+				m_priorities.push_back(error);
+			}
+		}
+		refine(scene, prepared, viewport, pool, budget, firstSample, std::min(maxSamples - 1, firstSample + 4));
+	}
+}
+
+template<typename T>
+void AdaptiveSampler<T>::refine(const Scene<T>& scene, const PreparedCamera<T>& camera, Viewport<T>& viewport, ThreadPool& pool, std::size_t budget, int firstSample, int endSample)
+{
+	const std::size_t maxPixels = budget > m_sampleTotal ? (budget - m_sampleTotal) / std::size_t(endSample - firstSample) : 0;
+	if (m_candidates.size() > maxPixels)
+	{
+		std::vector<std::uint32_t> order(m_candidates.size());
+		for (std::size_t i = 0; i < order.size(); ++i)
+			order[i] = std::uint32_t(i);
+		std::nth_element(order.begin(), order.begin() + std::ptrdiff_t(maxPixels), order.end(), [&](std::uint32_t a, std::uint32_t b)
+		{
+			return m_priorities[a] > m_priorities[b];
+		});
+		order.resize(maxPixels);
+		for (std::uint32_t& index : order)
+			index = m_candidates[index];
+		m_candidates.swap(order);
+		// Back in scan order, for coherent rays within a task.
+		std::sort(m_candidates.begin(), m_candidates.end());
+	}
+
+	const std::size_t chunkSize = 64;
+	pool.run((m_candidates.size() + chunkSize - 1) / chunkSize, [&](std::size_t chunk, unsigned)
+	{
+		const std::size_t end = std::min(m_candidates.size(), (chunk + 1) * chunkSize);
+		for (std::size_t i = chunk * chunkSize; i < end; ++i)
+			addSamples(scene, camera, viewport, m_candidates[i], firstSample, endSample);
+	});
+	m_sampleTotal += m_candidates.size() * std::size_t(endSample - firstSample);
+}
+
+template<typename T>
+void AdaptiveSampler<T>::addSamples(const Scene<T>& scene, const PreparedCamera<T>& camera, Viewport<T>& viewport, std::uint32_t pixel, int firstSample, int endSample)
+{
+	const int width = viewport.getWidth();
+	const int row = int(pixel / std::uint32_t(width)), col = int(pixel % std::uint32_t(width));
+	Color<T>& mean = viewport(col, row);
+	T& luminanceMean = m_luminanceMean[pixel];
+	T& luminanceM2 = m_luminanceM2[pixel];
+	std::uint16_t& count = m_sampleCounts[pixel];
+
+	for (int sample = firstSample; sample < endSample; ++sample)
+	{
+		// The pattern index is the stratum of a 4x4 grid, the centre sample aside; consecutive
+		// strata are in different quadrants.
+		const int quadrant = sample % 4, cell = sample / 4;
+		const int sx = (quadrant & 1) * 2 + (cell & 1);
+		const int sy = (quadrant >> 1) * 2 + (cell >> 1);
+		const T jitterX = T(detail::hashSample(pixel, 2 * std::uint32_t(sample), m_settings.seed) >> 8) * T(1. / 16777216.);
+		const T jitterY = T(detail::hashSample(pixel, 2 * std::uint32_t(sample) + 1, m_settings.seed) >> 8) * T(1. / 16777216.);
+
+		const Color<T> c = scene.traceRay(camera.getRay(row, col, (T(sx) + jitterX) / T(4) - T(0.5), (T(sy) + jitterY) / T(4) - T(0.5)), camera.getPixelSpread());
+
+		// Running means, and Welford's update for the luminance variance.
+		const T n = T(++count);
+		mean = { mean.r + (c.r - mean.r) / n, mean.g + (c.g - mean.g) / n, mean.b + (c.b - mean.b) / n };
+		const T l = getLuminance(c);
+		const T delta = l - luminanceMean;
+		luminanceMean += delta / n;
+		luminanceM2 += delta * (l - luminanceMean);
+	}
+}
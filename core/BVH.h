@@ -0,0 +1,459 @@
+#pragma once
+
+#include "RenderStats.h"
+
+#include "../math/AABB.h"
+#include "../math/RayPacket.h"
+#include "../math/Simd.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+enum class BVHQuality
+{
+	Fast,
+	Balanced,
+	High
+};
+
+struct BVHBuildSettings
+{
+	int binCount = 16;
+	int maxLeafSize = 4;
+	float traversalCost = 1.f;
+	float intersectionCost = 1.f;
+
+	static BVHBuildSettings fromQuality(BVHQuality quality)
+	{
+		BVHBuildSettings settings;
+		switch (quality)
+		{
+		case BVHQuality::Fast:
+			settings.binCount = 8;
+			settings.maxLeafSize = 8;
+			break;
+		case BVHQuality::Balanced:
+			break;
+		case BVHQuality::High:
+			settings.binCount = 32;
+			settings.maxLeafSize = 2;
+			break;
+		}
+		return settings;
+	}
+};
+
+// Nodes are stored depth-first: the first child of an interior node immediately follows it,
+// `offset` is the index of the second child. For a leaf, `offset` is the first entry in the
+// primitive index table and `count` the number of primitives.
+template<typename T>
+struct BVHNode
+{
+	AABB<T> bounds;
+	std::uint32_t offset;
+	std::uint16_t count;
+	std::uint16_t axis;
+
+	bool isLeaf() const { return count != 0; }
+};
+
+template<typename T>
+class BVH
+{
+public:
+	void build(const std::vector<AABB<T> >& primitiveBounds, const BVHBuildSettings& settings = BVHBuildSettings{});
+	// Uses nodes built earlier, e.g. in a mapped scene file, in place; they must outlive the hierarchy.
+	// Primitives are already in leaf order, so getPrimitiveIndices() stays empty. Returns false and
+	// stays empty if the nodes do not form a valid hierarchy over primitiveCount primitives.
+	bool adopt(const BVHNode<T>* nodes, std::size_t nodeCount, std::size_t primitiveCount);
+	void clear();
+
+	// Walks the hierarchy front to back. `intersectLeaf(primitiveIndex, tMax)` tests one primitive
+	// and is expected to lower `tMax` when it finds a closer hit.
+	template<typename IntersectFn>
+	void traverse(const Ray<T>& ray, T tMax, IntersectFn&& intersectLeaf) const;
+
+	// Same walk, handing over whole leaves as `intersectLeaves(first, count, tMax)` where
+	// [first, first + count) indexes getPrimitiveIndices(), or the primitives themselves once adopted. Within a leaf, primitives keep their input order.
+	template<typename IntersectFn>
+	void traverseLeaves(const Ray<T>& ray, T tMax, IntersectFn&& intersectLeaves) const;
+
+	// Any-hit walk of a batch of rays, restricted to those in activeMask. `intersectLeaves(first, count, mask)`
+	// gets the rays whose segment reaches the leaf and returns those it found blocked, which are then
+	// dropped; the walk ends early once every ray is blocked. Returns the rays left unblocked.
+	template<typename IntersectFn>
+	std::uint32_t traverseBatchLeaves(const ShadowRays<T>& rays, std::uint32_t activeMask, IntersectFn&& intersectLeaves) const;
+
+	std::size_t getNodeCount() const { return m_nodeCount; }
+	// Adopted nodes are not counted.
+	std::size_t getMemoryFootprint() const
+	{
+		return m_nodes.capacity() * sizeof(BVHNode<T>) + m_primitiveIndices.capacity() * sizeof(std::uint32_t);
+	}
+
+	const BVHNode<T>* getNodes() const { return m_externalNodes != nullptr ? m_externalNodes : m_nodes.data(); }
+	const std::vector<std::uint32_t>& getPrimitiveIndices() const { return m_primitiveIndices; }
+
+private:
+	struct BuildPrimitive
+	{
+		AABB<T> bounds;
+		Point3<T> centroid;
+		std::uint32_t index;
+	};
+
+	void buildRecursive(std::vector<BuildPrimitive>& primitives, std::uint32_t begin, std::uint32_t end, int depth, const BVHBuildSettings& settings);
+	void makeLeaf(std::vector<BuildPrimitive>& primitives, std::uint32_t nodeIndex, std::uint32_t begin, std::uint32_t end);
+
+	// Past this depth nodes are split at the median, which bounds the traversal stack.
+	static constexpr int MAX_SAH_DEPTH = 64;
+	static constexpr int MAX_STACK_SIZE = 128;
+
+	std::vector<BVHNode<T> > m_nodes;
+	std::vector<std::uint32_t> m_primitiveIndices;
+	const BVHNode<T>* m_externalNodes = nullptr;
+	std::size_t m_nodeCount = 0;
+};
+
+template<typename T>
+void BVH<T>::clear()
+{
+	m_nodes.clear();
+	m_nodes.shrink_to_fit();
+	m_primitiveIndices.clear();
+	m_primitiveIndices.shrink_to_fit();
+	m_externalNodes = nullptr;
+	m_nodeCount = 0;
+}
+
+template<typename T>
+void BVH<T>::build(const std::vector<AABB<T> >& primitiveBounds, const BVHBuildSettings& settings)
+{
+	clear();
+	if (primitiveBounds.empty())
+		return;
+
+	std::vector<BuildPrimitive> primitives;
+	primitives.reserve(primitiveBounds.size());
+	for (std::size_t i = 0; i < primitiveBounds.size(); ++i)
+		primitives.push_back({ primitiveBounds[i], primitiveBounds[i].getCentroid(), std::uint32_t(i) });
+
+	m_nodes.reserve(2 * primitiveBounds.size() / std::max(1, settings.maxLeafSize) + 1);
+	buildRecursive(primitives, 0, std::uint32_t(primitives.size()), 0, settings);
+	m_nodes.shrink_to_fit();
+	m_nodeCount = m_nodes.size();
+
+	m_primitiveIndices.reserve(primitives.size());
+	for (const auto& prim : primitives)
+		m_primitiveIndices.push_back(prim.index);
+}
+
+template<typename T>
+bool BVH<T>::adopt(const BVHNode<T>* nodes, std::size_t nodeCount, std::size_t primitiveCount)
+{
+	clear();
+	if (nodeCount == 0 || nodeCount > std::numeric_limits<std::uint32_t>::max())
+		return primitiveCount == 0 && nodeCount == 0;
+
+	// Children always come after their parent, so depths are known by the time a node is reached.
+	// Every node but the root has exactly one parent, and leaves cover the primitives in order.
+	std::vector<std::uint8_t> depth(nodeCount, 0);
+	std::vector<bool> referenced(nodeCount, false);
+	std::size_t nextPrimitive = 0;
+	for (std::size_t i = 0; i < nodeCount; ++i)
+	{
+		if (i != 0 && !referenced[i])
+			return false;
+
+		const BVHNode<T>& node = nodes[i];
+		if (node.isLeaf())
+		{
+			if (node.offset != nextPrimitive)
+				return false;
+			nextPrimitive += node.count;
+			continue;
+		}
+
+		if (node.axis > 2 || node.offset <= i + 1 || node.offset >= nodeCount || referenced[i + 1] || referenced[node.offset]
+			|| depth[i] >= MAX_STACK_SIZE)
+			return false;
+		referenced[i + 1] = referenced[node.offset] = true;
+		depth[i + 1] = depth[node.offset] = std::uint8_t(depth[i] + 1);
+	}
+	if (nextPrimitive != primitiveCount)
+		return false;
+
+	m_externalNodes = nodes;
+	m_nodeCount = nodeCount;
+	return true;
+}
+
+template<typename T>
+void BVH<T>::makeLeaf(std::vector<BuildPrimitive>& primitives, std::uint32_t nodeIndex, std::uint32_t begin, std::uint32_t end)
+{
+	std::sort(primitives.begin() + begin, primitives.begin() + end,
+		[](const BuildPrimitive& a, const BuildPrimitive& b) { return a.index < b.index; });
+
+	m_nodes[nodeIndex].offset = begin;
+	m_nodes[nodeIndex].count = std::uint16_t(end - begin);
+	m_nodes[nodeIndex].axis = 0;
+}
+
+template<typename T>
+void BVH<T>::buildRecursive(std::vector<BuildPrimitive>& primitives, std::uint32_t begin, std::uint32_t end, int depth, const BVHBuildSettings& settings)
+{
+	std::uint32_t nodeIndex = std::uint32_t(m_nodes.size());
+	m_nodes.push_back(BVHNode<T>{});
+
+	AABB<T> bounds;
+	AABB<T> centroidBounds;
+	for (std::uint32_t i = begin; i < end; ++i)
+	{
+		bounds = merge(bounds, primitives[i].bounds);
+		centroidBounds = merge(centroidBounds, primitives[i].centroid);
+	}
+	m_nodes[nodeIndex].bounds = bounds;
+
+	std::uint32_t count = end - begin;
+	if (count == 1)
+	{
+		makeLeaf(primitives, nodeIndex, begin, end);
+		return;
+	}
+
+	int axis = centroidBounds.getLargestAxis();
+	T axisMin = centroidBounds.min[axis];
+	T axisExtent = centroidBounds.max[axis] - axisMin;
+
+	std::uint32_t mid = begin;
+	if (axisExtent <= T(0) || depth >= MAX_SAH_DEPTH)
+	{
+		// All centroids coincide, or SAH produced a degenerate chain: split by count unless they fit in a leaf.
+		if (count <= std::uint32_t(settings.maxLeafSize))
+		{
+			makeLeaf(primitives, nodeIndex, begin, end);
+			return;
+		}
+	}
+	else
+	{
+		const int binCount = std::max(2, settings.binCount);
+		struct Bin
+		{
+			AABB<T> bounds;
+			std::uint32_t count = 0;
+		};
+		std::vector<Bin> bins(binCount);
+
+		auto binOf = [&](const BuildPrimitive& prim)
+		{
+			int b = int(T(binCount) * (prim.centroid[axis] - axisMin) / axisExtent);
+			return std::min(std::max(b, 0), binCount - 1);
+		};
+
+		for (std::uint32_t i = begin; i < end; ++i)
+		{
+			Bin& bin = bins[binOf(primitives[i])];
+			bin.bounds = merge(bin.bounds, primitives[i].bounds);
+			++bin.count;
+		}
+
+		std::vector<T> rightArea(binCount);
+		std::vector<std::uint32_t> rightCount(binCount);
+		AABB<T> accumulated;
+		std::uint32_t accumulatedCount = 0;
+		for (int b = binCount - 1; b > 0; --b)
+		{
+			accumulated = merge(accumulated, bins[b].bounds);
+			accumulatedCount += bins[b].count;
+			rightArea[b] = accumulated.getSurfaceArea();
+			rightCount[b] = accumulatedCount;
+		}
+
+		T bestCost = std::numeric_limits<T>::infinity();
+		int bestSplit = -1;
+		accumulated = AABB<T>{};
+		accumulatedCount = 0;
+		for (int b = 0; b < binCount - 1; ++b)
+		{
+			accumulated = merge(accumulated, bins[b].bounds);
+			accumulatedCount += bins[b].count;
+			if (accumulatedCount == 0 || rightCount[b + 1] == 0)
+				continue;
+
+			T cost = accumulated.getSurfaceArea() * T(accumulatedCount) + rightArea[b + 1] * T(rightCount[b + 1]);
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestSplit = b;
+			}
+		}
+
+		T parentArea = bounds.getSurfaceArea();
+		T leafCost = T(settings.intersectionCost) * T(count);
+		T splitCost = bestSplit < 0 ? std::numeric_limits<T>::infinity()
+			: T(settings.traversalCost) + T(settings.intersectionCost) * bestCost / (parentArea > T(0) ? parentArea : T(1));
+
+		if (count <= std::uint32_t(settings.maxLeafSize) && leafCost <= splitCost)
+		{
+			makeLeaf(primitives, nodeIndex, begin, end);
+			return;
+		}
+
+		if (bestSplit >= 0)
+		{
+			auto split = std::partition(primitives.begin() + begin, primitives.begin() + end,
+				[&](const BuildPrimitive& prim) { return binOf(prim) <= bestSplit; });
+			mid = std::uint32_t(split - primitives.begin());
+		}
+	}
+
+	if (mid == begin || mid == end)
+	{
+		mid = begin + count / 2;
+		std::nth_element(primitives.begin() + begin, primitives.begin() + mid, primitives.begin() + end,
+			[axis](const BuildPrimitive& a, const BuildPrimitive& b) { return a.centroid[axis] < b.centroid[axis]; });
+	}
+
+	m_nodes[nodeIndex].count = 0;
+	m_nodes[nodeIndex].axis = std::uint16_t(axis);
+	buildRecursive(primitives, begin, mid, depth + 1, settings);
+	m_nodes[nodeIndex].offset = std::uint32_t(m_nodes.size());
+	buildRecursive(primitives, mid, end, depth + 1, settings);
+}
+
+template<typename T>
+template<typename IntersectFn>
+void BVH<T>::traverse(const Ray<T>& ray, T tMax, IntersectFn&& intersectLeaf) const
+{
+	traverseLeaves(ray, tMax, [&](std::uint32_t first, std::uint32_t count, T& leafTMax)
+	{
+		for (std::uint32_t i = first; i < first + count; ++i)
+			intersectLeaf(m_primitiveIndices.empty() ? i : m_primitiveIndices[i], leafTMax);
+	});
+}
+
+template<typename T>
+template<typename IntersectFn>
+void BVH<T>::traverseLeaves(const Ray<T>& ray, T tMax, IntersectFn&& intersectLeaves) const
+{
+	if (m_nodeCount == 0)
+		return;
+
+	const BVHNode<T>* nodes = getNodes();
+	const Vec3<T> invDirection{ T(1) / ray.direction.x, T(1) / ray.direction.y, T(1) / ray.direction.z };
+	const bool negative[3] = { invDirection.x < T(0), invDirection.y < T(0), invDirection.z < T(0) };
+
+	std::uint32_t stack[MAX_STACK_SIZE];
+	int stackSize = 0;
+	std::uint32_t current = 0;
+	std::uint32_t visits = 0;
+
+	while (true)
+	{
+		const BVHNode<T>& node = nodes[current];
+		++visits;
+		if (intersect(node.bounds, ray.origin, invDirection, T(0), tMax))
+		{
+			if (node.isLeaf())
+			{
+				intersectLeaves(node.offset, std::uint32_t(node.count), tMax);
+			}
+			else
+			{
+				// Visit the child on the near side of the split axis first.
+				if (negative[node.axis])
+				{
+					stack[stackSize++] = current + 1;
+					current = node.offset;
+				}
+				else
+				{
+					stack[stackSize++] = node.offset;
+					current = current + 1;
+				}
+				continue;
+			}
+		}
+
+		if (stackSize == 0)
+			break;
+		current = stack[--stackSize];
+	}
+	RAYTRACER_STAT_ADD(NodeVisits, visits);
+}
+
+template<typename T>
+template<typename IntersectFn>
+std::uint32_t BVH<T>::traverseBatchLeaves(const ShadowRays<T>& rays, std::uint32_t activeMask, IntersectFn&& intersectLeaves) const
+{
+	if (m_nodeCount == 0 || activeMask == 0)
+		return activeMask;
+
+	const BVHNode<T>* nodes = getNodes();
+	T invX[ShadowRays<T>::CAPACITY], invY[ShadowRays<T>::CAPACITY], invZ[ShadowRays<T>::CAPACITY];
+	for (std::size_t i = 0; i < rays.count; ++i)
+	{
+		invX[i] = T(1) / rays.directionX[i];
+		invY[i] = T(1) / rays.directionY[i];
+		invZ[i] = T(1) / rays.directionZ[i];
+	}
+
+	struct Entry
+	{
+		std::uint32_t node;
+		std::uint32_t mask;
+	};
+	Entry stack[MAX_STACK_SIZE];
+	int stackSize = 0;
+	Entry current{ 0, activeMask };
+	std::uint32_t visits = 0;
+
+	while (true)
+	{
+		const BVHNode<T>& node = nodes[current.node];
+		++visits;
+		std::uint32_t hitMask = 0;
+		// Rays blocked since this node was pushed are skipped.
+		for (unsigned bits = current.mask & activeMask; bits != 0; bits &= bits - 1u)
+		{
+			const int i = countTrailingZeros(bits);
+			if (intersect(node.bounds, rays.origin, Vec3<T>{ invX[i], invY[i], invZ[i] }, T(0), rays.maxDistance[i]))
+				hitMask |= std::uint32_t(1) << i;
+		}
+
+		if (hitMask != 0)
+		{
+			if (node.isLeaf())
+			{
+				activeMask &= ~intersectLeaves(node.offset, std::uint32_t(node.count), hitMask);
+				if (activeMask == 0)
+					break;
+			}
+			else
+			{
+				// The rays share an origin, so the first one picks the near child for all of them.
+				const T* inverse = node.axis == 0 ? invX : (node.axis == 1 ? invY : invZ);
+				if (inverse[countTrailingZeros(hitMask)] < T(0))
+				{
+					stack[stackSize++] = { current.node + 1, hitMask };
+					current = { node.offset, hitMask };
+				}
+				else
+				{
+					stack[stackSize++] = { node.offset, hitMask };
+					current = { current.node + 1, hitMask };
+				}
+				continue;
+			}
+		}
+
+		if (stackSize == 0)
+			break;
+		current = stack[--stackSize];
+	}
+	RAYTRACER_STAT_ADD(ShadowNodeVisits, visits);
+	return activeMask;
+}
@@ -0,0 +1,285 @@
+#pragma once
+
+#include "Camera.h"
+#include "Scene.h"
+#include "ThreadPool.h"
+#include "Tile.h"
+#include "Viewport.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+struct FrameBudgetSettings
+{
+	// Time a frame should take, from the start of render to the output being filled.
+	float targetMilliseconds = 33.3f;
+	// Smallest resolution the frame is traced at, relative to the output along each axis.
+	float minScale = 0.25f;
+	// Samples per pixel along each axis when the budget allows it: 2 traces the frame at twice the
+	// output size and averages 2x2 samples per pixel. 1 never supersamples.
+	int maxSupersampling = 1;
+	// While the frame is traced below the output resolution, the output tiles within this radius of
+	// the focus are traced again at full resolution, nearest first, until the deadline. In fractions
+	// of half the output height; 0 disables it.
+	float foveaRadius = 0.25f;
+	// Focus, in fractions of the output width and height.
+	float focusX = 0.5f;
+	float focusY = 0.5f;
+	// Share of the target kept for the full-resolution tiles around the focus.
+	float foveaShare = 0.25f;
+	// Fraction of the way to the scale that would have met the target the controller moves per frame.
+	float damping = 0.5f;
+	// Scale changes below this ratio are ignored, so that the resolution does not flicker.
+	float hysteresis = 0.05f;
+};
+
+// What the last frame cost and what the controller made of it.
+struct FrameBudgetStats
+{
+	// Scale the frame was traced at, and the size it was traced at; above 1 is supersampling.
+	float scale = 1;
+	int width = 0;
+	int height = 0;
+	int samplesPerPixel = 1;
+	double traceMilliseconds = 0;
+	double resampleMilliseconds = 0;
+	double foveaMilliseconds = 0;
+	double frameMilliseconds = 0;
+	// Time each tile of the scaled frame took on its thread.
+	double meanTileMilliseconds = 0;
+	double maxTileMilliseconds = 0;
+	// Output tiles traced at full resolution around the focus, and those left upscaled because the
+	// deadline came first.
+	std::size_t foveaTiles = 0;
+	std::size_t skippedFoveaTiles = 0;
+	// Scale the controller picked for the next frame.
+	float nextScale = 1;
+};
+
+// Renders frames within a time budget by tracing them at a lower or higher resolution than the
+// output, then resampling: bilinear upscaling below the output size, averaging whole blocks of
+// samples above it. After each frame the controller turns the measured cost per traced pixel into
+// the scale that would have met the target, and moves part of the way there. Below full resolution
+// the tiles around a focus are traced again at the output resolution, nearest first; a tile only
+// starts if its expected cost, from the tiles of the scaled frame, fits before the deadline.
+template<typename T>
+class BudgetedRenderer
+{
+public:
+	explicit BudgetedRenderer(const FrameBudgetSettings& settings = FrameBudgetSettings{}) : m_settings(settings)
+	{}
+
+	void setSettings(const FrameBudgetSettings& settings) { m_settings = settings; }
+	const FrameBudgetSettings& getSettings() const { return m_settings; }
+
+	// Compiles the scene first if needed; the build is not counted in the frame.
+	void render(Scene<T>& scene, const Camera<T>& camera, Viewport<T>& viewport, ThreadPool& pool);
+
+	// Scale the next frame is traced at, e.g. to start a new view from a known cost.
+	void setScale(float scale) { m_scale = scale; }
+	float getScale() const { return m_scale; }
+	const FrameBudgetStats& getStats() const { return m_stats; }
+
+private:
+	static double secondsSince(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	void resample(const Viewport<T>& source, Viewport<T>& target, ThreadPool& pool) const;
+	// Traces the output tiles around the focus until the deadline.
+	void traceFovea(const Scene<T>& scene, const PreparedCamera<T>& camera, Viewport<T>& viewport, ThreadPool& pool,
+		std::chrono::steady_clock::time_point deadline, double tileSecondsPerPixel, FrameBudgetStats& stats) const;
+
+	FrameBudgetSettings m_settings;
+	FrameBudgetStats m_stats;
+	float m_scale = 1;
+	std::unique_ptr<Viewport<T> > m_scaled;
+	std::vector<double> m_tileSeconds;
+};
+
+template<typename T>
+void BudgetedRenderer<T>::render(Scene<T>& scene, const Camera<T>& camera, Viewport<T>& viewport, ThreadPool& pool)
+{
+	if (!scene.isCompiled())
+		scene.compile();
+
+	const auto start = std::chrono::steady_clock::now();
+	const auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+		std::chrono::duration<double, std::milli>(m_settings.targetMilliseconds));
+	const int outputWidth = viewport.getWidth(), outputHeight = viewport.getHeight();
+	const float maxScale = float(std::max(1, m_settings.maxSupersampling));
+	const float scale = std::max(std::min(m_scale, maxScale), std::min(m_settings.minScale, 1.f));
+
+	// Supersampling takes whole samples per pixel; between 1 and the next whole factor the frame is
+	// traced at the output size.
+	int width = outputWidth, height = outputHeight, factor = 1;
+	if (scale >= 2.f)
+	{
+		factor = int(scale);
+		width *= factor;
+		height *= factor;
+	}
+	else if (scale < 1.f)
+	{
+		width = std::max(1, int(std::lround(outputWidth * scale)));
+		height = std::max(1, int(std::lround(outputHeight * scale)));
+	}
+
+	FrameBudgetStats stats;
+	stats.scale = scale;
+	stats.width = width;
+	stats.height = height;
+	stats.samplesPerPixel = factor * factor;
+
+	const bool direct = width == outputWidth && height == outputHeight;
+	if (!direct && (!m_scaled || m_scaled->getWidth() != width || m_scaled->getHeight() != height))
+		m_scaled.reset(new Viewport<T>(width, height));
+	Viewport<T>& traced = direct ? viewport : *m_scaled;
+
+	const PreparedCamera<T> prepared = camera.prepare(traced);
+	const std::vector<Tile> tiles = makeTiles(width, height);
+	m_tileSeconds.assign(tiles.size(), 0.);
+	pool.run(tiles.size(), [&](std::size_t tileIndex, unsigned)
+	{
+		const auto tileStart = std::chrono::steady_clock::now();
+		scene.renderTile(prepared, traced, tiles[tileIndex]);
+		m_tileSeconds[tileIndex] = secondsSince(tileStart);
+	});
+	const double traceSeconds = secondsSince(start);
+	stats.traceMilliseconds = traceSeconds * 1e3;
+
+	double tileSeconds = 0;
+	for (double seconds : m_tileSeconds)
+	{
+		tileSeconds += seconds;
+		stats.maxTileMilliseconds = std::max(stats.maxTileMilliseconds, seconds * 1e3);
+	}
+	stats.meanTileMilliseconds = tileSeconds * 1e3 / double(tiles.size());
+
+	if (!direct)
+	{
+		const auto resampleStart = std::chrono::steady_clock::now();
+		resample(traced, viewport, pool);
+		stats.resampleMilliseconds = secondsSince(resampleStart) * 1e3;
+	}
+
+	const bool foveated = scale < 1.f && m_settings.foveaRadius > 0.f;
+	if (foveated)
+	{
+		const auto foveaStart = std::chrono::steady_clock::now();
+		const PreparedCamera<T> full = camera.prepare(viewport);
+		const std::size_t pixelCount = std::size_t(width) * std::size_t(height);
+		traceFovea(scene, full, viewport, pool, deadline, tileSeconds / double(pixelCount), stats);
+		stats.foveaMilliseconds = secondsSince(foveaStart) * 1e3;
+	}
+	stats.frameMilliseconds = secondsSince(start) * 1e3;
+
+	// The scale whose pixels would have fit in the trace's share of the target at this frame's cost
+	// per pixel; pixels cost about the same at every scale, so their count follows the scale squared.
+	const double traceBudget = m_settings.targetMilliseconds * 1e-3 * (foveated ? 1. - m_settings.foveaShare : 1.);
+	const double idealScale = std::sqrt(traceBudget / std::max(traceSeconds, 1e-9) * double(width) * double(height)
+		/ (double(outputWidth) * double(outputHeight)));
+	const double damping = std::max(0.f, std::min(1.f, m_settings.damping));
+	float next = float(double(scale) * std::pow(idealScale / double(scale), damping));
+	next = std::max(std::min(m_settings.minScale, 1.f), std::min(maxScale, next));
+	if (std::abs(next / scale - 1.f) < m_settings.hysteresis)
+		next = scale;
+	m_scale = next;
+	stats.nextScale = next;
+	m_stats = stats;
+}
+
+template<typename T>
+void BudgetedRenderer<T>::resample(const Viewport<T>& source, Viewport<T>& target, ThreadPool& pool) const
+{
+	const int sourceWidth = source.getWidth(), sourceHeight = source.getHeight();
+	const int width = target.getWidth(), height = target.getHeight();
+	const std::vector<Tile> tiles = makeTiles(width, height);
+	pool.run(tiles.size(), [&](std::size_t tileIndex, unsigned)
+	{
+		const Tile& tile = tiles[tileIndex];
+		if (sourceWidth >= width)
+		{
+			// Whole blocks of samples per pixel.
+			const int factor = sourceWidth / width;
+			const T weight = T(1) / T(factor * factor);
+			for (int row = tile.rowBegin; row < tile.rowEnd; ++row)
+			{
+				for (int col = tile.colBegin; col < tile.colEnd; ++col)
+				{
+					Color<T> sum{ 0., 0., 0. };
+					for (int y = 0; y < factor; ++y)
+					{
+						for (int x = 0; x < factor; ++x)
+							sum = sum + source(col * factor + x, row * factor + y);
+					}
+					target(col, row) = weight * sum;
+				}
+			}
+			return;
+		}
+
+		// Bilinear, with the pixel centres of both images aligned.
+		const T scaleX = T(sourceWidth) / T(width), scaleY = T(sourceHeight) / T(height);
+		for (int row = tile.rowBegin; row < tile.rowEnd; ++row)
+		{
+			const T y = std::max(T(0), std::min(T(sourceHeight - 1), (T(row) + T(0.5)) * scaleY - T(0.5)));
+			const int y0 = int(y), y1 = std::min(y0 + 1, sourceHeight - 1);
+			const T fy = y - T(y0);
+			for (int col = tile.colBegin; col < tile.colEnd; ++col)
+			{
+				const T x = std::max(T(0), std::min(T(sourceWidth - 1), (T(col) + T(0.5)) * scaleX - T(0.5)));
+				const int x0 = int(x), x1 = std::min(x0 + 1, sourceWidth - 1);
+				const T fx = x - T(x0);
+				const Color<T> top = (T(1) - fx) * source(x0, y0) + fx * source(x1, y0);
+				const Color<T> bottom = (T(1) - fx) * source(x0, y1) + fx * source(x1, y1);
+				target(col, row) = (T(1) - fy) * top + fy * bottom;
+			}
+		}
+	});
+}
+
+template<typename T>
+void BudgetedRenderer<T>::traceFovea(const Scene<T>& scene, const PreparedCamera<T>& camera, Viewport<T>& viewport, ThreadPool& pool,
+	std::chrono::steady_clock::time_point deadline, double tileSecondsPerPixel, FrameBudgetStats& stats) const
+{
+	const int width = viewport.getWidth(), height = viewport.getHeight();
+	const T focusX = T(m_settings.focusX) * T(width), focusY = T(m_settings.focusY) * T(height);
+	const T radius = T(m_settings.foveaRadius) * T(0.5) * T(height);
+
+	// Tiles touching the circle, by their distance to the focus.
+	std::vector<std::pair<T, Tile> > candidates;
+	for (const Tile& tile : makeTiles(width, height))
+	{
+		const T dx = std::max(T(0), std::max(T(tile.colBegin) - focusX, focusX - T(tile.colEnd)));
+		const T dy = std::max(T(0), std::max(T(tile.rowBegin) - focusY, focusY - T(tile.rowEnd)));
+		const T distance = std::sqrt(dx * dx + dy * dy);
+		if (distance <= radius)
+			candidates.emplace_back(distance, tile);
+	}
+	std::stable_sort(candidates.begin(), candidates.end(), [](const std::pair<T, Tile>& a, const std::pair<T, Tile>& b)
+	{
+		return a.first < b.first;
+	});
+
+	// Tasks are dealt in index order, so the nearest tiles start first.
+	std::vector<std::uint8_t> traced(candidates.size(), 0);
+	pool.run(candidates.size(), [&](std::size_t index, unsigned)
+	{
+		const Tile& tile = candidates[index].second;
+		const double expected = tileSecondsPerPixel * double(tile.colEnd - tile.colBegin) * double(tile.rowEnd - tile.rowBegin);
+		if (std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(expected)) > deadline)
+			return;
+		scene.renderTile(camera, viewport, tile);
+		traced[index] = 1;
+	});
+
+	stats.foveaTiles = std::size_t(std::count(traced.begin(), traced.end(), std::uint8_t(1)));
+	stats.skippedFoveaTiles = candidates.size() - stats.foveaTiles;
+}
@@ -1,10 +1,19 @@
 #pragma once
 
+#include "RenderStats.h"
+#include "Tile.h"
+
 #include "../math/Vec3.h"
+#include "../math/RayPacket.h"
+
+#include <vector>
 
 template<typename T>
 class Viewport;
 
+template<typename T>
+class PreparedCamera;
+
 template<typename T>
 class Camera
 {
@@ -34,8 +43,168 @@ public:
 		return Ray<T>{m_origin, dir.getNormalized()};
 	}
 
+	// Everything getRay derives from the camera and the viewport size, computed once per frame.
+	PreparedCamera<T> prepare(const Viewport<T>& viewport) const;
+
+	const Point3<T>& getOrigin() const { return m_origin; }
+	const Vec3<T>& getDirection() const { return m_direction; }
+	T getHorizontalFov() const { return m_horizontalFovAngle; }
+
 private:
 	Point3<T> m_origin;
 	Vec3<T> m_direction;
 	T m_horizontalFovAngle;
 };
+
+enum class RayStepping
+{
+	// Bit-identical to Camera::getRay.
+	Exact,
+	// Adds a constant per-column step along a row. Before normalization, directions drift from Exact
+	// by at most about (colEnd - colBegin) ulps of their magnitude.
+	Incremental
+};
+
+template<typename T>
+class PreparedCamera
+{
+public:
+	PreparedCamera(const Point3<T>& origin, const Vec3<T>& look, const Vec3<T>& right, const Vec3<T>& up, T pixelWidth, T pixelHeight, int width, int height);
+
+	Ray<T> getRay(int row, int col) const
+	{
+		Vec3<T> dir = m_look + m_columnOffsets[col] + m_rowOffsets[row];
+		return Ray<T>{m_origin, dir.getNormalized()};
+	}
+
+	// Ray through (dx, dy) pixels away from the pixel centre, for sampling within the pixel.
+	Ray<T> getRay(int row, int col, T dx, T dy) const
+	{
+		Vec3<T> dir = m_look + m_columnOffsets[col] + m_rowOffsets[row] + dx * m_columnStep + dy * m_rowStep;
+		return Ray<T>{m_origin, dir.getNormalized()};
+	}
+
+	// Writes the rays of columns [colBegin, colEnd) of a row at rays[offset...], which must be large enough.
+	void generateRow(int row, int colBegin, int colEnd, RayPacket<T>& rays, std::size_t offset = 0, RayStepping stepping = RayStepping::Exact) const;
+	// Resizes rays to the tile and fills it row-major.
+	void generateTile(const Tile& tile, RayPacket<T>& rays, RayStepping stepping = RayStepping::Exact) const;
+
+	// Inverse of getRay: the pixel coordinates, centres being integers, of the ray through a point.
+	// Returns false for points that are not in front of the camera.
+	bool project(const Point3<T>& point, T& col, T& row) const
+	{
+		const Vec3<T> v = point - m_origin;
+		const T depth = getDepth(point);
+		if (!(depth > T(0)))
+			return false;
+		col = (v * m_columnStep) / (depth * (m_columnStep * m_columnStep)) + T(m_width) / 2. - 0.5;
+		row = (v * m_rowStep) / (depth * (m_rowStep * m_rowStep)) + T(m_height) / 2. - 0.5;
+		return true;
+	}
+	// Distance of a point from the camera along its axis.
+	T getDepth(const Point3<T>& point) const { return (point - m_origin) * m_look; }
+
+	// Whether both cameras give every pixel the same ray.
+	bool isSameView(const PreparedCamera& other) const
+	{
+		auto equal = [](const Vec3<T>& a, const Vec3<T>& b) { return a.x == b.x && a.y == b.y && a.z == b.z; };
+		return m_width == other.m_width && m_height == other.m_height && equal(m_origin, other.m_origin) && equal(m_look, other.m_look)
+			&& equal(m_columnStep, other.m_columnStep) && equal(m_rowStep, other.m_rowStep);
+	}
+
+	const Point3<T>& getOrigin() const { return m_origin; }
+	// Width of a pixel at unit distance in the centre of the view, about the angle between the rays
+	// of neighbouring pixels.
+	T getPixelSpread() const { return std::sqrt(m_columnStep * m_columnStep); }
+	int getWidth() const { return m_width; }
+	int getHeight() const { return m_height; }
+
+private:
+	Point3<T> m_origin;
+	Vec3<T> m_look;
+	Vec3<T> m_columnStep;
+	Vec3<T> m_rowStep;
+	int m_width;
+	int m_height;
+
+	// (pL * dL) * right per column and (ph * dh) * up per row, the two terms getRay adds to look.
+	std::vector<Vec3<T> > m_columnOffsets;
+	std::vector<Vec3<T> > m_rowOffsets;
+};
+
+template<typename T>
+PreparedCamera<T> Camera<T>::prepare(const Viewport<T>& viewport) const
+{
+	RAYTRACER_STAT_TIMER(CameraSetup);
+	T verticalFovAngle = 2. * std::atan(T(viewport.getHeight()) / T(viewport.getWidth()) * std::tan(m_horizontalFovAngle / 2.));
+
+	Vec3<T> look = m_direction.getNormalized();
+	Vec3<T> right = (look ^ Vec3<T>{0., 1., 0.}).getNormalized();
+	Vec3<T> up = look ^ right;
+
+	T L = std::tan(m_horizontalFovAngle / 2.) * 2. * 1.;
+	T h = std::tan(verticalFovAngle / 2.) * 2. * 1.;
+
+	T pL = L / T(viewport.getWidth());
+	T ph = h / T(viewport.getHeight());
+
+	return PreparedCamera<T>(m_origin, look, right, up, pL, ph, viewport.getWidth(), viewport.getHeight());
+}
+
+template<typename T>
+PreparedCamera<T>::PreparedCamera(const Point3<T>& origin, const Vec3<T>& look, const Vec3<T>& right, const Vec3<T>& up, T pixelWidth, T pixelHeight, int width, int height) :
+	m_origin(origin), m_look(look), m_columnStep(pixelWidth * right), m_rowStep(pixelHeight * up), m_width(width), m_height(height)
+{
+	m_columnOffsets.reserve(width);
+	for (int col = 0; col < width; ++col)
+	{
+		T dL = T(col) - T(width) / 2. + 0.5;
+		m_columnOffsets.push_back(pixelWidth * dL * right);
+	}
+
+	m_rowOffsets.reserve(height);
+	for (int row = 0; row < height; ++row)
+	{
+		T dh = T(row) - T(height) / 2. + 0.5;
+		m_rowOffsets.push_back(pixelHeight * dh * up);
+	}
+}
+
+template<typename T>
+void PreparedCamera<T>::generateRow(int row, int colBegin, int colEnd, RayPacket<T>& rays, std::size_t offset, RayStepping stepping) const
+{
+	const Vec3<T>& rowOffset = m_rowOffsets[row];
+	Vec3<T> incremental = m_look + m_columnOffsets[colBegin] + rowOffset;
+
+	T* ox = rays.originX.data() + offset;
+	T* oy = rays.originY.data() + offset;
+	T* oz = rays.originZ.data() + offset;
+	T* dx = rays.directionX.data() + offset;
+	T* dy = rays.directionY.data() + offset;
+	T* dz = rays.directionZ.data() + offset;
+
+	const int count = colEnd - colBegin;
+	for (int i = 0; i < count; ++i)
+	{
+		Vec3<T> dir = stepping == RayStepping::Exact ? m_look + m_columnOffsets[colBegin + i] + rowOffset : incremental;
+		incremental = incremental + m_columnStep;
+
+		// Same arithmetic as Vec3::getNormalized.
+		T scale = std::sqrt(T(1.) / (dir * dir));
+		ox[i] = m_origin.x;
+		oy[i] = m_origin.y;
+		oz[i] = m_origin.z;
+		dx[i] = scale * dir.x;
+		dy[i] = scale * dir.y;
+		dz[i] = scale * dir.z;
+	}
+}
+
+template<typename T>
+void PreparedCamera<T>::generateTile(const Tile& tile, RayPacket<T>& rays, RayStepping stepping) const
+{
+	const int tileWidth = tile.colEnd - tile.colBegin;
+	rays.resize(std::size_t(tileWidth) * std::size_t(tile.rowEnd - tile.rowBegin));
+	for (int row = tile.rowBegin; row < tile.rowEnd; ++row)
+		generateRow(row, tile.colBegin, tile.colEnd, rays, std::size_t(row - tile.rowBegin) * tileWidth, stepping);
+}
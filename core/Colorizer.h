@@ -1,13 +1,19 @@
 #pragma once
 
 #include "Color.h"
+#include "Geometry.h"
 
 template<typename T>
 class IColorizer
 {
 public:
-	virtual Color<T> getColor() const = 0;
+	// footprint is the width of surface the hit stands for, in scene units: the ray's spread over
+	// its distance. Zero asks for the finest detail.
+	virtual Color<T> getColor(const Contact<T>& contact, T footprint) const = 0;
 	virtual ~IColorizer() = default;
+
+	// Lets a compiled scene store the color in its material table instead of calling getColor.
+	virtual const Color<T>* getConstantColor() const { return nullptr; }
 };
 
 template<typename T>
@@ -17,7 +23,8 @@ public:
 	FlatColorizer(const Color<T>& color) : m_color(color)
 	{}
 
-	virtual Color<T> getColor() const override { return m_color; }
+	virtual Color<T> getColor(const Contact<T>&, T) const override { return m_color; }
+	virtual const Color<T>* getConstantColor() const override { return &m_color; }
 
 private:
 	Color<T> m_color;
@@ -0,0 +1,510 @@
+#pragma once
+
+#include "BVH.h"
+#include "Color.h"
+
+#include "../math/Vec3.h"
+#include "../math/SphereSoA.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+template<typename T>
+class IGeometry;
+
+template<typename T>
+class IColorizer;
+
+template<typename T>
+struct Contact;
+
+template<typename T>
+struct Material
+{
+	Color<T> color;
+	T ambient;
+	T diffusion;
+	T reflection;
+	T transmission;
+	T refractiveIndex;
+	// Only set for colorizers without a constant color; shading then falls back to a virtual call.
+	const IColorizer<T>* colorizer;
+};
+
+template<typename T>
+struct SurfaceHit
+{
+	Contact<T> contact;
+	std::uint32_t objectIndex;
+	std::uint32_t materialIndex;
+};
+
+constexpr std::uint32_t NO_OBJECT = std::numeric_limits<std::uint32_t>::max();
+
+// Spheres held in caller-owned flat arrays, such as the sections of a mapped scene file.
+template<typename T>
+struct SphereArray
+{
+	const Sphere<T>* spheres = nullptr;
+	// Indices into the scene's flat material table, offset by materialBase.
+	const std::uint32_t* materialIndices = nullptr;
+	std::size_t count = 0;
+	std::uint32_t materialBase = 0;
+	// Optional hierarchy over the spheres, which are then stored in its leaf order.
+	const BVHNode<T>* bvhNodes = nullptr;
+	std::size_t bvhNodeCount = 0;
+};
+
+// Spheres in BVH leaf order, tested in batches by the SIMD kernels.
+template<typename T>
+class SphereGroup
+{
+public:
+	void clear();
+	void add(const Sphere<T>& sphere, std::uint32_t objectIndex, std::uint32_t materialIndex);
+	// Read by build(), not copied. Its hierarchy, if any, is used when it is the only thing in the group.
+	void addArray(const SphereArray<T>& array, std::uint32_t firstObjectIndex);
+	void build(const BVHBuildSettings& settings);
+
+	// Calls onHit(slot, objectIndex, distance, tMax) for every sphere hit at or before tMax.
+	template<typename HitFn>
+	void intersect(const Ray<T>& ray, T& tMax, HitFn&& onHit, SimdIsa isa, std::size_t* primitiveTests = nullptr) const;
+	// Returns the rays of activeMask that no sphere blocks.
+	std::uint32_t findUnoccluded(const ShadowRays<T>& rays, std::uint32_t activeMask, SimdIsa isa) const;
+
+	Contact<T> getContact(std::uint32_t slot, const Ray<T>& ray, T distance) const;
+	std::uint32_t getMaterialIndex(std::uint32_t slot) const { return m_materialIndices[slot]; }
+
+	std::size_t size() const { return m_objectIndices.size(); }
+	std::size_t getNodeCount() const { return m_bvh.getNodeCount(); }
+	std::size_t getMemoryFootprint() const;
+
+private:
+	struct PendingArray
+	{
+		SphereArray<T> array;
+		std::uint32_t firstObjectIndex;
+	};
+
+	std::vector<PendingArray> m_pendingArrays;
+	std::vector<Sphere<T> > m_pending;
+	std::vector<std::uint32_t> m_pendingObjects;
+	std::vector<std::uint32_t> m_pendingMaterials;
+
+	BVH<T> m_bvh;
+	SphereSoA<T> m_spheres;
+	std::vector<std::uint32_t> m_objectIndices;
+	std::vector<std::uint32_t> m_materialIndices;
+};
+
+// Geometries without a flat representation, still intersected through IGeometry.
+template<typename T>
+class GenericGroup
+{
+public:
+	void clear();
+	void add(const IGeometry<T>* geometry, std::uint32_t objectIndex, std::uint32_t materialIndex);
+	void build(const BVHBuildSettings& settings);
+
+	// Calls onHit(slot, objectIndex, contact, tMax) for every geometry hit at or before tMax.
+	template<typename HitFn>
+	void intersect(const Ray<T>& ray, T& tMax, HitFn&& onHit, std::size_t* primitiveTests = nullptr) const;
+	std::uint32_t findUnoccluded(const ShadowRays<T>& rays, std::uint32_t activeMask) const;
+
+	std::uint32_t getMaterialIndex(std::uint32_t slot) const { return m_materialIndices[slot]; }
+
+	std::size_t size() const { return m_geometries.size(); }
+	std::size_t getNodeCount() const { return m_bvh.getNodeCount(); }
+	std::size_t getMemoryFootprint() const;
+
+private:
+	std::vector<const IGeometry<T>*> m_geometries;
+	std::vector<std::uint32_t> m_objectIndices;
+	std::vector<std::uint32_t> m_materialIndices;
+
+	BVH<T> m_bvh;
+};
+
+// Render-time form of a Scene: primitives grouped by concrete type in flat arrays, each group with
+// its own BVH, and materials in a dense table. Nothing here owns the geometries it points to.
+template<typename T>
+class CompiledScene
+{
+public:
+	void clear();
+
+	std::uint32_t addMaterial(const Material<T>& material);
+	// Materials can be edited after build(), which does not look at them.
+	void setMaterial(std::uint32_t index, const Material<T>& material) { m_materials[index] = material; }
+	void addSphere(const Sphere<T>& sphere, std::uint32_t objectIndex, std::uint32_t materialIndex);
+	// Spheres get consecutive object indices starting at firstObjectIndex.
+	void addSphereArray(const SphereArray<T>& array, std::uint32_t firstObjectIndex);
+	void addGeometry(const IGeometry<T>* geometry, std::uint32_t objectIndex, std::uint32_t materialIndex);
+	void build(const BVHBuildSettings& settings);
+
+	// Equal distances resolve to the lowest object index. When primitiveTests is set, the number of
+	// primitives tested against the ray is added to it.
+	bool findClosestHit(const Ray<T>& ray, SurfaceHit<T>& hit, std::size_t* primitiveTests = nullptr) const;
+
+	// Any-hit queries: a ray is occluded by anything at or before its max distance. A batch shares
+	// one traversal per group, each ray leaving it at its first blocker. Returns the unoccluded rays.
+	std::uint32_t findUnoccluded(const ShadowRays<T>& rays) const;
+	bool isOccluded(const Ray<T>& ray, T maxDistance) const;
+
+	const Material<T>& getMaterial(std::uint32_t index) const { return m_materials[index]; }
+	std::size_t getMaterialCount() const { return m_materials.size(); }
+
+	void setSimdIsa(SimdIsa isa) { m_simdIsa = isSimdIsaSupported(isa) ? isa : SimdIsa::Scalar; }
+	SimdIsa getSimdIsa() const { return m_simdIsa; }
+
+	std::size_t getNodeCount() const { return m_spheres.getNodeCount() + m_generic.getNodeCount(); }
+	std::size_t getMemoryFootprint() const;
+
+private:
+	std::vector<Material<T> > m_materials;
+	SphereGroup<T> m_spheres;
+	GenericGroup<T> m_generic;
+	SimdIsa m_simdIsa = detectSimdIsa();
+};
+
+#include "Geometry.h"
+
+template<typename T>
+void SphereGroup<T>::clear()
+{
+	*this = SphereGroup<T>{};
+}
+
+template<typename T>
+void SphereGroup<T>::add(const Sphere<T>& sphere, std::uint32_t objectIndex, std::uint32_t materialIndex)
+{
+	m_pending.push_back(sphere);
+	m_pendingObjects.push_back(objectIndex);
+	m_pendingMaterials.push_back(materialIndex);
+}
+
+template<typename T>
+void SphereGroup<T>::addArray(const SphereArray<T>& array, std::uint32_t firstObjectIndex)
+{
+	if (array.count != 0)
+		m_pendingArrays.push_back({ array, firstObjectIndex });
+}
+
+template<typename T>
+void SphereGroup<T>::build(const BVHBuildSettings& settings)
+{
+	// Pending spheres are numbered through the arrays in order, then the individually added ones.
+	std::vector<std::size_t> arrayStarts;
+	std::size_t arraysTotal = 0;
+	for (const auto& pending : m_pendingArrays)
+	{
+		arrayStarts.push_back(arraysTotal);
+		arraysTotal += pending.array.count;
+	}
+	const std::size_t total = arraysTotal + m_pending.size();
+
+	auto getPending = [&](std::size_t index, const Sphere<T>*& sphere, std::uint32_t& objectIndex, std::uint32_t& materialIndex)
+	{
+		if (index >= arraysTotal)
+		{
+			index -= arraysTotal;
+			sphere = &m_pending[index];
+			objectIndex = m_pendingObjects[index];
+			materialIndex = m_pendingMaterials[index];
+			return;
+		}
+
+		std::size_t a = std::size_t(std::upper_bound(arrayStarts.begin(), arrayStarts.end(), index) - arrayStarts.begin()) - 1;
+		const PendingArray& pending = m_pendingArrays[a];
+		index -= arrayStarts[a];
+		sphere = &pending.array.spheres[index];
+		objectIndex = pending.firstObjectIndex + std::uint32_t(index);
+		materialIndex = pending.array.materialBase + pending.array.materialIndices[index];
+	};
+
+	const bool adopted = m_pendingArrays.size() == 1 && m_pending.empty() && m_pendingArrays[0].array.bvhNodes != nullptr
+		&& m_bvh.adopt(m_pendingArrays[0].array.bvhNodes, m_pendingArrays[0].array.bvhNodeCount, total);
+	if (!adopted)
+	{
+		std::vector<AABB<T> > bounds;
+		bounds.reserve(total);
+		const Sphere<T>* sphere;
+		std::uint32_t objectIndex, materialIndex;
+		for (std::size_t i = 0; i < total; ++i)
+		{
+			getPending(i, sphere, objectIndex, materialIndex);
+			Vec3<T> extent{ sphere->radius, sphere->radius, sphere->radius };
+			bounds.push_back({ sphere->center - extent, sphere->center + extent });
+		}
+		m_bvh.build(bounds, settings);
+	}
+
+	const auto& order = m_bvh.getPrimitiveIndices();
+	m_spheres.resize(total);
+	m_objectIndices.resize(total);
+	m_materialIndices.resize(total);
+	for (std::size_t slot = 0; slot < total; ++slot)
+	{
+		const Sphere<T>* sphere;
+		getPending(adopted ? slot : order[slot], sphere, m_objectIndices[slot], m_materialIndices[slot]);
+		m_spheres.set(slot, *sphere);
+	}
+
+	m_pendingArrays = std::vector<PendingArray>();
+	m_pending = std::vector<Sphere<T> >();
+	m_pendingObjects = std::vector<std::uint32_t>();
+	m_pendingMaterials = std::vector<std::uint32_t>();
+}
+
+template<typename T>
+template<typename HitFn>
+void SphereGroup<T>::intersect(const Ray<T>& ray, T& tMax, HitFn&& onHit, SimdIsa isa, std::size_t* primitiveTests) const
+{
+	m_bvh.traverseLeaves(ray, tMax, [&](std::uint32_t first, std::uint32_t count, T& leafTMax)
+	{
+		RAYTRACER_STAT_ADD(SphereTests, count);
+		if (primitiveTests != nullptr)
+			*primitiveTests += count;
+		intersectSpheres(m_spheres, first, count, ray, leafTMax, [&](std::uint32_t slot, T distance)
+		{
+			onHit(slot, m_objectIndices[slot], distance, leafTMax);
+		}, isa);
+	});
+}
+
+template<typename T>
+std::uint32_t SphereGroup<T>::findUnoccluded(const ShadowRays<T>& rays, std::uint32_t activeMask, SimdIsa isa) const
+{
+	return m_bvh.traverseBatchLeaves(rays, activeMask, [&](std::uint32_t first, std::uint32_t count, std::uint32_t mask)
+	{
+		std::uint32_t blocked = 0;
+		for (unsigned bits = mask; bits != 0; bits &= bits - 1u)
+		{
+			const int i = countTrailingZeros(bits);
+			const std::uint32_t bit = std::uint32_t(1) << i;
+			T tMax = rays.maxDistance[i];
+			RAYTRACER_STAT_ADD(ShadowTests, count);
+			intersectSpheres(m_spheres, first, count, rays.get(i), tMax, [&](std::uint32_t, T) { blocked |= bit; }, isa);
+		}
+		return blocked;
+	});
+}
+
+template<typename T>
+Contact<T> SphereGroup<T>::getContact(std::uint32_t slot, const Ray<T>& ray, T distance) const
+{
+	// Mirrors SphereGeometry::getIntersection.
+	Point3<T> center{ m_spheres.centerX()[slot], m_spheres.centerY()[slot], m_spheres.centerZ()[slot] };
+	auto point = ray.getPointAtAbscice(distance);
+	const Vec3<T> normal = (point - center).getNormalized();
+	return { distance, point, normal, getSphericalCoordinates(normal) };
+}
+
+template<typename T>
+std::size_t SphereGroup<T>::getMemoryFootprint() const
+{
+	return m_bvh.getMemoryFootprint() + m_spheres.getMemoryFootprint()
+		+ (m_objectIndices.capacity() + m_materialIndices.capacity()) * sizeof(std::uint32_t);
+}
+
+template<typename T>
+void GenericGroup<T>::clear()
+{
+	*this = GenericGroup<T>{};
+}
+
+template<typename T>
+void GenericGroup<T>::add(const IGeometry<T>* geometry, std::uint32_t objectIndex, std::uint32_t materialIndex)
+{
+	m_geometries.push_back(geometry);
+	m_objectIndices.push_back(objectIndex);
+	m_materialIndices.push_back(materialIndex);
+}
+
+template<typename T>
+void GenericGroup<T>::build(const BVHBuildSettings& settings)
+{
+	std::vector<AABB<T> > bounds;
+	bounds.reserve(m_geometries.size());
+	for (const auto* geometry : m_geometries)
+		bounds.push_back(geometry->getBoundingBox());
+	m_bvh.build(bounds, settings);
+
+	const auto& order = m_bvh.getPrimitiveIndices();
+	std::vector<const IGeometry<T>*> geometries(order.size());
+	std::vector<std::uint32_t> objectIndices(order.size());
+	std::vector<std::uint32_t> materialIndices(order.size());
+	for (std::size_t slot = 0; slot < order.size(); ++slot)
+	{
+		geometries[slot] = m_geometries[order[slot]];
+		objectIndices[slot] = m_objectIndices[order[slot]];
+		materialIndices[slot] = m_materialIndices[order[slot]];
+	}
+	m_geometries.swap(geometries);
+	m_objectIndices.swap(objectIndices);
+	m_materialIndices.swap(materialIndices);
+}
+
+template<typename T>
+template<typename HitFn>
+void GenericGroup<T>::intersect(const Ray<T>& ray, T& tMax, HitFn&& onHit, std::size_t* primitiveTests) const
+{
+	m_bvh.traverseLeaves(ray, tMax, [&](std::uint32_t first, std::uint32_t count, T& leafTMax)
+	{
+		RAYTRACER_STAT_ADD(GeometryTests, count);
+		if (primitiveTests != nullptr)
+			*primitiveTests += count;
+		for (std::uint32_t slot = first; slot < first + count; ++slot)
+		{
+			Contact<T> contact = m_geometries[slot]->getIntersectionBefore(ray, leafTMax);
+			if (contact.distance != NO_INTERSECTION<T>() && contact.distance <= leafTMax)
+				onHit(slot, m_objectIndices[slot], contact, leafTMax);
+		}
+	});
+}
+
+template<typename T>
+std::uint32_t GenericGroup<T>::findUnoccluded(const ShadowRays<T>& rays, std::uint32_t activeMask) const
+{
+	return m_bvh.traverseBatchLeaves(rays, activeMask, [&](std::uint32_t first, std::uint32_t count, std::uint32_t mask)
+	{
+		std::uint32_t blocked = 0;
+		for (unsigned bits = mask; bits != 0; bits &= bits - 1u)
+		{
+			const int i = countTrailingZeros(bits);
+			const std::uint32_t bit = std::uint32_t(1) << i;
+			const Ray<T> ray = rays.get(i);
+			for (std::uint32_t slot = first; slot < first + count; ++slot)
+			{
+				RAYTRACER_STAT_ADD(ShadowTests, 1);
+				if (m_geometries[slot]->isHitBefore(ray, rays.maxDistance[i]))
+				{
+					blocked |= bit;
+					break;
+				}
+			}
+		}
+		return blocked;
+	});
+}
+
+template<typename T>
+std::size_t GenericGroup<T>::getMemoryFootprint() const
+{
+	return m_bvh.getMemoryFootprint() + m_geometries.capacity() * sizeof(const IGeometry<T>*)
+		+ (m_objectIndices.capacity() + m_materialIndices.capacity()) * sizeof(std::uint32_t);
+}
+
+template<typename T>
+void CompiledScene<T>::clear()
+{
+	m_materials.clear();
+	m_spheres.clear();
+	m_generic.clear();
+}
+
+template<typename T>
+std::uint32_t CompiledScene<T>::addMaterial(const Material<T>& material)
+{
+	m_materials.push_back(material);
+	return std::uint32_t(m_materials.size() - 1);
+}
+
+template<typename T>
+void CompiledScene<T>::addSphere(const Sphere<T>& sphere, std::uint32_t objectIndex, std::uint32_t materialIndex)
+{
+	m_spheres.add(sphere, objectIndex, materialIndex);
+}
+
+template<typename T>
+void CompiledScene<T>::addSphereArray(const SphereArray<T>& array, std::uint32_t firstObjectIndex)
+{
+	m_spheres.addArray(array, firstObjectIndex);
+}
+
+template<typename T>
+void CompiledScene<T>::addGeometry(const IGeometry<T>* geometry, std::uint32_t objectIndex, std::uint32_t materialIndex)
+{
+	m_generic.add(geometry, objectIndex, materialIndex);
+}
+
+template<typename T>
+void CompiledScene<T>::build(const BVHBuildSettings& settings)
+{
+	m_spheres.build(settings);
+	m_generic.build(settings);
+}
+
+template<typename T>
+bool CompiledScene<T>::findClosestHit(const Ray<T>& ray, SurfaceHit<T>& hit, std::size_t* primitiveTests) const
+{
+	enum class Group { None, Sphere, Generic };
+
+	T minDistance = std::numeric_limits<T>::infinity();
+	std::uint32_t minObject = NO_OBJECT;
+	std::uint32_t minSlot = 0;
+	Group minGroup = Group::None;
+	Contact<T> genericContact = NO_CONTACT<T>();
+
+	auto accept = [&](std::uint32_t objectIndex, T distance)
+	{
+		return distance < minDistance || (distance == minDistance && objectIndex < minObject);
+	};
+
+	T tMax = std::numeric_limits<T>::infinity();
+	m_spheres.intersect(ray, tMax, [&](std::uint32_t slot, std::uint32_t objectIndex, T distance, T& leafTMax)
+	{
+		if (!accept(objectIndex, distance))
+			return;
+		minDistance = leafTMax = distance;
+		minObject = objectIndex;
+		minSlot = slot;
+		minGroup = Group::Sphere;
+	}, m_simdIsa, primitiveTests);
+
+	tMax = minDistance;
+	m_generic.intersect(ray, tMax, [&](std::uint32_t slot, std::uint32_t objectIndex, const Contact<T>& contact, T& leafTMax)
+	{
+		if (!accept(objectIndex, contact.distance))
+			return;
+		minDistance = leafTMax = contact.distance;
+		minObject = objectIndex;
+		minSlot = slot;
+		minGroup = Group::Generic;
+		genericContact = contact;
+	}, primitiveTests);
+
+	switch (minGroup)
+	{
+	case Group::Sphere:
+		hit = { m_spheres.getContact(minSlot, ray, minDistance), minObject, m_spheres.getMaterialIndex(minSlot) };
+		return true;
+	case Group::Generic:
+		hit = { genericContact, minObject, m_generic.getMaterialIndex(minSlot) };
+		return true;
+	default:
+		return false;
+	}
+}
+
+template<typename T>
+std::uint32_t CompiledScene<T>::findUnoccluded(const ShadowRays<T>& rays) const
+{
+	return m_generic.findUnoccluded(rays, m_spheres.findUnoccluded(rays, rays.getFullMask(), m_simdIsa));
+}
+
+template<typename T>
+bool CompiledScene<T>::isOccluded(const Ray<T>& ray, T maxDistance) const
+{
+	ShadowRays<T> rays(ray.origin);
+	rays.add(ray.direction, maxDistance);
+	return findUnoccluded(rays) == 0;
+}
+
+template<typename T>
+std::size_t CompiledScene<T>::getMemoryFootprint() const
+{
+	return m_materials.capacity() * sizeof(Material<T>) + m_spheres.getMemoryFootprint() + m_generic.getMemoryFootprint();
+}
@@ -0,0 +1,526 @@
+#pragma once
+
+#include "Camera.h"
+#include "Scene.h"
+#include "SceneFile.h"
+#include "Socket.h"
+#include "ThreadPool.h"
+#include "Tile.h"
+#include "Viewport.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Messages between a coordinator and its workers, little-endian: a RenderMessageHeader followed by
+// size bytes of payload.
+//   Scene       coordinator -> worker  a binary scene file; replaces the worker's scene
+//   Frame       coordinator -> worker  RenderFrameRecord<T>; starts a frame
+//   Tile        coordinator -> worker  Tile to render in the current frame
+//   TilePixels  worker -> coordinator  the Tile, then its Color<T> pixels row by row
+// Tile messages carry the frame number they belong to, so that results arriving after their frame
+// are dropped.
+enum class RenderMessage : std::uint32_t
+{
+	Scene = 1,
+	Frame = 2,
+	Tile = 3,
+	TilePixels = 4
+};
+
+struct RenderMessageHeader
+{
+	std::uint32_t type;
+	std::uint32_t frame;
+	std::uint64_t size;
+};
+
+template<typename T>
+struct RenderFrameRecord
+{
+	CameraRecord<T> camera;
+	std::int32_t width;
+	std::int32_t height;
+};
+
+struct DistributedRenderSettings
+{
+	// Pixels per side of the tiles sent to workers; larger tiles spend less time on round trips.
+	int tileSize = 64;
+	// Tiles requested from a worker ahead of its results, to hide the round trip.
+	int tilesInFlight = 2;
+	// A worker that sends nothing, or reads nothing, for this long is dropped and its tiles go to the
+	// others.
+	int workerTimeoutMilliseconds = 60000;
+};
+
+struct DistributedRenderStats
+{
+	// Tiles each worker of the last render delivered first, in connection order.
+	std::vector<std::size_t> workerTiles;
+	// Tiles sent to a second worker once none were left, in case the first one was slow.
+	std::size_t reissuedTiles = 0;
+	// Tiles the coordinator rendered itself because every worker failed.
+	std::size_t localTiles = 0;
+	std::size_t failedWorkers = 0;
+};
+
+// Splits frames into tiles rendered by worker processes, see runRenderWorker. Workers get the scene
+// once, as a binary scene file, then the camera of each frame and tiles to render; the first result
+// for a tile is kept. Workers that fail are dropped, and tiles left over when none remain are
+// rendered here, so a frame always completes and matches a local render of the same scene.
+template<typename T>
+class RenderCoordinator
+{
+public:
+	explicit RenderCoordinator(const DistributedRenderSettings& settings = DistributedRenderSettings{}) : m_settings(settings)
+	{}
+
+	// Returns the number of workers reached; the error is that of the last one that was not.
+	std::size_t connect(const std::vector<std::string>& addresses, std::string* error = nullptr);
+	// The view must stay valid while frames are rendered, for the tiles left to the coordinator.
+	void setScene(const SceneFileView<T>& view);
+	void render(const Camera<T>& camera, Viewport<T>& viewport);
+
+	std::size_t getWorkerCount() const { return m_workers.size(); }
+	const DistributedRenderStats& getStats() const { return m_stats; }
+
+private:
+	struct Worker
+	{
+		Socket socket;
+		std::string address;
+		bool failed = false;
+	};
+
+	struct TileState
+	{
+		int assignments = 0;
+		bool done = false;
+		std::chrono::steady_clock::time_point requested;
+	};
+
+	// Shared by the threads talking to the workers during one render.
+	struct FrameState
+	{
+		std::mutex mutex;
+		std::condition_variable changed;
+		std::vector<Tile> tiles;
+		std::vector<TileState> states;
+		std::deque<std::size_t> pending;
+		std::size_t doneCount = 0;
+		int tilesPerRow = 0;
+	};
+
+	void runWorker(std::size_t workerIndex, const RenderFrameRecord<T>& record, FrameState& frame, Viewport<T>& viewport);
+	// Next tile for a worker: one nobody has, else the oldest one requested from a single other worker.
+	bool takeTile(FrameState& frame, const std::deque<std::size_t>& inFlight, std::size_t& tileIndex);
+	void renderLocally(const PreparedCamera<T>& camera, Viewport<T>& viewport, const Tile& tile);
+
+	DistributedRenderSettings m_settings;
+	std::vector<std::unique_ptr<Worker> > m_workers;
+	SceneFileView<T> m_view;
+	std::unique_ptr<Scene<T> > m_localScene;
+	std::unique_ptr<ThreadPool> m_localPool;
+	std::uint32_t m_frame = 0;
+	DistributedRenderStats m_stats;
+};
+
+// Largest scene, and largest frame, a worker accepts by default, in bytes.
+constexpr std::uint64_t DEFAULT_WORKER_MEMORY_LIMIT = std::uint64_t(4) << 30;
+
+// Serves one coordinator on a connected socket until it disconnects, rendering its tiles on the pool.
+// Returns false, with an error, when the coordinator sends something invalid, or a scene or frame
+// larger than memoryLimit bytes.
+bool runRenderWorker(const Socket& connection, ThreadPool& pool, std::string* error = nullptr,
+	std::uint64_t memoryLimit = DEFAULT_WORKER_MEMORY_LIMIT);
+
+namespace detail
+{
+	static_assert(sizeof(RenderMessageHeader) == 16 && sizeof(Tile) == 16, "render messages must not be padded");
+
+	inline bool sendRenderMessage(const Socket& socket, RenderMessage type, std::uint32_t frame, const void* payload, std::size_t size,
+		const void* extra = nullptr, std::size_t extraSize = 0)
+	{
+		const RenderMessageHeader header{ std::uint32_t(type), frame, std::uint64_t(size + extraSize) };
+		return socket.sendAll(&header, sizeof(header)) && socket.sendAll(payload, size) && (extraSize == 0 || socket.sendAll(extra, extraSize));
+	}
+
+	inline bool setRenderError(std::string* error, const std::string& message)
+	{
+		if (error != nullptr)
+			*error = message;
+		return false;
+	}
+
+	// Renders the frames of one scene. Returns true when the coordinator sends another scene, whose
+	// header is then in header, and false when it disconnects or on an error.
+	template<typename T>
+	bool runWorkerScene(const Socket& connection, ThreadPool& pool, const std::vector<unsigned char>& sceneBytes, RenderMessageHeader& header,
+		std::uint64_t memoryLimit, std::string* error)
+	{
+		SceneFileView<T> view;
+		if (!readSceneBuffer(sceneBytes.data(), sceneBytes.size(), "received scene", view, error))
+			return false;
+		Scene<T> scene;
+		if (!addToScene(view, scene, error))
+			return false;
+		scene.compile();
+
+		std::unique_ptr<Viewport<T> > viewport;
+		std::unique_ptr<PreparedCamera<T> > camera;
+		std::vector<Color<T> > pixels;
+		while (connection.receiveAll(&header, sizeof(header)))
+		{
+			switch (RenderMessage(header.type))
+			{
+			case RenderMessage::Scene:
+				return true;
+
+			case RenderMessage::Frame:
+			{
+				RenderFrameRecord<T> record{ { { 0., 0., 0. }, { 0., 0., 1. }, 0. }, 0, 0 };
+				if (header.size != sizeof(record) || !connection.receiveAll(&record, sizeof(record)))
+					return setRenderError(error, "invalid frame message");
+				if (record.width <= 0 || record.height <= 0)
+					return setRenderError(error, "invalid frame size");
+				if (std::uint64_t(record.width) * std::uint64_t(record.height) > memoryLimit / sizeof(Color<T>))
+					return setRenderError(error, "frame larger than the memory limit");
+				if (!viewport || viewport->getWidth() != record.width || viewport->getHeight() != record.height)
+					viewport.reset(new Viewport<T>{ record.width, record.height });
+				camera.reset(new PreparedCamera<T>(Camera<T>{ record.camera.origin, record.camera.direction, record.camera.horizontalFov }.prepare(*viewport)));
+				break;
+			}
+
+			case RenderMessage::Tile:
+			{
+				Tile tile;
+				if (header.size != sizeof(tile) || !connection.receiveAll(&tile, sizeof(tile)))
+					return setRenderError(error, "invalid tile message");
+				if (!camera || tile.colBegin < 0 || tile.rowBegin < 0 || tile.colEnd > viewport->getWidth() || tile.rowEnd > viewport->getHeight()
+					|| tile.colBegin >= tile.colEnd || tile.rowBegin >= tile.rowEnd)
+					return setRenderError(error, "tile outside the frame");
+
+				// Split again so that the whole pool works on the tile.
+				const int width = tile.colEnd - tile.colBegin, height = tile.rowEnd - tile.rowBegin;
+				const std::vector<Tile> parts = makeTiles(width, height);
+				pool.run(parts.size(), [&](std::size_t partIndex, unsigned)
+				{
+					const Tile& part = parts[partIndex];
+					scene.renderTile(*camera, *viewport, Tile{ tile.colBegin + part.colBegin, tile.rowBegin + part.rowBegin,
+						tile.colBegin + part.colEnd, tile.rowBegin + part.rowEnd });
+				});
+
+				pixels.resize(std::size_t(width) * std::size_t(height));
+				for (int row = 0; row < height; ++row)
+					std::copy_n(&(*viewport)(tile.colBegin, tile.rowBegin + row), width, pixels.data() + std::size_t(row) * width);
+				if (!sendRenderMessage(connection, RenderMessage::TilePixels, header.frame, &tile, sizeof(tile), pixels.data(), pixels.size() * sizeof(Color<T>)))
+					return false;
+				break;
+			}
+
+			default:
+				return setRenderError(error, "unexpected message " + std::to_string(header.type));
+			}
+		}
+		return false;
+	}
+}
+
+inline bool runRenderWorker(const Socket& connection, ThreadPool& pool, std::string* error, std::uint64_t memoryLimit)
+{
+	RenderMessageHeader header;
+	if (!connection.receiveAll(&header, sizeof(header)))
+		return true;
+
+	std::vector<unsigned char> sceneBytes;
+	while (true)
+	{
+		if (RenderMessage(header.type) != RenderMessage::Scene || header.size < sizeof(SceneFileHeader))
+			return detail::setRenderError(error, "expected a scene");
+		if (header.size > memoryLimit || header.size > std::uint64_t(sceneBytes.max_size()))
+			return detail::setRenderError(error, "scene of " + std::to_string(header.size) + " bytes larger than the memory limit");
+		sceneBytes.resize(std::size_t(header.size));
+		if (!connection.receiveAll(sceneBytes.data(), sceneBytes.size()))
+			return true;
+
+		SceneFileHeader fileHeader;
+		std::memcpy(&fileHeader, sceneBytes.data(), sizeof(fileHeader));
+		std::string message;
+		const bool nextScene = fileHeader.scalarSize == sizeof(float) ? detail::runWorkerScene<float>(connection, pool, sceneBytes, header, memoryLimit, &message)
+			: detail::runWorkerScene<double>(connection, pool, sceneBytes, header, memoryLimit, &message);
+		if (!nextScene)
+			return message.empty() || detail::setRenderError(error, message);
+	}
+}
+
+template<typename T>
+std::size_t RenderCoordinator<T>::connect(const std::vector<std::string>& addresses, std::string* error)
+{
+	std::size_t connected = 0;
+	for (const std::string& address : addresses)
+	{
+		std::unique_ptr<Worker> worker(new Worker);
+		worker->address = address;
+		if (!worker->socket.connect(address, error))
+			continue;
+		worker->socket.setReceiveTimeout(m_settings.workerTimeoutMilliseconds);
+		worker->socket.setSendTimeout(m_settings.workerTimeoutMilliseconds);
+		m_workers.push_back(std::move(worker));
+		++connected;
+	}
+	return connected;
+}
+
+template<typename T>
+void RenderCoordinator<T>::setScene(const SceneFileView<T>& view)
+{
+	m_view = view;
+	m_localScene.reset();
+
+	// Sent as is: workers build the same hierarchy as a local render would when the view has none.
+	const std::vector<unsigned char> bytes = writeSceneBuffer(view, false);
+	for (auto& worker : m_workers)
+	{
+		// A worker that stops reading times the send out; the scene is then partly sent, so the
+		// connection cannot be used again.
+		if (!detail::sendRenderMessage(worker->socket, RenderMessage::Scene, 0, bytes.data(), bytes.size()))
+		{
+			worker->failed = true;
+			worker->socket.close();
+		}
+	}
+}
+
+template<typename T>
+void RenderCoordinator<T>::render(const Camera<T>& camera, Viewport<T>& viewport)
+{
+	++m_frame;
+	const int tileSize = std::max(1, m_settings.tileSize);
+	FrameState frame;
+	frame.tiles = makeTiles(viewport.getWidth(), viewport.getHeight(), tileSize);
+	frame.states.resize(frame.tiles.size());
+	frame.tilesPerRow = (viewport.getWidth() + tileSize - 1) / tileSize;
+	for (std::size_t i = 0; i < frame.tiles.size(); ++i)
+		frame.pending.push_back(i);
+
+	m_stats = DistributedRenderStats{};
+	m_stats.workerTiles.assign(m_workers.size(), 0);
+	const RenderFrameRecord<T> record{ { camera.getOrigin(), camera.getDirection(), camera.getHorizontalFov() }, viewport.getWidth(), viewport.getHeight() };
+	std::vector<std::thread> threads;
+	for (std::size_t i = 0; i < m_workers.size(); ++i)
+	{
+		if (!m_workers[i]->failed)
+			threads.emplace_back(&RenderCoordinator<T>::runWorker, this, i, std::cref(record), std::ref(frame), std::ref(viewport));
+	}
+	for (std::thread& thread : threads)
+		thread.join();
+
+	for (std::size_t i = 0; i < m_workers.size(); ++i)
+		m_stats.failedWorkers += m_workers[i]->failed ? 1 : 0;
+
+	if (frame.doneCount != frame.tiles.size())
+	{
+		const PreparedCamera<T> prepared = camera.prepare(viewport);
+		for (std::size_t i = 0; i < frame.tiles.size(); ++i)
+		{
+			if (!frame.states[i].done)
+			{
+				renderLocally(prepared, viewport, frame.tiles[i]);
+				++m_stats.localTiles;
+			}
+		}
+	}
+
+	// Failed workers are forgotten once their statistics are reported.
+	std::size_t kept = 0;
+	for (std::size_t i = 0; i < m_workers.size(); ++i)
+	{
+		if (!m_workers[i]->failed)
+			m_workers[kept++] = std::move(m_workers[i]);
+	}
+	m_workers.resize(kept);
+}
+
+template<typename T>
+bool RenderCoordinator<T>::takeTile(FrameState& frame, const std::deque<std::size_t>& inFlight, std::size_t& tileIndex)
+{
+	if (!frame.pending.empty())
+	{
+		tileIndex = frame.pending.front();
+		frame.pending.pop_front();
+		return true;
+	}
+
+	bool found = false;
+	for (std::size_t i = 0; i < frame.states.size(); ++i)
+	{
+		const TileState& state = frame.states[i];
+		if (state.done || state.assignments != 1 || std::find(inFlight.begin(), inFlight.end(), i) != inFlight.end())
+			continue;
+		if (!found || state.requested < frame.states[tileIndex].requested)
+			tileIndex = i;
+		found = true;
+	}
+	if (found)
+		++m_stats.reissuedTiles;
+	return found;
+}
+
+template<typename T>
+void RenderCoordinator<T>::runWorker(std::size_t workerIndex, const RenderFrameRecord<T>& record, FrameState& frame, Viewport<T>& viewport)
+{
+	using Clock = std::chrono::steady_clock;
+	Worker& worker = *m_workers[workerIndex];
+	const Socket& socket = worker.socket;
+	const std::size_t tileCount = frame.tiles.size();
+	std::deque<std::size_t> inFlight;
+	std::vector<Color<T> > pixels;
+	Clock::time_point lastMessage = Clock::now();
+
+	bool ok = detail::sendRenderMessage(socket, RenderMessage::Frame, m_frame, &record, sizeof(record));
+	while (ok)
+	{
+		std::vector<std::size_t> requests;
+		{
+			std::unique_lock<std::mutex> lock(frame.mutex);
+			std::size_t tileIndex;
+			while (inFlight.size() < std::size_t(std::max(1, m_settings.tilesInFlight)) && takeTile(frame, inFlight, tileIndex))
+			{
+				TileState& state = frame.states[tileIndex];
+				++state.assignments;
+				state.requested = Clock::now();
+				inFlight.push_back(tileIndex);
+				requests.push_back(tileIndex);
+			}
+
+			if (inFlight.empty())
+			{
+				// Nothing to render until a failed worker gives tiles back.
+				if (frame.doneCount == tileCount)
+					break;
+				frame.changed.wait_for(lock, std::chrono::milliseconds(100));
+				continue;
+			}
+		}
+
+		// The timeout runs from the oldest request still waiting for its result.
+		if (requests.size() == inFlight.size())
+			lastMessage = Clock::now();
+		for (std::size_t i = 0; ok && i < requests.size(); ++i)
+			ok = detail::sendRenderMessage(socket, RenderMessage::Tile, m_frame, &frame.tiles[requests[i]], sizeof(Tile));
+		if (!ok)
+			break;
+
+		if (!socket.waitReadable(100))
+		{
+			// Tiles still in flight here were delivered by another worker once the frame is done.
+			std::lock_guard<std::mutex> lock(frame.mutex);
+			if (frame.doneCount == tileCount)
+				break;
+			ok = Clock::now() - lastMessage < std::chrono::milliseconds(m_settings.workerTimeoutMilliseconds);
+			continue;
+		}
+
+		RenderMessageHeader header;
+		Tile tile;
+		ok = socket.receiveAll(&header, sizeof(header)) && RenderMessage(header.type) == RenderMessage::TilePixels
+			&& header.size >= sizeof(Tile) && socket.receiveAll(&tile, sizeof(tile));
+		if (!ok)
+			break;
+
+		// The size must be that of the tile, which is no larger than the tiles sent, before anything is
+		// allocated for it: a worker sending garbage is dropped rather than trusted with the memory.
+		const int tileSize = std::max(1, m_settings.tileSize);
+		const std::int64_t tileWidth = std::int64_t(tile.colEnd) - tile.colBegin, tileHeight = std::int64_t(tile.rowEnd) - tile.rowBegin;
+		ok = tile.colBegin >= 0 && tile.rowBegin >= 0 && tileWidth > 0 && tileWidth <= tileSize && tileHeight > 0 && tileHeight <= tileSize
+			&& header.size == sizeof(Tile) + std::uint64_t(tileWidth) * std::uint64_t(tileHeight) * sizeof(Color<T>);
+		if (!ok)
+			break;
+
+		const std::size_t pixelCount = std::size_t(tileWidth) * std::size_t(tileHeight);
+		pixels.resize(pixelCount);
+		ok = socket.receiveAll(pixels.data(), pixelCount * sizeof(Color<T>));
+		if (!ok)
+			break;
+		lastMessage = Clock::now();
+
+		// Results of an earlier frame, whose tile another worker delivered first.
+		if (header.frame != m_frame)
+			continue;
+
+		const std::size_t tileIndex = std::size_t(tile.rowBegin / std::max(1, m_settings.tileSize)) * std::size_t(frame.tilesPerRow)
+			+ std::size_t(tile.colBegin / std::max(1, m_settings.tileSize));
+		auto position = std::find(inFlight.begin(), inFlight.end(), tileIndex);
+		const Tile& expected = frame.tiles[std::min(tileIndex, tileCount - 1)];
+		ok = position != inFlight.end() && std::memcmp(&expected, &tile, sizeof(Tile)) == 0;
+		if (!ok)
+			break;
+		inFlight.erase(position);
+
+		bool first;
+		{
+			std::lock_guard<std::mutex> lock(frame.mutex);
+			first = !frame.states[tileIndex].done;
+			if (first)
+			{
+				frame.states[tileIndex].done = true;
+				++frame.doneCount;
+				++m_stats.workerTiles[workerIndex];
+			}
+		}
+		// Only the first result for a tile is written, so no other thread touches its pixels.
+		if (first)
+		{
+			const int width = tile.colEnd - tile.colBegin;
+			for (int row = tile.rowBegin; row < tile.rowEnd; ++row)
+				std::copy_n(pixels.data() + std::size_t(row - tile.rowBegin) * width, width, &viewport(tile.colBegin, row));
+		}
+		frame.changed.notify_all();
+	}
+
+	if (ok)
+		return;
+
+	// The worker is dropped: tiles only it had go back to the others.
+	worker.failed = true;
+	worker.socket.close();
+	{
+		std::lock_guard<std::mutex> lock(frame.mutex);
+		for (std::size_t tileIndex : inFlight)
+		{
+			TileState& state = frame.states[tileIndex];
+			if (!state.done && --state.assignments == 0)
+				frame.pending.push_front(tileIndex);
+		}
+	}
+	frame.changed.notify_all();
+}
+
+template<typename T>
+void RenderCoordinator<T>::renderLocally(const PreparedCamera<T>& camera, Viewport<T>& viewport, const Tile& tile)
+{
+	if (!m_localScene)
+	{
+		m_localScene.reset(new Scene<T>);
+		addToScene(m_view, *m_localScene);
+		m_localScene->compile();
+		m_localPool.reset(new ThreadPool);
+	}
+
+	const std::vector<Tile> parts = makeTiles(tile.colEnd - tile.colBegin, tile.rowEnd - tile.rowBegin);
+	m_localPool->run(parts.size(), [&](std::size_t partIndex, unsigned)
+	{
+		const Tile& part = parts[partIndex];
+		m_localScene->renderTile(camera, viewport, Tile{ tile.colBegin + part.colBegin, tile.rowBegin + part.rowBegin,
+			tile.colBegin + part.colEnd, tile.rowBegin + part.rowEnd });
+	});
+}
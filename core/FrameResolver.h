@@ -0,0 +1,170 @@
+#pragma once
+
+#include "Color.h"
+#include "RenderStats.h"
+#include "ThreadPool.h"
+#include "Viewport.h"
+
+#include "../math/MinMax.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+enum class ResolveMode
+{
+	// Stretches the value range of the frame over [0, 255], as the viewer always did.
+	MinMax,
+	// Scales values by a fixed exposure, then clamps them to [0, 1].
+	Exposure
+};
+
+template<typename T>
+struct ResolveSettings
+{
+	ResolveMode mode = ResolveMode::MinMax;
+	T exposure = T(1);
+};
+
+// A channel value v becomes the byte clamp((v - offset) * scale + 0.5, 0, 255).
+template<typename T>
+struct ResolveRange
+{
+	T offset;
+	T scale;
+};
+
+// Converts viewports to RGBA8, row-major with 4 bytes per pixel, into caller-provided buffers.
+// Both the range reduction and the quantization run in row bands on the pool, if any; scratch
+// space is kept between frames so that resolving does not allocate once warmed up.
+template<typename T>
+class FrameResolver
+{
+public:
+	explicit FrameResolver(ThreadPool* pool = nullptr, SimdIsa isa = detectSimdIsa()) : m_pool(pool), m_isa(isSimdIsaSupported(isa) ? isa : SimdIsa::Scalar)
+	{}
+
+	ResolveRange<T> computeRange(const Viewport<T>& viewport, const ResolveSettings<T>& settings = ResolveSettings<T>{});
+	// Writes rows [rowBegin, rowEnd) to rgba, which holds row rowBegin first, so that a frame can be
+	// handed to a streaming writer one band at a time.
+	void quantizeRows(const Viewport<T>& viewport, const ResolveRange<T>& range, int rowBegin, int rowEnd, std::uint8_t* rgba);
+	void resolve(const Viewport<T>& viewport, std::uint8_t* rgba, const ResolveSettings<T>& settings = ResolveSettings<T>{})
+	{
+		quantizeRows(viewport, computeRange(viewport, settings), 0, viewport.getHeight(), rgba);
+	}
+
+private:
+	int getBandCount(int rowCount) const;
+	// Calls fn(band, bandRowBegin, bandRowEnd) for every band of [rowBegin, rowEnd).
+	template<typename BandFn>
+	void forEachBand(int rowBegin, int rowEnd, int bandCount, BandFn& fn);
+
+	static const T* getValues(const Viewport<T>& viewport)
+	{
+		static_assert(sizeof(Color<T>) == 3 * sizeof(T), "Color must be three packed channels");
+		return reinterpret_cast<const T*>(viewport.getPixels());
+	}
+
+	ThreadPool* m_pool;
+	SimdIsa m_isa;
+	std::vector<T> m_bandMin;
+	std::vector<T> m_bandMax;
+};
+
+template<typename T>
+int FrameResolver<T>::getBandCount(int rowCount) const
+{
+	// A few bands per thread even out rows that take longer than others.
+	const int threadCount = m_pool != nullptr ? int(m_pool->getThreadCount()) : 1;
+	return std::max(1, std::min(rowCount, threadCount > 1 ? 4 * threadCount : 1));
+}
+
+template<typename T>
+template<typename BandFn>
+void FrameResolver<T>::forEachBand(int rowBegin, int rowEnd, int bandCount, BandFn& fn)
+{
+	struct Job
+	{
+		BandFn* fn;
+		int rowBegin, rowCount, bandCount;
+	} job{ &fn, rowBegin, rowEnd - rowBegin, bandCount };
+
+	auto runBand = [&job](std::size_t band, unsigned)
+	{
+		const int begin = job.rowBegin + int(std::int64_t(job.rowCount) * std::int64_t(band) / job.bandCount);
+		const int end = job.rowBegin + int(std::int64_t(job.rowCount) * std::int64_t(band + 1) / job.bandCount);
+		(*job.fn)(band, begin, end);
+	};
+
+	if (m_pool == nullptr || bandCount == 1)
+	{
+		for (int band = 0; band < bandCount; ++band)
+			runBand(std::size_t(band), 0);
+	}
+	else
+	{
+		// The task captures a single reference, so std::function keeps it in its inline storage.
+		m_pool->run(std::size_t(bandCount), runBand);
+	}
+}
+
+template<typename T>
+ResolveRange<T> FrameResolver<T>::computeRange(const Viewport<T>& viewport, const ResolveSettings<T>& settings)
+{
+	if (settings.mode == ResolveMode::Exposure)
+		return { T(0), T(255) * settings.exposure };
+
+	RAYTRACER_STAT_SCOPE(Resolve);
+	const int bandCount = getBandCount(viewport.getHeight());
+	m_bandMin.resize(std::size_t(bandCount));
+	m_bandMax.resize(std::size_t(bandCount));
+
+	const T* values = getValues(viewport);
+	const std::size_t rowValues = 3 * std::size_t(viewport.getWidth());
+	auto reduce = [&](std::size_t band, int rowBegin, int rowEnd)
+	{
+		T min = std::numeric_limits<T>::infinity();
+		T max = -std::numeric_limits<T>::infinity();
+		findMinMax(values + rowValues * std::size_t(rowBegin), rowValues * std::size_t(rowEnd - rowBegin), min, max, m_isa);
+		m_bandMin[band] = min;
+		m_bandMax[band] = max;
+	};
+	forEachBand(0, viewport.getHeight(), bandCount, reduce);
+
+	const T min = *std::min_element(m_bandMin.begin(), m_bandMin.end());
+	const T max = *std::max_element(m_bandMax.begin(), m_bandMax.end());
+	return { min, max > min ? T(255) / (max - min) : T(0) };
+}
+
+template<typename T>
+void FrameResolver<T>::quantizeRows(const Viewport<T>& viewport, const ResolveRange<T>& range, int rowBegin, int rowEnd, std::uint8_t* rgba)
+{
+	if (rowEnd <= rowBegin)
+		return;
+
+	RAYTRACER_STAT_SCOPE(Resolve);
+	const T* values = getValues(viewport);
+	const std::size_t width = std::size_t(viewport.getWidth());
+	auto quantize = [&](std::size_t, int bandBegin, int bandEnd)
+	{
+		// Branch-free and division-free, so that compilers vectorize the inner loop.
+		const T offset = range.offset, scale = range.scale;
+		for (int row = bandBegin; row < bandEnd; ++row)
+		{
+			const T* in = values + 3 * width * std::size_t(row);
+			std::uint8_t* out = rgba + 4 * width * std::size_t(row - rowBegin);
+			for (std::size_t i = 0; i < width; ++i)
+			{
+				for (int channel = 0; channel < 3; ++channel)
+				{
+					T v = (in[3 * i + channel] - offset) * scale + T(0.5);
+					v = v > T(0) ? (v < T(255) ? v : T(255)) : T(0);
+					out[4 * i + channel] = std::uint8_t(v);
+				}
+				out[4 * i + 3] = 255;
+			}
+		}
+	};
+	forEachBand(rowBegin, rowEnd, getBandCount(rowEnd - rowBegin), quantize);
+}
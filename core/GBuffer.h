@@ -0,0 +1,198 @@
+#pragma once
+
+#include "Camera.h"
+#include "Light.h"
+#include "Scene.h"
+#include "ThreadPool.h"
+#include "Tile.h"
+#include "Viewport.h"
+
+#include "../math/RayPacket.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Pixels shaded by the last render or reshade, and how many of them reused the visibility of their
+// lights or traced bounces.
+struct GBufferStats
+{
+	std::size_t pixels = 0;
+	std::size_t reusedVisibility = 0;
+	std::size_t bounced = 0;
+};
+
+// Keeps the closest hit of every pixel of a frame, so that the frame can be shaded again after
+// lights or materials are edited without tracing its primary rays. Which lights reach each hit is
+// kept as well (see LightVisibility) and reused while every light stays in place, so that changing
+// intensities, colors or materials traces no ray at all; hits on reflective or transmissive
+// surfaces still trace their bounces. Reshaded frames are identical to a full render of the
+// edited scene.
+template<typename T>
+class GBuffer
+{
+public:
+	// Renders the frame like Scene::render, keeping its hits. Compiles the scene first if needed.
+	void render(Scene<T>& scene, const Camera<T>& camera, Viewport<T>& viewport, ThreadPool& pool);
+	// Shades the kept hits into the viewport again, compiling the scene's edits first. Returns false,
+	// without drawing anything, when the hits are out of date; render the frame instead.
+	bool reshade(Scene<T>& scene, Viewport<T>& viewport, ThreadPool& pool);
+	// Whether reshade can draw this scene into this viewport: it was rendered here last, and nothing
+	// changed what rays hit since (Scene::getVisibilityRevision).
+	bool isValid(const Scene<T>& scene, const Viewport<T>& viewport) const;
+	void clear();
+
+	const std::vector<SurfaceHit<T> >& getHits() const { return m_hits; }
+	const GBufferStats& getStats() const { return m_stats; }
+	std::size_t getMemoryFootprint() const;
+
+private:
+	// Traces or reshades every pixel, one tile per pool task.
+	void shadeTiles(const Scene<T>& scene, Viewport<T>& viewport, ThreadPool& pool, bool trace);
+	// Forgets the visibility of every hit if any light moved since it was recorded.
+	void checkLights(const Scene<T>& scene);
+
+	const Scene<T>* m_scene = nullptr;
+	std::uint64_t m_revision = 0;
+	std::unique_ptr<PreparedCamera<T> > m_camera;
+	std::vector<SurfaceHit<T> > m_hits;
+	std::vector<LightVisibility> m_visibility;
+	// Where the lights were when visibility was recorded; empty if some light has no position.
+	std::vector<Point3<T> > m_lightPositions;
+	GBufferStats m_stats;
+};
+
+template<typename T>
+void GBuffer<T>::render(Scene<T>& scene, const Camera<T>& camera, Viewport<T>& viewport, ThreadPool& pool)
+{
+	if (!scene.isCompiled())
+		scene.compile();
+	m_scene = &scene;
+	m_revision = scene.getVisibilityRevision();
+	m_camera.reset(new PreparedCamera<T>(camera.prepare(viewport)));
+
+	const std::size_t pixelCount = std::size_t(viewport.getWidth()) * std::size_t(viewport.getHeight());
+	m_hits.assign(pixelCount, SurfaceHit<T>{ NO_CONTACT<T>(), NO_OBJECT, 0 });
+	m_visibility.assign(pixelCount, LightVisibility{ 0, false });
+	m_lightPositions.clear();
+	checkLights(scene);
+	shadeTiles(scene, viewport, pool, true);
+}
+
+template<typename T>
+bool GBuffer<T>::reshade(Scene<T>& scene, Viewport<T>& viewport, ThreadPool& pool)
+{
+	if (!scene.isCompiled())
+		scene.compile();
+	if (!isValid(scene, viewport))
+		return false;
+
+	checkLights(scene);
+	shadeTiles(scene, viewport, pool, false);
+	return true;
+}
+
+template<typename T>
+bool GBuffer<T>::isValid(const Scene<T>& scene, const Viewport<T>& viewport) const
+{
+	return m_camera && m_scene == &scene && m_revision == scene.getVisibilityRevision() && m_camera->getWidth() == viewport.getWidth()
+		&& m_camera->getHeight() == viewport.getHeight();
+}
+
+template<typename T>
+void GBuffer<T>::clear()
+{
+	m_scene = nullptr;
+	m_camera.reset();
+	m_hits = std::vector<SurfaceHit<T> >();
+	m_visibility = std::vector<LightVisibility>();
+	m_lightPositions.clear();
+}
+
+template<typename T>
+std::size_t GBuffer<T>::getMemoryFootprint() const
+{
+	return m_hits.capacity() * sizeof(SurfaceHit<T>) + m_visibility.capacity() * sizeof(LightVisibility);
+}
+
+template<typename T>
+void GBuffer<T>::checkLights(const Scene<T>& scene)
+{
+	std::vector<Point3<T> > positions;
+	positions.reserve(scene.getLightCount());
+	for (std::size_t i = 0; i < scene.getLightCount(); ++i)
+	{
+		Point3<T> position{ 0., 0., 0. };
+		T power;
+		if (!scene.getLight(i).getEmission(position, power))
+		{
+			positions.clear();
+			break;
+		}
+		positions.push_back(position);
+	}
+
+	bool moved = positions.empty() || positions.size() != m_lightPositions.size();
+	for (std::size_t i = 0; !moved && i < positions.size(); ++i)
+	{
+		const Point3<T>& a = positions[i];
+		const Point3<T>& b = m_lightPositions[i];
+		moved = a.x != b.x || a.y != b.y || a.z != b.z;
+	}
+	if (moved)
+	{
+		for (LightVisibility& visibility : m_visibility)
+			visibility.known = false;
+	}
+	m_lightPositions.swap(positions);
+}
+
+template<typename T>
+void GBuffer<T>::shadeTiles(const Scene<T>& scene, Viewport<T>& viewport, ThreadPool& pool, bool trace)
+{
+	const PreparedCamera<T>& camera = *m_camera;
+	const int width = viewport.getWidth();
+	const std::vector<Tile> tiles = makeTiles(width, viewport.getHeight());
+	std::vector<GBufferStats> tileStats(tiles.size());
+	pool.run(tiles.size(), [&](std::size_t tileIndex, unsigned)
+	{
+		RAYTRACER_STAT_SCOPE(Tile);
+		const Tile& tile = tiles[tileIndex];
+		GBufferStats& stats = tileStats[tileIndex];
+		RayPacket<T> rays;
+		rays.resize(std::size_t(tile.colEnd - tile.colBegin));
+		for (int row = tile.rowBegin; row < tile.rowEnd; ++row)
+		{
+			{
+				RAYTRACER_STAT_TIMER(CameraSetup);
+				camera.generateRow(row, tile.colBegin, tile.colEnd, rays);
+			}
+			for (int col = tile.colBegin; col < tile.colEnd; ++col)
+			{
+				const std::size_t pixel = std::size_t(row) * std::size_t(width) + std::size_t(col);
+				const Ray<T> ray = rays.get(std::size_t(col - tile.colBegin));
+				SurfaceHit<T>& hit = m_hits[pixel];
+				LightVisibility& visibility = m_visibility[pixel];
+				if (trace)
+					scene.findClosestHit(ray, hit);
+				else if (visibility.known)
+					++stats.reusedVisibility;
+				if (hit.objectIndex != NO_OBJECT)
+				{
+					const Material<T>& material = scene.getCompiledScene().getMaterial(hit.materialIndex);
+					stats.bounced += material.reflection != T(0) || material.transmission != T(0) ? 1 : 0;
+				}
+				viewport(col, row) = scene.shadeHit(ray, hit, visibility, m_camera->getPixelSpread());
+			}
+		}
+		stats.pixels += std::size_t(tile.colEnd - tile.colBegin) * std::size_t(tile.rowEnd - tile.rowBegin);
+	});
+
+	m_stats = GBufferStats{};
+	for (const GBufferStats& stats : tileStats)
+	{
+		m_stats.pixels += stats.pixels;
+		m_stats.reusedVisibility += stats.reusedVisibility;
+		m_stats.bounced += stats.bounced;
+	}
+}
@@ -1,15 +1,39 @@
 #pragma once
 
+#include "../math/AABB.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Surface parameters of a hit, which textures are mapped with.
+template<typename T>
+struct TextureCoordinates
+{
+	T u;
+	T v;
+};
+
 template<typename T>
 struct Contact
 {
 	T distance;
 	Point3<T> point;
 	Vec3<T> normal;
+	TextureCoordinates<T> coordinates;
 };
 
 template<typename T>
-constexpr Contact<T> NO_CONTACT() { return { -1., {0., 0., 0.}, {0., 0., 0.} }; }
+constexpr Contact<T> NO_CONTACT() { return { -1., {0., 0., 0.}, {0., 0., 0.}, {0., 0.} }; }
+
+// Longitude and latitude of a direction from the centre of a sphere, each in [0, 1]: the
+// parameters of its surface, which move with the sphere.
+template<typename T>
+TextureCoordinates<T> getSphericalCoordinates(const Vec3<T>& direction)
+{
+	const T u = std::atan2(direction.z, direction.x) / (T(2) * pi<T>()) + T(0.5);
+	const T v = std::acos(std::max(T(-1), std::min(T(1), direction.y))) / pi<T>();
+	return { u, v };
+}
 
 template<typename T>
 class IGeometry
@@ -18,6 +42,22 @@ public:
 	virtual ~IGeometry() = default;
 
 	virtual Contact<T> getIntersection(const Ray<T>& ray) const = 0;
+	virtual AABB<T> getBoundingBox() const = 0;
+
+	// Lets geometries with their own acceleration structure stop at hits beyond tMax, which are
+	// discarded anyway. The result is only meaningful when its distance is at or before tMax.
+	virtual Contact<T> getIntersectionBefore(const Ray<T>& ray, T /*tMax*/) const { return getIntersection(ray); }
+
+	// Any-hit test for shadow rays: whether something is hit at or before tMax. Overrides can stop at
+	// the first hit and skip the point and normal.
+	virtual bool isHitBefore(const Ray<T>& ray, T tMax) const
+	{
+		T distance = getIntersectionBefore(ray, tMax).distance;
+		return distance != NO_INTERSECTION<T>() && distance <= tMax;
+	}
+
+	// Lets the scene batch spheres into SIMD kernels instead of calling getIntersection.
+	virtual const Sphere<T>* getSphere() const { return nullptr; }
 };
 
 template<typename T>
@@ -34,10 +74,24 @@ public:
 			return NO_CONTACT<T>();
 
 		auto point = ray.getPointAtAbscice(inter);
+		const Vec3<T> normal = (point - m_sphere.center).getNormalized();
+		return { inter, point, normal, getSphericalCoordinates(normal) };
+	}
+
+	virtual bool isHitBefore(const Ray<T>& ray, T tMax) const override
+	{
+		T inter = intersect(m_sphere, ray);
+		return inter != NO_INTERSECTION<T>() && inter <= tMax;
+	}
 
-		return { inter, point, (point - m_sphere.center).getNormalized() };
+	virtual AABB<T> getBoundingBox() const override
+	{
+		Vec3<T> extent{ m_sphere.radius, m_sphere.radius, m_sphere.radius };
+		return { m_sphere.center - extent, m_sphere.center + extent };
 	}
 
+	virtual const Sphere<T>* getSphere() const override { return &m_sphere; }
+
 private:
 	Sphere<T> m_sphere;
 };
@@ -0,0 +1,366 @@
+#pragma once
+
+#include "Color.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Streaming image writers: open() writes the header, then rows are appended top to bottom as they
+// are produced, so a frame never has to be held as a whole in the output format. close() reports
+// failed writes and missing rows.
+namespace detail
+{
+	class StreamingImageFile
+	{
+	public:
+		~StreamingImageFile()
+		{
+			if (m_file != nullptr)
+				std::fclose(m_file);
+		}
+
+		int getWidth() const { return m_width; }
+		int getHeight() const { return m_height; }
+
+	protected:
+		bool openFile(const std::string& path, int width, int height, std::string* error)
+		{
+			if (m_file != nullptr)
+				std::fclose(m_file);
+			m_path = path;
+			m_width = width;
+			m_height = height;
+			m_rowsWritten = 0;
+			m_ok = width > 0 && height > 0;
+			if (!m_ok)
+				return fail(error, path + ": empty image");
+			m_file = std::fopen(path.c_str(), "wb");
+			if (m_file == nullptr)
+				return fail(error, "cannot create " + path);
+			return true;
+		}
+
+		bool write(const void* data, std::size_t size)
+		{
+			m_ok = m_ok && m_file != nullptr && std::fwrite(data, 1, size, m_file) == size;
+			return m_ok;
+		}
+
+		// Rows past the declared height are refused.
+		bool beginRows(int rowCount)
+		{
+			m_ok = m_ok && rowCount >= 0 && m_rowsWritten + rowCount <= m_height;
+			return m_ok;
+		}
+
+		bool closeFile(std::string* error)
+		{
+			if (m_file == nullptr)
+				return m_ok || fail(error, "cannot write " + m_path);
+			bool complete = m_rowsWritten == m_height;
+			bool closed = std::fclose(m_file) == 0;
+			m_file = nullptr;
+			if (!complete)
+				return fail(error, m_path + ": " + std::to_string(m_rowsWritten) + " of " + std::to_string(m_height) + " rows written");
+			if (!m_ok || !closed)
+				return fail(error, "cannot write " + m_path);
+			return true;
+		}
+
+		static bool fail(std::string* error, const std::string& message)
+		{
+			if (error != nullptr)
+				*error = message;
+			return false;
+		}
+
+		std::FILE* m_file = nullptr;
+		std::string m_path;
+		int m_width = 0;
+		int m_height = 0;
+		int m_rowsWritten = 0;
+		bool m_ok = false;
+	};
+
+	inline void putBigEndian32(std::uint8_t* out, std::uint32_t value)
+	{
+		out[0] = std::uint8_t(value >> 24); out[1] = std::uint8_t(value >> 16); out[2] = std::uint8_t(value >> 8); out[3] = std::uint8_t(value);
+	}
+
+	inline void appendLittleEndian(std::vector<std::uint8_t>& out, std::uint64_t value, int byteCount)
+	{
+		for (int i = 0; i < byteCount; ++i)
+			out.push_back(std::uint8_t(value >> (8 * i)));
+	}
+
+	inline std::uint32_t updateCrc32(std::uint32_t crc, const std::uint8_t* data, std::size_t size)
+	{
+		static const std::vector<std::uint32_t> table = []
+		{
+			std::vector<std::uint32_t> entries(256);
+			for (std::uint32_t n = 0; n < 256; ++n)
+			{
+				std::uint32_t c = n;
+				for (int k = 0; k < 8; ++k)
+					c = (c & 1) != 0 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+				entries[n] = c;
+			}
+			return entries;
+		}();
+
+		crc = ~crc;
+		for (std::size_t i = 0; i < size; ++i)
+			crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+		return ~crc;
+	}
+}
+
+// Binary PPM (P6); alpha is dropped.
+class PpmWriter : public detail::StreamingImageFile
+{
+public:
+	bool open(const std::string& path, int width, int height, std::string* error = nullptr)
+	{
+		if (!openFile(path, width, height, error))
+			return false;
+		const std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+		m_row.resize(3 * std::size_t(width));
+		return write(header.data(), header.size()) || fail(error, "cannot write " + path);
+	}
+
+	// rowCount rows of getWidth() RGBA8 pixels.
+	bool writeRows(const std::uint8_t* rgba, int rowCount)
+	{
+		if (!beginRows(rowCount))
+			return false;
+		for (int row = 0; row < rowCount; ++row, ++m_rowsWritten)
+		{
+			const std::uint8_t* in = rgba + 4 * std::size_t(m_width) * std::size_t(row);
+			for (std::size_t i = 0; i < std::size_t(m_width); ++i)
+				std::memcpy(&m_row[3 * i], in + 4 * i, 3);
+			if (!write(m_row.data(), m_row.size()))
+				return false;
+		}
+		return true;
+	}
+
+	bool close(std::string* error = nullptr) { return closeFile(error); }
+
+private:
+	std::vector<std::uint8_t> m_row;
+};
+
+// 8-bit RGB PNG. Rows go into stored (uncompressed) deflate blocks, one IDAT chunk per writeRows
+// call, so no compression library is needed and nothing is buffered beyond one call's rows.
+class PngWriter : public detail::StreamingImageFile
+{
+public:
+	bool open(const std::string& path, int width, int height, std::string* error = nullptr)
+	{
+		if (!openFile(path, width, height, error))
+			return false;
+
+		static const std::uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+		std::uint8_t header[13];
+		detail::putBigEndian32(header, std::uint32_t(width));
+		detail::putBigEndian32(header + 4, std::uint32_t(height));
+		// 8 bits per channel, truecolor, deflate, adaptive filtering, no interlacing.
+		header[8] = 8; header[9] = 2; header[10] = 0; header[11] = 0; header[12] = 0;
+
+		m_adler1 = 1;
+		m_adler2 = 0;
+		m_chunk.clear();
+		// zlib header: deflate with a 32K window, no preset dictionary, check bits for 0x7801.
+		m_chunk.push_back(0x78);
+		m_chunk.push_back(0x01);
+		return (write(signature, sizeof(signature)) && writeChunk("IHDR", header, sizeof(header))) || fail(error, "cannot write " + path);
+	}
+
+	bool writeRows(const std::uint8_t* rgba, int rowCount)
+	{
+		if (!beginRows(rowCount))
+			return false;
+
+		const std::size_t rowBytes = 1 + 3 * std::size_t(m_width);
+		for (int row = 0; row < rowCount; ++row, ++m_rowsWritten)
+		{
+			const std::uint8_t* in = rgba + 4 * std::size_t(m_width) * std::size_t(row);
+			m_row.resize(rowBytes);
+			m_row[0] = 0; // No filter.
+			for (std::size_t i = 0; i < std::size_t(m_width); ++i)
+				std::memcpy(&m_row[1 + 3 * i], in + 4 * i, 3);
+			updateAdler32(m_row.data(), rowBytes);
+
+			// Stored blocks hold at most 65535 bytes; the last block of the last row is final.
+			for (std::size_t offset = 0; offset < rowBytes; offset += 65535)
+			{
+				const std::size_t size = std::min<std::size_t>(65535, rowBytes - offset);
+				const bool final = m_rowsWritten + 1 == m_height && offset + size == rowBytes;
+				m_chunk.push_back(final ? 1 : 0);
+				m_chunk.push_back(std::uint8_t(size));
+				m_chunk.push_back(std::uint8_t(size >> 8));
+				m_chunk.push_back(std::uint8_t(~size));
+				m_chunk.push_back(std::uint8_t(~size >> 8));
+				m_chunk.insert(m_chunk.end(), m_row.begin() + std::ptrdiff_t(offset), m_row.begin() + std::ptrdiff_t(offset + size));
+			}
+		}
+
+		if (m_rowsWritten == m_height)
+		{
+			std::uint8_t adler[4];
+			detail::putBigEndian32(adler, (m_adler2 << 16) | m_adler1);
+			m_chunk.insert(m_chunk.end(), adler, adler + 4);
+		}
+		bool ok = writeChunk("IDAT", m_chunk.data(), m_chunk.size());
+		m_chunk.clear();
+		return ok;
+	}
+
+	bool close(std::string* error = nullptr)
+	{
+		if (m_file != nullptr && m_rowsWritten == m_height)
+			writeChunk("IEND", nullptr, 0);
+		return closeFile(error);
+	}
+
+private:
+	bool writeChunk(const char* type, const std::uint8_t* data, std::size_t size)
+	{
+		std::uint8_t prefix[8];
+		detail::putBigEndian32(prefix, std::uint32_t(size));
+		std::memcpy(prefix + 4, type, 4);
+		std::uint32_t crc = detail::updateCrc32(0, prefix + 4, 4);
+		if (size != 0)
+			crc = detail::updateCrc32(crc, data, size);
+		std::uint8_t suffix[4];
+		detail::putBigEndian32(suffix, crc);
+		return write(prefix, sizeof(prefix)) && (size == 0 || write(data, size)) && write(suffix, sizeof(suffix));
+	}
+
+	void updateAdler32(const std::uint8_t* data, std::size_t size)
+	{
+		// 5552 bytes is the most that can be summed before the 32-bit sums may overflow.
+		while (size != 0)
+		{
+			const std::size_t run = std::min<std::size_t>(size, 5552);
+			for (std::size_t i = 0; i < run; ++i)
+			{
+				m_adler1 += data[i];
+				m_adler2 += m_adler1;
+			}
+			m_adler1 %= 65521;
+			m_adler2 %= 65521;
+			data += run;
+			size -= run;
+		}
+	}
+
+	std::vector<std::uint8_t> m_row;
+	std::vector<std::uint8_t> m_chunk;
+	std::uint32_t m_adler1 = 1;
+	std::uint32_t m_adler2 = 0;
+};
+
+// Single-part scanline OpenEXR with uncompressed 32-bit float R, G and B channels. Takes linear
+// colors straight from the viewport, before any resolve. Uncompressed blocks have a known size,
+// so the line offset table is written up front.
+class ExrWriter : public detail::StreamingImageFile
+{
+public:
+	bool open(const std::string& path, int width, int height, std::string* error = nullptr)
+	{
+		if (!openFile(path, width, height, error))
+			return false;
+
+		std::vector<std::uint8_t> header = { 0x76, 0x2F, 0x31, 0x01, 2, 0, 0, 0 };
+		auto attribute = [&](const char* name, const char* type, const std::vector<std::uint8_t>& value)
+		{
+			header.insert(header.end(), name, name + std::strlen(name) + 1);
+			header.insert(header.end(), type, type + std::strlen(type) + 1);
+			detail::appendLittleEndian(header, value.size(), 4);
+			header.insert(header.end(), value.begin(), value.end());
+		};
+		auto floatBits = [](float value)
+		{
+			std::uint32_t bits;
+			std::memcpy(&bits, &value, sizeof(bits));
+			return bits;
+		};
+
+		// Channels are listed, and stored in each line, in alphabetical order.
+		std::vector<std::uint8_t> channels;
+		for (const char* name : { "B", "G", "R" })
+		{
+			channels.insert(channels.end(), name, name + 2);
+			detail::appendLittleEndian(channels, 2, 4); // FLOAT
+			detail::appendLittleEndian(channels, 0, 4); // pLinear and reserved bytes.
+			detail::appendLittleEndian(channels, 1, 4);
+			detail::appendLittleEndian(channels, 1, 4);
+		}
+		channels.push_back(0);
+
+		std::vector<std::uint8_t> window;
+		for (int value : { 0, 0, width - 1, height - 1 })
+			detail::appendLittleEndian(window, std::uint32_t(value), 4);
+		std::vector<std::uint8_t> one, center;
+		detail::appendLittleEndian(one, floatBits(1.f), 4);
+		detail::appendLittleEndian(center, 0, 8);
+
+		attribute("channels", "chlist", channels);
+		attribute("compression", "compression", { 0 });
+		attribute("dataWindow", "box2i", window);
+		attribute("displayWindow", "box2i", window);
+		attribute("lineOrder", "lineOrder", { 0 });
+		attribute("pixelAspectRatio", "float", one);
+		attribute("screenWindowCenter", "v2f", center);
+		attribute("screenWindowWidth", "float", one);
+		header.push_back(0);
+
+		const std::uint64_t lineBytes = 8 + 3 * 4 * std::uint64_t(width);
+		const std::uint64_t firstLine = header.size() + 8 * std::uint64_t(height);
+		for (int y = 0; y < height; ++y)
+			detail::appendLittleEndian(header, firstLine + std::uint64_t(y) * lineBytes, 8);
+
+		m_line.clear();
+		m_line.reserve(std::size_t(lineBytes));
+		return write(header.data(), header.size()) || fail(error, "cannot write " + path);
+	}
+
+	// rowCount rows of getWidth() pixels, converted to float.
+	template<typename T>
+	bool writeRows(const Color<T>* pixels, int rowCount)
+	{
+		if (!beginRows(rowCount))
+			return false;
+
+		for (int row = 0; row < rowCount; ++row, ++m_rowsWritten)
+		{
+			const Color<T>* in = pixels + std::size_t(m_width) * std::size_t(row);
+			m_line.clear();
+			detail::appendLittleEndian(m_line, std::uint32_t(m_rowsWritten), 4);
+			detail::appendLittleEndian(m_line, 3 * 4 * std::uint32_t(m_width), 4);
+			for (int channel = 2; channel >= 0; --channel)
+			{
+				for (std::size_t i = 0; i < std::size_t(m_width); ++i)
+				{
+					const float value = float(channel == 0 ? in[i].r : (channel == 1 ? in[i].g : in[i].b));
+					std::uint32_t bits;
+					std::memcpy(&bits, &value, sizeof(bits));
+					detail::appendLittleEndian(m_line, bits, 4);
+				}
+			}
+			if (!write(m_line.data(), m_line.size()))
+				return false;
+		}
+		return true;
+	}
+
+	bool close(std::string* error = nullptr) { return closeFile(error); }
+
+private:
+	std::vector<std::uint8_t> m_line;
+};
@@ -2,15 +2,34 @@
 
 #include "../math/Vec3.h"
 
+#include <algorithm>
+#include <cmath>
+
 #include "Color.h"
 
+template<typename T>
+struct LightSample
+{
+	// Unit vector from the contact towards the light, and the distance to it.
+	Vec3<T> direction;
+	T distance;
+	// Light received at the contact if nothing blocks it.
+	Color<T> color;
+};
+
 template<typename T>
 class ILight
 {
 public:
 	virtual ~ILight() = default;
 
-	virtual Color<T> getLightAtContact(const Contact<T>& contact) const = 0;
+	// Returns false when the light cannot reach the contact at all, e.g. from behind the surface;
+	// the scene then skips its shadow ray.
+	virtual bool sample(const Contact<T>& contact, LightSample<T>& sample) const = 0;
+
+	// Position and power of a light whose contribution falls off with the squared distance, for the
+	// scene's light hierarchy. Lights returning false are sampled at every hit.
+	virtual bool getEmission(Point3<T>& /*position*/, T& /*power*/) const { return false; }
 };
 
 template<typename T>
@@ -20,11 +39,25 @@ public:
 	PointLight(const Point3<T>& origin, const Color<T>& color, T intensity) : m_origin(origin), m_color(color), m_intensity(intensity)
 	{}
 
-	virtual Color<T> getLightAtContact(const Contact<T>& contact) const override
+	virtual bool sample(const Contact<T>& contact, LightSample<T>& sample) const override
 	{
-		T dist = std::sqrt((contact.point - m_origin) * (contact.point - m_origin));
-		Vec3<T> lightVec = (contact.point - m_origin).getNormalized();
-		return (m_intensity / dist / dist) * (contact.normal * lightVec) * m_color;
+		Vec3<T> toLight = m_origin - contact.point;
+		T dist2 = toLight * toLight;
+		T dist = std::sqrt(dist2);
+		Vec3<T> lightVec = (T(1) / dist) * toLight;
+		T cosine = contact.normal * lightVec;
+		if (!(cosine > T(0)))
+			return false;
+
+		sample = { lightVec, dist, (m_intensity / dist2 * cosine) * m_color };
+		return true;
+	}
+
+	virtual bool getEmission(Point3<T>& position, T& power) const override
+	{
+		position = m_origin;
+		power = m_intensity * std::max(m_color.r, std::max(m_color.g, m_color.b));
+		return true;
 	}
 
 private:
@@ -32,4 +65,3 @@ private:
 	Color<T> m_color;
 	T m_intensity;
 };
-
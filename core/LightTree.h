@@ -0,0 +1,357 @@
+#pragma once
+
+#include "BVH.h"
+#include "Geometry.h"
+#include "Light.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+// How Scene::shade picks the lights whose contribution it computes at a hit.
+enum class LightSelection
+{
+	// Every light, as many shadow rays as lights.
+	All,
+	// Groups of lights are skipped while the bound of the light they could send stays within
+	// cullThreshold of an estimate of the light reaching the hit.
+	Culled,
+	// lightSamples lights drawn per hit, in proportion to an estimate of their contribution, each
+	// weighted by the inverse of its probability: unbiased, with noise instead of missing light.
+	Sampled
+};
+
+struct LightSamplingSettings
+{
+	LightSelection selection = LightSelection::All;
+	// Culled: share of the light reaching a hit, as estimated from the tree, that may be skipped.
+	float cullThreshold = 1e-3f;
+	// Sampled: draws per hit. With no more lights than this, every light is used instead.
+	int lightSamples = 4;
+	// Sampled: groups closer than this many times their radius are split and drawn from separately,
+	// so that the lights the estimate tells apart worst are not left to chance. 0 never splits.
+	float splitDistance = 1.f;
+	std::uint32_t seed = 0;
+};
+
+namespace detail
+{
+	// Random numbers keyed on the hit point, so that the image does not depend on the thread
+	// schedule and a static scene renders the same noise every frame.
+	template<typename T>
+	std::uint32_t hashPoint(const Point3<T>& point)
+	{
+		std::uint32_t h = 0x811C9DC5u;
+		const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&point);
+		for (std::size_t i = 0; i < sizeof(point); ++i)
+			h = (h ^ bytes[i]) * 0x01000193u;
+		return h;
+	}
+
+	inline std::uint32_t hashLightSample(std::uint32_t point, std::uint32_t sample, std::uint32_t seed)
+	{
+		std::uint32_t h = point * 0x9E3779B1u ^ (sample + 0x7F4A7C15u) * 0x85EBCA77u ^ seed * 0xC2B2AE3Du;
+		h ^= h >> 16;
+		h *= 0x7FEB352Du;
+		h ^= h >> 15;
+		h *= 0x846CA68Bu;
+		h ^= h >> 16;
+		return h;
+	}
+}
+
+// Hierarchy over the lights that tell where they are, ILight::getEmission, with the power of each
+// group, so that shading can bound or estimate what a group contributes at a contact without
+// visiting its lights. Costs grow with the depth of the tree rather than the number of lights.
+template<typename T>
+class LightTree
+{
+public:
+	// Lights the tree cannot hold are listed in getOtherLights().
+	void build(const std::vector<std::unique_ptr<ILight<T> > >& lights);
+
+	std::size_t getLightCount() const { return m_lights.size(); }
+	// Scene indices of the lights outside the tree; shading always samples them.
+	const std::vector<std::uint32_t>& getOtherLights() const { return m_otherLights; }
+
+	// Calls visit(lightIndex) for the lights at the contact, except for groups whose bounds add up to
+	// at most relativeThreshold times an estimate of the light of the whole tree there.
+	template<typename VisitFn>
+	void cull(const Contact<T>& contact, T relativeThreshold, VisitFn&& visit) const;
+
+	// Draws a light from u in [0, 1) in proportion to its estimated contribution, once per group split
+	// off by splitDistance, and calls visit(lightIndex, probability) for each.
+	template<typename VisitFn>
+	void sample(const Contact<T>& contact, T u, T splitDistance, VisitFn&& visit) const;
+
+private:
+	// Upper bound of the light a group sends to the contact, 0 when it is all behind the surface.
+	T getBound(const AABB<T>& bounds, T power, const Contact<T>& contact) const;
+	// Smoother estimate used to draw lights: the distance to the centre of the group rather than to
+	// its nearest point.
+	T getImportance(const AABB<T>& bounds, T power, const Contact<T>& contact) const;
+	// Importance of a node from its children, whose tighter boxes rarely reach above the surface when
+	// none of their lights do, so that draws seldom end in a group that cannot light the contact.
+	T getNodeImportance(std::uint32_t nodeIndex, const Contact<T>& contact) const;
+	// Sum of the importance of the groups ESTIMATE_DEPTH levels down.
+	T getEstimate(const Contact<T>& contact) const;
+	// Bound of the cosine at the contact over the group: 0 when its box is behind the surface,
+	// otherwise from the sphere around it.
+	static T getCosineBound(const AABB<T>& bounds, const Vec3<T>& toCentre, T distance, T radius, const Vec3<T>& normal);
+
+	static constexpr int STACK_SIZE = 128;
+	static constexpr int ESTIMATE_DEPTH = 5;
+
+	BVH<T> m_bvh;
+	// Per node, the power of the lights below it.
+	std::vector<T> m_nodePower;
+	// Per primitive of the hierarchy: scene index and power of the light.
+	std::vector<std::uint32_t> m_lights;
+	std::vector<T> m_power;
+	std::vector<std::uint32_t> m_otherLights;
+};
+
+template<typename T>
+void LightTree<T>::build(const std::vector<std::unique_ptr<ILight<T> > >& lights)
+{
+	m_lights.clear();
+	m_power.clear();
+	m_otherLights.clear();
+
+	std::vector<AABB<T> > bounds;
+	for (std::size_t i = 0; i < lights.size(); ++i)
+	{
+		Point3<T> position{ 0., 0., 0. };
+		T power = 0;
+		if (!lights[i]->getEmission(position, power))
+		{
+			m_otherLights.push_back(std::uint32_t(i));
+			continue;
+		}
+		m_lights.push_back(std::uint32_t(i));
+		m_power.push_back(power);
+		bounds.push_back(AABB<T>{ position, position });
+	}
+
+	// One light per leaf, so that drawing a leaf draws a light.
+	BVHBuildSettings settings;
+	settings.maxLeafSize = 1;
+	m_bvh.build(bounds, settings);
+
+	// Children follow their parent, so a reverse pass sums powers bottom-up.
+	const BVHNode<T>* nodes = m_bvh.getNodes();
+	const std::vector<std::uint32_t>& order = m_bvh.getPrimitiveIndices();
+	m_nodePower.assign(m_bvh.getNodeCount(), T(0));
+	for (std::size_t i = m_bvh.getNodeCount(); i-- > 0;)
+	{
+		const BVHNode<T>& node = nodes[i];
+		if (node.isLeaf())
+		{
+			for (std::uint32_t j = node.offset; j < node.offset + node.count; ++j)
+				m_nodePower[i] += m_power[order[j]];
+		}
+		else
+			m_nodePower[i] = m_nodePower[i + 1] + m_nodePower[node.offset];
+	}
+}
+
+template<typename T>
+T LightTree<T>::getCosineBound(const AABB<T>& bounds, const Vec3<T>& toCentre, T distance, T radius, const Vec3<T>& normal)
+{
+	// Highest point of the box above the plane of the surface.
+	const Vec3<T> halfExtent = T(0.5) * (bounds.max - bounds.min);
+	const T height = normal * toCentre + std::abs(normal.x) * halfExtent.x + std::abs(normal.y) * halfExtent.y + std::abs(normal.z) * halfExtent.z;
+	if (!(height > T(0)))
+		return T(0);
+	if (distance <= radius)
+		return T(1);
+
+	// cos(max(0, theta - alpha)), theta the angle between the normal and the centre, alpha the
+	// half-angle the sphere subtends.
+	const T cosTheta = (normal * toCentre) / distance;
+	const T sinAlpha = radius / distance;
+	const T cosAlpha = std::sqrt(std::max(T(0), T(1) - sinAlpha * sinAlpha));
+	if (cosTheta >= cosAlpha)
+		return T(1);
+	const T sinTheta = std::sqrt(std::max(T(0), T(1) - cosTheta * cosTheta));
+	return std::max(T(0), cosTheta * cosAlpha + sinTheta * sinAlpha);
+}
+
+template<typename T>
+T LightTree<T>::getBound(const AABB<T>& bounds, T power, const Contact<T>& contact) const
+{
+	const Point3<T>& p = contact.point;
+	const Vec3<T> nearest{ std::min(std::max(p.x, bounds.min.x), bounds.max.x) - p.x, std::min(std::max(p.y, bounds.min.y), bounds.max.y) - p.y,
+		std::min(std::max(p.z, bounds.min.z), bounds.max.z) - p.z };
+	const T distance2 = nearest * nearest;
+	if (!(distance2 > T(0)))
+		return std::numeric_limits<T>::infinity();
+
+	const Vec3<T> extent = bounds.max - bounds.min;
+	const Vec3<T> toCentre = bounds.getCentroid() - p;
+	const T cosine = getCosineBound(bounds, toCentre, std::sqrt(toCentre * toCentre), T(0.5) * std::sqrt(extent * extent), contact.normal);
+	return power * cosine / distance2;
+}
+
+template<typename T>
+T LightTree<T>::getImportance(const AABB<T>& bounds, T power, const Contact<T>& contact) const
+{
+	const Vec3<T> extent = bounds.max - bounds.min;
+	const T radius = T(0.5) * std::sqrt(extent * extent);
+	const Vec3<T> toCentre = bounds.getCentroid() - contact.point;
+	const T distance2 = toCentre * toCentre;
+	const T cosine = getCosineBound(bounds, toCentre, std::sqrt(distance2), radius, contact.normal);
+	// Inside a group the distance is unknown; its radius keeps nearby groups from dominating.
+	return power * cosine / std::max(distance2, std::max(radius * radius, std::numeric_limits<T>::min()));
+}
+
+template<typename T>
+T LightTree<T>::getNodeImportance(std::uint32_t nodeIndex, const Contact<T>& contact) const
+{
+	const BVHNode<T>* nodes = m_bvh.getNodes();
+	const BVHNode<T>& node = nodes[nodeIndex];
+	if (node.isLeaf())
+		return getImportance(node.bounds, m_nodePower[nodeIndex], contact);
+	const std::uint32_t left = nodeIndex + 1, right = node.offset;
+	return getImportance(nodes[left].bounds, m_nodePower[left], contact) + getImportance(nodes[right].bounds, m_nodePower[right], contact);
+}
+
+template<typename T>
+T LightTree<T>::getEstimate(const Contact<T>& contact) const
+{
+	const BVHNode<T>* nodes = m_bvh.getNodes();
+	T estimate = 0;
+	std::uint32_t stack[ESTIMATE_DEPTH + 1];
+	int depths[ESTIMATE_DEPTH + 1];
+	int stackSize = 0;
+	stack[stackSize] = 0;
+	depths[stackSize++] = 0;
+	while (stackSize > 0)
+	{
+		--stackSize;
+		const std::uint32_t nodeIndex = stack[stackSize];
+		const int depth = depths[stackSize];
+		const BVHNode<T>& node = nodes[nodeIndex];
+		if (node.isLeaf() || depth == ESTIMATE_DEPTH)
+		{
+			estimate += getImportance(node.bounds, m_nodePower[nodeIndex], contact);
+			continue;
+		}
+		stack[stackSize] = node.offset;
+		depths[stackSize++] = depth + 1;
+		stack[stackSize] = nodeIndex + 1;
+		depths[stackSize++] = depth + 1;
+	}
+	return estimate;
+}
+
+template<typename T>
+template<typename VisitFn>
+void LightTree<T>::cull(const Contact<T>& contact, T relativeThreshold, VisitFn&& visit) const
+{
+	if (m_lights.empty())
+		return;
+
+	const BVHNode<T>* nodes = m_bvh.getNodes();
+	const std::vector<std::uint32_t>& order = m_bvh.getPrimitiveIndices();
+	// Groups are skipped until their bounds use up the budget, so that many faint ones cannot add up
+	// to more than the threshold allows.
+	T budget = relativeThreshold * getEstimate(contact);
+
+	// The build bounds the depth of the tree, and one sibling per level waits on the stack.
+	std::uint32_t stack[STACK_SIZE];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+	while (stackSize > 0)
+	{
+		const std::uint32_t nodeIndex = stack[--stackSize];
+		const BVHNode<T>& node = nodes[nodeIndex];
+		const T bound = getBound(node.bounds, m_nodePower[nodeIndex], contact);
+		if (!(bound > T(0)))
+			continue;
+		if (bound <= budget)
+		{
+			budget -= bound;
+			continue;
+		}
+
+		if (node.isLeaf())
+		{
+			for (std::uint32_t j = node.offset; j < node.offset + node.count; ++j)
+				visit(m_lights[order[j]]);
+		}
+		else if (stackSize + 2 <= STACK_SIZE)
+		{
+			stack[stackSize++] = node.offset;
+			stack[stackSize++] = nodeIndex + 1;
+		}
+	}
+}
+
+template<typename T>
+template<typename VisitFn>
+void LightTree<T>::sample(const Contact<T>& contact, T u, T splitDistance, VisitFn&& visit) const
+{
+	if (m_lights.empty())
+		return;
+
+	// Each split branch draws with the u and probability of the group it came from.
+	struct Draw
+	{
+		std::uint32_t node;
+		T u;
+		T probability;
+	};
+	const BVHNode<T>* nodes = m_bvh.getNodes();
+	Draw stack[STACK_SIZE];
+	int stackSize = 0;
+	stack[stackSize++] = { 0, u, T(1) };
+	while (stackSize > 0)
+	{
+		Draw draw = stack[--stackSize];
+		while (!nodes[draw.node].isLeaf())
+		{
+			const BVHNode<T>& node = nodes[draw.node];
+			const std::uint32_t left = draw.node + 1, right = node.offset;
+			const Vec3<T> extent = node.bounds.max - node.bounds.min;
+			const Vec3<T> toCentre = node.bounds.getCentroid() - contact.point;
+			if (splitDistance > T(0) && stackSize + 1 < STACK_SIZE && toCentre * toCentre < splitDistance * splitDistance * T(0.25) * (extent * extent))
+			{
+				stack[stackSize++] = { right, draw.u, draw.probability };
+				draw.node = left;
+				continue;
+			}
+
+			const T leftImportance = getNodeImportance(left, contact);
+			const T rightImportance = getNodeImportance(right, contact);
+			const T total = leftImportance + rightImportance;
+			if (!(total > T(0)))
+				break;
+
+			// u is rescaled to [0, 1) within the chosen branch and reused below it.
+			const T leftProbability = leftImportance / total;
+			if (draw.u < leftProbability)
+			{
+				draw.node = left;
+				draw.u = draw.u / leftProbability;
+				draw.probability *= leftProbability;
+			}
+			else
+			{
+				draw.node = right;
+				draw.u = std::min((draw.u - leftProbability) / (T(1) - leftProbability), T(1) - std::numeric_limits<T>::epsilon());
+				draw.probability *= T(1) - leftProbability;
+			}
+		}
+
+		// Leaves hold one light, unless several share a position.
+		const BVHNode<T>& leaf = nodes[draw.node];
+		if (!leaf.isLeaf() || !(draw.probability > T(0)))
+			continue;
+		const std::uint32_t slot = leaf.offset + std::min(std::uint32_t(draw.u * T(leaf.count)), std::uint32_t(leaf.count - 1));
+		visit(m_lights[m_bvh.getPrimitiveIndices()[slot]], draw.probability / T(leaf.count));
+	}
+}
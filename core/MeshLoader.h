@@ -0,0 +1,542 @@
+#pragma once
+
+#include "MappedFile.h"
+#include "TriangleMesh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// OBJ and PLY (ascii and binary) readers. Files are mapped and parsed straight into the mesh buffers,
+// which are sized up front; polygons are split into fans. OBJ texture coordinates ("vt") are kept
+// for the faces that reference them. A failed load leaves the mesh as it was. Call
+// TriangleMesh::build() once loaded.
+template<typename T>
+bool loadObj(const std::string& path, TriangleMesh<T>& mesh, std::string* error = nullptr);
+
+template<typename T>
+bool loadPly(const std::string& path, TriangleMesh<T>& mesh, std::string* error = nullptr);
+
+// Picks the reader from the extension.
+template<typename T>
+bool loadMesh(const std::string& path, TriangleMesh<T>& mesh, std::string* error = nullptr);
+
+namespace detail
+{
+	inline bool meshError(std::string* error, const std::string& message)
+	{
+		if (error != nullptr)
+			*error = message;
+		return false;
+	}
+
+	inline bool isBlank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+	inline bool isSpace(char c) { return isBlank(c) || c == '\n'; }
+
+	// Bounded tokenizer over a mapped file, which is not null-terminated.
+	struct TextCursor
+	{
+		const char* position;
+		const char* end;
+
+		void skipBlanks() { while (position < end && isBlank(*position)) ++position; }
+		void skipSpaces() { while (position < end && isSpace(*position)) ++position; }
+		void skipLine()
+		{
+			const void* newline = std::memchr(position, '\n', std::size_t(end - position));
+			position = newline != nullptr ? static_cast<const char*>(newline) + 1 : end;
+		}
+		bool atLineEnd() const { return position == end || *position == '\n'; }
+
+		const char* tokenEnd() const
+		{
+			const char* p = position;
+			while (p < end && !isSpace(*p))
+				++p;
+			return p;
+		}
+
+		bool startsWith(const char* word) const
+		{
+			std::size_t length = std::strlen(word);
+			return std::size_t(end - position) >= length && std::memcmp(position, word, length) == 0
+				&& (position + length == end || isSpace(position[length]));
+		}
+
+		bool readReal(double& value)
+		{
+			skipBlanks();
+			const char* tokenStop = tokenEnd();
+			char buffer[64];
+			std::size_t length = std::size_t(tokenStop - position);
+			if (length == 0 || length >= sizeof(buffer))
+				return false;
+			std::memcpy(buffer, position, length);
+			buffer[length] = '\0';
+
+			char* parsed;
+			value = std::strtod(buffer, &parsed);
+			position = tokenStop;
+			return parsed == buffer + length;
+		}
+
+		// Reads the leading integer of a token and leaves the cursor right after it.
+		bool readInteger(long long& value)
+		{
+			skipBlanks();
+			bool negative = position < end && *position == '-';
+			if (negative || (position < end && *position == '+'))
+				++position;
+			if (position == end || *position < '0' || *position > '9')
+				return false;
+
+			value = 0;
+			while (position < end && *position >= '0' && *position <= '9' && value < (1ll << 40))
+				value = value * 10 + (*position++ - '0');
+			if (negative)
+				value = -value;
+			return true;
+		}
+	};
+
+	inline std::size_t countLinesStartingWith(const char* data, const char* end, const char* prefix)
+	{
+		std::size_t count = 0;
+		const std::size_t length = std::strlen(prefix);
+		for (const char* line = data; line < end;)
+		{
+			if (std::size_t(end - line) > length && std::memcmp(line, prefix, length) == 0)
+				++count;
+			const void* newline = std::memchr(line, '\n', std::size_t(end - line));
+			line = newline != nullptr ? static_cast<const char*>(newline) + 1 : end;
+		}
+		return count;
+	}
+}
+
+template<typename T>
+bool loadObj(const std::string& path, TriangleMesh<T>& mesh, std::string* error)
+{
+	using detail::meshError;
+
+	MappedFile file;
+	if (!file.open(path))
+		return meshError(error, "cannot map " + path);
+
+	const char* data = reinterpret_cast<const char*>(file.getData());
+	const char* end = data + file.getSize();
+	const std::size_t firstVertex = mesh.getVertexCount();
+	const std::size_t firstTriangle = mesh.getTriangleCount();
+	mesh.reserve(firstVertex + detail::countLinesStartingWith(data, end, "v "), mesh.getTriangleCount() + detail::countLinesStartingWith(data, end, "f "));
+
+	std::vector<TextureCoordinates<T> > textureCoordinates;
+	detail::TextCursor cursor{ data, end };
+	for (int lineNumber = 1; cursor.position < end; ++lineNumber, cursor.skipLine())
+	{
+		cursor.skipBlanks();
+		auto fail = [&](const char* problem)
+		{
+			mesh.truncate(firstVertex, firstTriangle);
+			return meshError(error, path + ":" + std::to_string(lineNumber) + ": " + problem);
+		};
+		if (cursor.startsWith("v"))
+		{
+			++cursor.position;
+			double x, y, z;
+			if (!cursor.readReal(x) || !cursor.readReal(y) || !cursor.readReal(z))
+				return fail("malformed vertex");
+			mesh.addVertex({ T(x), T(y), T(z) });
+		}
+		else if (cursor.startsWith("vt"))
+		{
+			// A third coordinate, for 3D textures, is ignored.
+			cursor.position += 2;
+			double u, v;
+			if (!cursor.readReal(u) || !cursor.readReal(v))
+				return fail("malformed texture coordinates");
+			textureCoordinates.push_back({ T(u), T(v) });
+		}
+		else if (cursor.startsWith("f"))
+		{
+			++cursor.position;
+			const long long vertexCount = (long long)(mesh.getVertexCount() - firstVertex);
+			const long long coordinateCount = (long long)textureCoordinates.size();
+			std::uint32_t corners[3];
+			TextureCoordinates<T> cornerCoordinates[3];
+			int cornerCount = 0, texturedCorners = 0;
+			while (true)
+			{
+				cursor.skipBlanks();
+				if (cursor.atLineEnd())
+					break;
+
+				// "v", "v/vt", "v//vn" or "v/vt/vn", of which the normal is not used; negative indices
+				// count from the end.
+				long long index;
+				if (!cursor.readInteger(index) || index == 0)
+					return fail("malformed face");
+				index = index > 0 ? index - 1 : vertexCount + index;
+				if (index < 0 || index >= vertexCount)
+					return fail("vertex index out of range");
+				TextureCoordinates<T> coordinates{ 0., 0. };
+				if (cursor.position < end && *cursor.position == '/' && cursor.position + 1 < end && cursor.position[1] != '/')
+				{
+					++cursor.position;
+					long long coordinateIndex;
+					if (!cursor.readInteger(coordinateIndex) || coordinateIndex == 0)
+						return fail("malformed face");
+					coordinateIndex = coordinateIndex > 0 ? coordinateIndex - 1 : coordinateCount + coordinateIndex;
+					if (coordinateIndex < 0 || coordinateIndex >= coordinateCount)
+						return fail("texture coordinate index out of range");
+					coordinates = textureCoordinates[std::size_t(coordinateIndex)];
+					++texturedCorners;
+				}
+				cursor.position = cursor.tokenEnd();
+
+				const std::uint32_t corner = std::uint32_t(firstVertex + std::size_t(index));
+				if (cornerCount < 3)
+				{
+					cornerCoordinates[cornerCount] = coordinates;
+					corners[cornerCount++] = corner;
+				}
+				else
+				{
+					corners[1] = corners[2];
+					corners[2] = corner;
+					cornerCoordinates[1] = cornerCoordinates[2];
+					cornerCoordinates[2] = coordinates;
+				}
+				if (cornerCount == 3 && !mesh.addTriangle(corners[0], corners[1], corners[2], texturedCorners != 0 ? cornerCoordinates : nullptr))
+					return fail("vertex index out of range");
+			}
+			if (cornerCount < 3)
+				return fail("face with fewer than 3 vertices");
+		}
+	}
+	return true;
+}
+
+namespace detail
+{
+	enum class PlyFormat { Ascii, BinaryLittleEndian, BinaryBigEndian };
+
+	enum class PlyType { None, Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64 };
+
+	inline PlyType parsePlyType(const std::string& name)
+	{
+		if (name == "char" || name == "int8") return PlyType::Int8;
+		if (name == "uchar" || name == "uint8") return PlyType::UInt8;
+		if (name == "short" || name == "int16") return PlyType::Int16;
+		if (name == "ushort" || name == "uint16") return PlyType::UInt16;
+		if (name == "int" || name == "int32") return PlyType::Int32;
+		if (name == "uint" || name == "uint32") return PlyType::UInt32;
+		if (name == "float" || name == "float32") return PlyType::Float32;
+		if (name == "double" || name == "float64") return PlyType::Float64;
+		return PlyType::None;
+	}
+
+	inline std::size_t getPlyTypeSize(PlyType type)
+	{
+		switch (type)
+		{
+		case PlyType::Int8: case PlyType::UInt8: return 1;
+		case PlyType::Int16: case PlyType::UInt16: return 2;
+		case PlyType::Int32: case PlyType::UInt32: case PlyType::Float32: return 4;
+		case PlyType::Float64: return 8;
+		default: return 0;
+		}
+	}
+
+	struct PlyProperty
+	{
+		std::string name;
+		PlyType type;
+		// Set for list properties, whose element count comes first.
+		PlyType countType;
+	};
+
+	struct PlyElement
+	{
+		std::string name;
+		std::size_t count;
+		std::vector<PlyProperty> properties;
+	};
+
+	struct PlyReader
+	{
+		PlyFormat format;
+		TextCursor cursor;
+
+		bool read(PlyType type, double& value)
+		{
+			if (format == PlyFormat::Ascii)
+			{
+				cursor.skipSpaces();
+				return cursor.readReal(value);
+			}
+
+			const std::size_t size = getPlyTypeSize(type);
+			if (std::size_t(cursor.end - cursor.position) < size)
+				return false;
+
+			unsigned char bytes[8];
+			std::memcpy(bytes, cursor.position, size);
+			cursor.position += size;
+			if (format == PlyFormat::BinaryBigEndian)
+			{
+				for (std::size_t i = 0; i < size / 2; ++i)
+					std::swap(bytes[i], bytes[size - 1 - i]);
+			}
+
+			switch (type)
+			{
+			case PlyType::Int8: { std::int8_t v; std::memcpy(&v, bytes, 1); value = v; break; }
+			case PlyType::UInt8: { std::uint8_t v; std::memcpy(&v, bytes, 1); value = v; break; }
+			case PlyType::Int16: { std::int16_t v; std::memcpy(&v, bytes, 2); value = v; break; }
+			case PlyType::UInt16: { std::uint16_t v; std::memcpy(&v, bytes, 2); value = v; break; }
+			case PlyType::Int32: { std::int32_t v; std::memcpy(&v, bytes, 4); value = v; break; }
+			case PlyType::UInt32: { std::uint32_t v; std::memcpy(&v, bytes, 4); value = v; break; }
+			case PlyType::Float32: { float v; std::memcpy(&v, bytes, 4); value = v; break; }
+			case PlyType::Float64: { double v; std::memcpy(&v, bytes, 8); value = v; break; }
+			default: return false;
+			}
+			return true;
+		}
+	};
+
+	inline bool parsePlyHeader(TextCursor& cursor, PlyFormat& format, std::vector<PlyElement>& elements, std::string& problem)
+	{
+		if (!cursor.startsWith("ply"))
+		{
+			problem = "not a PLY file";
+			return false;
+		}
+
+		bool hasFormat = false;
+		for (cursor.skipLine(); cursor.position < cursor.end; cursor.skipLine())
+		{
+			const char* lineEnd = static_cast<const char*>(std::memchr(cursor.position, '\n', std::size_t(cursor.end - cursor.position)));
+			std::vector<std::string> words;
+			for (TextCursor word{ cursor.position, lineEnd != nullptr ? lineEnd : cursor.end };;)
+			{
+				word.skipBlanks();
+				if (word.position == word.end)
+					break;
+				const char* stop = word.tokenEnd();
+				words.emplace_back(word.position, stop);
+				word.position = stop;
+			}
+			if (words.empty() || words[0] == "comment" || words[0] == "obj_info")
+				continue;
+
+			if (words[0] == "end_header")
+			{
+				cursor.skipLine();
+				if (!hasFormat)
+					problem = "missing format line";
+				return hasFormat;
+			}
+			else if (words[0] == "format" && words.size() >= 2)
+			{
+				hasFormat = true;
+				if (words[1] == "ascii")
+					format = PlyFormat::Ascii;
+				else if (words[1] == "binary_little_endian")
+					format = PlyFormat::BinaryLittleEndian;
+				else if (words[1] == "binary_big_endian")
+					format = PlyFormat::BinaryBigEndian;
+				else
+					hasFormat = false;
+			}
+			else if (words[0] == "element" && words.size() == 3)
+			{
+				elements.push_back({ words[1], std::size_t(std::strtoull(words[2].c_str(), nullptr, 10)), {} });
+			}
+			else if (words[0] == "property" && !elements.empty())
+			{
+				PlyProperty property;
+				if (words.size() == 5 && words[1] == "list")
+					property = { words[4], parsePlyType(words[3]), parsePlyType(words[2]) };
+				else if (words.size() == 3)
+					property = { words[2], parsePlyType(words[1]), PlyType::None };
+				else
+					property.type = PlyType::None;
+
+				if (property.type == PlyType::None || (words[1] == "list" && property.countType == PlyType::None))
+				{
+					problem = "unsupported property";
+					return false;
+				}
+				if (property.countType == PlyType::Float32 || property.countType == PlyType::Float64)
+				{
+					problem = "list counts must be integers";
+					return false;
+				}
+				elements.back().properties.push_back(property);
+			}
+			else
+			{
+				problem = "unexpected header line '" + words[0] + "'";
+				return false;
+			}
+		}
+
+		problem = "missing end_header";
+		return false;
+	}
+}
+
+template<typename T>
+bool loadPly(const std::string& path, TriangleMesh<T>& mesh, std::string* error)
+{
+	using detail::meshError;
+
+	MappedFile file;
+	if (!file.open(path))
+		return meshError(error, "cannot map " + path);
+
+	const char* data = reinterpret_cast<const char*>(file.getData());
+	detail::PlyReader reader{ detail::PlyFormat::Ascii, { data, data + file.getSize() } };
+	std::vector<detail::PlyElement> elements;
+	std::string problem;
+	if (!detail::parsePlyHeader(reader.cursor, reader.format, elements, problem))
+		return meshError(error, path + ": " + problem);
+
+	// Counts come from the header. An item takes at least a byte per value in binary, or a digit and
+	// a separator per value in ASCII, so counts larger than the rest of the file can hold are rejected
+	// before any buffer is sized from them.
+	std::size_t remaining = std::size_t(reader.cursor.end - reader.cursor.position);
+	std::size_t vertexCount = 0, faceCount = 0;
+	bool hasVertices = false;
+	for (const auto& element : elements)
+	{
+		std::size_t itemSize = 0;
+		for (const auto& property : element.properties)
+		{
+			const detail::PlyType first = property.countType != detail::PlyType::None ? property.countType : property.type;
+			itemSize += reader.format == detail::PlyFormat::Ascii ? 2 : detail::getPlyTypeSize(first);
+		}
+		itemSize = std::max<std::size_t>(itemSize, 1);
+		if (element.count > remaining / itemSize)
+			return meshError(error, path + ": " + element.name + " count exceeds the file size");
+		remaining -= element.count * itemSize;
+
+		if (element.name == "vertex")
+		{
+			vertexCount = element.count;
+			hasVertices = true;
+		}
+		else if (element.name == "face")
+		{
+			// Triangles only take indices of vertices already added.
+			if (!hasVertices && element.count != 0)
+				return meshError(error, path + ": faces before vertices");
+			faceCount = element.count;
+		}
+	}
+
+	const std::size_t firstVertex = mesh.getVertexCount();
+	const std::size_t firstTriangle = mesh.getTriangleCount();
+	auto fail = [&](const std::string& problem)
+	{
+		mesh.truncate(firstVertex, firstTriangle);
+		return meshError(error, path + ": " + problem);
+	};
+	mesh.reserve(firstVertex + vertexCount, firstTriangle + faceCount);
+
+	std::size_t loadedVertices = 0;
+	for (const auto& element : elements)
+	{
+		const bool isVertex = element.name == "vertex";
+		const bool isFace = element.name == "face";
+		for (std::size_t item = 0; item < element.count; ++item)
+		{
+			double position[3] = { 0., 0., 0. };
+			for (const auto& property : element.properties)
+			{
+				double value;
+				if (property.countType == detail::PlyType::None)
+				{
+					if (!reader.read(property.type, value))
+						return fail("truncated " + element.name + " " + std::to_string(item));
+					if (isVertex && property.name.size() == 1 && property.name[0] >= 'x' && property.name[0] <= 'z')
+						position[property.name[0] - 'x'] = value;
+					continue;
+				}
+
+				// A list must fit in the rest of the file, at a digit and a separator per value in ASCII.
+				double listSize;
+				if (!reader.read(property.countType, listSize) || !(listSize >= 0) || listSize != std::floor(listSize))
+					return fail("malformed list in " + element.name + " " + std::to_string(item));
+				const std::size_t remaining = std::size_t(reader.cursor.end - reader.cursor.position);
+				const std::size_t valueSize = reader.format == detail::PlyFormat::Ascii ? 2 : detail::getPlyTypeSize(property.type);
+				if (listSize > double(remaining / valueSize + 1))
+					return fail("truncated " + element.name + " " + std::to_string(item));
+
+				const bool isIndices = isFace && (property.name == "vertex_indices" || property.name == "vertex_index");
+				if (isIndices && listSize < 3)
+					return fail("face " + std::to_string(item) + " has fewer than 3 vertices");
+
+				std::uint32_t corners[3];
+				for (std::size_t i = 0; i < std::size_t(listSize); ++i)
+				{
+					if (!reader.read(property.type, value))
+						return fail("truncated " + element.name + " " + std::to_string(item));
+					if (!isIndices)
+						continue;
+					if (!(value >= 0 && value < double(vertexCount)) || value != std::floor(value))
+						return fail("face " + std::to_string(item) + " references a missing vertex");
+
+					const std::uint32_t corner = std::uint32_t(firstVertex + std::size_t(value));
+					if (i < 3)
+						corners[i] = corner;
+					else
+					{
+						corners[1] = corners[2];
+						corners[2] = corner;
+					}
+					if (i >= 2 && !mesh.addTriangle(corners[0], corners[1], corners[2]))
+						return fail("face " + std::to_string(item) + " references a missing vertex");
+				}
+			}
+
+			if (isVertex)
+			{
+				mesh.addVertex({ T(position[0]), T(position[1]), T(position[2]) });
+				++loadedVertices;
+			}
+		}
+	}
+
+	if (loadedVertices != vertexCount)
+		return fail("truncated vertex list");
+	return true;
+}
+
+template<typename T>
+bool loadMesh(const std::string& path, TriangleMesh<T>& mesh, std::string* error)
+{
+	auto hasExtension = [&](const char* extension)
+	{
+		std::size_t length = std::strlen(extension);
+		if (path.size() < length)
+			return false;
+		for (std::size_t i = 0; i < length; ++i)
+		{
+			char c = path[path.size() - length + i];
+			if ((c >= 'A' && c <= 'Z' ? char(c - 'A' + 'a') : c) != extension[i])
+				return false;
+		}
+		return true;
+	};
+
+	if (hasExtension(".obj"))
+		return loadObj(path, mesh, error);
+	if (hasExtension(".ply"))
+		return loadPly(path, mesh, error);
+	return detail::meshError(error, path + ": unknown mesh format");
+}
@@ -8,4 +8,11 @@ class OpticalProperties
 public:
 	T ambient = 1.0;
 	T diffusion = 0.5;
+	// Shares of the light coming from the mirror direction and through the surface, which Scene
+	// traces for up to its maximum number of bounces. Ambient and diffuse light is scaled by what
+	// they leave.
+	T reflection = 0.0;
+	T transmission = 0.0;
+	// Inside over outside, for transmitted rays.
+	T refractiveIndex = 1.0;
 };
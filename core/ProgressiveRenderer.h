@@ -0,0 +1,169 @@
+#pragma once
+
+#include "Scene.h"
+#include "ThreadPool.h"
+#include "Tile.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+// Renders a frame in coarse-to-fine passes on a background thread. The first pass traces one pixel per
+// block of initialBlockSize x initialBlockSize pixels and fills the block with it; each following pass
+// halves the block size and only traces the pixels not traced yet, so the last pass (block size 1) is
+// identical to Scene::render. Each finished pass is published to a front buffer the caller can poll.
+template<typename T>
+class ProgressiveRenderer
+{
+public:
+	ProgressiveRenderer(int width, int height, unsigned threadCount = 0, int initialBlockSize = 8);
+	~ProgressiveRenderer();
+
+	ProgressiveRenderer(const ProgressiveRenderer&) = delete;
+	ProgressiveRenderer& operator=(const ProgressiveRenderer&) = delete;
+
+	// Stops the frame in flight and starts again from the coarsest pass. The scene is compiled here if
+	// needed and must then stay unmodified until cancel() or the next start().
+	void start(Scene<T>& scene, const Camera<T>& camera);
+	void cancel();
+
+	// Never blocks: calls fn(const Viewport<T>&, int blockSize) with the newest published pass if there
+	// is one the caller has not seen yet and the front buffer is not being written right now.
+	template<typename Fn>
+	bool consumeFrame(Fn&& fn);
+
+	bool isComplete() const { return m_complete.load(); }
+
+private:
+	void renderPasses(const Scene<T>& scene, const PreparedCamera<T>& camera);
+	void renderBlocks(const Scene<T>& scene, const PreparedCamera<T>& camera, const Tile& tile, int blockSize, bool firstPass);
+	void publish(int blockSize);
+
+	ThreadPool m_pool;
+	int m_initialBlockSize;
+	std::vector<Tile> m_tiles;
+
+	Viewport<T> m_working;
+	std::thread m_controller;
+	std::atomic<bool> m_cancel{ false };
+	std::atomic<bool> m_complete{ false };
+
+	std::mutex m_frontMutex;
+	Viewport<T> m_front;
+	int m_frontBlockSize = 0;
+	std::uint64_t m_frontVersion = 0;
+	std::uint64_t m_consumedVersion = 0;
+};
+
+template<typename T>
+ProgressiveRenderer<T>::ProgressiveRenderer(int width, int height, unsigned threadCount, int initialBlockSize) :
+	m_pool(threadCount), m_working(width, height), m_front(width, height)
+{
+	m_initialBlockSize = 1;
+	while (m_initialBlockSize * 2 <= initialBlockSize)
+		m_initialBlockSize *= 2;
+
+	// Tiles are a multiple of the coarsest block so that blocks never straddle two tiles.
+	m_tiles = makeTiles(width, height, std::max(DEFAULT_TILE_SIZE, m_initialBlockSize));
+}
+
+template<typename T>
+ProgressiveRenderer<T>::~ProgressiveRenderer()
+{
+	cancel();
+}
+
+template<typename T>
+void ProgressiveRenderer<T>::cancel()
+{
+	m_cancel = true;
+	if (m_controller.joinable())
+		m_controller.join();
+	m_cancel = false;
+}
+
+template<typename T>
+void ProgressiveRenderer<T>::start(Scene<T>& scene, const Camera<T>& camera)
+{
+	cancel();
+
+	if (!scene.isCompiled())
+		scene.compile();
+
+	m_complete = false;
+	const Scene<T>* renderedScene = &scene;
+	PreparedCamera<T> prepared = camera.prepare(m_working);
+	m_controller = std::thread([this, renderedScene, prepared]
+	{
+		renderPasses(*renderedScene, prepared);
+	});
+}
+
+template<typename T>
+void ProgressiveRenderer<T>::renderPasses(const Scene<T>& scene, const PreparedCamera<T>& camera)
+{
+	for (int blockSize = m_initialBlockSize; blockSize >= 1; blockSize /= 2)
+	{
+		const bool firstPass = blockSize == m_initialBlockSize;
+		m_pool.run(m_tiles.size(), [&](std::size_t tileIndex, unsigned)
+		{
+			renderBlocks(scene, camera, m_tiles[tileIndex], blockSize, firstPass);
+		});
+
+		if (m_cancel)
+			return;
+
+		publish(blockSize);
+	}
+	m_complete = true;
+}
+
+template<typename T>
+void ProgressiveRenderer<T>::renderBlocks(const Scene<T>& scene, const PreparedCamera<T>& camera, const Tile& tile, int blockSize, bool firstPass)
+{
+	for (int row = tile.rowBegin; row < tile.rowEnd; row += blockSize)
+	{
+		if (m_cancel)
+			return;
+
+		const int rowEnd = std::min(row + blockSize, tile.rowEnd);
+		for (int col = tile.colBegin; col < tile.colEnd; col += blockSize)
+		{
+			// Pixels on the previous pass's grid were traced already.
+			if (!firstPass && row % (2 * blockSize) == 0 && col % (2 * blockSize) == 0)
+				continue;
+
+			const Color<T> color = scene.traceRay(camera.getRay(row, col), camera.getPixelSpread());
+			const int colEnd = std::min(col + blockSize, tile.colEnd);
+			for (int fillRow = row; fillRow < rowEnd; ++fillRow)
+			{
+				for (int fillCol = col; fillCol < colEnd; ++fillCol)
+					m_working(fillCol, fillRow) = color;
+			}
+		}
+	}
+}
+
+template<typename T>
+void ProgressiveRenderer<T>::publish(int blockSize)
+{
+	std::lock_guard<std::mutex> lock(m_frontMutex);
+	m_front = m_working;
+	m_frontBlockSize = blockSize;
+	++m_frontVersion;
+}
+
+template<typename T>
+template<typename Fn>
+bool ProgressiveRenderer<T>::consumeFrame(Fn&& fn)
+{
+	std::unique_lock<std::mutex> lock(m_frontMutex, std::try_to_lock);
+	if (!lock.owns_lock() || m_frontVersion == m_consumedVersion)
+		return false;
+
+	m_consumedVersion = m_frontVersion;
+	fn(static_cast<const Viewport<T>&>(m_front), m_frontBlockSize);
+	return true;
+}
@@ -0,0 +1,405 @@
+#pragma once
+
+#include "../math/Simd.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+// Render statistics: counters and phase timings kept per thread and merged at frame end, plus an
+// optional timeline in the Chrome trace format, for chrome://tracing or Perfetto. The macros below
+// compile to nothing unless RAYTRACER_STATS is defined to 1, which the CMake option of the same
+// name does.
+#ifndef RAYTRACER_STATS
+#define RAYTRACER_STATS 0
+#endif
+
+enum class StatCounter
+{
+	// Rays traced by Scene::traceRay, and whether they hit anything.
+	Rays,
+	Hits,
+	Misses,
+	// Reflected and transmitted rays among them.
+	SecondaryRays,
+	NodeVisits,
+	SphereTests,
+	// IGeometry intersection calls.
+	GeometryTests,
+	LightSamples,
+	ShadowRays,
+	ShadowRaysBlocked,
+	// Nodes visited by batches of shadow rays, once per batch.
+	ShadowNodeVisits,
+	// Primitive tests made for shadow rays, spheres and other geometry alike.
+	ShadowTests,
+	Count
+};
+
+enum class StatPhase
+{
+	Compile,
+	// Camera preparation and primary ray generation.
+	CameraSetup,
+	Tile,
+	// Closest-hit search of traced rays.
+	Trace,
+	// Shading of their hits, shadow rays included.
+	Shade,
+	// Reordering of secondary rays for coherence by WavefrontRenderer.
+	RaySort,
+	Resolve,
+	Count
+};
+
+inline const char* getStatCounterName(StatCounter counter)
+{
+	switch (counter)
+	{
+	case StatCounter::Rays: return "rays";
+	case StatCounter::Hits: return "hits";
+	case StatCounter::Misses: return "misses";
+	case StatCounter::SecondaryRays: return "secondaryRays";
+	case StatCounter::NodeVisits: return "nodeVisits";
+	case StatCounter::SphereTests: return "sphereTests";
+	case StatCounter::GeometryTests: return "geometryTests";
+	case StatCounter::LightSamples: return "lightSamples";
+	case StatCounter::ShadowRays: return "shadowRays";
+	case StatCounter::ShadowRaysBlocked: return "shadowRaysBlocked";
+	case StatCounter::ShadowNodeVisits: return "shadowNodeVisits";
+	case StatCounter::ShadowTests: return "shadowTests";
+	default: return "unknown";
+	}
+}
+
+inline const char* getStatPhaseName(StatPhase phase)
+{
+	switch (phase)
+	{
+	case StatPhase::Compile: return "compile";
+	case StatPhase::CameraSetup: return "cameraSetup";
+	case StatPhase::Tile: return "tile";
+	case StatPhase::Trace: return "trace";
+	case StatPhase::Shade: return "shade";
+	case StatPhase::RaySort: return "raySort";
+	case StatPhase::Resolve: return "resolve";
+	default: return "unknown";
+	}
+}
+
+inline constexpr bool isRenderStatsEnabled() { return RAYTRACER_STATS != 0; }
+
+struct FrameStats
+{
+	static constexpr std::size_t COUNTER_COUNT = std::size_t(StatCounter::Count);
+	static constexpr std::size_t PHASE_COUNT = std::size_t(StatPhase::Count);
+
+	std::uint64_t counters[COUNTER_COUNT] = {};
+	// Summed over threads, so phases run on the pool can add up to more than the frame.
+	double phaseMilliseconds[PHASE_COUNT] = {};
+	double frameMilliseconds = 0;
+
+	std::uint64_t operator[](StatCounter counter) const { return counters[std::size_t(counter)]; }
+	double getMilliseconds(StatPhase phase) const { return phaseMilliseconds[std::size_t(phase)]; }
+};
+
+// Process-wide collector. Each thread counts into its own block, registered on first use and
+// reused once the thread exits, so that counting needs no synchronization; beginFrame and endFrame
+// read and reset every block and must therefore be called between frames, while no render is in
+// flight.
+class RenderStats
+{
+public:
+	static RenderStats& get()
+	{
+		static RenderStats stats;
+		return stats;
+	}
+
+	static void add(StatCounter counter, std::uint64_t n = 1) { getThreadBlock().counters[std::size_t(counter)] += n; }
+	static void addTime(StatPhase phase, std::int64_t beginNanoseconds, std::int64_t endNanoseconds, bool traced);
+	static void addTicks(StatPhase phase, std::uint64_t ticks) { getThreadBlock().phaseTicks[std::size_t(phase)] += ticks; }
+	static std::int64_t now()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - get().m_epoch).count();
+	}
+	// Cheaper than now() but in unspecified units, converted at frame end; for per-ray timers.
+	static std::uint64_t readTicks()
+	{
+#if RAYTRACER_SIMD_X86
+		return __rdtsc();
+#else
+		return std::uint64_t(now());
+#endif
+	}
+
+	// Whether traced phases are recorded on the timeline, which then grows until clearTrace().
+	void setTracing(bool tracing) { m_tracing.store(tracing, std::memory_order_relaxed); }
+	bool isTracing() const { return m_tracing.load(std::memory_order_relaxed); }
+
+	void beginFrame();
+	FrameStats endFrame();
+
+	void clearTrace();
+	void writeChromeTrace(std::ostream& out);
+
+private:
+	struct TraceEvent
+	{
+		StatPhase phase;
+		std::int64_t beginNanoseconds;
+		std::int64_t durationNanoseconds;
+	};
+
+	struct ThreadBlock
+	{
+		std::uint64_t counters[FrameStats::COUNTER_COUNT] = {};
+		std::int64_t phaseNanoseconds[FrameStats::PHASE_COUNT] = {};
+		std::uint64_t phaseTicks[FrameStats::PHASE_COUNT] = {};
+		std::vector<TraceEvent> events;
+		unsigned thread = 0;
+	};
+
+	struct FrameEvent
+	{
+		unsigned thread;
+		std::int64_t beginNanoseconds;
+		FrameStats stats;
+	};
+
+	RenderStats() : m_epoch(std::chrono::steady_clock::now())
+	{}
+
+	static ThreadBlock& getThreadBlock();
+	void mergeEvents(ThreadBlock& block);
+
+	const std::chrono::steady_clock::time_point m_epoch;
+	std::atomic<bool> m_tracing{ false };
+	std::mutex m_mutex;
+	std::vector<std::unique_ptr<ThreadBlock> > m_blocks;
+	std::vector<ThreadBlock*> m_freeBlocks;
+	std::vector<std::pair<unsigned, TraceEvent> > m_trace;
+	std::vector<FrameEvent> m_frames;
+	std::int64_t m_frameBegin = 0;
+	std::uint64_t m_frameBeginTicks = 0;
+};
+
+inline RenderStats::ThreadBlock& RenderStats::getThreadBlock()
+{
+	// Constant-initialized, so that the hot path is a plain thread-local load.
+	static thread_local ThreadBlock* block = nullptr;
+	if (block == nullptr)
+	{
+		// Hands the block back when the thread exits, counts included, for the next new thread to
+		// take over; the registry thus holds as many blocks as threads ever ran at once.
+		struct Release
+		{
+			ThreadBlock*& block;
+			~Release()
+			{
+				RenderStats& stats = get();
+				std::lock_guard<std::mutex> lock(stats.m_mutex);
+				stats.m_freeBlocks.push_back(block);
+				block = nullptr;
+			}
+		};
+		static thread_local Release release{ block };
+
+		RenderStats& stats = get();
+		std::lock_guard<std::mutex> lock(stats.m_mutex);
+		if (!stats.m_freeBlocks.empty())
+		{
+			block = stats.m_freeBlocks.back();
+			stats.m_freeBlocks.pop_back();
+		}
+		else
+		{
+			stats.m_blocks.emplace_back(new ThreadBlock);
+			block = stats.m_blocks.back().get();
+			block->thread = unsigned(stats.m_blocks.size() - 1);
+		}
+	}
+	return *block;
+}
+
+inline void RenderStats::addTime(StatPhase phase, std::int64_t beginNanoseconds, std::int64_t endNanoseconds, bool traced)
+{
+	ThreadBlock& block = getThreadBlock();
+	block.phaseNanoseconds[std::size_t(phase)] += endNanoseconds - beginNanoseconds;
+	if (traced)
+		block.events.push_back({ phase, beginNanoseconds, endNanoseconds - beginNanoseconds });
+}
+
+inline void RenderStats::mergeEvents(ThreadBlock& block)
+{
+	for (const TraceEvent& event : block.events)
+		m_trace.emplace_back(block.thread, event);
+	block.events.clear();
+}
+
+inline void RenderStats::beginFrame()
+{
+	// Registers the calling thread first, as getThreadBlock takes the lock.
+	getThreadBlock();
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (auto& block : m_blocks)
+	{
+		// Work done before the frame, such as a compile, stays on the timeline but not in the counts.
+		mergeEvents(*block);
+		std::fill(std::begin(block->counters), std::end(block->counters), std::uint64_t(0));
+		std::fill(std::begin(block->phaseNanoseconds), std::end(block->phaseNanoseconds), std::int64_t(0));
+		std::fill(std::begin(block->phaseTicks), std::end(block->phaseTicks), std::uint64_t(0));
+	}
+	m_frameBegin = now();
+	m_frameBeginTicks = readTicks();
+}
+
+inline FrameStats RenderStats::endFrame()
+{
+	const unsigned thread = getThreadBlock().thread;
+	FrameStats stats;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	const std::int64_t frameNanoseconds = now() - m_frameBegin;
+	const std::uint64_t frameTicks = readTicks() - m_frameBeginTicks;
+	const double nanosecondsPerTick = frameTicks != 0 ? double(frameNanoseconds) / double(frameTicks) : 0.;
+	stats.frameMilliseconds = double(frameNanoseconds) * 1e-6;
+	for (auto& block : m_blocks)
+	{
+		for (std::size_t i = 0; i < FrameStats::COUNTER_COUNT; ++i)
+		{
+			stats.counters[i] += block->counters[i];
+			block->counters[i] = 0;
+		}
+		for (std::size_t i = 0; i < FrameStats::PHASE_COUNT; ++i)
+		{
+			stats.phaseMilliseconds[i] += (double(block->phaseNanoseconds[i]) + double(block->phaseTicks[i]) * nanosecondsPerTick) * 1e-6;
+			block->phaseNanoseconds[i] = 0;
+			block->phaseTicks[i] = 0;
+		}
+		mergeEvents(*block);
+	}
+	if (isTracing())
+		m_frames.push_back({ thread, m_frameBegin, stats });
+	return stats;
+}
+
+inline void RenderStats::clearTrace()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (auto& block : m_blocks)
+		block->events.clear();
+	m_trace.clear();
+	m_frames.clear();
+}
+
+inline void RenderStats::writeChromeTrace(std::ostream& out)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (auto& block : m_blocks)
+		mergeEvents(*block);
+
+	// Timestamps are in microseconds; frames carry their counters as arguments.
+	char buffer[256];
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	for (std::size_t i = 0; i < m_blocks.size(); ++i)
+	{
+		std::snprintf(buffer, sizeof(buffer), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"thread %zu\"}},\n", i, i);
+		out << buffer;
+	}
+	for (const auto& entry : m_trace)
+	{
+		std::snprintf(buffer, sizeof(buffer), "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f},\n",
+			getStatPhaseName(entry.second.phase), entry.first, double(entry.second.beginNanoseconds) * 1e-3, double(entry.second.durationNanoseconds) * 1e-3);
+		out << buffer;
+	}
+	for (const FrameEvent& frame : m_frames)
+	{
+		std::snprintf(buffer, sizeof(buffer), "{\"name\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+			frame.thread, double(frame.beginNanoseconds) * 1e-3, frame.stats.frameMilliseconds * 1e3);
+		out << buffer;
+		for (std::size_t i = 0; i < FrameStats::COUNTER_COUNT; ++i)
+			out << (i != 0 ? "," : "") << '"' << getStatCounterName(StatCounter(i)) << "\":" << frame.stats.counters[i];
+		out << "}},\n";
+	}
+	// An empty metadata event, so that every entry above can end with a comma.
+	out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"raytracer\"}}\n]}\n";
+}
+
+// One JSON object with the counters and phase timings of a frame.
+inline void writeFrameStatsJson(std::ostream& out, const FrameStats& stats)
+{
+	char buffer[64];
+	std::snprintf(buffer, sizeof(buffer), "%.3f", stats.frameMilliseconds);
+	out << "{\n  \"frameMilliseconds\": " << buffer << ",\n  \"counters\": {\n";
+	for (std::size_t i = 0; i < FrameStats::COUNTER_COUNT; ++i)
+	{
+		out << "    \"" << getStatCounterName(StatCounter(i)) << "\": " << stats.counters[i]
+			<< (i + 1 < FrameStats::COUNTER_COUNT ? ",\n" : "\n");
+	}
+	out << "  },\n  \"phaseMilliseconds\": {\n";
+	for (std::size_t i = 0; i < FrameStats::PHASE_COUNT; ++i)
+	{
+		std::snprintf(buffer, sizeof(buffer), "%.3f", stats.phaseMilliseconds[i]);
+		out << "    \"" << getStatPhaseName(StatPhase(i)) << "\": " << buffer
+			<< (i + 1 < FrameStats::PHASE_COUNT ? ",\n" : "\n");
+	}
+	out << "  }\n}\n";
+}
+
+// Adds the lifetime of the scope to a phase, and puts it on the timeline when tracing is on.
+class StatScope
+{
+public:
+	explicit StatScope(StatPhase phase) : m_phase(phase), m_traced(RenderStats::get().isTracing()), m_begin(RenderStats::now())
+	{}
+	~StatScope() { RenderStats::addTime(m_phase, m_begin, RenderStats::now(), m_traced); }
+
+	StatScope(const StatScope&) = delete;
+	StatScope& operator=(const StatScope&) = delete;
+
+private:
+	StatPhase m_phase;
+	bool m_traced;
+	std::int64_t m_begin;
+};
+
+// Adds the lifetime of the scope to a phase, in ticks.
+class StatTimer
+{
+public:
+	explicit StatTimer(StatPhase phase) : m_phase(phase), m_begin(RenderStats::readTicks())
+	{}
+	~StatTimer() { RenderStats::addTicks(m_phase, RenderStats::readTicks() - m_begin); }
+
+	StatTimer(const StatTimer&) = delete;
+	StatTimer& operator=(const StatTimer&) = delete;
+
+private:
+	StatPhase m_phase;
+	std::uint64_t m_begin;
+};
+
+#define RAYTRACER_STAT_CONCAT_(a, b) a##b
+#define RAYTRACER_STAT_CONCAT(a, b) RAYTRACER_STAT_CONCAT_(a, b)
+
+#if RAYTRACER_STATS
+// RAYTRACER_STAT_ADD(Rays, n) adds n to StatCounter::Rays.
+#define RAYTRACER_STAT_ADD(counter, n) RenderStats::add(StatCounter::counter, std::uint64_t(n))
+// Times the rest of the enclosing block and puts it on the timeline; for coarse phases only.
+#define RAYTRACER_STAT_SCOPE(phase) StatScope RAYTRACER_STAT_CONCAT(statScope_, __LINE__)(StatPhase::phase)
+// Times the rest of the enclosing block, off the timeline; for per-ray phases.
+#define RAYTRACER_STAT_TIMER(phase) StatTimer RAYTRACER_STAT_CONCAT(statTimer_, __LINE__)(StatPhase::phase)
+#else
+// Names n without evaluating it, so that locals kept only for the counters do not warn.
+#define RAYTRACER_STAT_ADD(counter, n) ((void)sizeof(n))
+#define RAYTRACER_STAT_SCOPE(phase) ((void)0)
+#define RAYTRACER_STAT_TIMER(phase) ((void)0)
+#endif
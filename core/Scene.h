@@ -1,11 +1,19 @@
 #pragma once
 
 #include "Color.h"
+#include "CompiledScene.h"
+#include "LightTree.h"
+#include "RenderStats.h"
+#include "ThreadPool.h"
+#include "Tile.h"
 
 #include "../math/Vec3.h"
 
+#include <algorithm>
+#include <cmath>
 #include <vector>
 #include <memory>
+#include <limits>
 
 template<typename T>
 class Scene;
@@ -25,6 +33,9 @@ class Scene;
 template<typename T>
 class Camera;
 
+template<typename T>
+class PreparedCamera;
+
 template<typename T>
 class Viewport;
 
@@ -32,37 +43,184 @@ template<typename T>
 class ILight;
 
 template<typename T>
-class Object
+struct Contact;
+
+// What changed in a scene since a renderer last looked, so that it can reuse what did not.
+template<typename T>
+struct SceneChanges
 {
-	friend class Scene<T>;
+	// Set when the changes are not limited to known objects, e.g. after a new light.
+	bool all = false;
+	// Objects added or edited, sorted.
+	std::vector<std::uint32_t> objects;
+	// Where geometry changed: the bounds of edited geometry before and after the edit.
+	std::vector<AABB<T> > bounds;
+};
 
-private:
-	Object(IGeometry<T>* geometry, IColorizer<T>* colorizer, OpticalProperties<T>* opticalProperties) :
-		m_geometry(geometry), m_colorizer(colorizer), m_opticalProperties(opticalProperties)
-	{}
+// Which lights reached a hit, bit i for light i, as its shadow rays found. Shading the hit again
+// reuses it while the geometry and the lights' positions stay the same, e.g. after a light's
+// intensity or a material changed; only recorded when every hit is shaded with all the lights and
+// there are at most CAPACITY of them.
+struct LightVisibility
+{
+	enum : std::uint32_t { CAPACITY = 64 };
 
-	const IGeometry<T>& getGeometry() const { return *m_geometry; }
-	const IColorizer<T>& getColorizer() const { return *m_colorizer; }
-	const OpticalProperties<T>& getOpticalProperties() const { return *m_opticalProperties; }
+	std::uint64_t lit;
+	bool known;
+};
 
-private:
-	std::unique_ptr<IGeometry<T> > m_geometry;
-	std::unique_ptr<IColorizer<T> > m_colorizer;
-	std::unique_ptr<OpticalProperties<T> > m_opticalProperties;
+// An object as the scene stores it: a plain record in one array, so that adding objects does not
+// allocate per object and dropping the scene frees a few blocks. Geometries and colorizers handed
+// over by pointer are owned next to it.
+template<typename T>
+struct SceneObject
+{
+	enum : std::uint32_t { NO_PART = 0xFFFFFFFFu };
+
+	// Used when the object has no geometry of its own.
+	Sphere<T> sphere;
+	// Slots of the parts the scene owns for this object, NO_PART or empty when not needed.
+	std::uint32_t geometry;
+	std::uint32_t colorizer;
+	std::uint32_t material;
+	// Whether the material is this object's own, so that editing it does not change other objects.
+	bool ownMaterial;
 };
 
 template<typename T>
 class Scene
 {
 public:
-	void addObject(IGeometry<T>* geometry, IColorizer<T>* colorizer, OpticalProperties<T>* opticalProperties);
+	// Returns the index SurfaceHit::objectIndex refers to. The scene takes ownership of the three parts.
+	std::uint32_t addObject(IGeometry<T>* geometry, IColorizer<T>* colorizer, OpticalProperties<T>* opticalProperties);
+	// A sphere stored in place, using a material shared with other objects. Adds nothing and returns
+	// NO_OBJECT if materialIndex is not one of the scene's materials.
+	std::uint32_t emplaceSphere(const Point3<T>& center, T radius, std::uint32_t materialIndex);
+	// Spheres from a range of Sphere<T>, all with the same material. Returns the index of the first one,
+	// or NO_OBJECT for a material index emplaceSphere would reject.
+	template<typename SphereIt>
+	std::uint32_t insertSpheres(SphereIt first, SphereIt last, std::uint32_t materialIndex);
+	void reserve(std::size_t objectCount) { m_objects.reserve(objectCount); }
+	std::size_t getObjectCount() const { return m_objects.size(); }
 	void addLight(ILight<T>* light);
+	// Replaces a light, taking ownership of the new one. No render may be in flight.
+	void setLight(std::size_t index, ILight<T>* light);
+	std::size_t getLightCount() const { return m_lights.size(); }
+	const ILight<T>& getLight(std::size_t index) const { return *m_lights[index]; }
+	// Which lights each hit is shaded with; see LightSelection. Defaults to all of them.
+	void setLightSampling(const LightSamplingSettings& settings);
+	const LightSamplingSettings& getLightSampling() const { return m_lightSampling; }
+
+	// Replace a part of an object added with addObject, taking ownership of the new one. The old one is
+	// destroyed here, so no render may be in flight.
+	void setObjectGeometry(std::uint32_t objectIndex, IGeometry<T>* geometry);
+	void setObjectColorizer(std::uint32_t objectIndex, IColorizer<T>* colorizer);
+	void setObjectOpticalProperties(std::uint32_t objectIndex, OpticalProperties<T>* opticalProperties);
+	// Changes since the last call. Everything counts as changed before the first one.
+	SceneChanges<T> takeChanges();
+
+	// Materials shared by the objects referring to them, and spheres added without an allocation per
+	// object. Sphere arrays and their hierarchy are used in place and must outlive the scene, as a
+	// mapped scene file does.
+	std::uint32_t addMaterial(const Color<T>& color, T ambient, T diffusion, T reflection = 0, T transmission = 0, T refractiveIndex = 1);
+	// Takes ownership of the colorizer.
+	std::uint32_t addMaterial(IColorizer<T>* colorizer, const OpticalProperties<T>& opticalProperties);
+	// Edits a material and every object sharing it.
+	void setMaterialOpticalProperties(std::uint32_t materialIndex, const OpticalProperties<T>& opticalProperties);
+	std::size_t getMaterialCount() const { return m_materials.size(); }
+	void addSphereArray(const SphereArray<T>& spheres);
+	// Traces at the finest texture detail.
 	Color<T> renderRay(const Ray<T>& ray);
 	void render(const Camera<T>& camera, Viewport<T>& viewport);
+	// Splits the viewport into tiles rendered on the pool. The output is identical to the serial render.
+	void render(const Camera<T>& camera, Viewport<T>& viewport, ThreadPool& pool, int tileSize = DEFAULT_TILE_SIZE);
+	void renderTile(const PreparedCamera<T>& camera, Viewport<T>& viewport, const Tile& tile) const;
+
+	// Objects and lights are compiled lazily by render/renderRay after they change; call this
+	// explicitly to control when the build cost is paid. Only what changed is rebuilt: editing
+	// materials or lights leaves the hierarchies alone.
+	void compile();
+	bool isCompiled() const { return !m_dirty && !m_materialsDirty && !m_lightsDirty; }
+	// Changes whenever what a ray hits may change: objects added or given a new geometry, or given a
+	// material of their own, which renumbers the material of their hits.
+	std::uint64_t getVisibilityRevision() const { return m_visibilityRevision; }
+	void setBVHBuildSettings(const BVHBuildSettings& settings);
+	std::size_t getBVHNodeCount() const { return m_compiled.getNodeCount(); }
+	std::size_t getCompiledMemoryFootprint() const { return m_compiled.getMemoryFootprint(); }
+	const CompiledScene<T>& getCompiledScene() const { return m_compiled; }
+
+	// Instruction set used to test spheres against rays; defaults to the best one the CPU supports.
+	void setSimdIsa(SimdIsa isa) { m_compiled.setSimdIsa(isa); }
+	SimdIsa getSimdIsa() const { return m_compiled.getSimdIsa(); }
+
+	// Reflected and transmitted rays are followed for up to this many bounces after the primary hit.
+	void setMaxBounces(int bounces);
+	int getMaxBounces() const { return m_maxBounces; }
+
+	// Thread-safe, but only valid once the scene is compiled. pixelSpread is the angle between the
+	// rays of neighbouring pixels, PreparedCamera::getPixelSpread(), which sizes the footprint
+	// colorizers filter textures over; a bounced ray's footprint only counts its own distance. 0
+	// asks for the finest detail.
+	Color<T> traceRay(const Ray<T>& ray, T pixelSpread) const;
+	// Also returns what the ray hit; hit.objectIndex is NO_OBJECT for a miss.
+	Color<T> traceRay(const Ray<T>& ray, SurfaceHit<T>& hit, T pixelSpread) const;
+	// The stages of traceRay, for renderers tracing rays in batches: the closest hit, the shading of
+	// a hit without its bounces, and the rays it bounces into. Same conditions as traceRay.
+	bool findClosestHit(const Ray<T>& ray, SurfaceHit<T>& hit) const;
+	Color<T> shadeHit(const SurfaceHit<T>& hit, T pixelSpread) const { return shade(m_compiled.getMaterial(hit.materialIndex), hit.contact, pixelSpread); }
+	// Shades a hit found earlier, e.g. kept in a G-buffer, with the bounces traceRay adds; the same
+	// color traceRay returned for the ray. visibility is reused when known and recorded otherwise.
+	Color<T> shadeHit(const Ray<T>& ray, const SurfaceHit<T>& hit, LightVisibility& visibility, T pixelSpread) const;
+	// Calls spawn(ray, weight) for the reflected and transmitted rays leaving the hit of a ray that
+	// is itself at the given bounce, and returns the weight of the hit's own shading.
+	template<typename SpawnFn>
+	T spawnSecondaryRays(const Ray<T>& ray, const SurfaceHit<T>& hit, int bounce, SpawnFn&& spawn) const;
+	// Whether anything lies on the ray at or before maxDistance; stops at the first blocker found.
+	// Same conditions as traceRay.
+	bool isOccluded(const Ray<T>& ray, T maxDistance) const { return m_compiled.isOccluded(ray, maxDistance); }
 
 private:
-	std::vector<std::unique_ptr<Object<T> > > m_objects;
+	Color<T> traceRay(const Ray<T>& ray, SurfaceHit<T>& hit, int bounce, T pixelSpread) const;
+	Color<T> shadeRay(const Ray<T>& ray, const SurfaceHit<T>& hit, int bounce, T pixelSpread, LightVisibility* visibility) const;
+	Color<T> shade(const Material<T>& material, const Contact<T>& contact, T pixelSpread, LightVisibility* visibility = nullptr) const;
+	// Rays leaving a surface start this far above it, so that it does not hit itself.
+	static T getSurfaceOffset(const Point3<T>& point)
+	{
+		return std::sqrt(std::numeric_limits<T>::epsilon()) * std::max(T(1), std::max(std::abs(point.x), std::max(std::abs(point.y), std::abs(point.z))));
+	}
+	// Calls addLight(lightIndex, weight) for the lights the hit is shaded with, the weight scaling
+	// the light of sampled ones.
+	template<typename AddLightFn>
+	void selectLights(const Contact<T>& contact, AddLightFn&& addLight) const;
+	void recordChange(std::uint32_t objectIndex);
+	void recordAddition(std::uint32_t objectIndex);
+	// Null for plain spheres.
+	const IGeometry<T>* getGeometry(const SceneObject<T>& object) const
+	{
+		return object.geometry != SceneObject<T>::NO_PART ? m_geometries[object.geometry].get() : nullptr;
+	}
+	AABB<T> getObjectBounds(const SceneObject<T>& object) const;
+	Material<T> makeMaterial(const IColorizer<T>& colorizer, const OpticalProperties<T>& opticalProperties) const;
+	// Gives the object a material of its own, a copy of the shared one, before it is edited.
+	Material<T>& getOwnMaterial(SceneObject<T>& object);
+
+	std::vector<SceneObject<T> > m_objects;
+	std::vector<std::unique_ptr<IGeometry<T> > > m_geometries;
+	std::vector<std::unique_ptr<IColorizer<T> > > m_colorizers;
 	std::vector<std::unique_ptr<ILight<T> > > m_lights;
+	std::vector<Material<T> > m_materials;
+	std::vector<SphereArray<T> > m_sphereArrays;
+
+	CompiledScene<T> m_compiled;
+	BVHBuildSettings m_bvhSettings;
+	bool m_dirty = true;
+	bool m_materialsDirty = false;
+	std::uint64_t m_visibilityRevision = 0;
+	LightSamplingSettings m_lightSampling;
+	LightTree<T> m_lightTree;
+	bool m_lightsDirty = true;
+	int m_maxBounces = 4;
+	SceneChanges<T> m_changes{ true, {}, {} };
 };
 
 #include "Geometry.h"
@@ -74,59 +232,588 @@ private:
 
 
 template<typename T>
-void Scene<T>::addObject(IGeometry<T>* geometry, IColorizer<T>* colorizer, OpticalProperties<T>* opticalProperties)
+std::uint32_t Scene<T>::addObject(IGeometry<T>* geometry, IColorizer<T>* colorizer, OpticalProperties<T>* opticalProperties)
+{
+	// Spheres and constant colors are compiled by value, so those parts are copied into the scene's
+	// arrays and freed right away; other ones are kept for the renderer to call.
+	std::unique_ptr<IGeometry<T> > ownedGeometry(geometry);
+	std::unique_ptr<IColorizer<T> > ownedColorizer(colorizer);
+	std::unique_ptr<OpticalProperties<T> > properties(opticalProperties);
+	m_materials.push_back(makeMaterial(*colorizer, *properties));
+
+	SceneObject<T> object{ Sphere<T>{ {0., 0., 0.}, 0. }, SceneObject<T>::NO_PART, SceneObject<T>::NO_PART, std::uint32_t(m_materials.size() - 1), true };
+	if (const Sphere<T>* sphere = geometry->getSphere())
+		object.sphere = *sphere;
+	else
+	{
+		m_geometries.push_back(std::move(ownedGeometry));
+		object.geometry = std::uint32_t(m_geometries.size() - 1);
+	}
+	if (m_materials.back().colorizer != nullptr)
+	{
+		m_colorizers.push_back(std::move(ownedColorizer));
+		object.colorizer = std::uint32_t(m_colorizers.size() - 1);
+	}
+	m_objects.push_back(object);
+	m_dirty = true;
+	++m_visibilityRevision;
+
+	const std::uint32_t objectIndex = std::uint32_t(m_objects.size() - 1);
+	recordAddition(objectIndex);
+	return objectIndex;
+}
+
+template<typename T>
+std::uint32_t Scene<T>::emplaceSphere(const Point3<T>& center, T radius, std::uint32_t materialIndex)
+{
+	if (materialIndex >= m_materials.size())
+		return NO_OBJECT;
+	m_objects.push_back(SceneObject<T>{ Sphere<T>{ center, radius }, SceneObject<T>::NO_PART, SceneObject<T>::NO_PART, materialIndex, false });
+	m_dirty = true;
+	++m_visibilityRevision;
+
+	const std::uint32_t objectIndex = std::uint32_t(m_objects.size() - 1);
+	recordAddition(objectIndex);
+	return objectIndex;
+}
+
+template<typename T>
+template<typename SphereIt>
+std::uint32_t Scene<T>::insertSpheres(SphereIt first, SphereIt last, std::uint32_t materialIndex)
 {
-	Object<T>* obj = new Object<T>(geometry, colorizer, opticalProperties);
-	m_objects.push_back(std::unique_ptr<Object<T> >(obj));
+	if (materialIndex >= m_materials.size())
+		return NO_OBJECT;
+	const std::uint32_t firstIndex = std::uint32_t(m_objects.size());
+	for (; first != last; ++first)
+	{
+		const Sphere<T>& sphere = *first;
+		emplaceSphere(sphere.center, sphere.radius, materialIndex);
+	}
+	return firstIndex;
 }
 
 template<typename T>
 void Scene<T>::addLight(ILight<T>* light)
 {
 	m_lights.emplace_back(light);
+	m_lightsDirty = true;
+	m_changes.all = true;
 }
 
 template<typename T>
-Color<T> Scene<T>::renderRay(const Ray<T>& ray)
+void Scene<T>::setLight(std::size_t index, ILight<T>* light)
 {
-	Contact<T> minContact = { std::numeric_limits<T>::infinity(), {0., 0., 0.}, {0., 0., 0.} };
-	Object<T>* minObj = nullptr;
-	for (auto& obj : m_objects)
+	m_lights[index].reset(light);
+	m_lightsDirty = true;
+	m_changes.all = true;
+}
+
+template<typename T>
+void Scene<T>::setLightSampling(const LightSamplingSettings& settings)
+{
+	m_lightSampling = settings;
+	m_lightsDirty = true;
+	m_changes.all = true;
+}
+
+template<typename T>
+void Scene<T>::setObjectGeometry(std::uint32_t objectIndex, IGeometry<T>* geometry)
+{
+	SceneObject<T>& object = m_objects[objectIndex];
+	if (!m_changes.all)
+	{
+		recordChange(objectIndex);
+		m_changes.bounds.push_back(getObjectBounds(object));
+		m_changes.bounds.push_back(geometry->getBoundingBox());
+	}
+
+	// A sphere is copied and its geometry freed; the object keeps its slot, empty, for later edits.
+	std::unique_ptr<IGeometry<T> > owned(geometry);
+	if (const Sphere<T>* sphere = geometry->getSphere())
 	{
-		Contact<T> intersection = obj->getGeometry().getIntersection(ray);
-		if ((intersection.distance != NO_INTERSECTION<T>()) && (minContact.distance > intersection.distance))
+		object.sphere = *sphere;
+		owned.reset();
+	}
+	if (object.geometry != SceneObject<T>::NO_PART)
+		m_geometries[object.geometry] = std::move(owned);
+	else if (owned)
+	{
+		m_geometries.push_back(std::move(owned));
+		object.geometry = std::uint32_t(m_geometries.size() - 1);
+	}
+	m_dirty = true;
+	++m_visibilityRevision;
+}
+
+template<typename T>
+void Scene<T>::setObjectColorizer(std::uint32_t objectIndex, IColorizer<T>* colorizer)
+{
+	SceneObject<T>& object = m_objects[objectIndex];
+	Material<T>& material = getOwnMaterial(object);
+	const Material<T> update = makeMaterial(*colorizer, OpticalProperties<T>{});
+	material.color = update.color;
+	material.colorizer = update.colorizer;
+
+	std::unique_ptr<IColorizer<T> > owned(colorizer);
+	if (material.colorizer == nullptr)
+		owned.reset();
+	if (object.colorizer != SceneObject<T>::NO_PART)
+		m_colorizers[object.colorizer] = std::move(owned);
+	else if (owned)
+	{
+		m_colorizers.push_back(std::move(owned));
+		object.colorizer = std::uint32_t(m_colorizers.size() - 1);
+	}
+	if (!m_changes.all)
+		recordChange(objectIndex);
+	m_materialsDirty = true;
+}
+
+template<typename T>
+void Scene<T>::setObjectOpticalProperties(std::uint32_t objectIndex, OpticalProperties<T>* opticalProperties)
+{
+	std::unique_ptr<OpticalProperties<T> > properties(opticalProperties);
+	Material<T>& material = getOwnMaterial(m_objects[objectIndex]);
+	material.ambient = properties->ambient;
+	material.diffusion = properties->diffusion;
+	material.reflection = properties->reflection;
+	material.transmission = properties->transmission;
+	material.refractiveIndex = properties->refractiveIndex;
+	if (!m_changes.all)
+		recordChange(objectIndex);
+	m_materialsDirty = true;
+}
+
+template<typename T>
+void Scene<T>::setMaterialOpticalProperties(std::uint32_t materialIndex, const OpticalProperties<T>& opticalProperties)
+{
+	Material<T>& material = m_materials[materialIndex];
+	material.ambient = opticalProperties.ambient;
+	material.diffusion = opticalProperties.diffusion;
+	material.reflection = opticalProperties.reflection;
+	material.transmission = opticalProperties.transmission;
+	material.refractiveIndex = opticalProperties.refractiveIndex;
+	m_materialsDirty = true;
+	m_changes.all = true;
+}
+
+template<typename T>
+void Scene<T>::recordAddition(std::uint32_t objectIndex)
+{
+	if (m_changes.all)
+		return;
+	recordChange(objectIndex);
+	m_changes.bounds.push_back(getObjectBounds(m_objects[objectIndex]));
+}
+
+template<typename T>
+AABB<T> Scene<T>::getObjectBounds(const SceneObject<T>& object) const
+{
+	if (const IGeometry<T>* geometry = getGeometry(object))
+		return geometry->getBoundingBox();
+	const Vec3<T> extent{ object.sphere.radius, object.sphere.radius, object.sphere.radius };
+	return { object.sphere.center - extent, object.sphere.center + extent };
+}
+
+template<typename T>
+Material<T> Scene<T>::makeMaterial(const IColorizer<T>& colorizer, const OpticalProperties<T>& opticalProperties) const
+{
+	const Color<T>* constantColor = colorizer.getConstantColor();
+	return Material<T>{ constantColor != nullptr ? *constantColor : Color<T>{0., 0., 0.}, opticalProperties.ambient, opticalProperties.diffusion,
+		opticalProperties.reflection, opticalProperties.transmission, opticalProperties.refractiveIndex, constantColor != nullptr ? nullptr : &colorizer };
+}
+
+template<typename T>
+Material<T>& Scene<T>::getOwnMaterial(SceneObject<T>& object)
+{
+	if (!object.ownMaterial)
+	{
+		m_materials.push_back(m_materials[object.material]);
+		object.material = std::uint32_t(m_materials.size() - 1);
+		object.ownMaterial = true;
+		m_dirty = true;
+		++m_visibilityRevision;
+	}
+	return m_materials[object.material];
+}
+
+template<typename T>
+void Scene<T>::recordChange(std::uint32_t objectIndex)
+{
+	auto it = std::lower_bound(m_changes.objects.begin(), m_changes.objects.end(), objectIndex);
+	if (it == m_changes.objects.end() || *it != objectIndex)
+		m_changes.objects.insert(it, objectIndex);
+}
+
+template<typename T>
+SceneChanges<T> Scene<T>::takeChanges()
+{
+	SceneChanges<T> changes;
+	std::swap(changes, m_changes);
+	return changes;
+}
+
+template<typename T>
+std::uint32_t Scene<T>::addMaterial(const Color<T>& color, T ambient, T diffusion, T reflection, T transmission, T refractiveIndex)
+{
+	m_materials.push_back(Material<T>{ color, ambient, diffusion, reflection, transmission, refractiveIndex, nullptr });
+	m_materialsDirty = true;
+	return std::uint32_t(m_materials.size() - 1);
+}
+
+template<typename T>
+std::uint32_t Scene<T>::addMaterial(IColorizer<T>* colorizer, const OpticalProperties<T>& opticalProperties)
+{
+	m_colorizers.emplace_back(colorizer);
+	m_materials.push_back(makeMaterial(*colorizer, opticalProperties));
+	m_materialsDirty = true;
+	return std::uint32_t(m_materials.size() - 1);
+}
+
+template<typename T>
+void Scene<T>::addSphereArray(const SphereArray<T>& spheres)
+{
+	m_sphereArrays.push_back(spheres);
+	m_dirty = true;
+	++m_visibilityRevision;
+	m_changes.all = true;
+}
+
+template<typename T>
+void Scene<T>::compile()
+{
+	RAYTRACER_STAT_SCOPE(Compile);
+	if (m_lightsDirty)
+	{
+		// Shading with every light needs no hierarchy.
+		if (m_lightSampling.selection != LightSelection::All)
+			m_lightTree.build(m_lights);
+		else
+			m_lightTree = LightTree<T>();
+		m_lightsDirty = false;
+	}
+	if (!m_dirty)
+	{
+		if (m_materialsDirty)
 		{
-			minContact = intersection;
-			minObj = obj.get();
+			for (std::size_t i = 0; i < m_materials.size(); ++i)
+			{
+				if (i < m_compiled.getMaterialCount())
+					m_compiled.setMaterial(std::uint32_t(i), m_materials[i]);
+				else
+					m_compiled.addMaterial(m_materials[i]);
+			}
+			m_materialsDirty = false;
 		}
+		return;
 	}
 
-	if (minObj == nullptr)
-		return NO_INTERSECTION_COLOR<T>();
+	m_compiled.clear();
+
+	// Materials come first so that sphere arrays and objects can index the compiled table directly.
+	for (const auto& material : m_materials)
+		m_compiled.addMaterial(material);
+
+	std::uint32_t objectIndex = std::uint32_t(m_objects.size());
+	for (const auto& spheres : m_sphereArrays)
+	{
+		m_compiled.addSphereArray(spheres, objectIndex);
+		objectIndex += std::uint32_t(spheres.count);
+	}
+
+	// Only geometries other than spheres are reached through a pointer.
+	for (std::size_t i = 0; i < m_objects.size(); ++i)
+	{
+		const SceneObject<T>& object = m_objects[i];
+		if (const IGeometry<T>* geometry = getGeometry(object))
+			m_compiled.addGeometry(geometry, std::uint32_t(i), object.material);
+		else
+			m_compiled.addSphere(object.sphere, std::uint32_t(i), object.material);
+	}
+
+	m_compiled.build(m_bvhSettings);
+	m_dirty = false;
+	m_materialsDirty = false;
+}
 
-	auto& op = minObj->getOpticalProperties();
+template<typename T>
+void Scene<T>::setMaxBounces(int bounces)
+{
+	m_maxBounces = std::max(0, bounces);
+	m_changes.all = true;
+}
+
+template<typename T>
+void Scene<T>::setBVHBuildSettings(const BVHBuildSettings& settings)
+{
+	m_bvhSettings = settings;
+	m_dirty = true;
+}
 
-	Color<T> col = minObj->getColorizer().getColor();
-	Color<T> finalColor = op.ambient * col;
+template<typename T>
+template<typename AddLightFn>
+void Scene<T>::selectLights(const Contact<T>& contact, AddLightFn&& addLight) const
+{
+	const LightSelection selection = m_lightSampling.selection;
+	const int lightSamples = std::max(1, m_lightSampling.lightSamples);
+	if (selection == LightSelection::All || (selection == LightSelection::Sampled && m_lightTree.getLightCount() <= std::size_t(lightSamples)))
+	{
+		for (std::size_t i = 0; i < m_lights.size(); ++i)
+			addLight(std::uint32_t(i), T(1));
+		return;
+	}
 
-	for (auto& light : m_lights)
+	for (std::uint32_t i : m_lightTree.getOtherLights())
+		addLight(i, T(1));
+	if (selection == LightSelection::Culled)
 	{
-		Color<T> lightColor = op.diffusion * light->getLightAtContact(minContact);
-		finalColor = finalColor + Color<T>{ lightColor.r* col.r, lightColor.g* col.g, lightColor.b* col.b};
+		m_lightTree.cull(contact, T(m_lightSampling.cullThreshold), [&addLight](std::uint32_t i) { addLight(i, T(1)); });
+		return;
 	}
 
+	// One draw per stratum of [0, 1), so that the draws spread over the lights.
+	const std::uint32_t key = detail::hashPoint(contact.point);
+	for (int s = 0; s < lightSamples; ++s)
+	{
+		const T jitter = T(detail::hashLightSample(key, std::uint32_t(s), m_lightSampling.seed) >> 8) * T(1. / 16777216.);
+		const T u = std::min((T(s) + jitter) / T(lightSamples), T(1) - std::numeric_limits<T>::epsilon());
+		m_lightTree.sample(contact, u, T(m_lightSampling.splitDistance), [&addLight, lightSamples](std::uint32_t i, T probability)
+		{
+			addLight(i, T(1) / (T(lightSamples) * probability));
+		});
+	}
+}
+
+template<typename T>
+Color<T> Scene<T>::shade(const Material<T>& material, const Contact<T>& contact, T pixelSpread, LightVisibility* visibility) const
+{
+	Color<T> col = material.colorizer != nullptr
+		? material.colorizer->getColor(contact, pixelSpread * contact.distance) : material.color;
+	Color<T> finalColor = material.ambient * col;
+	if (m_lights.empty() || material.diffusion == T(0))
+		return finalColor;
+
+	// Shadow rays are traced together for up to ShadowRays::CAPACITY lights at a time, unless their
+	// results are known already.
+	const T offset = getSurfaceOffset(contact.point);
+	const Point3<T> origin = contact.point + offset * contact.normal;
+	const bool recordable = visibility != nullptr && m_lightSampling.selection == LightSelection::All && m_lights.size() <= LightVisibility::CAPACITY;
+	const bool reuse = recordable && visibility->known;
+	if (recordable && !reuse)
+		visibility->lit = 0;
+
+	Color<T> lightColors[ShadowRays<T>::CAPACITY];
+	std::uint32_t lightIndices[ShadowRays<T>::CAPACITY];
+	ShadowRays<T> rays(origin);
+	auto traceBatch = [&]()
+	{
+		std::uint32_t lit = 0;
+		if (reuse)
+		{
+			for (std::size_t i = 0; i < rays.count; ++i)
+				lit |= std::uint32_t((visibility->lit >> lightIndices[i]) & 1u) << i;
+		}
+		else
+		{
+			lit = m_compiled.findUnoccluded(rays);
+			RAYTRACER_STAT_ADD(ShadowRays, rays.count);
+			for (std::size_t i = 0; recordable && i < rays.count; ++i)
+				visibility->lit |= std::uint64_t((lit >> i) & 1u) << lightIndices[i];
+		}
+		for (std::size_t i = 0; i < rays.count; ++i)
+		{
+			if ((lit & (std::uint32_t(1) << i)) == 0)
+			{
+				RAYTRACER_STAT_ADD(ShadowRaysBlocked, 1);
+				continue;
+			}
+			Color<T> lightColor = material.diffusion * lightColors[i];
+			finalColor = finalColor + Color<T>{ lightColor.r* col.r, lightColor.g* col.g, lightColor.b* col.b};
+		}
+		rays.count = 0;
+	};
+
+	LightSample<T> sample{ {0., 0., 0.}, 0., {0., 0., 0.} };
+	std::size_t lightSamples = 0;
+	selectLights(contact, [&](std::uint32_t lightIndex, T weight)
+	{
+		++lightSamples;
+		if (!m_lights[lightIndex]->sample(contact, sample) || !(sample.distance > offset))
+			return;
+		lightColors[rays.count] = weight == T(1) ? sample.color : weight * sample.color;
+		lightIndices[rays.count] = lightIndex;
+		rays.add(sample.direction, sample.distance - offset);
+		if (rays.count == ShadowRays<T>::CAPACITY)
+			traceBatch();
+	});
+	RAYTRACER_STAT_ADD(LightSamples, lightSamples);
+	if (rays.count != 0)
+		traceBatch();
+	if (recordable)
+		visibility->known = true;
+
 	return finalColor;
 }
 
 template<typename T>
-void Scene<T>::render(const Camera<T>& camera, Viewport<T>& viewport)
+Color<T> Scene<T>::renderRay(const Ray<T>& ray)
+{
+	if (!isCompiled())
+		compile();
+
+	return traceRay(ray, T(0));
+}
+
+template<typename T>
+Color<T> Scene<T>::traceRay(const Ray<T>& ray, T pixelSpread) const
+{
+	SurfaceHit<T> hit{ NO_CONTACT<T>(), NO_OBJECT, 0 };
+	return traceRay(ray, hit, pixelSpread);
+}
+
+template<typename T>
+Color<T> Scene<T>::traceRay(const Ray<T>& ray, SurfaceHit<T>& hit, T pixelSpread) const
+{
+	return traceRay(ray, hit, 0, pixelSpread);
+}
+
+template<typename T>
+Color<T> Scene<T>::traceRay(const Ray<T>& ray, SurfaceHit<T>& hit, int bounce, T pixelSpread) const
+{
+	findClosestHit(ray, hit);
+	return shadeRay(ray, hit, bounce, pixelSpread, nullptr);
+}
+
+template<typename T>
+Color<T> Scene<T>::shadeHit(const Ray<T>& ray, const SurfaceHit<T>& hit, LightVisibility& visibility, T pixelSpread) const
+{
+	return shadeRay(ray, hit, 0, pixelSpread, &visibility);
+}
+
+template<typename T>
+Color<T> Scene<T>::shadeRay(const Ray<T>& ray, const SurfaceHit<T>& hit, int bounce, T pixelSpread, LightVisibility* visibility) const
+{
+	if (hit.objectIndex == NO_OBJECT)
+		return NO_INTERSECTION_COLOR<T>();
+
+	Color<T> color;
+	{
+		RAYTRACER_STAT_TIMER(Shade);
+		color = shade(m_compiled.getMaterial(hit.materialIndex), hit.contact, pixelSpread, visibility);
+	}
+	const Material<T>& material = m_compiled.getMaterial(hit.materialIndex);
+	if (material.reflection == T(0) && material.transmission == T(0))
+		return color;
+
+	Color<T> bounced{ 0., 0., 0. };
+	const T ownWeight = spawnSecondaryRays(ray, hit, bounce, [&](const Ray<T>& secondary, T weight)
+	{
+		SurfaceHit<T> secondaryHit{ NO_CONTACT<T>(), NO_OBJECT, 0 };
+		bounced = bounced + weight * traceRay(secondary, secondaryHit, bounce + 1, pixelSpread);
+	});
+	return ownWeight * color + bounced;
+}
+
+template<typename T>
+bool Scene<T>::findClosestHit(const Ray<T>& ray, SurfaceHit<T>& hit) const
 {
-	for (int col = 0; col < viewport.getWidth(); ++col)
+	RAYTRACER_STAT_ADD(Rays, 1);
+	hit.objectIndex = NO_OBJECT;
+	bool found;
 	{
-		for (int row = 0; row < viewport.getHeight(); ++row)
+		RAYTRACER_STAT_TIMER(Trace);
+		found = m_compiled.findClosestHit(ray, hit);
+	}
+	if (found)
+		RAYTRACER_STAT_ADD(Hits, 1);
+	else
+		RAYTRACER_STAT_ADD(Misses, 1);
+	return found;
+}
+
+template<typename T>
+template<typename SpawnFn>
+T Scene<T>::spawnSecondaryRays(const Ray<T>& ray, const SurfaceHit<T>& hit, int bounce, SpawnFn&& spawn) const
+{
+	const Material<T>& material = m_compiled.getMaterial(hit.materialIndex);
+	const T ownWeight = std::max(T(0), T(1) - material.reflection - material.transmission);
+	if (bounce >= m_maxBounces || (!(material.reflection > T(0)) && !(material.transmission > T(0))))
+		return ownWeight;
+
+	// Against the normal facing the ray, so that rays inside a transmissive object leave it into the
+	// outside medium.
+	const Vec3<T> direction = ray.direction.getNormalized();
+	Vec3<T> normal = hit.contact.normal;
+	T cosine = -(direction * normal);
+	T eta = T(1) / material.refractiveIndex;
+	if (cosine < T(0))
+	{
+		normal = T(-1) * normal;
+		cosine = -cosine;
+		eta = material.refractiveIndex;
+	}
+
+	const Point3<T>& point = hit.contact.point;
+	const T offset = getSurfaceOffset(point);
+	T reflection = material.reflection;
+	if (material.transmission > T(0))
+	{
+		const T k = T(1) - eta * eta * (T(1) - cosine * cosine);
+		// Past the critical angle, all of it is reflected.
+		if (k < T(0))
+			reflection += material.transmission;
+		else
 		{
-			auto ray = camera.getRay(viewport, row, col);
-			viewport(col, row) = renderRay(ray);
+			RAYTRACER_STAT_ADD(SecondaryRays, 1);
+			spawn(Ray<T>{ point - offset * normal, eta * direction + (eta * cosine - std::sqrt(k)) * normal }, material.transmission);
 		}
 	}
+	if (reflection > T(0))
+	{
+		RAYTRACER_STAT_ADD(SecondaryRays, 1);
+		spawn(Ray<T>{ point + offset * normal, direction + (T(2) * cosine) * normal }, reflection);
+	}
+	return ownWeight;
+}
+
+template<typename T>
+void Scene<T>::renderTile(const PreparedCamera<T>& camera, Viewport<T>& viewport, const Tile& tile) const
+{
+	RAYTRACER_STAT_SCOPE(Tile);
+	RayPacket<T> rays;
+	rays.resize(std::size_t(tile.colEnd - tile.colBegin));
+	const T pixelSpread = camera.getPixelSpread();
+	for (int row = tile.rowBegin; row < tile.rowEnd; ++row)
+	{
+		{
+			RAYTRACER_STAT_TIMER(CameraSetup);
+			camera.generateRow(row, tile.colBegin, tile.colEnd, rays);
+		}
+		for (int col = tile.colBegin; col < tile.colEnd; ++col)
+			viewport(col, row) = traceRay(rays.get(std::size_t(col - tile.colBegin)), pixelSpread);
+	}
+}
+
+template<typename T>
+void Scene<T>::render(const Camera<T>& camera, Viewport<T>& viewport)
+{
+	if (!isCompiled())
+		compile();
+
+	const PreparedCamera<T> prepared = camera.prepare(viewport);
+	renderTile(prepared, viewport, Tile{ 0, 0, viewport.getWidth(), viewport.getHeight() });
+}
+
+template<typename T>
+void Scene<T>::render(const Camera<T>& camera, Viewport<T>& viewport, ThreadPool& pool, int tileSize)
+{
+	if (!isCompiled())
+		compile();
+
+	const PreparedCamera<T> prepared = camera.prepare(viewport);
+	std::vector<Tile> tiles = makeTiles(viewport.getWidth(), viewport.getHeight(), tileSize);
+	pool.run(tiles.size(), [&](std::size_t tileIndex, unsigned)
+	{
+		renderTile(prepared, viewport, tiles[tileIndex]);
+	});
 }
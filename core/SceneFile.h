@@ -0,0 +1,547 @@
+#pragma once
+
+#include "BVH.h"
+#include "Color.h"
+#include "MappedFile.h"
+#include "Scene.h"
+#include "Texture.h"
+
+#include "../math/Vec3.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Binary scene file, little-endian:
+//   SceneFileHeader
+//   SceneFileSection[sectionCount]
+//   section payloads, each aligned on SCENE_FILE_ALIGNMENT bytes
+// Payloads are raw arrays of the records below in the scalar type given by the header, so a mapped
+// file is used in place: loading only validates the section table and the material indices.
+
+constexpr char SCENE_FILE_MAGIC[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0' };
+constexpr std::uint32_t SCENE_FILE_VERSION = 1;
+constexpr std::uint32_t SCENE_FILE_BYTE_ORDER = 0x01020304;
+constexpr std::uint64_t SCENE_FILE_ALIGNMENT = 64;
+
+enum class SceneSection : std::uint32_t
+{
+	Spheres = 1,
+	SphereMaterials = 2,
+	Materials = 3,
+	Lights = 4,
+	Cameras = 5,
+	// BVHNode<T> over the spheres, which are then stored in its leaf order.
+	SphereBVH = 6,
+	// SurfaceRecord<T> per material, when any of them reflects or transmits light.
+	MaterialSurfaces = 7,
+	// TextureRecord<T> per material, when any of them is textured.
+	MaterialTextures = 8
+};
+
+struct SceneFileHeader
+{
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t byteOrder;
+	std::uint32_t scalarSize;
+	std::uint32_t sectionCount;
+	std::uint64_t fileSize;
+};
+
+struct SceneFileSection
+{
+	std::uint32_t type;
+	std::uint32_t elementSize;
+	std::uint64_t offset;
+	std::uint64_t count;
+};
+
+template<typename T>
+struct MaterialRecord
+{
+	Color<T> color;
+	T ambient;
+	T diffusion;
+};
+
+template<typename T>
+struct SurfaceRecord
+{
+	T reflection;
+	T transmission;
+	T refractiveIndex;
+};
+
+constexpr std::size_t TEXTURE_RECORD_PATH_SIZE = 248;
+
+// A material without a texture has an empty path. Relative paths are opened from the working
+// directory of the process rendering the scene, which loads the tiles it needs from there.
+template<typename T>
+struct TextureRecord
+{
+	T worldSize;
+	char path[TEXTURE_RECORD_PATH_SIZE];
+};
+
+// Point lights only, for now.
+template<typename T>
+struct LightRecord
+{
+	Point3<T> position;
+	Color<T> color;
+	T intensity;
+};
+
+template<typename T>
+struct CameraRecord
+{
+	Point3<T> origin;
+	Vec3<T> direction;
+	T horizontalFov;
+};
+
+// Non-owning view of every section; the arrays of a mapped file or of a SceneFileContent.
+template<typename T>
+struct SceneFileView
+{
+	const Sphere<T>* spheres = nullptr;
+	const std::uint32_t* sphereMaterials = nullptr;
+	std::size_t sphereCount = 0;
+	const MaterialRecord<T>* materials = nullptr;
+	std::size_t materialCount = 0;
+	// Null, or materialCount records.
+	const SurfaceRecord<T>* materialSurfaces = nullptr;
+	// Null, or materialCount records.
+	const TextureRecord<T>* materialTextures = nullptr;
+	const LightRecord<T>* lights = nullptr;
+	std::size_t lightCount = 0;
+	const CameraRecord<T>* cameras = nullptr;
+	std::size_t cameraCount = 0;
+	const BVHNode<T>* bvhNodes = nullptr;
+	std::size_t bvhNodeCount = 0;
+};
+
+// Owning counterpart, filled by the text importer or by code generating scenes.
+template<typename T>
+struct SceneFileContent
+{
+	std::vector<Sphere<T> > spheres;
+	std::vector<std::uint32_t> sphereMaterials;
+	std::vector<MaterialRecord<T> > materials;
+	// Empty, or one per material.
+	std::vector<SurfaceRecord<T> > materialSurfaces;
+	// Empty, or one per material.
+	std::vector<TextureRecord<T> > materialTextures;
+	std::vector<LightRecord<T> > lights;
+	std::vector<CameraRecord<T> > cameras;
+
+	SceneFileView<T> getView() const
+	{
+		SceneFileView<T> view;
+		view.spheres = spheres.data();
+		view.sphereMaterials = sphereMaterials.data();
+		view.sphereCount = spheres.size();
+		view.materials = materials.data();
+		view.materialCount = materials.size();
+		view.materialSurfaces = materialSurfaces.empty() ? nullptr : materialSurfaces.data();
+		view.materialTextures = materialTextures.empty() ? nullptr : materialTextures.data();
+		view.lights = lights.data();
+		view.lightCount = lights.size();
+		view.cameras = cameras.data();
+		view.cameraCount = cameras.size();
+		return view;
+	}
+};
+
+// With buildBVH, spheres are written in the leaf order of a new hierarchy stored alongside them;
+// otherwise a hierarchy already in the view is written as is.
+template<typename T>
+bool writeSceneFile(const std::string& path, const SceneFileView<T>& view, bool buildBVH, std::string* error = nullptr,
+	const BVHBuildSettings& settings = BVHBuildSettings{});
+// Same file, in memory, e.g. to send it over a socket.
+template<typename T>
+std::vector<unsigned char> writeSceneBuffer(const SceneFileView<T>& view, bool buildBVH, const BVHBuildSettings& settings = BVHBuildSettings{});
+
+// Views a scene file already in memory, which must stay alive and unchanged while the view is used.
+// name only appears in error messages.
+template<typename T>
+bool readSceneBuffer(const unsigned char* data, std::size_t size, const std::string& name, SceneFileView<T>& view, std::string* error = nullptr);
+
+template<typename T>
+class MappedSceneFile
+{
+public:
+	bool open(const std::string& path, std::string* error = nullptr);
+	void close();
+
+	const SceneFileView<T>& getView() const { return m_view; }
+
+private:
+	MappedFile m_file;
+	SceneFileView<T> m_view;
+};
+
+// Lights are the only records copied; spheres stay in the view, which must outlive the scene.
+// Textures are opened through TextureCache; a material whose texture cannot be opened keeps its
+// flat color and makes this return false, the rest of the scene being added anyway.
+template<typename T>
+bool addToScene(const SceneFileView<T>& view, Scene<T>& scene, std::string* error = nullptr);
+
+template<typename T>
+std::vector<Camera<T> > getCameras(const SceneFileView<T>& view);
+
+namespace detail
+{
+	static_assert(sizeof(SceneFileHeader) == 32 && sizeof(SceneFileSection) == 24, "scene file tables must not be padded");
+
+	inline bool setError(std::string* error, const std::string& message)
+	{
+		if (error != nullptr)
+			*error = message;
+		return false;
+	}
+
+	// Written so that NaNs fail too.
+	template<typename T>
+	bool isValidSurface(const SurfaceRecord<T>& surface)
+	{
+		return surface.refractiveIndex > T(0) && surface.reflection >= T(0) && surface.transmission >= T(0)
+			&& surface.reflection + surface.transmission <= T(1);
+	}
+
+	struct SectionPayload
+	{
+		SceneSection type;
+		std::uint32_t elementSize;
+		const void* data;
+		std::uint64_t count;
+	};
+
+	// Calls write(data, size) for the header, the section table, and each payload after its padding.
+	template<typename Write>
+	bool writeSections(std::uint32_t scalarSize, const std::vector<SectionPayload>& payloads, Write&& write)
+	{
+		std::vector<SceneFileSection> table;
+		std::uint64_t position = sizeof(SceneFileHeader) + payloads.size() * sizeof(SceneFileSection);
+		for (const auto& payload : payloads)
+		{
+			position = (position + SCENE_FILE_ALIGNMENT - 1) / SCENE_FILE_ALIGNMENT * SCENE_FILE_ALIGNMENT;
+			table.push_back({ std::uint32_t(payload.type), payload.elementSize, position, payload.count });
+			position += payload.count * payload.elementSize;
+		}
+
+		SceneFileHeader header;
+		std::memcpy(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic));
+		header.version = SCENE_FILE_VERSION;
+		header.byteOrder = SCENE_FILE_BYTE_ORDER;
+		header.scalarSize = scalarSize;
+		header.sectionCount = std::uint32_t(table.size());
+		header.fileSize = position;
+
+		static const char zeros[SCENE_FILE_ALIGNMENT] = {};
+		bool ok = write(&header, sizeof(header)) && write(table.data(), table.size() * sizeof(SceneFileSection));
+		position = sizeof(SceneFileHeader) + table.size() * sizeof(SceneFileSection);
+		for (std::size_t i = 0; ok && i < payloads.size(); ++i)
+		{
+			const std::uint64_t padding = (SCENE_FILE_ALIGNMENT - position % SCENE_FILE_ALIGNMENT) % SCENE_FILE_ALIGNMENT;
+			const std::uint64_t bytes = payloads[i].count * payloads[i].elementSize;
+			ok = write(zeros, std::size_t(padding)) && write(payloads[i].data, std::size_t(bytes));
+			position += padding + bytes;
+		}
+		return ok;
+	}
+
+	template<typename T, typename Write>
+	bool writeSceneSections(const SceneFileView<T>& view, bool buildBVH, const BVHBuildSettings& settings, Write&& write)
+	{
+		static_assert(std::is_trivially_copyable<Sphere<T> >::value && std::is_trivially_copyable<BVHNode<T> >::value, "records are written raw");
+
+		const Sphere<T>* spheres = view.spheres;
+		const std::uint32_t* sphereMaterials = view.sphereMaterials;
+		const BVHNode<T>* bvhNodes = view.bvhNodes;
+		std::size_t bvhNodeCount = view.bvhNodeCount;
+
+		BVH<T> bvh;
+		std::vector<Sphere<T> > orderedSpheres;
+		std::vector<std::uint32_t> orderedMaterials;
+		if (buildBVH && view.sphereCount != 0)
+		{
+			std::vector<AABB<T> > bounds;
+			bounds.reserve(view.sphereCount);
+			for (std::size_t i = 0; i < view.sphereCount; ++i)
+			{
+				const Sphere<T>& sphere = view.spheres[i];
+				Vec3<T> extent{ sphere.radius, sphere.radius, sphere.radius };
+				bounds.push_back({ sphere.center - extent, sphere.center + extent });
+			}
+			bvh.build(bounds, settings);
+
+			orderedSpheres.reserve(view.sphereCount);
+			orderedMaterials.reserve(view.sphereCount);
+			for (std::uint32_t index : bvh.getPrimitiveIndices())
+			{
+				orderedSpheres.push_back(view.spheres[index]);
+				orderedMaterials.push_back(view.sphereMaterials[index]);
+			}
+			spheres = orderedSpheres.data();
+			sphereMaterials = orderedMaterials.data();
+			bvhNodes = bvh.getNodes();
+			bvhNodeCount = bvh.getNodeCount();
+		}
+
+		std::vector<SectionPayload> payloads;
+		auto addSection = [&](SceneSection type, std::uint32_t elementSize, const void* data, std::size_t count)
+		{
+			if (count != 0)
+				payloads.push_back({ type, elementSize, data, count });
+		};
+		addSection(SceneSection::Spheres, sizeof(Sphere<T>), spheres, view.sphereCount);
+		addSection(SceneSection::SphereMaterials, sizeof(std::uint32_t), sphereMaterials, view.sphereCount);
+		addSection(SceneSection::Materials, sizeof(MaterialRecord<T>), view.materials, view.materialCount);
+		addSection(SceneSection::MaterialSurfaces, sizeof(SurfaceRecord<T>), view.materialSurfaces, view.materialSurfaces != nullptr ? view.materialCount : 0);
+		addSection(SceneSection::MaterialTextures, sizeof(TextureRecord<T>), view.materialTextures, view.materialTextures != nullptr ? view.materialCount : 0);
+		addSection(SceneSection::Lights, sizeof(LightRecord<T>), view.lights, view.lightCount);
+		addSection(SceneSection::Cameras, sizeof(CameraRecord<T>), view.cameras, view.cameraCount);
+		addSection(SceneSection::SphereBVH, sizeof(BVHNode<T>), bvhNodes, bvhNodeCount);
+
+		return writeSections(sizeof(T), payloads, write);
+	}
+}
+
+template<typename T>
+bool writeSceneFile(const std::string& path, const SceneFileView<T>& view, bool buildBVH, std::string* error, const BVHBuildSettings& settings)
+{
+	std::FILE* file = std::fopen(path.c_str(), "wb");
+	if (file == nullptr)
+		return detail::setError(error, "cannot create " + path);
+
+	bool ok = detail::writeSceneSections(view, buildBVH, settings, [file](const void* data, std::size_t size)
+	{
+		return size == 0 || std::fwrite(data, 1, size, file) == size;
+	});
+	if (std::fclose(file) != 0 || !ok)
+		return detail::setError(error, "cannot write " + path);
+	return true;
+}
+
+template<typename T>
+std::vector<unsigned char> writeSceneBuffer(const SceneFileView<T>& view, bool buildBVH, const BVHBuildSettings& settings)
+{
+	std::vector<unsigned char> bytes;
+	detail::writeSceneSections(view, buildBVH, settings, [&bytes](const void* data, std::size_t size)
+	{
+		const unsigned char* begin = static_cast<const unsigned char*>(data);
+		bytes.insert(bytes.end(), begin, begin + size);
+		return true;
+	});
+	return bytes;
+}
+
+template<typename T>
+void MappedSceneFile<T>::close()
+{
+	m_file.close();
+	m_view = SceneFileView<T>{};
+}
+
+template<typename T>
+bool MappedSceneFile<T>::open(const std::string& path, std::string* error)
+{
+	close();
+	if (!m_file.open(path))
+		return detail::setError(error, "cannot map " + path);
+
+	if (!readSceneBuffer(m_file.getData(), m_file.getSize(), path, m_view, error))
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+
+template<typename T>
+bool readSceneBuffer(const unsigned char* data, std::size_t dataSize, const std::string& path, SceneFileView<T>& result, std::string* error)
+{
+	using detail::setError;
+
+	const std::uint64_t size = dataSize;
+	SceneFileHeader header;
+	if (size < sizeof(header))
+		return setError(error, path + " is too small to be a scene file");
+	std::memcpy(&header, data, sizeof(header));
+
+	if (std::memcmp(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic)) != 0)
+		return setError(error, path + " is not a scene file");
+	if (header.version != SCENE_FILE_VERSION)
+		return setError(error, path + " has unsupported version " + std::to_string(header.version));
+	if (header.byteOrder != SCENE_FILE_BYTE_ORDER)
+		return setError(error, path + " was written with another byte order");
+	if (header.scalarSize != sizeof(T))
+		return setError(error, path + " stores " + std::to_string(header.scalarSize) + "-byte scalars");
+	if (header.fileSize != size || header.sectionCount > (size - sizeof(header)) / sizeof(SceneFileSection))
+		return setError(error, path + " is truncated");
+
+	SceneFileView<T> view;
+	std::size_t sphereMaterialCount = 0;
+	std::size_t materialSurfaceCount = 0;
+	std::size_t materialTextureCount = 0;
+	bool seen[9] = {};
+	for (std::uint32_t i = 0; i < header.sectionCount; ++i)
+	{
+		SceneFileSection section;
+		std::memcpy(&section, data + sizeof(header) + i * sizeof(SceneFileSection), sizeof(section));
+
+		std::uint32_t expectedSize = 0;
+		switch (SceneSection(section.type))
+		{
+		case SceneSection::Spheres: expectedSize = sizeof(Sphere<T>); break;
+		case SceneSection::SphereMaterials: expectedSize = sizeof(std::uint32_t); break;
+		case SceneSection::Materials: expectedSize = sizeof(MaterialRecord<T>); break;
+		case SceneSection::Lights: expectedSize = sizeof(LightRecord<T>); break;
+		case SceneSection::Cameras: expectedSize = sizeof(CameraRecord<T>); break;
+		case SceneSection::SphereBVH: expectedSize = sizeof(BVHNode<T>); break;
+		case SceneSection::MaterialSurfaces: expectedSize = sizeof(SurfaceRecord<T>); break;
+		case SceneSection::MaterialTextures: expectedSize = sizeof(TextureRecord<T>); break;
+		default:
+			// Sections added by later revisions of this version are skipped.
+			continue;
+		}
+
+		if (seen[section.type])
+			return setError(error, path + " repeats section " + std::to_string(section.type));
+		seen[section.type] = true;
+
+		if (section.elementSize != expectedSize || section.offset % SCENE_FILE_ALIGNMENT != 0 || section.offset > size
+			|| section.count > (size - section.offset) / expectedSize)
+			return setError(error, path + " has a malformed section " + std::to_string(section.type));
+
+		const void* payload = data + section.offset;
+		const std::size_t count = std::size_t(section.count);
+		switch (SceneSection(section.type))
+		{
+		case SceneSection::Spheres:
+			view.spheres = static_cast<const Sphere<T>*>(payload);
+			view.sphereCount = count;
+			break;
+		case SceneSection::SphereMaterials:
+			view.sphereMaterials = static_cast<const std::uint32_t*>(payload);
+			sphereMaterialCount = count;
+			break;
+		case SceneSection::Materials:
+			view.materials = static_cast<const MaterialRecord<T>*>(payload);
+			view.materialCount = count;
+			break;
+		case SceneSection::Lights:
+			view.lights = static_cast<const LightRecord<T>*>(payload);
+			view.lightCount = count;
+			break;
+		case SceneSection::Cameras:
+			view.cameras = static_cast<const CameraRecord<T>*>(payload);
+			view.cameraCount = count;
+			break;
+		case SceneSection::SphereBVH:
+			view.bvhNodes = static_cast<const BVHNode<T>*>(payload);
+			view.bvhNodeCount = count;
+			break;
+		case SceneSection::MaterialSurfaces:
+			view.materialSurfaces = static_cast<const SurfaceRecord<T>*>(payload);
+			materialSurfaceCount = count;
+			break;
+		case SceneSection::MaterialTextures:
+			view.materialTextures = static_cast<const TextureRecord<T>*>(payload);
+			materialTextureCount = count;
+			break;
+		}
+	}
+
+	if (sphereMaterialCount != view.sphereCount)
+		return setError(error, path + " does not have one material index per sphere");
+	if (view.materialSurfaces != nullptr && materialSurfaceCount != view.materialCount)
+		return setError(error, path + " does not have one surface record per material");
+	if (view.materialTextures != nullptr && materialTextureCount != view.materialCount)
+		return setError(error, path + " does not have one texture record per material");
+	for (std::size_t i = 0; view.materialSurfaces != nullptr && i < view.materialCount; ++i)
+	{
+		if (!detail::isValidSurface(view.materialSurfaces[i]))
+			return setError(error, path + " has a malformed surface record for material " + std::to_string(i));
+	}
+	for (std::size_t i = 0; view.materialTextures != nullptr && i < view.materialCount; ++i)
+	{
+		if (std::memchr(view.materialTextures[i].path, '\0', TEXTURE_RECORD_PATH_SIZE) == nullptr)
+			return setError(error, path + " has an unterminated texture path");
+	}
+
+	// The hierarchy is validated when the scene adopts it; material indices are checked here since
+	// the renderer trusts them.
+	for (std::size_t i = 0; i < view.sphereCount; ++i)
+	{
+		if (view.sphereMaterials[i] >= view.materialCount)
+			return setError(error, path + " references missing material " + std::to_string(view.sphereMaterials[i]));
+	}
+
+	result = view;
+	return true;
+}
+
+template<typename T>
+bool addToScene(const SceneFileView<T>& view, Scene<T>& scene, std::string* error)
+{
+	bool ok = true;
+	const std::uint32_t materialBase = std::uint32_t(scene.getMaterialCount());
+	for (std::size_t i = 0; i < view.materialCount; ++i)
+	{
+		const MaterialRecord<T>& material = view.materials[i];
+		const SurfaceRecord<T> surface = view.materialSurfaces != nullptr ? view.materialSurfaces[i] : SurfaceRecord<T>{ T(0), T(0), T(1) };
+		std::shared_ptr<const TextureFile> texture;
+		if (view.materialTextures != nullptr && view.materialTextures[i].path[0] != '\0')
+		{
+			std::string message;
+			texture = TextureCache::getInstance().open(view.materialTextures[i].path, &message);
+			if (!texture && ok)
+				ok = detail::setError(error, message);
+		}
+		if (!texture)
+		{
+			scene.addMaterial(material.color, material.ambient, material.diffusion, surface.reflection, surface.transmission, surface.refractiveIndex);
+			continue;
+		}
+
+		OpticalProperties<T> properties;
+		properties.ambient = material.ambient;
+		properties.diffusion = material.diffusion;
+		properties.reflection = surface.reflection;
+		properties.transmission = surface.transmission;
+		properties.refractiveIndex = surface.refractiveIndex;
+		scene.addMaterial(new TextureColorizer<T>(texture, view.materialTextures[i].worldSize, material.color), properties);
+	}
+
+	for (std::size_t i = 0; i < view.lightCount; ++i)
+		scene.addLight(new PointLight<T>{ view.lights[i].position, view.lights[i].color, view.lights[i].intensity });
+
+	if (view.sphereCount != 0)
+	{
+		SphereArray<T> spheres;
+		spheres.spheres = view.spheres;
+		spheres.materialIndices = view.sphereMaterials;
+		spheres.count = view.sphereCount;
+		spheres.materialBase = materialBase;
+		spheres.bvhNodes = view.bvhNodes;
+		spheres.bvhNodeCount = view.bvhNodeCount;
+		scene.addSphereArray(spheres);
+	}
+	return ok;
+}
+
+template<typename T>
+std::vector<Camera<T> > getCameras(const SceneFileView<T>& view)
+{
+	std::vector<Camera<T> > cameras;
+	cameras.reserve(view.cameraCount);
+	for (std::size_t i = 0; i < view.cameraCount; ++i)
+		cameras.push_back(Camera<T>{ view.cameras[i].origin, view.cameras[i].direction, view.cameras[i].horizontalFov });
+	return cameras;
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include "SceneFile.h"
+
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <sstream>
+#include <string>
+
+// Text form of a scene file, for authoring. One record per line, '#' starts a comment:
+//   material r g b ambient diffusion [reflection transmission refractiveIndex]
+//   texture path worldSize           textures the material before it; the path has no spaces
+//   sphere x y z radius materialIndex
+//   light x y z r g b intensity
+//   camera x y z directionX directionY directionZ horizontalFovDegrees
+// Materials are numbered in the order they appear. Reflection and transmission are fractions that
+// sum to at most 1, and the refractive index is positive.
+
+template<typename T>
+bool readSceneText(std::istream& in, SceneFileContent<T>& content, std::string* error = nullptr);
+
+template<typename T>
+void writeSceneText(std::ostream& out, const SceneFileView<T>& view);
+
+template<typename T>
+bool readSceneText(std::istream& in, SceneFileContent<T>& content, std::string* error)
+{
+	std::string line;
+	bool surfaces = false;
+	bool textures = false;
+	for (int lineNumber = 1; std::getline(in, line); ++lineNumber)
+	{
+		std::string::size_type comment = line.find('#');
+		if (comment != std::string::npos)
+			line.erase(comment);
+
+		std::istringstream fields(line);
+		std::string keyword;
+		if (!(fields >> keyword))
+			continue;
+
+		bool ok;
+		if (keyword == "material")
+		{
+			T r, g, b, ambient, diffusion;
+			SurfaceRecord<T> surface{ T(0), T(0), T(1) };
+			ok = bool(fields >> r >> g >> b >> ambient >> diffusion);
+			if (ok && fields >> surface.reflection)
+			{
+				ok = fields >> surface.transmission >> surface.refractiveIndex && detail::isValidSurface(surface);
+				surfaces = true;
+			}
+			if (ok)
+			{
+				content.materials.push_back(MaterialRecord<T>{ { r, g, b }, ambient, diffusion });
+				content.materialSurfaces.push_back(surface);
+				content.materialTextures.push_back(TextureRecord<T>{ T(0), {} });
+			}
+		}
+		else if (keyword == "texture")
+		{
+			std::string path;
+			T worldSize;
+			ok = bool(fields >> path >> worldSize) && !content.materials.empty() && path.size() < TEXTURE_RECORD_PATH_SIZE && worldSize > T(0);
+			if (ok)
+			{
+				TextureRecord<T>& texture = content.materialTextures.back();
+				texture.worldSize = worldSize;
+				path.copy(texture.path, path.size());
+				texture.path[path.size()] = '\0';
+				textures = true;
+			}
+		}
+		else if (keyword == "sphere")
+		{
+			T x, y, z, radius;
+			std::uint32_t material;
+			ok = bool(fields >> x >> y >> z >> radius >> material);
+			if (ok)
+			{
+				content.spheres.push_back(Sphere<T>{ { x, y, z }, radius });
+				content.sphereMaterials.push_back(material);
+			}
+		}
+		else if (keyword == "light")
+		{
+			T x, y, z, r, g, b, intensity;
+			ok = bool(fields >> x >> y >> z >> r >> g >> b >> intensity);
+			if (ok)
+				content.lights.push_back(LightRecord<T>{ { x, y, z }, { r, g, b }, intensity });
+		}
+		else if (keyword == "camera")
+		{
+			T x, y, z, dx, dy, dz, fov;
+			ok = bool(fields >> x >> y >> z >> dx >> dy >> dz >> fov);
+			if (ok)
+				content.cameras.push_back(CameraRecord<T>{ { x, y, z }, { dx, dy, dz }, deg_to_rad(fov) });
+		}
+		else
+		{
+			return detail::setError(error, "line " + std::to_string(lineNumber) + ": unknown record '" + keyword + "'");
+		}
+
+		// A material without surface fields leaves the stream failed; anything else left is an error.
+		std::string extra;
+		fields.clear();
+		if (!ok || fields >> extra)
+			return detail::setError(error, "line " + std::to_string(lineNumber) + ": malformed " + keyword);
+	}
+
+	if (!surfaces)
+		content.materialSurfaces.clear();
+	if (!textures)
+		content.materialTextures.clear();
+
+	for (std::size_t i = 0; i < content.sphereMaterials.size(); ++i)
+	{
+		if (content.sphereMaterials[i] >= content.materials.size())
+			return detail::setError(error, "sphere " + std::to_string(i) + " references missing material " + std::to_string(content.sphereMaterials[i]));
+	}
+	return true;
+}
+
+template<typename T>
+void writeSceneText(std::ostream& out, const SceneFileView<T>& view)
+{
+	const std::streamsize precision = out.precision(std::numeric_limits<T>::max_digits10);
+
+	for (std::size_t i = 0; i < view.materialCount; ++i)
+	{
+		const MaterialRecord<T>& m = view.materials[i];
+		out << "material " << m.color.r << ' ' << m.color.g << ' ' << m.color.b << ' ' << m.ambient << ' ' << m.diffusion;
+		if (view.materialSurfaces != nullptr)
+		{
+			const SurfaceRecord<T>& surface = view.materialSurfaces[i];
+			out << ' ' << surface.reflection << ' ' << surface.transmission << ' ' << surface.refractiveIndex;
+		}
+		out << '\n';
+		if (view.materialTextures != nullptr && view.materialTextures[i].path[0] != '\0')
+			out << "texture " << view.materialTextures[i].path << ' ' << view.materialTextures[i].worldSize << '\n';
+	}
+	for (std::size_t i = 0; i < view.lightCount; ++i)
+	{
+		const LightRecord<T>& l = view.lights[i];
+		out << "light " << l.position.x << ' ' << l.position.y << ' ' << l.position.z << ' '
+			<< l.color.r << ' ' << l.color.g << ' ' << l.color.b << ' ' << l.intensity << '\n';
+	}
+	for (std::size_t i = 0; i < view.cameraCount; ++i)
+	{
+		const CameraRecord<T>& c = view.cameras[i];
+		out << "camera " << c.origin.x << ' ' << c.origin.y << ' ' << c.origin.z << ' '
+			<< c.direction.x << ' ' << c.direction.y << ' ' << c.direction.z << ' ' << c.horizontalFov * T(180) / pi<T>() << '\n';
+	}
+	for (std::size_t i = 0; i < view.sphereCount; ++i)
+	{
+		const Sphere<T>& s = view.spheres[i];
+		out << "sphere " << s.center.x << ' ' << s.center.y << ' ' << s.center.z << ' ' << s.radius << ' ' << view.sphereMaterials[i] << '\n';
+	}
+
+	out.precision(precision);
+}
@@ -0,0 +1,304 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// Blocking stream socket. Addresses are "host:port" for TCP or, except on Windows, "unix:path" for
+// a Unix domain socket.
+class Socket
+{
+public:
+#ifdef _WIN32
+	using Handle = SOCKET;
+	static constexpr Handle INVALID_HANDLE = INVALID_SOCKET;
+#else
+	using Handle = int;
+	static constexpr Handle INVALID_HANDLE = -1;
+#endif
+
+	Socket() = default;
+	~Socket() { close(); }
+
+	Socket(const Socket&) = delete;
+	Socket& operator=(const Socket&) = delete;
+	Socket(Socket&& other) : m_handle(other.m_handle) { other.m_handle = INVALID_HANDLE; }
+	Socket& operator=(Socket&& other)
+	{
+		if (this != &other)
+		{
+			close();
+			m_handle = other.m_handle;
+			other.m_handle = INVALID_HANDLE;
+		}
+		return *this;
+	}
+
+	bool connect(const std::string& address, std::string* error = nullptr);
+	bool listen(const std::string& address, std::string* error = nullptr);
+	// Waits for the next connection on a listening socket.
+	bool accept(Socket& connection, std::string* error = nullptr) const;
+	void close();
+
+	bool isOpen() const { return m_handle != INVALID_HANDLE; }
+
+	// Whether all bytes were sent or received; either fails once the peer is gone.
+	bool sendAll(const void* data, std::size_t size) const;
+	bool receiveAll(void* data, std::size_t size) const;
+	// Waits up to timeoutMilliseconds for data to read, or for the peer to close.
+	bool waitReadable(int timeoutMilliseconds) const;
+	// Receives fail after this long without data, and sends after this long without progress; 0
+	// waits forever.
+	void setReceiveTimeout(int milliseconds) const { setTimeout(SO_RCVTIMEO, milliseconds); }
+	void setSendTimeout(int milliseconds) const { setTimeout(SO_SNDTIMEO, milliseconds); }
+
+private:
+	static bool setError(std::string* error, const std::string& message)
+	{
+		if (error != nullptr)
+			*error = message;
+		return false;
+	}
+
+	// Opens the socket for an address: a TCP endpoint resolved with getaddrinfo, or a Unix path.
+	template<typename Fn>
+	bool forEachEndpoint(const std::string& address, bool passive, std::string* error, Fn&& fn);
+	void setTimeout(int option, int milliseconds) const;
+
+	Handle m_handle = INVALID_HANDLE;
+};
+
+namespace detail
+{
+#ifdef _WIN32
+	inline bool initSockets()
+	{
+		static const bool initialized = []
+		{
+			WSADATA data;
+			return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+		}();
+		return initialized;
+	}
+#endif
+
+	// Where send has no MSG_NOSIGNAL, the socket itself must not raise SIGPIPE once the peer is gone.
+	inline void disableSigpipe(Socket::Handle handle)
+	{
+#ifdef __APPLE__
+		const int enable = 1;
+		::setsockopt(handle, SOL_SOCKET, SO_NOSIGPIPE, &enable, sizeof(enable));
+#else
+		(void)handle;
+#endif
+	}
+
+	// Whether a failed send or receive was only interrupted by a signal, and should be retried.
+	inline bool isInterrupted()
+	{
+#ifdef _WIN32
+		return false;
+#else
+		return errno == EINTR;
+#endif
+	}
+
+	inline void closeSocketHandle(Socket::Handle handle)
+	{
+#ifdef _WIN32
+		closesocket(handle);
+#else
+		::close(handle);
+#endif
+	}
+}
+
+template<typename Fn>
+bool Socket::forEachEndpoint(const std::string& address, bool passive, std::string* error, Fn&& fn)
+{
+#ifdef _WIN32
+	if (!detail::initSockets())
+		return setError(error, "cannot initialize Windows sockets");
+#else
+	if (address.compare(0, 5, "unix:") == 0)
+	{
+		sockaddr_un endpoint;
+		std::memset(&endpoint, 0, sizeof(endpoint));
+		endpoint.sun_family = AF_UNIX;
+		const std::string path = address.substr(5);
+		if (path.empty() || path.size() >= sizeof(endpoint.sun_path))
+			return setError(error, "invalid Unix socket path in " + address);
+		std::memcpy(endpoint.sun_path, path.c_str(), path.size() + 1);
+
+		m_handle = ::socket(AF_UNIX, SOCK_STREAM, 0);
+		if (m_handle == INVALID_HANDLE)
+			return setError(error, "cannot create a socket for " + address);
+		detail::disableSigpipe(m_handle);
+		if (passive)
+			::unlink(endpoint.sun_path);
+		if (fn(reinterpret_cast<const sockaddr*>(&endpoint), socklen_t(sizeof(endpoint))))
+			return true;
+		close();
+		return setError(error, std::string(passive ? "cannot listen on " : "cannot connect to ") + address);
+	}
+#endif
+
+	const std::size_t colon = address.rfind(':');
+	if (colon == std::string::npos)
+		return setError(error, "expected host:port, got " + address);
+	const std::string host = address.substr(0, colon), port = address.substr(colon + 1);
+
+	addrinfo hints;
+	std::memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+	addrinfo* endpoints = nullptr;
+	if (getaddrinfo(host.empty() || host == "*" ? nullptr : host.c_str(), port.c_str(), &hints, &endpoints) != 0)
+		return setError(error, "cannot resolve " + address);
+
+	for (addrinfo* endpoint = endpoints; endpoint != nullptr; endpoint = endpoint->ai_next)
+	{
+		m_handle = ::socket(endpoint->ai_family, endpoint->ai_socktype, endpoint->ai_protocol);
+		if (m_handle == INVALID_HANDLE)
+			continue;
+		detail::disableSigpipe(m_handle);
+
+		// Tiles are requested and returned one message at a time, so Nagle's delay would only add latency.
+		const int enable = 1;
+		::setsockopt(m_handle, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&enable), sizeof(enable));
+		if (passive)
+			::setsockopt(m_handle, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&enable), sizeof(enable));
+		if (fn(endpoint->ai_addr, endpoint->ai_addrlen))
+		{
+			freeaddrinfo(endpoints);
+			return true;
+		}
+		close();
+	}
+	freeaddrinfo(endpoints);
+	return setError(error, std::string(passive ? "cannot listen on " : "cannot connect to ") + address);
+}
+
+inline bool Socket::connect(const std::string& address, std::string* error)
+{
+	close();
+	return forEachEndpoint(address, false, error, [this](const sockaddr* endpoint, socklen_t length)
+	{
+		return ::connect(m_handle, endpoint, length) == 0;
+	});
+}
+
+inline bool Socket::listen(const std::string& address, std::string* error)
+{
+	close();
+	return forEachEndpoint(address, true, error, [this](const sockaddr* endpoint, socklen_t length)
+	{
+		return ::bind(m_handle, endpoint, length) == 0 && ::listen(m_handle, SOMAXCONN) == 0;
+	});
+}
+
+inline bool Socket::accept(Socket& connection, std::string* error) const
+{
+	connection.close();
+	connection.m_handle = ::accept(m_handle, nullptr, nullptr);
+	if (connection.m_handle == INVALID_HANDLE)
+		return setError(error, "cannot accept a connection");
+
+	detail::disableSigpipe(connection.m_handle);
+	const int enable = 1;
+	::setsockopt(connection.m_handle, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&enable), sizeof(enable));
+	return true;
+}
+
+inline void Socket::close()
+{
+	if (m_handle != INVALID_HANDLE)
+		detail::closeSocketHandle(m_handle);
+	m_handle = INVALID_HANDLE;
+}
+
+inline bool Socket::sendAll(const void* data, std::size_t size) const
+{
+	const char* bytes = static_cast<const char*>(data);
+	while (size != 0)
+	{
+		// Sends are chunked so that the length fits the int Windows takes.
+		const int chunk = int(size < (std::size_t(1) << 30) ? size : std::size_t(1) << 30);
+#if defined(_WIN32) || defined(__APPLE__)
+		const int flags = 0;
+#else
+		// A worker that died must fail the send, not raise SIGPIPE in the coordinator.
+		const int flags = MSG_NOSIGNAL;
+#endif
+		const auto sent = ::send(m_handle, bytes, chunk, flags);
+		if (sent < 0 && detail::isInterrupted())
+			continue;
+		if (sent <= 0)
+			return false;
+		bytes += sent;
+		size -= std::size_t(sent);
+	}
+	return true;
+}
+
+inline bool Socket::receiveAll(void* data, std::size_t size) const
+{
+	char* bytes = static_cast<char*>(data);
+	while (size != 0)
+	{
+		const int chunk = int(size < (std::size_t(1) << 30) ? size : std::size_t(1) << 30);
+		const auto received = ::recv(m_handle, bytes, chunk, 0);
+		if (received < 0 && detail::isInterrupted())
+			continue;
+		if (received <= 0)
+			return false;
+		bytes += received;
+		size -= std::size_t(received);
+	}
+	return true;
+}
+
+inline bool Socket::waitReadable(int timeoutMilliseconds) const
+{
+#ifdef _WIN32
+	WSAPOLLFD descriptor{ m_handle, POLLRDNORM, 0 };
+	return WSAPoll(&descriptor, 1, timeoutMilliseconds) > 0;
+#else
+	pollfd descriptor{ m_handle, POLLIN, 0 };
+	return ::poll(&descriptor, 1, timeoutMilliseconds) > 0;
+#endif
+}
+
+inline void Socket::setTimeout(int option, int milliseconds) const
+{
+#ifdef _WIN32
+	const DWORD timeout = DWORD(milliseconds);
+	::setsockopt(m_handle, SOL_SOCKET, option, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+#else
+	timeval timeout{ milliseconds / 1000, (milliseconds % 1000) * 1000 };
+	::setsockopt(m_handle, SOL_SOCKET, option, &timeout, sizeof(timeout));
+#endif
+}
@@ -0,0 +1,316 @@
+#pragma once
+
+#include "Camera.h"
+#include "Scene.h"
+#include "ThreadPool.h"
+#include "Viewport.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+struct TemporalSettings
+{
+	// A pixel reprojected this many times is traced again, so that reprojection errors do not stay
+	// on screen; 0 keeps pixels forever. Expiry is staggered over the image.
+	int maxAge = 16;
+	// A reprojected pixel is traced again when the neighbours on two opposite sides are closer to the
+	// camera by more than this fraction of its depth: it may be background showing through a gap in a
+	// magnified surface.
+	float depthTolerance = 0.05f;
+};
+
+// Renders camera moves and scene edits by reusing the previous frame. Every pixel remembers the
+// surface point it shows, and after a camera move the points are projected into the new view,
+// nearest first. Shading only depends on the point, its normal and the lights, so a reused pixel
+// keeps its colour; pixels no point lands on, gaps in magnified surfaces and pixels a scene change
+// may affect are traced. Reflective and transmissive surfaces depend on the view and on the whole
+// scene, so their pixels are traced whenever the camera or the scene changes. Surfaces entering
+// the view in front of reused points, e.g. from beyond the frame edge, only show up once those
+// points expire.
+template<typename T>
+class TemporalRenderer
+{
+public:
+	explicit TemporalRenderer(const TemporalSettings& settings = TemporalSettings{}) : m_settings(settings)
+	{}
+
+	// Compiles the scene first if needed, and takes its changes: a scene is meant to be shown by one
+	// temporal renderer.
+	void render(Scene<T>& scene, const Camera<T>& camera, Viewport<T>& viewport, ThreadPool& pool);
+	// The next frame is traced in full.
+	void invalidate() { m_camera.reset(); }
+
+	// Pixels traced by the last render.
+	std::size_t getTracedPixelCount() const { return m_trace.size(); }
+
+private:
+	enum : std::uint32_t { NO_SOURCE = 0xFFFFFFFFu };
+	// Age of pixels showing a surface that reflects or transmits light, which are never reused.
+	enum : std::uint8_t { VIEW_DEPENDENT = 0xFF };
+
+	// Same view: the pixels stay where they are, and those the changes may affect are traced.
+	void update(const Scene<T>& scene, const PreparedCamera<T>& camera, const SceneChanges<T>& changes);
+	void reproject(const Scene<T>& scene, const PreparedCamera<T>& camera, const SceneChanges<T>& changes);
+	bool isAffected(const Scene<T>& scene, const PreparedCamera<T>& camera, const SceneChanges<T>& changes, std::uint32_t source) const;
+	// Traces the pixels in m_trace into the given set.
+	void trace(const Scene<T>& scene, const PreparedCamera<T>& camera, ThreadPool& pool, int set, bool fullFrame);
+	void resize(std::size_t pixelCount);
+
+	TemporalSettings m_settings;
+	// The view of the previous frame, if any.
+	std::unique_ptr<PreparedCamera<T> > m_camera;
+
+	// Per pixel: the point shown, or the ray direction for the background, its normal, the object
+	// (NO_OBJECT for the background), its colour, and the frames since it was traced. The next frame
+	// is assembled in the second set.
+	std::vector<Point3<T> > m_points[2];
+	std::vector<Vec3<T> > m_normals[2];
+	std::vector<std::uint32_t> m_objects[2];
+	std::vector<Color<T> > m_colors[2];
+	std::vector<std::uint8_t> m_ages[2];
+
+	std::vector<T> m_depths;
+	std::vector<std::uint32_t> m_sources;
+	std::vector<std::uint32_t> m_trace;
+};
+
+template<typename T>
+void TemporalRenderer<T>::render(Scene<T>& scene, const Camera<T>& camera, Viewport<T>& viewport, ThreadPool& pool)
+{
+	if (!scene.isCompiled())
+		scene.compile();
+	const SceneChanges<T> changes = scene.takeChanges();
+	const PreparedCamera<T> prepared = camera.prepare(viewport);
+
+	const int width = viewport.getWidth(), height = viewport.getHeight();
+	const std::size_t pixelCount = std::size_t(width) * std::size_t(height);
+	const bool fullFrame = m_camera == nullptr || width != m_camera->getWidth() || height != m_camera->getHeight() || changes.all;
+	resize(pixelCount);
+
+	m_trace.clear();
+	if (fullFrame)
+	{
+		for (std::size_t i = 0; i < pixelCount; ++i)
+			m_trace.push_back(std::uint32_t(i));
+		trace(scene, prepared, pool, 0, true);
+	}
+	else if (prepared.isSameView(*m_camera))
+	{
+		update(scene, prepared, changes);
+		trace(scene, prepared, pool, 0, false);
+	}
+	else
+	{
+		reproject(scene, prepared, changes);
+		trace(scene, prepared, pool, 1, false);
+		m_points[0].swap(m_points[1]);
+		m_normals[0].swap(m_normals[1]);
+		m_objects[0].swap(m_objects[1]);
+		m_colors[0].swap(m_colors[1]);
+		m_ages[0].swap(m_ages[1]);
+	}
+	m_camera.reset(new PreparedCamera<T>(prepared));
+
+	for (int row = 0; row < height; ++row)
+	{
+		for (int col = 0; col < width; ++col)
+			viewport(col, row) = m_colors[0][std::size_t(row) * width + col];
+	}
+}
+
+template<typename T>
+void TemporalRenderer<T>::resize(std::size_t pixelCount)
+{
+	for (int set = 0; set < 2; ++set)
+	{
+		m_points[set].resize(pixelCount, Point3<T>{ 0., 0., 0. });
+		m_normals[set].resize(pixelCount, Vec3<T>{ 0., 0., 0. });
+		m_objects[set].resize(pixelCount, NO_OBJECT);
+		m_colors[set].resize(pixelCount);
+		m_ages[set].resize(pixelCount, 0);
+	}
+}
+
+template<typename T>
+void TemporalRenderer<T>::update(const Scene<T>& scene, const PreparedCamera<T>& camera, const SceneChanges<T>& changes)
+{
+	if (changes.objects.empty() && changes.bounds.empty())
+		return;
+
+	const std::size_t pixelCount = m_objects[0].size();
+	for (std::size_t i = 0; i < pixelCount; ++i)
+	{
+		if (m_ages[0][i] == VIEW_DEPENDENT || isAffected(scene, camera, changes, std::uint32_t(i)))
+			m_trace.push_back(std::uint32_t(i));
+	}
+}
+
+template<typename T>
+void TemporalRenderer<T>::reproject(const Scene<T>& scene, const PreparedCamera<T>& camera, const SceneChanges<T>& changes)
+{
+	const int width = camera.getWidth(), height = camera.getHeight();
+	const std::size_t pixelCount = std::size_t(width) * std::size_t(height);
+	const Point3<T>& origin = camera.getOrigin();
+	const Point3<T>& previousOrigin = m_camera->getOrigin();
+	// The background only stays put when the camera turns without moving.
+	const bool sameOrigin = origin.x == previousOrigin.x && origin.y == previousOrigin.y && origin.z == previousOrigin.z;
+	const int maxAge = std::min(254, m_settings.maxAge);
+	const T backgroundDepth = std::numeric_limits<T>::max();
+
+	// Scatter, keeping the nearest point landing on each pixel.
+	m_depths.assign(pixelCount, std::numeric_limits<T>::infinity());
+	m_sources.assign(pixelCount, NO_SOURCE);
+	for (std::size_t i = 0; i < pixelCount; ++i)
+	{
+		const bool hit = m_objects[0][i] != NO_OBJECT;
+		if ((maxAge > 0 && m_ages[0][i] + 1 >= maxAge) || m_ages[0][i] == VIEW_DEPENDENT || (!hit && !sameOrigin))
+			continue;
+
+		const Point3<T> point = hit ? m_points[0][i] : origin + m_points[0][i];
+		T col, row;
+		if ((hit && (point - origin) * m_normals[0][i] > T(0)) || !camera.project(point, col, row))
+			continue;
+		const T colRounded = std::floor(col + T(0.5)), rowRounded = std::floor(row + T(0.5));
+		if (!(colRounded >= T(0) && colRounded < T(width) && rowRounded >= T(0) && rowRounded < T(height)))
+			continue;
+
+		const std::size_t target = std::size_t(rowRounded) * width + std::size_t(colRounded);
+		const T depth = hit ? camera.getDepth(point) : backgroundDepth;
+		if (depth < m_depths[target])
+		{
+			m_depths[target] = depth;
+			m_sources[target] = std::uint32_t(i);
+		}
+	}
+
+	// Where two points of one surface landed on the same pixel, the farther one moves to the next nearest
+	// pixel if nothing landed there. Without this, samples traced at different frames, and so at
+	// different offsets within their pixels, collide more and more as the camera keeps moving.
+	const T tolerance = T(1) - T(m_settings.depthTolerance);
+	for (std::size_t i = 0; i < pixelCount; ++i)
+	{
+		const bool hit = m_objects[0][i] != NO_OBJECT;
+		if ((maxAge > 0 && m_ages[0][i] + 1 >= maxAge) || m_ages[0][i] == VIEW_DEPENDENT || (!hit && !sameOrigin))
+			continue;
+
+		const Point3<T> point = hit ? m_points[0][i] : origin + m_points[0][i];
+		T col, row;
+		if ((hit && (point - origin) * m_normals[0][i] > T(0)) || !camera.project(point, col, row))
+			continue;
+		const T colRounded = std::floor(col + T(0.5)), rowRounded = std::floor(row + T(0.5));
+		if (!(colRounded >= T(0) && colRounded < T(width) && rowRounded >= T(0) && rowRounded < T(height)))
+			continue;
+		const std::size_t target = std::size_t(rowRounded) * width + std::size_t(colRounded);
+		const T depth = hit ? camera.getDepth(point) : backgroundDepth;
+		if (m_sources[target] == std::uint32_t(i) || depth * tolerance > m_depths[target])
+			continue;
+
+		T nextCol = colRounded, nextRow = rowRounded;
+		if (std::abs(col - colRounded) > std::abs(row - rowRounded))
+			nextCol += col > colRounded ? T(1) : T(-1);
+		else
+			nextRow += row > rowRounded ? T(1) : T(-1);
+		if (!(nextCol >= T(0) && nextCol < T(width) && nextRow >= T(0) && nextRow < T(height)))
+			continue;
+		const std::size_t next = std::size_t(nextRow) * width + std::size_t(nextCol);
+		if (m_sources[next] == NO_SOURCE)
+		{
+			m_depths[next] = depth;
+			m_sources[next] = std::uint32_t(i);
+		}
+	}
+
+	for (int row = 0; row < height; ++row)
+	{
+		for (int col = 0; col < width; ++col)
+		{
+			const std::size_t target = std::size_t(row) * width + col;
+			const std::uint32_t source = m_sources[target];
+			const T limit = m_depths[target] * tolerance;
+			const bool gap = (col > 0 && col + 1 < width && m_depths[target - 1] < limit && m_depths[target + 1] < limit)
+				|| (row > 0 && row + 1 < height && m_depths[target - width] < limit && m_depths[target + width] < limit);
+			if (source == NO_SOURCE || gap || isAffected(scene, camera, changes, source))
+			{
+				m_trace.push_back(std::uint32_t(target));
+				continue;
+			}
+
+			m_points[1][target] = m_points[0][source];
+			m_normals[1][target] = m_normals[0][source];
+			m_objects[1][target] = m_objects[0][source];
+			m_colors[1][target] = m_colors[0][source];
+			m_ages[1][target] = std::uint8_t(std::min(VIEW_DEPENDENT - 1, m_ages[0][source] + 1));
+		}
+	}
+}
+
+template<typename T>
+bool TemporalRenderer<T>::isAffected(const Scene<T>& scene, const PreparedCamera<T>& camera, const SceneChanges<T>& changes, std::uint32_t source) const
+{
+	const std::uint32_t object = m_objects[0][source];
+	if (object != NO_OBJECT && std::binary_search(changes.objects.begin(), changes.objects.end(), object))
+		return true;
+	if (changes.bounds.empty())
+		return false;
+
+	// Changed geometry may now hide the point, or stop or start shadowing it.
+	auto crosses = [&](const Point3<T>& from, const Vec3<T>& direction, T length)
+	{
+		const Vec3<T> invDirection{ T(1) / direction.x, T(1) / direction.y, T(1) / direction.z };
+		for (const AABB<T>& box : changes.bounds)
+		{
+			if (intersect(box, from, invDirection, T(0), length))
+				return true;
+		}
+		return false;
+	};
+
+	const Point3<T>& point = m_points[0][source];
+	if (object == NO_OBJECT)
+		return crosses(camera.getOrigin(), point, std::numeric_limits<T>::infinity());
+	if (crosses(camera.getOrigin(), point - camera.getOrigin(), T(1)))
+		return true;
+
+	const Contact<T> contact{ T(0), point, m_normals[0][source] };
+	LightSample<T> sample{ {0., 0., 0.}, 0., {0., 0., 0.} };
+	for (std::size_t i = 0; i < scene.getLightCount(); ++i)
+	{
+		if (scene.getLight(i).sample(contact, sample) && crosses(point, sample.direction, sample.distance))
+			return true;
+	}
+	return false;
+}
+
+template<typename T>
+void TemporalRenderer<T>::trace(const Scene<T>& scene, const PreparedCamera<T>& camera, ThreadPool& pool, int set, bool fullFrame)
+{
+	const int width = camera.getWidth();
+	const int maxAge = std::max(1, std::min(254, m_settings.maxAge));
+	const std::size_t chunkSize = 256;
+	pool.run((m_trace.size() + chunkSize - 1) / chunkSize, [&](std::size_t chunk, unsigned)
+	{
+		const std::size_t end = std::min(m_trace.size(), (chunk + 1) * chunkSize);
+		for (std::size_t i = chunk * chunkSize; i < end; ++i)
+		{
+			const std::uint32_t pixel = m_trace[i];
+			const Ray<T> ray = camera.getRay(int(pixel / std::uint32_t(width)), int(pixel % std::uint32_t(width)));
+			SurfaceHit<T> hit{ NO_CONTACT<T>(), NO_OBJECT, 0 };
+			m_colors[set][pixel] = scene.traceRay(ray, hit, camera.getPixelSpread());
+			m_objects[set][pixel] = hit.objectIndex;
+			m_points[set][pixel] = hit.objectIndex != NO_OBJECT ? hit.contact.point : ray.direction;
+			m_normals[set][pixel] = hit.contact.normal;
+			// After a full frame, ages start out of phase so that pixels do not all expire together.
+			m_ages[set][pixel] = fullFrame ? std::uint8_t((pixel * 2654435761u >> 24) % std::uint32_t(maxAge)) : 0;
+			if (hit.objectIndex != NO_OBJECT)
+			{
+				const Material<T>& material = scene.getCompiledScene().getMaterial(hit.materialIndex);
+				if (material.reflection > T(0) || material.transmission > T(0))
+					m_ages[set][pixel] = VIEW_DEPENDENT;
+			}
+		}
+	});
+}
@@ -0,0 +1,554 @@
+#pragma once
+
+#include "Color.h"
+#include "Colorizer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Texture file, little-endian:
+//   TextureFileHeader
+//   TextureLevel[levelCount]: level 0 is the image, each next one half the size of the previous,
+//   rounded up, down to 1x1
+//   level payloads, each a grid of TEXTURE_TILE_SIZE square tiles row by row, with the texels of a
+//   tile in Morton order; edge tiles repeat the last column and row of the level
+// A tile is the unit TextureCache reads and evicts, so a lookup touches one contiguous block and
+// its neighbours are likely in the same one.
+
+constexpr char TEXTURE_FILE_MAGIC[8] = { 'R', 'T', 'T', 'E', 'X', 'T', 'U', 'R' };
+constexpr std::uint32_t TEXTURE_FILE_VERSION = 1;
+constexpr std::uint32_t TEXTURE_FILE_BYTE_ORDER = 0x01020304;
+constexpr std::uint32_t TEXTURE_TILE_SIZE = 32;
+
+struct Texel
+{
+	std::uint8_t r;
+	std::uint8_t g;
+	std::uint8_t b;
+	std::uint8_t a;
+};
+
+struct TextureFileHeader
+{
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t byteOrder;
+	std::uint32_t width;
+	std::uint32_t height;
+	std::uint32_t levelCount;
+	std::uint32_t tileSize;
+};
+
+struct TextureLevel
+{
+	std::uint32_t width;
+	std::uint32_t height;
+	std::uint64_t offset;
+};
+
+// Writes a texture file from row-major texels, computing its mip levels with a box filter.
+inline bool writeTextureFile(const std::string& path, std::uint32_t width, std::uint32_t height, const Texel* texels, std::string* error = nullptr);
+
+// An open texture file. Only its level table is kept; tiles are read through TextureCache.
+class TextureFile
+{
+public:
+	std::uint32_t getWidth() const { return m_levels[0].width; }
+	std::uint32_t getHeight() const { return m_levels[0].height; }
+	std::uint32_t getLevelCount() const { return std::uint32_t(m_levels.size()); }
+	const TextureLevel& getLevel(std::uint32_t level) const { return m_levels[level]; }
+	const std::string& getPath() const { return m_path; }
+
+private:
+	friend class TextureCache;
+
+	bool readTile(std::uint32_t level, std::uint32_t tile, std::vector<Texel>& texels) const;
+
+	std::uint64_t m_id = 0;
+	std::string m_path;
+	std::vector<TextureLevel> m_levels;
+	mutable std::mutex m_fileMutex;
+	mutable std::ifstream m_file;
+};
+
+struct TextureCacheStats
+{
+	// Lookups that reached the shared table; a thread looking up one of its recent tiles again is
+	// served from its own slots and not counted.
+	std::size_t lookups = 0;
+	std::size_t misses = 0;
+	std::size_t evictions = 0;
+	std::size_t failedReads = 0;
+	std::size_t residentBytes = 0;
+};
+
+// Tiles of every open texture file, shared by the whole process and read from disk on first use.
+// When the resident tiles exceed the capacity, the least recently used ones are dropped; tiles
+// still being read by a lookup stay alive until it is done with them. Each thread keeps the tiles
+// it looked up last in a few slots of its own, so that lookups of those take no lock; such a hit
+// only sets the tile's reference bit, and eviction gives a referenced tile a second chance at the
+// front of the recency list. A dropped tile may stay alive in the slots of the threads that used
+// it, at most THREAD_SLOTS tiles per thread.
+class TextureCache
+{
+public:
+	static TextureCache& getInstance();
+
+	void setCapacity(std::size_t bytes);
+	std::size_t getCapacity() const;
+
+	// Opening a path that is already open returns the same texture.
+	std::shared_ptr<const TextureFile> open(const std::string& path, std::string* error = nullptr);
+	// Null when the tile cannot be read. The tile stays valid until the calling thread's next getTile.
+	const std::vector<Texel>* getTile(const TextureFile& texture, std::uint32_t level, std::uint32_t tile);
+
+	TextureCacheStats getStats() const;
+	void resetStats();
+	void clear();
+
+private:
+	struct Tile
+	{
+		std::vector<Texel> texels;
+		// Set by lookups served from thread slots, cleared by eviction.
+		mutable std::atomic<bool> referenced{ false };
+	};
+	typedef std::shared_ptr<const Tile> TilePointer;
+
+	// Texture ids are unique in the process, so keys never match a tile of another cache.
+	struct TileKey
+	{
+		std::uint64_t texture;
+		std::uint64_t tile;
+
+		bool operator==(const TileKey& other) const { return texture == other.texture && tile == other.tile; }
+	};
+
+	struct TileKeyHash
+	{
+		std::size_t operator()(const TileKey& key) const { return std::hash<std::uint64_t>()(key.texture * 0x9E3779B97F4A7C15ull ^ key.tile); }
+	};
+
+	struct Entry
+	{
+		TilePointer tile;
+		std::list<TileKey>::iterator recent;
+	};
+
+	enum : std::uint32_t { THREAD_SLOTS = 16 };
+
+	// A tile held by one thread. Generations are unique in the process too, and change when the
+	// cache is cleared, so a slot of another cache or of an earlier generation never matches.
+	struct ThreadSlot
+	{
+		TileKey key = { 0, 0 };
+		std::uint64_t generation = 0;
+		TilePointer tile;
+	};
+
+	// Texture ids and cache generations, counted from 1 so that an empty slot matches nothing.
+	static std::uint64_t takeStamp()
+	{
+		static std::atomic<std::uint64_t> next{ 1 };
+		return next.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// The calling thread's slots.
+	static ThreadSlot* getThreadSlots()
+	{
+		static thread_local ThreadSlot slots[THREAD_SLOTS];
+		return slots;
+	}
+
+	static std::size_t getTileBytes() { return std::size_t(TEXTURE_TILE_SIZE) * TEXTURE_TILE_SIZE * sizeof(Texel); }
+	// Called with the lock held.
+	void evict();
+
+	mutable std::mutex m_mutex;
+	// Replaced by clear(), so that threads let go of the tiles in their slots.
+	std::atomic<std::uint64_t> m_generation{ takeStamp() };
+	std::size_t m_capacity = std::size_t(256) << 20;
+	std::unordered_map<TileKey, Entry, TileKeyHash> m_tiles;
+	// Most recently used first.
+	std::list<TileKey> m_recent;
+	std::unordered_map<std::string, std::weak_ptr<const TextureFile> > m_files;
+	TextureCacheStats m_stats;
+};
+
+// Colors from a texture file, filtered bilinearly in the mip level whose texels are closest to the
+// footprint of the hit. u repeats, v is clamped.
+template<typename T>
+class TextureColorizer : public IColorizer<T>
+{
+public:
+	// worldSize is the length of surface the width of the texture spans, which converts footprints
+	// into texels. fallback is returned where tiles cannot be read.
+	TextureColorizer(std::shared_ptr<const TextureFile> texture, T worldSize, const Color<T>& fallback) :
+		m_texture(std::move(texture)), m_worldSize(worldSize), m_fallback(fallback)
+	{}
+
+	virtual Color<T> getColor(const Contact<T>& contact, T footprint) const override;
+
+	const TextureFile& getTexture() const { return *m_texture; }
+
+private:
+	std::shared_ptr<const TextureFile> m_texture;
+	T m_worldSize;
+	Color<T> m_fallback;
+};
+
+namespace detail
+{
+	static_assert(sizeof(TextureFileHeader) == 32 && sizeof(TextureLevel) == 16 && sizeof(Texel) == 4, "texture file tables must not be padded");
+
+	inline bool setTextureError(std::string* error, const std::string& message)
+	{
+		if (error != nullptr)
+			*error = message;
+		return false;
+	}
+
+	// Position of a texel in its tile: the bits of x and y interleaved.
+	inline std::uint32_t getTileTexelIndex(std::uint32_t x, std::uint32_t y)
+	{
+		auto spread = [](std::uint32_t v)
+		{
+			v = (v | (v << 8)) & 0x00FF00FFu;
+			v = (v | (v << 4)) & 0x0F0F0F0Fu;
+			v = (v | (v << 2)) & 0x33333333u;
+			v = (v | (v << 1)) & 0x55555555u;
+			return v;
+		};
+		return spread(x) | spread(y) << 1;
+	}
+
+	inline std::uint32_t getTileColumns(const TextureLevel& level) { return (level.width + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE; }
+	inline std::uint32_t getTileRows(const TextureLevel& level) { return (level.height + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE; }
+
+	// Sizes of the mip chain of an image, and where each level starts after the tables.
+	inline std::vector<TextureLevel> getTextureLevels(std::uint32_t width, std::uint32_t height)
+	{
+		std::vector<TextureLevel> levels;
+		for (;;)
+		{
+			levels.push_back(TextureLevel{ width, height, 0 });
+			if (width == 1 && height == 1)
+				break;
+			width = std::max<std::uint32_t>(1, (width + 1) / 2);
+			height = std::max<std::uint32_t>(1, (height + 1) / 2);
+		}
+		std::uint64_t position = sizeof(TextureFileHeader) + levels.size() * sizeof(TextureLevel);
+		for (TextureLevel& level : levels)
+		{
+			level.offset = position;
+			position += std::uint64_t(getTileColumns(level)) * getTileRows(level) * TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE * sizeof(Texel);
+		}
+		return levels;
+	}
+}
+
+inline bool writeTextureFile(const std::string& path, std::uint32_t width, std::uint32_t height, const Texel* texels, std::string* error)
+{
+	if (width == 0 || height == 0)
+		return detail::setTextureError(error, "cannot write an empty texture to " + path);
+
+	std::ofstream out(path, std::ios::binary);
+	if (!out)
+		return detail::setTextureError(error, "cannot create " + path);
+
+	const std::vector<TextureLevel> levels = detail::getTextureLevels(width, height);
+	TextureFileHeader header;
+	std::memcpy(header.magic, TEXTURE_FILE_MAGIC, sizeof(header.magic));
+	header.version = TEXTURE_FILE_VERSION;
+	header.byteOrder = TEXTURE_FILE_BYTE_ORDER;
+	header.width = width;
+	header.height = height;
+	header.levelCount = std::uint32_t(levels.size());
+	header.tileSize = TEXTURE_TILE_SIZE;
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(levels.data()), std::streamsize(levels.size() * sizeof(TextureLevel)));
+
+	std::vector<Texel> image(texels, texels + std::size_t(width) * height);
+	std::vector<Texel> tile(TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE);
+	for (std::size_t l = 0; l < levels.size(); ++l)
+	{
+		const TextureLevel& level = levels[l];
+		if (l != 0)
+		{
+			// Box filter over the 2x2 texels of the previous level, the last row or column repeated
+			// when its size is odd.
+			const TextureLevel& previous = levels[l - 1];
+			std::vector<Texel> next(std::size_t(level.width) * level.height);
+			for (std::uint32_t y = 0; y < level.height; ++y)
+			{
+				const std::uint32_t y0 = std::min(previous.height - 1, 2 * y), y1 = std::min(previous.height - 1, 2 * y + 1);
+				for (std::uint32_t x = 0; x < level.width; ++x)
+				{
+					const std::uint32_t x0 = std::min(previous.width - 1, 2 * x), x1 = std::min(previous.width - 1, 2 * x + 1);
+					const Texel& a = image[std::size_t(y0) * previous.width + x0];
+					const Texel& b = image[std::size_t(y0) * previous.width + x1];
+					const Texel& c = image[std::size_t(y1) * previous.width + x0];
+					const Texel& d = image[std::size_t(y1) * previous.width + x1];
+					next[std::size_t(y) * level.width + x] = Texel{ std::uint8_t((a.r + b.r + c.r + d.r + 2) / 4), std::uint8_t((a.g + b.g + c.g + d.g + 2) / 4),
+						std::uint8_t((a.b + b.b + c.b + d.b + 2) / 4), std::uint8_t((a.a + b.a + c.a + d.a + 2) / 4) };
+				}
+			}
+			image.swap(next);
+		}
+
+		const std::uint32_t columns = detail::getTileColumns(level), rows = detail::getTileRows(level);
+		for (std::uint32_t tileRow = 0; tileRow < rows; ++tileRow)
+		{
+			for (std::uint32_t tileColumn = 0; tileColumn < columns; ++tileColumn)
+			{
+				for (std::uint32_t y = 0; y < TEXTURE_TILE_SIZE; ++y)
+				{
+					const std::uint32_t sourceY = std::min(level.height - 1, tileRow * TEXTURE_TILE_SIZE + y);
+					for (std::uint32_t x = 0; x < TEXTURE_TILE_SIZE; ++x)
+					{
+						const std::uint32_t sourceX = std::min(level.width - 1, tileColumn * TEXTURE_TILE_SIZE + x);
+						tile[detail::getTileTexelIndex(x, y)] = image[std::size_t(sourceY) * level.width + sourceX];
+					}
+				}
+				out.write(reinterpret_cast<const char*>(tile.data()), std::streamsize(tile.size() * sizeof(Texel)));
+			}
+		}
+	}
+
+	out.close();
+	if (!out)
+		return detail::setTextureError(error, "cannot write " + path);
+	return true;
+}
+
+inline bool TextureFile::readTile(std::uint32_t level, std::uint32_t tile, std::vector<Texel>& texels) const
+{
+	texels.resize(TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE);
+	const std::uint64_t offset = m_levels[level].offset + std::uint64_t(tile) * texels.size() * sizeof(Texel);
+	std::lock_guard<std::mutex> lock(m_fileMutex);
+	m_file.clear();
+	m_file.seekg(std::streamoff(offset));
+	m_file.read(reinterpret_cast<char*>(texels.data()), std::streamsize(texels.size() * sizeof(Texel)));
+	return bool(m_file);
+}
+
+inline TextureCache& TextureCache::getInstance()
+{
+	static TextureCache cache;
+	return cache;
+}
+
+inline void TextureCache::setCapacity(std::size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_capacity = bytes;
+	evict();
+}
+
+inline std::size_t TextureCache::getCapacity() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_capacity;
+}
+
+inline std::shared_ptr<const TextureFile> TextureCache::open(const std::string& path, std::string* error)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto found = m_files.find(path);
+	if (found != m_files.end())
+	{
+		if (std::shared_ptr<const TextureFile> texture = found->second.lock())
+			return texture;
+	}
+
+	auto fail = [error](const std::string& message)
+	{
+		detail::setTextureError(error, message);
+		return std::shared_ptr<const TextureFile>();
+	};
+	std::shared_ptr<TextureFile> texture = std::make_shared<TextureFile>();
+	texture->m_path = path;
+	texture->m_file.open(path, std::ios::binary);
+	if (!texture->m_file)
+		return fail("cannot open " + path);
+
+	texture->m_file.seekg(0, std::ios::end);
+	const std::uint64_t size = std::uint64_t(texture->m_file.tellg());
+	texture->m_file.seekg(0);
+	TextureFileHeader header;
+	if (size < sizeof(header) || !texture->m_file.read(reinterpret_cast<char*>(&header), sizeof(header)))
+		return fail(path + " is too small to be a texture file");
+	if (std::memcmp(header.magic, TEXTURE_FILE_MAGIC, sizeof(header.magic)) != 0)
+		return fail(path + " is not a texture file");
+	if (header.version != TEXTURE_FILE_VERSION)
+		return fail(path + " has unsupported version " + std::to_string(header.version));
+	if (header.byteOrder != TEXTURE_FILE_BYTE_ORDER)
+		return fail(path + " was written with another byte order");
+	if (header.width == 0 || header.height == 0 || header.tileSize != TEXTURE_TILE_SIZE)
+		return fail(path + " has a malformed header");
+
+	// The table must be the one the writer computes, which also bounds every tile read.
+	const std::vector<TextureLevel> expected = detail::getTextureLevels(header.width, header.height);
+	texture->m_levels.resize(expected.size());
+	const std::uint64_t tableBytes = expected.size() * sizeof(TextureLevel);
+	if (header.levelCount != expected.size() || !texture->m_file.read(reinterpret_cast<char*>(texture->m_levels.data()), std::streamsize(tableBytes))
+		|| std::memcmp(texture->m_levels.data(), expected.data(), std::size_t(tableBytes)) != 0)
+		return fail(path + " has a malformed level table");
+	const TextureLevel& last = expected.back();
+	if (size < last.offset + TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE * sizeof(Texel))
+		return fail(path + " is truncated");
+
+	texture->m_id = takeStamp();
+	m_files[path] = texture;
+	return texture;
+}
+
+inline const std::vector<Texel>* TextureCache::getTile(const TextureFile& texture, std::uint32_t level, std::uint32_t tile)
+{
+	const TileKey key{ texture.m_id, std::uint64_t(level) << 32 | tile };
+	const std::uint64_t generation = m_generation.load(std::memory_order_acquire);
+	ThreadSlot& slot = getThreadSlots()[(tile ^ level * 0x9E3779B1u ^ std::uint32_t(texture.m_id) * 0x85EBCA77u) % THREAD_SLOTS];
+	if (slot.key == key && slot.generation == generation && slot.tile)
+	{
+		// Read first, so that tiles in steady use do not keep writing to a shared cache line.
+		if (!slot.tile->referenced.load(std::memory_order_relaxed))
+			slot.tile->referenced.store(true, std::memory_order_relaxed);
+		return &slot.tile->texels;
+	}
+
+	auto keep = [&](const TilePointer& found)
+	{
+		slot.key = key;
+		slot.generation = generation;
+		slot.tile = found;
+		return &found->texels;
+	};
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		++m_stats.lookups;
+		auto found = m_tiles.find(key);
+		if (found != m_tiles.end())
+		{
+			m_recent.splice(m_recent.begin(), m_recent, found->second.recent);
+			return keep(found->second.tile);
+		}
+		++m_stats.misses;
+	}
+
+	// Read without the cache lock, so that lookups of resident tiles go on meanwhile. Two threads
+	// missing the same tile both read it; the first one stored is kept.
+	std::shared_ptr<Tile> read = std::make_shared<Tile>();
+	const bool ok = texture.readTile(level, tile, read->texels);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!ok)
+	{
+		++m_stats.failedReads;
+		return nullptr;
+	}
+	auto inserted = m_tiles.emplace(key, Entry{ read, m_recent.end() });
+	const TilePointer stored = inserted.first->second.tile;
+	if (inserted.second)
+	{
+		m_recent.push_front(key);
+		inserted.first->second.recent = m_recent.begin();
+		m_stats.residentBytes += getTileBytes();
+		evict();
+	}
+	return keep(stored);
+}
+
+inline void TextureCache::evict()
+{
+	// One tile always stays. Each tile gets at most one second chance per call, as moving it to the
+	// front clears its reference bit.
+	while (m_stats.residentBytes > m_capacity && m_recent.size() > 1)
+	{
+		auto found = m_tiles.find(m_recent.back());
+		if (found->second.tile->referenced.exchange(false, std::memory_order_relaxed))
+		{
+			m_recent.splice(m_recent.begin(), m_recent, found->second.recent);
+			continue;
+		}
+		m_tiles.erase(found);
+		m_recent.pop_back();
+		m_stats.residentBytes -= getTileBytes();
+		++m_stats.evictions;
+	}
+}
+
+inline TextureCacheStats TextureCache::getStats() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_stats;
+}
+
+inline void TextureCache::resetStats()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	const std::size_t residentBytes = m_stats.residentBytes;
+	m_stats = TextureCacheStats{};
+	m_stats.residentBytes = residentBytes;
+}
+
+inline void TextureCache::clear()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_tiles.clear();
+	m_recent.clear();
+	m_stats.residentBytes = 0;
+	m_generation.store(takeStamp(), std::memory_order_release);
+}
+
+template<typename T>
+Color<T> TextureColorizer<T>::getColor(const Contact<T>& contact, T footprint) const
+{
+	const TextureCoordinates<T>& coordinates = contact.coordinates;
+	const TextureFile& texture = *m_texture;
+	std::uint32_t level = 0;
+	const T texels = footprint * T(texture.getWidth()) / m_worldSize;
+	if (texels > T(1))
+		level = std::min(texture.getLevelCount() - 1, std::uint32_t(std::log2(texels) + T(0.5)));
+	const TextureLevel& info = texture.getLevel(level);
+	const std::uint32_t columns = detail::getTileColumns(info);
+
+	const T x = (coordinates.u - std::floor(coordinates.u)) * T(info.width) - T(0.5);
+	const T y = std::max(T(0), std::min(T(1), coordinates.v)) * T(info.height) - T(0.5);
+	const T x0 = std::floor(x), y0 = std::floor(y);
+	const T fx = x - x0, fy = y - y0;
+
+	// The four texels mostly share a tile, which is then looked up once.
+	std::uint32_t currentTile = std::uint32_t(-1);
+	const std::vector<Texel>* tile = nullptr;
+	Color<T> result{ 0., 0., 0. };
+	for (int corner = 0; corner < 4; ++corner)
+	{
+		const std::int64_t cx = std::int64_t(x0) + (corner & 1), cy = std::int64_t(y0) + (corner >> 1);
+		const std::uint32_t tx = std::uint32_t((cx % std::int64_t(info.width) + std::int64_t(info.width)) % std::int64_t(info.width));
+		const std::uint32_t ty = std::uint32_t(std::max<std::int64_t>(0, std::min<std::int64_t>(info.height - 1, cy)));
+		const std::uint32_t tileIndex = ty / TEXTURE_TILE_SIZE * columns + tx / TEXTURE_TILE_SIZE;
+		if (tileIndex != currentTile)
+		{
+			tile = TextureCache::getInstance().getTile(texture, level, tileIndex);
+			if (!tile)
+				return m_fallback;
+			currentTile = tileIndex;
+		}
+
+		const Texel& texel = (*tile)[detail::getTileTexelIndex(tx % TEXTURE_TILE_SIZE, ty % TEXTURE_TILE_SIZE)];
+		const T weight = ((corner & 1) != 0 ? fx : T(1) - fx) * ((corner >> 1) != 0 ? fy : T(1) - fy) / T(255);
+		result = result + Color<T>{ weight * T(texel.r), weight * T(texel.g), weight * T(texel.b) };
+	}
+	return result;
+}
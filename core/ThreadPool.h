@@ -0,0 +1,202 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads running batches of indexed tasks. Each worker owns a queue:
+// it pops from the front of its own queue and, once empty, steals from the back of the others.
+// The thread calling run() takes part as worker 0.
+class ThreadPool
+{
+public:
+	explicit ThreadPool(unsigned threadCount = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	unsigned getThreadCount() const { return unsigned(m_queues.size()); }
+
+	// Calls task(taskIndex, workerIndex) for every index in [0, taskCount) and blocks until all are done.
+	// Tasks are dealt round-robin, so neighbouring indices start on different workers. If a task
+	// throws, the tasks not started yet are skipped and the first exception is rethrown here once the
+	// others have returned; the pool stays usable.
+	void run(std::size_t taskCount, const std::function<void(std::size_t, unsigned)>& task);
+
+private:
+	struct WorkQueue
+	{
+		std::mutex mutex;
+		std::deque<std::size_t> tasks;
+	};
+
+	bool popTask(unsigned workerIndex, std::size_t& taskIndex);
+	void workUntilEmpty(unsigned workerIndex, const std::function<void(std::size_t, unsigned)>& task);
+	void workerLoop(unsigned workerIndex);
+
+	std::vector<std::unique_ptr<WorkQueue> > m_queues;
+	std::vector<std::thread> m_threads;
+
+	std::mutex m_runMutex;
+	std::mutex m_stateMutex;
+	std::condition_variable m_wakeWorkers;
+	std::condition_variable m_batchDone;
+	const std::function<void(std::size_t, unsigned)>* m_task = nullptr;
+	// First exception thrown by a task of the current batch.
+	std::exception_ptr m_exception;
+	std::atomic<bool> m_failed{ false };
+	std::uint64_t m_generation = 0;
+	unsigned m_activeWorkers = 0;
+	bool m_stop = false;
+};
+
+inline ThreadPool::ThreadPool(unsigned threadCount)
+{
+	if (threadCount == 0)
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+	for (unsigned i = 0; i < threadCount; ++i)
+		m_queues.emplace_back(new WorkQueue);
+
+	for (unsigned i = 1; i < threadCount; ++i)
+		m_threads.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+inline ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_stateMutex);
+		m_stop = true;
+	}
+	m_wakeWorkers.notify_all();
+	for (auto& thread : m_threads)
+		thread.join();
+}
+
+inline bool ThreadPool::popTask(unsigned workerIndex, std::size_t& taskIndex)
+{
+	{
+		WorkQueue& own = *m_queues[workerIndex];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.tasks.empty())
+		{
+			taskIndex = own.tasks.front();
+			own.tasks.pop_front();
+			return true;
+		}
+	}
+
+	for (unsigned i = 1; i < m_queues.size(); ++i)
+	{
+		WorkQueue& victim = *m_queues[(workerIndex + i) % m_queues.size()];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.tasks.empty())
+		{
+			taskIndex = victim.tasks.back();
+			victim.tasks.pop_back();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+inline void ThreadPool::workUntilEmpty(unsigned workerIndex, const std::function<void(std::size_t, unsigned)>& task)
+{
+	std::size_t taskIndex;
+	while (popTask(workerIndex, taskIndex))
+	{
+		if (m_failed.load(std::memory_order_relaxed))
+			continue;
+		try
+		{
+			task(taskIndex, workerIndex);
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(m_stateMutex);
+			if (!m_exception)
+				m_exception = std::current_exception();
+			m_failed = true;
+		}
+	}
+}
+
+inline void ThreadPool::workerLoop(unsigned workerIndex)
+{
+	std::uint64_t seenGeneration = 0;
+	while (true)
+	{
+		const std::function<void(std::size_t, unsigned)>* task = nullptr;
+		{
+			std::unique_lock<std::mutex> lock(m_stateMutex);
+			m_wakeWorkers.wait(lock, [&] { return m_stop || m_generation != seenGeneration; });
+			if (m_stop)
+				return;
+			seenGeneration = m_generation;
+
+			// A worker waking after its batch already completed has nothing to do.
+			if (m_task == nullptr)
+				continue;
+			task = m_task;
+			++m_activeWorkers;
+		}
+
+		workUntilEmpty(workerIndex, *task);
+
+		{
+			std::lock_guard<std::mutex> lock(m_stateMutex);
+			if (--m_activeWorkers == 0)
+				m_batchDone.notify_all();
+		}
+	}
+}
+
+inline void ThreadPool::run(std::size_t taskCount, const std::function<void(std::size_t, unsigned)>& task)
+{
+	if (taskCount == 0)
+		return;
+
+	std::lock_guard<std::mutex> runLock(m_runMutex);
+
+	for (std::size_t i = 0; i < m_queues.size(); ++i)
+	{
+		WorkQueue& queue = *m_queues[i];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		for (std::size_t taskIndex = i; taskIndex < taskCount; taskIndex += m_queues.size())
+			queue.tasks.push_back(taskIndex);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_stateMutex);
+		m_task = &task;
+		++m_activeWorkers;
+		++m_generation;
+	}
+	m_wakeWorkers.notify_all();
+
+	workUntilEmpty(0, task);
+
+	// Queues are drained once worker 0 finds nothing left to steal; wait for tasks still in flight.
+	std::unique_lock<std::mutex> lock(m_stateMutex);
+	--m_activeWorkers;
+	m_batchDone.wait(lock, [&] { return m_activeWorkers == 0; });
+	m_task = nullptr;
+	if (m_exception)
+	{
+		std::exception_ptr exception = m_exception;
+		m_exception = nullptr;
+		m_failed = false;
+		lock.unlock();
+		std::rethrow_exception(exception);
+	}
+}
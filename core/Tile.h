@@ -0,0 +1,29 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+struct Tile
+{
+	int colBegin;
+	int rowBegin;
+	int colEnd;
+	int rowEnd;
+};
+
+// 32x32 pixels of Color<double> is 24KB, which keeps a tile's output within L1/L2.
+constexpr int DEFAULT_TILE_SIZE = 32;
+
+inline std::vector<Tile> makeTiles(int width, int height, int tileSize = DEFAULT_TILE_SIZE)
+{
+	tileSize = std::max(1, tileSize);
+
+	std::vector<Tile> tiles;
+	tiles.reserve(std::size_t((width + tileSize - 1) / tileSize) * std::size_t((height + tileSize - 1) / tileSize));
+	for (int row = 0; row < height; row += tileSize)
+	{
+		for (int col = 0; col < width; col += tileSize)
+			tiles.push_back({ col, row, std::min(col + tileSize, width), std::min(row + tileSize, height) });
+	}
+	return tiles;
+}
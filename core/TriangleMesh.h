@@ -0,0 +1,358 @@
+#pragma once
+
+#include "BVH.h"
+#include "Geometry.h"
+
+#include "../math/AABB.h"
+#include "../math/Vec3.h"
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Indexed triangles sharing one vertex buffer, with their own BVH. Indices are stored on 16 bits
+// while every vertex fits, and widened to 32 bits the first time a triangle needs it. Texture
+// coordinates are stored per triangle corner, as OBJ files index them apart from positions, and
+// interpolated over hits; a mesh without any is mapped like a sphere, by the normal of the hit.
+// build() reorders the triangles in leaf order; the mesh is immutable afterwards and can be shared
+// between several TriangleMeshGeometry objects.
+template<typename T>
+class TriangleMesh
+{
+public:
+	void reserve(std::size_t vertexCount, std::size_t triangleCount);
+	std::uint32_t addVertex(const Point3<T>& position);
+	// Returns false, adding nothing, if an index is not a vertex of the mesh. cornerCoordinates, if
+	// given, holds the texture coordinates of a, b and c; triangles added without get (0, 0) once
+	// the mesh has any.
+	bool addTriangle(std::uint32_t a, std::uint32_t b, std::uint32_t c, const TextureCoordinates<T>* cornerCoordinates = nullptr);
+	// Drops the vertices and triangles past the given counts, e.g. to undo a failed load. Not once built.
+	void truncate(std::size_t vertexCount, std::size_t triangleCount);
+	void build(const BVHBuildSettings& settings = BVHBuildSettings{});
+
+	// Closest hit at or before tMax; lowers tMax and fills contact when one is found.
+	bool intersect(const Ray<T>& ray, T& tMax, Contact<T>& contact) const;
+	// Any hit at or before tMax, for shadow rays.
+	bool isHitBefore(const Ray<T>& ray, T tMax) const;
+
+	std::size_t getVertexCount() const { return m_vertices.size(); }
+	std::size_t getTriangleCount() const { return (m_compactIndices ? m_indices16.size() : m_indices32.size()) / 3; }
+	bool hasCompactIndices() const { return m_compactIndices; }
+	bool hasTextureCoordinates() const { return !m_coordinates.empty(); }
+	const AABB<T>& getBoundingBox() const { return m_bounds; }
+	std::size_t getMemoryFootprint() const;
+
+private:
+	std::uint32_t getIndex(std::size_t i) const { return m_compactIndices ? m_indices16[i] : m_indices32[i]; }
+	void widenIndices();
+
+	std::vector<Point3<T> > m_vertices;
+	std::vector<std::uint16_t> m_indices16;
+	std::vector<std::uint32_t> m_indices32;
+	bool m_compactIndices = true;
+	// Three per triangle when any triangle has them, empty otherwise.
+	std::vector<TextureCoordinates<T> > m_coordinates;
+	// Triangles added before the first one with coordinates, which truncating back to undoes them.
+	std::size_t m_untexturedTriangles = 0;
+
+	BVH<T> m_bvh;
+	AABB<T> m_bounds;
+};
+
+template<typename T>
+class TriangleMeshGeometry : public IGeometry<T>
+{
+public:
+	explicit TriangleMeshGeometry(std::shared_ptr<const TriangleMesh<T> > mesh) : m_mesh(std::move(mesh))
+	{}
+
+	virtual Contact<T> getIntersection(const Ray<T>& ray) const override
+	{
+		return getIntersectionBefore(ray, std::numeric_limits<T>::infinity());
+	}
+
+	virtual Contact<T> getIntersectionBefore(const Ray<T>& ray, T tMax) const override
+	{
+		Contact<T> contact = NO_CONTACT<T>();
+		m_mesh->intersect(ray, tMax, contact);
+		return contact;
+	}
+
+	virtual bool isHitBefore(const Ray<T>& ray, T tMax) const override { return m_mesh->isHitBefore(ray, tMax); }
+
+	virtual AABB<T> getBoundingBox() const override { return m_mesh->getBoundingBox(); }
+
+	const TriangleMesh<T>& getMesh() const { return *m_mesh; }
+
+private:
+	std::shared_ptr<const TriangleMesh<T> > m_mesh;
+};
+
+namespace detail
+{
+	// Per-ray constants of the watertight ray/triangle test (Woop, Benthin and Wald, JCGT 2013):
+	// the ray is sheared onto +z so that edge tests are exact for edges shared by two triangles.
+	template<typename T>
+	struct WatertightRay
+	{
+		explicit WatertightRay(const Ray<T>& ray) : origin(ray.origin)
+		{
+			const T ax = std::abs(ray.direction.x), ay = std::abs(ray.direction.y), az = std::abs(ray.direction.z);
+			kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+			kx = (kz + 1) % 3;
+			ky = (kx + 1) % 3;
+			// Keeps the winding of the sheared triangle.
+			if (ray.direction[kz] < T(0))
+				std::swap(kx, ky);
+
+			sx = ray.direction[kx] / ray.direction[kz];
+			sy = ray.direction[ky] / ray.direction[kz];
+			sz = T(1) / ray.direction[kz];
+		}
+
+		Point3<T> origin;
+		int kx, ky, kz;
+		T sx, sy, sz;
+	};
+
+	// Distance to the triangle if it is hit in (0, tMax], NO_INTERSECTION otherwise.
+	template<typename T>
+	T intersectWatertight(const WatertightRay<T>& ray, const Point3<T>& v0, const Point3<T>& v1, const Point3<T>& v2, T tMax)
+	{
+		const Vec3<T> a = v0 - ray.origin;
+		const Vec3<T> b = v1 - ray.origin;
+		const Vec3<T> c = v2 - ray.origin;
+
+		const T ax = a[ray.kx] - ray.sx * a[ray.kz], ay = a[ray.ky] - ray.sy * a[ray.kz];
+		const T bx = b[ray.kx] - ray.sx * b[ray.kz], by = b[ray.ky] - ray.sy * b[ray.kz];
+		const T cx = c[ray.kx] - ray.sx * c[ray.kz], cy = c[ray.ky] - ray.sy * c[ray.kz];
+
+		T u = cx * by - cy * bx;
+		T v = ax * cy - ay * cx;
+		T w = bx * ay - by * ax;
+
+		// An edge through the ray: decide in double so that neighbours agree on who owns it.
+		if (sizeof(T) < sizeof(double) && (u == T(0) || v == T(0) || w == T(0)))
+		{
+			u = T(double(cx) * double(by) - double(cy) * double(bx));
+			v = T(double(ax) * double(cy) - double(ay) * double(cx));
+			w = T(double(bx) * double(ay) - double(by) * double(ax));
+		}
+
+		if ((u < T(0) || v < T(0) || w < T(0)) && (u > T(0) || v > T(0) || w > T(0)))
+			return NO_INTERSECTION<T>();
+
+		const T det = u + v + w;
+		if (det == T(0))
+			return NO_INTERSECTION<T>();
+
+		const T t = u * (ray.sz * a[ray.kz]) + v * (ray.sz * b[ray.kz]) + w * (ray.sz * c[ray.kz]);
+		if (det < T(0) ? (t >= T(0) || t < tMax * det) : (t <= T(0) || t > tMax * det))
+			return NO_INTERSECTION<T>();
+
+		return t / det;
+	}
+}
+
+template<typename T>
+void TriangleMesh<T>::reserve(std::size_t vertexCount, std::size_t triangleCount)
+{
+	m_vertices.reserve(vertexCount);
+	if (m_compactIndices && vertexCount > std::size_t(std::numeric_limits<std::uint16_t>::max()) + 1)
+		widenIndices();
+
+	if (m_compactIndices)
+		m_indices16.reserve(3 * triangleCount);
+	else
+		m_indices32.reserve(3 * triangleCount);
+}
+
+template<typename T>
+std::uint32_t TriangleMesh<T>::addVertex(const Point3<T>& position)
+{
+	m_vertices.push_back(position);
+	return std::uint32_t(m_vertices.size() - 1);
+}
+
+template<typename T>
+bool TriangleMesh<T>::addTriangle(std::uint32_t a, std::uint32_t b, std::uint32_t c, const TextureCoordinates<T>* cornerCoordinates)
+{
+	if (std::size_t(std::max(a, std::max(b, c))) >= m_vertices.size())
+		return false;
+
+	if (cornerCoordinates != nullptr && m_coordinates.empty())
+	{
+		m_untexturedTriangles = getTriangleCount();
+		m_coordinates.assign(3 * m_untexturedTriangles, TextureCoordinates<T>{ 0., 0. });
+	}
+	if (!m_coordinates.empty())
+	{
+		for (int corner = 0; corner < 3; ++corner)
+			m_coordinates.push_back(cornerCoordinates != nullptr ? cornerCoordinates[corner] : TextureCoordinates<T>{ 0., 0. });
+	}
+
+	if (m_compactIndices && std::max(a, std::max(b, c)) > std::numeric_limits<std::uint16_t>::max())
+		widenIndices();
+
+	if (m_compactIndices)
+	{
+		m_indices16.push_back(std::uint16_t(a));
+		m_indices16.push_back(std::uint16_t(b));
+		m_indices16.push_back(std::uint16_t(c));
+	}
+	else
+	{
+		m_indices32.push_back(a);
+		m_indices32.push_back(b);
+		m_indices32.push_back(c);
+	}
+	return true;
+}
+
+template<typename T>
+void TriangleMesh<T>::truncate(std::size_t vertexCount, std::size_t triangleCount)
+{
+	if (vertexCount < m_vertices.size())
+		m_vertices.erase(m_vertices.begin() + std::ptrdiff_t(vertexCount), m_vertices.end());
+	if (triangleCount < getTriangleCount())
+	{
+		if (m_compactIndices)
+			m_indices16.resize(3 * triangleCount);
+		else
+			m_indices32.resize(3 * triangleCount);
+		// Coordinates go too if no triangle left had any of its own.
+		if (triangleCount <= m_untexturedTriangles)
+			m_coordinates.clear();
+		else if (!m_coordinates.empty())
+			m_coordinates.resize(3 * triangleCount);
+	}
+}
+
+template<typename T>
+void TriangleMesh<T>::widenIndices()
+{
+	m_indices32.reserve(std::max(m_indices16.capacity(), m_indices16.size()));
+	m_indices32.assign(m_indices16.begin(), m_indices16.end());
+	m_indices16 = std::vector<std::uint16_t>();
+	m_compactIndices = false;
+}
+
+template<typename T>
+void TriangleMesh<T>::build(const BVHBuildSettings& settings)
+{
+	const std::size_t triangleCount = getTriangleCount();
+
+	std::vector<AABB<T> > bounds;
+	bounds.reserve(triangleCount);
+	m_bounds = AABB<T>{};
+	for (std::size_t i = 0; i < triangleCount; ++i)
+	{
+		AABB<T> box;
+		for (int corner = 0; corner < 3; ++corner)
+			box = merge(box, m_vertices[getIndex(3 * i + corner)]);
+		bounds.push_back(box);
+		m_bounds = merge(m_bounds, box);
+	}
+	m_bvh.build(bounds, settings);
+
+	// Triangles follow the leaf order, so a leaf covers a contiguous run of them.
+	const auto& order = m_bvh.getPrimitiveIndices();
+	auto reorder = [&](auto& indices)
+	{
+		typename std::remove_reference<decltype(indices)>::type sorted;
+		sorted.reserve(indices.size());
+		for (std::uint32_t triangle : order)
+		{
+			for (int corner = 0; corner < 3; ++corner)
+				sorted.push_back(indices[3 * std::size_t(triangle) + corner]);
+		}
+		indices.swap(sorted);
+	};
+	if (m_compactIndices)
+		reorder(m_indices16);
+	else
+		reorder(m_indices32);
+	if (!m_coordinates.empty())
+		reorder(m_coordinates);
+}
+
+template<typename T>
+bool TriangleMesh<T>::intersect(const Ray<T>& ray, T& tMax, Contact<T>& contact) const
+{
+	constexpr std::size_t NO_TRIANGLE = std::numeric_limits<std::size_t>::max();
+	const detail::WatertightRay<T> sheared(ray);
+	std::size_t hitTriangle = NO_TRIANGLE;
+	T hitDistance = tMax;
+
+	m_bvh.traverseLeaves(ray, tMax, [&](std::uint32_t first, std::uint32_t count, T& leafTMax)
+	{
+		for (std::size_t triangle = first; triangle < std::size_t(first) + count; ++triangle)
+		{
+			T t = detail::intersectWatertight(sheared, m_vertices[getIndex(3 * triangle)], m_vertices[getIndex(3 * triangle + 1)],
+				m_vertices[getIndex(3 * triangle + 2)], leafTMax);
+			if (t != NO_INTERSECTION<T>() && (hitTriangle == NO_TRIANGLE || t < hitDistance))
+			{
+				leafTMax = hitDistance = t;
+				hitTriangle = triangle;
+			}
+		}
+	});
+
+	if (hitTriangle == NO_TRIANGLE)
+		return false;
+
+	const Point3<T>& v0 = m_vertices[getIndex(3 * hitTriangle)];
+	const Point3<T>& v1 = m_vertices[getIndex(3 * hitTriangle + 1)];
+	const Point3<T>& v2 = m_vertices[getIndex(3 * hitTriangle + 2)];
+
+	tMax = hitDistance;
+	const Point3<T> point = ray.getPointAtAbscice(hitDistance);
+	const Vec3<T> normal = ((v1 - v0) ^ (v2 - v0)).getNormalized();
+	TextureCoordinates<T> coordinates;
+	if (m_coordinates.empty())
+		coordinates = getSphericalCoordinates(normal);
+	else
+	{
+		// Barycentric weights of the hit, from the areas of the sub-triangles facing each corner.
+		const Vec3<T> e1 = v1 - v0, e2 = v2 - v0, p = point - v0;
+		const Vec3<T> n = e1 ^ e2;
+		const T area = n * n;
+		const T w1 = area != T(0) ? ((p ^ e2) * n) / area : T(0);
+		const T w2 = area != T(0) ? ((e1 ^ p) * n) / area : T(0);
+		const TextureCoordinates<T>* corners = &m_coordinates[3 * hitTriangle];
+		coordinates = { (T(1) - w1 - w2) * corners[0].u + w1 * corners[1].u + w2 * corners[2].u,
+			(T(1) - w1 - w2) * corners[0].v + w1 * corners[1].v + w2 * corners[2].v };
+	}
+	contact = { hitDistance, point, normal, coordinates };
+	return true;
+}
+
+template<typename T>
+bool TriangleMesh<T>::isHitBefore(const Ray<T>& ray, T tMax) const
+{
+	const detail::WatertightRay<T> sheared(ray);
+	ShadowRays<T> rays(ray.origin);
+	rays.add(ray.direction, tMax);
+
+	return m_bvh.traverseBatchLeaves(rays, 1, [&](std::uint32_t first, std::uint32_t count, std::uint32_t)
+	{
+		for (std::size_t triangle = first; triangle < std::size_t(first) + count; ++triangle)
+		{
+			if (detail::intersectWatertight(sheared, m_vertices[getIndex(3 * triangle)], m_vertices[getIndex(3 * triangle + 1)],
+				m_vertices[getIndex(3 * triangle + 2)], tMax) != NO_INTERSECTION<T>())
+				return std::uint32_t(1);
+		}
+		return std::uint32_t(0);
+	}) == 0;
+}
+
+template<typename T>
+std::size_t TriangleMesh<T>::getMemoryFootprint() const
+{
+	return m_vertices.capacity() * sizeof(Point3<T>) + m_indices16.capacity() * sizeof(std::uint16_t)
+		+ m_indices32.capacity() * sizeof(std::uint32_t) + m_coordinates.capacity() * sizeof(TextureCoordinates<T>) + m_bvh.getMemoryFootprint();
+}
@@ -18,6 +18,9 @@ public:
 	Color<T>& operator()(int col, int row) { return m_pixels[col + row * m_width]; }
 	const Color<T>& operator()(int col, int row) const { return m_pixels[col + row * m_width]; }
 
+	// Row-major, m_width pixels per row.
+	const Color<T>* getPixels() const { return m_pixels.data(); }
+
 private:
 	int m_width;
 	int m_height;
@@ -35,7 +38,7 @@ std::tuple<T, T> getMinMaxOnViewport(const Viewport<T>& viewport)
         {
             const Color<T>& c = viewport(col, row);
             min = std::min(min, std::min(c.r, std::min(c.g, c.b)));
-            max = std::max(max, std::max(c.r, std::min(c.g, c.b)));
+            max = std::max(max, std::max(c.r, std::max(c.g, c.b)));
         }
     }
     return { min, max };
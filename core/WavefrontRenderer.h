@@ -0,0 +1,218 @@
+#pragma once
+
+#include "Camera.h"
+#include "RenderStats.h"
+#include "Scene.h"
+#include "ThreadPool.h"
+#include "Viewport.h"
+
+#include "../math/RayPacket.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+struct WavefrontSettings
+{
+	// Primary rays traced per wave; all their bounces are traced before the next wave starts, so
+	// this bounds the memory of the queues.
+	std::size_t waveSize = std::size_t(1) << 18;
+	// Rays per pool task in each stage.
+	std::size_t chunkSize = 4096;
+	// Bounced rays are reordered by direction octant, then by origin along a Morton curve, so that
+	// rays next to each other in a queue visit the same nodes.
+	bool sortRays = true;
+};
+
+// Rays traced and time spent per bounce by the last render, the primary rays at index 0. The time
+// of a bounce includes sorting the rays it spawns.
+struct WavefrontStats
+{
+	std::vector<std::size_t> rays;
+	std::vector<double> seconds;
+};
+
+// Traces primary rays and their reflection and transmission bounces breadth-first. Each bounce of
+// a wave is a queue: the closest hits of the whole queue are found, then the hits are shaded and
+// spawn the next queue, each stage a pass over the pool. The image matches Scene::render up to
+// rounding, as contributions reach the pixels one bounce at a time instead of recursively.
+template<typename T>
+class WavefrontRenderer
+{
+public:
+	explicit WavefrontRenderer(const WavefrontSettings& settings = WavefrontSettings{}) : m_settings(settings)
+	{}
+
+	// Compiles the scene first if needed.
+	void render(Scene<T>& scene, const Camera<T>& camera, Viewport<T>& viewport, ThreadPool& pool);
+
+	const WavefrontStats& getStats() const { return m_stats; }
+
+private:
+	struct QueuedRay
+	{
+		Ray<T> ray;
+		// Share of the pixel the ray's colour is worth.
+		T weight;
+		std::uint32_t pixel;
+	};
+
+	// Traces the queue at the given bounce into the viewport, leaving the rays it spawns in m_next.
+	void traceQueue(const Scene<T>& scene, T pixelSpread, Viewport<T>& viewport, ThreadPool& pool, int bounce);
+	void sortQueue();
+
+	WavefrontSettings m_settings;
+	WavefrontStats m_stats;
+	std::vector<QueuedRay> m_queue;
+	std::vector<QueuedRay> m_next;
+	std::vector<SurfaceHit<T> > m_hits;
+	std::vector<Color<T> > m_colors;
+	// Rays spawned by each chunk, gathered in chunk order so that the queues do not depend on the
+	// thread schedule.
+	std::vector<std::vector<QueuedRay> > m_spawned;
+	std::vector<std::uint64_t> m_keys;
+};
+
+template<typename T>
+void WavefrontRenderer<T>::render(Scene<T>& scene, const Camera<T>& camera, Viewport<T>& viewport, ThreadPool& pool)
+{
+	if (!scene.isCompiled())
+		scene.compile();
+	const PreparedCamera<T> prepared = camera.prepare(viewport);
+
+	m_stats.rays.assign(1, 0);
+	m_stats.seconds.assign(1, 0.);
+	const int width = viewport.getWidth();
+	const std::size_t pixelCount = std::size_t(width) * std::size_t(viewport.getHeight());
+	const std::size_t waveSize = std::max<std::size_t>(1, m_settings.waveSize);
+	RayPacket<T> rays;
+	for (std::size_t first = 0; first < pixelCount; first += waveSize)
+	{
+		const std::size_t end = std::min(pixelCount, first + waveSize);
+		m_queue.clear();
+		{
+			RAYTRACER_STAT_TIMER(CameraSetup);
+			for (std::size_t pixel = first; pixel < end;)
+			{
+				const int row = int(pixel / std::size_t(width));
+				const int colBegin = int(pixel % std::size_t(width));
+				const int colEnd = int(std::min<std::size_t>(std::size_t(width), colBegin + (end - pixel)));
+				rays.resize(std::size_t(colEnd - colBegin));
+				prepared.generateRow(row, colBegin, colEnd, rays);
+				for (int col = colBegin; col < colEnd; ++col)
+					m_queue.push_back(QueuedRay{ rays.get(std::size_t(col - colBegin)), T(1), std::uint32_t(pixel + std::size_t(col - colBegin)) });
+				pixel += std::size_t(colEnd - colBegin);
+			}
+		}
+
+		for (int bounce = 0; !m_queue.empty(); ++bounce)
+		{
+			if (std::size_t(bounce) >= m_stats.rays.size())
+			{
+				m_stats.rays.push_back(0);
+				m_stats.seconds.push_back(0.);
+			}
+			const auto start = std::chrono::steady_clock::now();
+			m_stats.rays[bounce] += m_queue.size();
+			traceQueue(scene, prepared.getPixelSpread(), viewport, pool, bounce);
+			m_queue.swap(m_next);
+			if (m_settings.sortRays && m_queue.size() > 1)
+				sortQueue();
+			m_stats.seconds[bounce] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+	}
+}
+
+template<typename T>
+void WavefrontRenderer<T>::traceQueue(const Scene<T>& scene, T pixelSpread, Viewport<T>& viewport, ThreadPool& pool, int bounce)
+{
+	const std::size_t count = m_queue.size();
+	const std::size_t chunkSize = std::max<std::size_t>(1, m_settings.chunkSize);
+	const std::size_t chunkCount = (count + chunkSize - 1) / chunkSize;
+	m_hits.resize(count, SurfaceHit<T>{ NO_CONTACT<T>(), NO_OBJECT, 0 });
+	m_colors.resize(count);
+	if (m_spawned.size() < chunkCount)
+		m_spawned.resize(chunkCount);
+
+	pool.run(chunkCount, [&](std::size_t chunk, unsigned)
+	{
+		const std::size_t end = std::min(count, (chunk + 1) * chunkSize);
+		for (std::size_t i = chunk * chunkSize; i < end; ++i)
+			scene.findClosestHit(m_queue[i].ray, m_hits[i]);
+	});
+
+	pool.run(chunkCount, [&](std::size_t chunk, unsigned)
+	{
+		RAYTRACER_STAT_TIMER(Shade);
+		std::vector<QueuedRay>& spawned = m_spawned[chunk];
+		spawned.clear();
+		const std::size_t end = std::min(count, (chunk + 1) * chunkSize);
+		for (std::size_t i = chunk * chunkSize; i < end; ++i)
+		{
+			const QueuedRay& queued = m_queue[i];
+			if (m_hits[i].objectIndex == NO_OBJECT)
+			{
+				m_colors[i] = queued.weight * NO_INTERSECTION_COLOR<T>();
+				continue;
+			}
+			const T ownWeight = scene.spawnSecondaryRays(queued.ray, m_hits[i], bounce, [&](const Ray<T>& ray, T weight)
+			{
+				spawned.push_back(QueuedRay{ ray, queued.weight * weight, queued.pixel });
+			});
+			m_colors[i] = (queued.weight * ownWeight) * scene.shadeHit(m_hits[i], pixelSpread);
+		}
+	});
+
+	// Rays of one pixel are added in queue order, which keeps the image deterministic.
+	const int width = viewport.getWidth();
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		const std::uint32_t pixel = m_queue[i].pixel;
+		Color<T>& target = viewport(int(pixel % std::uint32_t(width)), int(pixel / std::uint32_t(width)));
+		target = bounce == 0 ? m_colors[i] : target + m_colors[i];
+	}
+
+	m_next.clear();
+	for (std::size_t chunk = 0; chunk < chunkCount; ++chunk)
+		m_next.insert(m_next.end(), m_spawned[chunk].begin(), m_spawned[chunk].end());
+}
+
+template<typename T>
+void WavefrontRenderer<T>::sortQueue()
+{
+	RAYTRACER_STAT_TIMER(RaySort);
+	AABB<T> bounds;
+	for (const QueuedRay& queued : m_queue)
+		bounds = merge(bounds, queued.ray.origin);
+	const Vec3<T> extent = bounds.max - bounds.min;
+	const T scale[3] = { extent.x > T(0) ? T(511.99) / extent.x : T(0), extent.y > T(0) ? T(511.99) / extent.y : T(0),
+		extent.z > T(0) ? T(511.99) / extent.z : T(0) };
+
+	// Direction octant above 9 bits of Morton code per axis, above the index in the queue.
+	auto spread = [](std::uint32_t v)
+	{
+		v = (v | (v << 16)) & 0x030000FFu;
+		v = (v | (v << 8)) & 0x0300F00Fu;
+		v = (v | (v << 4)) & 0x030C30C3u;
+		v = (v | (v << 2)) & 0x09249249u;
+		return v;
+	};
+	m_keys.resize(m_queue.size());
+	for (std::size_t i = 0; i < m_queue.size(); ++i)
+	{
+		const Ray<T>& ray = m_queue[i].ray;
+		const std::uint32_t octant = (ray.direction.x < T(0) ? 1u : 0u) | (ray.direction.y < T(0) ? 2u : 0u) | (ray.direction.z < T(0) ? 4u : 0u);
+		const std::uint32_t x = std::uint32_t((ray.origin.x - bounds.min.x) * scale[0]);
+		const std::uint32_t y = std::uint32_t((ray.origin.y - bounds.min.y) * scale[1]);
+		const std::uint32_t z = std::uint32_t((ray.origin.z - bounds.min.z) * scale[2]);
+		const std::uint32_t key = octant << 27 | spread(x) << 2 | spread(y) << 1 | spread(z);
+		m_keys[i] = std::uint64_t(key) << 32 | std::uint64_t(i);
+	}
+	std::sort(m_keys.begin(), m_keys.end());
+
+	m_next.resize(m_queue.size(), m_queue.front());
+	for (std::size_t i = 0; i < m_keys.size(); ++i)
+		m_next[i] = m_queue[std::uint32_t(m_keys[i])];
+	m_queue.swap(m_next);
+}
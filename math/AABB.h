@@ -0,0 +1,83 @@
+#pragma once
+
+#include "Vec3.h"
+
+#include <algorithm>
+#include <limits>
+
+template<typename T>
+struct AABB
+{
+	AABB() :
+		min(std::numeric_limits<T>::infinity(), std::numeric_limits<T>::infinity(), std::numeric_limits<T>::infinity()),
+		max(-std::numeric_limits<T>::infinity(), -std::numeric_limits<T>::infinity(), -std::numeric_limits<T>::infinity())
+	{}
+
+	AABB(const Point3<T>& min_, const Point3<T>& max_) : min(min_), max(max_) {}
+
+	bool isEmpty() const { return min.x > max.x || min.y > max.y || min.z > max.z; }
+
+	Point3<T> getCentroid() const { return T(0.5) * (min + max); }
+
+	T getSurfaceArea() const
+	{
+		if (isEmpty())
+			return T(0);
+
+		Vec3<T> d = max - min;
+		return T(2) * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+
+	int getLargestAxis() const
+	{
+		Vec3<T> d = max - min;
+		if (d.x >= d.y && d.x >= d.z)
+			return 0;
+		return d.y >= d.z ? 1 : 2;
+	}
+
+	Point3<T> min;
+	Point3<T> max;
+};
+
+template<typename T>
+AABB<T> merge(const AABB<T>& box, const Point3<T>& p)
+{
+	return {
+		{ std::min(box.min.x, p.x), std::min(box.min.y, p.y), std::min(box.min.z, p.z) },
+		{ std::max(box.max.x, p.x), std::max(box.max.y, p.y), std::max(box.max.z, p.z) }
+	};
+}
+
+template<typename T>
+AABB<T> merge(const AABB<T>& box1, const AABB<T>& box2)
+{
+	return {
+		{ std::min(box1.min.x, box2.min.x), std::min(box1.min.y, box2.min.y), std::min(box1.min.z, box2.min.z) },
+		{ std::max(box1.max.x, box2.max.x), std::max(box1.max.y, box2.max.y), std::max(box1.max.z, box2.max.z) }
+	};
+}
+
+// Slab test against a ray given by its origin and the component-wise inverse of its direction.
+// The test is inclusive on both ends so that boxes touching tMax are not culled.
+template<typename T>
+bool intersect(const AABB<T>& box, const Point3<T>& origin, const Vec3<T>& invDirection, T tMin, T tMax)
+{
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		T t0 = (box.min[axis] - origin[axis]) * invDirection[axis];
+		T t1 = (box.max[axis] - origin[axis]) * invDirection[axis];
+		if (t0 > t1)
+			std::swap(t0, t1);
+		// Widens the exit by the rounding of the two operations above (Ize, JCGT 2013), so that
+		// flat boxes and primitives lying on a box face are never culled.
+		t1 *= T(1) + T(4) * std::numeric_limits<T>::epsilon();
+
+		// Written so that a NaN (origin on a slab plane with a zero direction component) keeps the current bounds.
+		tMin = t0 > tMin ? t0 : tMin;
+		tMax = t1 < tMax ? t1 : tMax;
+		if (tMin > tMax)
+			return false;
+	}
+	return true;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "Simd.h"
+
+#include <algorithm>
+#include <cstddef>
+
+namespace detail
+{
+	template<typename T>
+	void findMinMaxScalar(const T* values, std::size_t count, T& min, T& max)
+	{
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			min = std::min(min, values[i]);
+			max = std::max(max, values[i]);
+		}
+	}
+
+#if RAYTRACER_SIMD_X86
+#if defined(__GNUC__) && !defined(__clang__)
+	// Same false positives as the sphere kernels: vector ABI notes and _mm512_undefined_*.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#endif
+	template<typename Ops, typename T>
+	void findMinMaxWide(const T* values, std::size_t count, T& min, T& max)
+	{
+		constexpr int W = Ops::WIDTH;
+
+		// Two accumulators per bound hide the latency of min/max.
+		auto min0 = Ops::set1(min), min1 = min0;
+		auto max0 = Ops::set1(max), max1 = max0;
+		std::size_t i = 0;
+		for (; i + 2 * W <= count; i += 2 * W)
+		{
+			auto a = Ops::load(values + i);
+			auto b = Ops::load(values + i + W);
+			min0 = Ops::min(min0, a);
+			min1 = Ops::min(min1, b);
+			max0 = Ops::max(max0, a);
+			max1 = Ops::max(max1, b);
+		}
+
+		T lanes[2][W];
+		Ops::store(lanes[0], Ops::min(min0, min1));
+		Ops::store(lanes[1], Ops::max(max0, max1));
+		for (int lane = 0; lane < W; ++lane)
+		{
+			min = std::min(min, lanes[0][lane]);
+			max = std::max(max, lanes[1][lane]);
+		}
+		findMinMaxScalar(values + i, count - i, min, max);
+	}
+
+	template<typename T>
+	void findMinMaxSSE(const T* values, std::size_t count, T& min, T& max)
+	{
+		findMinMaxWide<SimdOps<T, SimdIsa::SSE> >(values, count, min, max);
+	}
+
+	template<typename T>
+	RAYTRACER_KERNEL_AVX2 void findMinMaxAVX2(const T* values, std::size_t count, T& min, T& max)
+	{
+		findMinMaxWide<SimdOps<T, SimdIsa::AVX2> >(values, count, min, max);
+	}
+
+	template<typename T>
+	RAYTRACER_KERNEL_AVX512 void findMinMaxAVX512(const T* values, std::size_t count, T& min, T& max)
+	{
+		findMinMaxWide<SimdOps<T, SimdIsa::AVX512> >(values, count, min, max);
+	}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+}
+
+// Widens [min, max] to cover values[0, count).
+template<typename T>
+void findMinMax(const T* values, std::size_t count, T& min, T& max, SimdIsa isa)
+{
+#if RAYTRACER_SIMD_X86
+	switch (isa)
+	{
+	case SimdIsa::SSE:
+		detail::findMinMaxSSE(values, count, min, max);
+		return;
+	case SimdIsa::AVX2:
+		detail::findMinMaxAVX2(values, count, min, max);
+		return;
+	case SimdIsa::AVX512:
+		detail::findMinMaxAVX512(values, count, min, max);
+		return;
+	default:
+		break;
+	}
+#endif
+	(void)isa;
+	detail::findMinMaxScalar(values, count, min, max);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "Vec3.h"
+
+#include <cstdint>
+#include <vector>
+
+// Rays stored structure-of-arrays, as produced by PreparedCamera and consumed by the packet kernels.
+template<typename T>
+struct RayPacket
+{
+	void resize(std::size_t count)
+	{
+		originX.resize(count); originY.resize(count); originZ.resize(count);
+		directionX.resize(count); directionY.resize(count); directionZ.resize(count);
+	}
+
+	void set(std::size_t i, const Ray<T>& ray)
+	{
+		originX[i] = ray.origin.x; originY[i] = ray.origin.y; originZ[i] = ray.origin.z;
+		directionX[i] = ray.direction.x; directionY[i] = ray.direction.y; directionZ[i] = ray.direction.z;
+	}
+
+	Ray<T> get(std::size_t i) const
+	{
+		return Ray<T>{ { originX[i], originY[i], originZ[i] }, { directionX[i], directionY[i], directionZ[i] } };
+	}
+
+	std::size_t size() const { return originX.size(); }
+
+	std::vector<T> originX, originY, originZ;
+	std::vector<T> directionX, directionY, directionZ;
+};
+
+// Rays leaving one point towards several targets, such as shadow rays towards the lights, traced
+// as a batch. Bit i of a ray mask stands for the i-th ray added.
+template<typename T>
+struct ShadowRays
+{
+	enum { CAPACITY = 32 };
+
+	explicit ShadowRays(const Point3<T>& origin_) : origin(origin_)
+	{}
+
+	void add(const Vec3<T>& direction, T maxDistance_)
+	{
+		directionX[count] = direction.x; directionY[count] = direction.y; directionZ[count] = direction.z;
+		maxDistance[count] = maxDistance_;
+		++count;
+	}
+
+	Ray<T> get(std::size_t i) const { return Ray<T>{ origin, { directionX[i], directionY[i], directionZ[i] } }; }
+	std::uint32_t getFullMask() const { return count == CAPACITY ? ~std::uint32_t(0) : (std::uint32_t(1) << count) - 1; }
+
+	Point3<T> origin;
+	T directionX[CAPACITY], directionY[CAPACITY], directionZ[CAPACITY];
+	// Only blockers at or before this distance count.
+	T maxDistance[CAPACITY];
+	std::size_t count = 0;
+};
@@ -0,0 +1,285 @@
+#pragma once
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RAYTRACER_SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#else
+#define RAYTRACER_SIMD_X86 0
+#endif
+
+// GCC and Clang only emit AVX2/AVX-512 code inside functions that request it; MSVC always can.
+#if RAYTRACER_SIMD_X86 && (defined(__GNUC__) || defined(__clang__))
+#define RAYTRACER_TARGET_AVX2 __attribute__((target("avx2")))
+#define RAYTRACER_TARGET_AVX512 __attribute__((target("avx512f")))
+// Kernel entry points: everything they call is inlined so the generic kernel body picks up the ISA.
+// AVX-512 implies FMA; contraction is disabled so results stay bit-identical to the scalar path.
+#define RAYTRACER_KERNEL_AVX2 __attribute__((target("avx2"), flatten))
+#define RAYTRACER_KERNEL_AVX512 __attribute__((target("avx512f"), flatten, optimize("fp-contract=off")))
+#else
+#define RAYTRACER_TARGET_AVX2
+#define RAYTRACER_TARGET_AVX512
+#define RAYTRACER_KERNEL_AVX2
+#define RAYTRACER_KERNEL_AVX512
+#endif
+
+enum class SimdIsa
+{
+	Scalar,
+	SSE,
+	AVX2,
+	AVX512
+};
+
+inline const char* getSimdIsaName(SimdIsa isa)
+{
+	switch (isa)
+	{
+	case SimdIsa::SSE: return "sse";
+	case SimdIsa::AVX2: return "avx2";
+	case SimdIsa::AVX512: return "avx512";
+	default: return "scalar";
+	}
+}
+
+inline bool isSimdIsaSupported(SimdIsa isa)
+{
+#if RAYTRACER_SIMD_X86
+	switch (isa)
+	{
+	case SimdIsa::Scalar:
+	case SimdIsa::SSE:
+		return true;
+#if defined(_MSC_VER) && !defined(__clang__)
+	case SimdIsa::AVX2:
+	case SimdIsa::AVX512:
+	{
+		int info[4];
+		__cpuid(info, 1);
+		bool osxsave = (info[2] & (1 << 27)) != 0;
+		bool avx = (info[2] & (1 << 28)) != 0;
+		if (!osxsave || !avx)
+			return false;
+
+		unsigned long long xcr0 = _xgetbv(0);
+		if ((xcr0 & 0x6) != 0x6)
+			return false;
+
+		__cpuidex(info, 7, 0);
+		if (isa == SimdIsa::AVX2)
+			return (info[1] & (1 << 5)) != 0;
+
+		return (info[1] & (1 << 16)) != 0 && (xcr0 & 0xe0) == 0xe0;
+	}
+#elif !defined(__OPTIMIZE__)
+	// Unoptimized builds do not inline into the kernel entry points, so the generic kernel bodies
+	// would be compiled without the ISA and pass vectors across the boundary with the wrong ABI.
+	case SimdIsa::AVX2:
+	case SimdIsa::AVX512:
+		return false;
+#else
+	case SimdIsa::AVX2:
+		return __builtin_cpu_supports("avx2");
+	case SimdIsa::AVX512:
+		return __builtin_cpu_supports("avx512f");
+#endif
+	}
+	return false;
+#else
+	return isa == SimdIsa::Scalar;
+#endif
+}
+
+inline int countTrailingZeros(unsigned bits)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+	unsigned long index;
+	_BitScanForward(&index, bits);
+	return int(index);
+#elif defined(__GNUC__) || defined(__clang__)
+	return __builtin_ctz(bits);
+#else
+	int index = 0;
+	while ((bits & 1u) == 0)
+	{
+		bits >>= 1;
+		++index;
+	}
+	return index;
+#endif
+}
+
+inline SimdIsa detectSimdIsa()
+{
+	static const SimdIsa detected = []
+	{
+		if (isSimdIsaSupported(SimdIsa::AVX512))
+			return SimdIsa::AVX512;
+		if (isSimdIsaSupported(SimdIsa::AVX2))
+			return SimdIsa::AVX2;
+		if (isSimdIsaSupported(SimdIsa::SSE))
+			return SimdIsa::SSE;
+		return SimdIsa::Scalar;
+	}();
+	return detected;
+}
+
+#if RAYTRACER_SIMD_X86
+
+// Thin wrappers giving every ISA/precision pair the same vocabulary, so kernels are written once.
+template<typename T, SimdIsa Isa>
+struct SimdOps;
+
+template<>
+struct SimdOps<float, SimdIsa::SSE>
+{
+	using V = __m128;
+	using Mask = __m128;
+	static constexpr int WIDTH = 4;
+
+	static V set1(float a) { return _mm_set1_ps(a); }
+	static V load(const float* p) { return _mm_loadu_ps(p); }
+	static void store(float* p, V a) { _mm_storeu_ps(p, a); }
+	static V add(V a, V b) { return _mm_add_ps(a, b); }
+	static V sub(V a, V b) { return _mm_sub_ps(a, b); }
+	static V mul(V a, V b) { return _mm_mul_ps(a, b); }
+	static V div(V a, V b) { return _mm_div_ps(a, b); }
+	static V sqrt(V a) { return _mm_sqrt_ps(a); }
+	static V min(V a, V b) { return _mm_min_ps(a, b); }
+	static V max(V a, V b) { return _mm_max_ps(a, b); }
+	static V neg(V a) { return _mm_xor_ps(a, _mm_set1_ps(-0.f)); }
+	static Mask greaterEqual(V a, V b) { return _mm_cmpge_ps(a, b); }
+	static Mask lessEqual(V a, V b) { return _mm_cmple_ps(a, b); }
+	static Mask maskAnd(Mask a, Mask b) { return _mm_and_ps(a, b); }
+	static V select(Mask m, V a, V b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+	static unsigned toBits(Mask m) { return unsigned(_mm_movemask_ps(m)); }
+};
+
+template<>
+struct SimdOps<double, SimdIsa::SSE>
+{
+	using V = __m128d;
+	using Mask = __m128d;
+	static constexpr int WIDTH = 2;
+
+	static V set1(double a) { return _mm_set1_pd(a); }
+	static V load(const double* p) { return _mm_loadu_pd(p); }
+	static void store(double* p, V a) { _mm_storeu_pd(p, a); }
+	static V add(V a, V b) { return _mm_add_pd(a, b); }
+	static V sub(V a, V b) { return _mm_sub_pd(a, b); }
+	static V mul(V a, V b) { return _mm_mul_pd(a, b); }
+	static V div(V a, V b) { return _mm_div_pd(a, b); }
+	static V sqrt(V a) { return _mm_sqrt_pd(a); }
+	static V min(V a, V b) { return _mm_min_pd(a, b); }
+	static V max(V a, V b) { return _mm_max_pd(a, b); }
+	static V neg(V a) { return _mm_xor_pd(a, _mm_set1_pd(-0.)); }
+	static Mask greaterEqual(V a, V b) { return _mm_cmpge_pd(a, b); }
+	static Mask lessEqual(V a, V b) { return _mm_cmple_pd(a, b); }
+	static Mask maskAnd(Mask a, Mask b) { return _mm_and_pd(a, b); }
+	static V select(Mask m, V a, V b) { return _mm_or_pd(_mm_and_pd(m, a), _mm_andnot_pd(m, b)); }
+	static unsigned toBits(Mask m) { return unsigned(_mm_movemask_pd(m)); }
+};
+
+template<>
+struct SimdOps<float, SimdIsa::AVX2>
+{
+	using V = __m256;
+	using Mask = __m256;
+	static constexpr int WIDTH = 8;
+
+	RAYTRACER_TARGET_AVX2 static V set1(float a) { return _mm256_set1_ps(a); }
+	RAYTRACER_TARGET_AVX2 static V load(const float* p) { return _mm256_loadu_ps(p); }
+	RAYTRACER_TARGET_AVX2 static void store(float* p, V a) { _mm256_storeu_ps(p, a); }
+	RAYTRACER_TARGET_AVX2 static V add(V a, V b) { return _mm256_add_ps(a, b); }
+	RAYTRACER_TARGET_AVX2 static V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+	RAYTRACER_TARGET_AVX2 static V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+	RAYTRACER_TARGET_AVX2 static V div(V a, V b) { return _mm256_div_ps(a, b); }
+	RAYTRACER_TARGET_AVX2 static V sqrt(V a) { return _mm256_sqrt_ps(a); }
+	RAYTRACER_TARGET_AVX2 static V min(V a, V b) { return _mm256_min_ps(a, b); }
+	RAYTRACER_TARGET_AVX2 static V max(V a, V b) { return _mm256_max_ps(a, b); }
+	RAYTRACER_TARGET_AVX2 static V neg(V a) { return _mm256_xor_ps(a, _mm256_set1_ps(-0.f)); }
+	RAYTRACER_TARGET_AVX2 static Mask greaterEqual(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+	RAYTRACER_TARGET_AVX2 static Mask lessEqual(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+	RAYTRACER_TARGET_AVX2 static Mask maskAnd(Mask a, Mask b) { return _mm256_and_ps(a, b); }
+	RAYTRACER_TARGET_AVX2 static V select(Mask m, V a, V b) { return _mm256_blendv_ps(b, a, m); }
+	RAYTRACER_TARGET_AVX2 static unsigned toBits(Mask m) { return unsigned(_mm256_movemask_ps(m)); }
+};
+
+template<>
+struct SimdOps<double, SimdIsa::AVX2>
+{
+	using V = __m256d;
+	using Mask = __m256d;
+	static constexpr int WIDTH = 4;
+
+	RAYTRACER_TARGET_AVX2 static V set1(double a) { return _mm256_set1_pd(a); }
+	RAYTRACER_TARGET_AVX2 static V load(const double* p) { return _mm256_loadu_pd(p); }
+	RAYTRACER_TARGET_AVX2 static void store(double* p, V a) { _mm256_storeu_pd(p, a); }
+	RAYTRACER_TARGET_AVX2 static V add(V a, V b) { return _mm256_add_pd(a, b); }
+	RAYTRACER_TARGET_AVX2 static V sub(V a, V b) { return _mm256_sub_pd(a, b); }
+	RAYTRACER_TARGET_AVX2 static V mul(V a, V b) { return _mm256_mul_pd(a, b); }
+	RAYTRACER_TARGET_AVX2 static V div(V a, V b) { return _mm256_div_pd(a, b); }
+	RAYTRACER_TARGET_AVX2 static V sqrt(V a) { return _mm256_sqrt_pd(a); }
+	RAYTRACER_TARGET_AVX2 static V min(V a, V b) { return _mm256_min_pd(a, b); }
+	RAYTRACER_TARGET_AVX2 static V max(V a, V b) { return _mm256_max_pd(a, b); }
+	RAYTRACER_TARGET_AVX2 static V neg(V a) { return _mm256_xor_pd(a, _mm256_set1_pd(-0.)); }
+	RAYTRACER_TARGET_AVX2 static Mask greaterEqual(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_GE_OQ); }
+	RAYTRACER_TARGET_AVX2 static Mask lessEqual(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_LE_OQ); }
+	RAYTRACER_TARGET_AVX2 static Mask maskAnd(Mask a, Mask b) { return _mm256_and_pd(a, b); }
+	RAYTRACER_TARGET_AVX2 static V select(Mask m, V a, V b) { return _mm256_blendv_pd(b, a, m); }
+	RAYTRACER_TARGET_AVX2 static unsigned toBits(Mask m) { return unsigned(_mm256_movemask_pd(m)); }
+};
+
+template<>
+struct SimdOps<float, SimdIsa::AVX512>
+{
+	using V = __m512;
+	using Mask = __mmask16;
+	static constexpr int WIDTH = 16;
+
+	RAYTRACER_TARGET_AVX512 static V set1(float a) { return _mm512_set1_ps(a); }
+	RAYTRACER_TARGET_AVX512 static V load(const float* p) { return _mm512_loadu_ps(p); }
+	RAYTRACER_TARGET_AVX512 static void store(float* p, V a) { _mm512_storeu_ps(p, a); }
+	RAYTRACER_TARGET_AVX512 static V add(V a, V b) { return _mm512_add_ps(a, b); }
+	RAYTRACER_TARGET_AVX512 static V sub(V a, V b) { return _mm512_sub_ps(a, b); }
+	RAYTRACER_TARGET_AVX512 static V mul(V a, V b) { return _mm512_mul_ps(a, b); }
+	RAYTRACER_TARGET_AVX512 static V div(V a, V b) { return _mm512_div_ps(a, b); }
+	RAYTRACER_TARGET_AVX512 static V sqrt(V a) { return _mm512_sqrt_ps(a); }
+	RAYTRACER_TARGET_AVX512 static V min(V a, V b) { return _mm512_min_ps(a, b); }
+	RAYTRACER_TARGET_AVX512 static V max(V a, V b) { return _mm512_max_ps(a, b); }
+	RAYTRACER_TARGET_AVX512 static V neg(V a) { return _mm512_sub_ps(_mm512_set1_ps(-0.f), a); }
+	RAYTRACER_TARGET_AVX512 static Mask greaterEqual(V a, V b) { return _mm512_cmp_ps_mask(a, b, _CMP_GE_OQ); }
+	RAYTRACER_TARGET_AVX512 static Mask lessEqual(V a, V b) { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+	RAYTRACER_TARGET_AVX512 static Mask maskAnd(Mask a, Mask b) { return Mask(a & b); }
+	RAYTRACER_TARGET_AVX512 static V select(Mask m, V a, V b) { return _mm512_mask_blend_ps(m, b, a); }
+	RAYTRACER_TARGET_AVX512 static unsigned toBits(Mask m) { return unsigned(m); }
+};
+
+template<>
+struct SimdOps<double, SimdIsa::AVX512>
+{
+	using V = __m512d;
+	using Mask = __mmask8;
+	static constexpr int WIDTH = 8;
+
+	RAYTRACER_TARGET_AVX512 static V set1(double a) { return _mm512_set1_pd(a); }
+	RAYTRACER_TARGET_AVX512 static V load(const double* p) { return _mm512_loadu_pd(p); }
+	RAYTRACER_TARGET_AVX512 static void store(double* p, V a) { _mm512_storeu_pd(p, a); }
+	RAYTRACER_TARGET_AVX512 static V add(V a, V b) { return _mm512_add_pd(a, b); }
+	RAYTRACER_TARGET_AVX512 static V sub(V a, V b) { return _mm512_sub_pd(a, b); }
+	RAYTRACER_TARGET_AVX512 static V mul(V a, V b) { return _mm512_mul_pd(a, b); }
+	RAYTRACER_TARGET_AVX512 static V div(V a, V b) { return _mm512_div_pd(a, b); }
+	RAYTRACER_TARGET_AVX512 static V sqrt(V a) { return _mm512_sqrt_pd(a); }
+	RAYTRACER_TARGET_AVX512 static V min(V a, V b) { return _mm512_min_pd(a, b); }
+	RAYTRACER_TARGET_AVX512 static V max(V a, V b) { return _mm512_max_pd(a, b); }
+	RAYTRACER_TARGET_AVX512 static V neg(V a) { return _mm512_sub_pd(_mm512_set1_pd(-0.), a); }
+	RAYTRACER_TARGET_AVX512 static Mask greaterEqual(V a, V b) { return _mm512_cmp_pd_mask(a, b, _CMP_GE_OQ); }
+	RAYTRACER_TARGET_AVX512 static Mask lessEqual(V a, V b) { return _mm512_cmp_pd_mask(a, b, _CMP_LE_OQ); }
+	RAYTRACER_TARGET_AVX512 static Mask maskAnd(Mask a, Mask b) { return Mask(a & b); }
+	RAYTRACER_TARGET_AVX512 static V select(Mask m, V a, V b) { return _mm512_mask_blend_pd(m, b, a); }
+	RAYTRACER_TARGET_AVX512 static unsigned toBits(Mask m) { return unsigned(m); }
+};
+
+#endif
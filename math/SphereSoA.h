@@ -0,0 +1,297 @@
+#pragma once
+
+#include "Vec3.h"
+#include "RayPacket.h"
+#include "Simd.h"
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Spheres stored structure-of-arrays so one ray can be tested against several of them per instruction.
+// Arrays are padded past size() with NaN radii, which never report a hit, so kernels can read whole
+// vectors from any starting slot.
+template<typename T>
+class SphereSoA
+{
+public:
+	static constexpr std::size_t PADDING = 16;
+
+	SphereSoA() { resize(0); }
+
+	void resize(std::size_t count)
+	{
+		m_size = count;
+		const T nan = std::numeric_limits<T>::quiet_NaN();
+		m_centerX.assign(count + PADDING, T(0));
+		m_centerY.assign(count + PADDING, T(0));
+		m_centerZ.assign(count + PADDING, T(0));
+		m_radius2.assign(count + PADDING, nan);
+	}
+
+	void set(std::size_t slot, const Sphere<T>& sphere)
+	{
+		m_centerX[slot] = sphere.center.x;
+		m_centerY[slot] = sphere.center.y;
+		m_centerZ[slot] = sphere.center.z;
+		m_radius2[slot] = sphere.radius * sphere.radius;
+	}
+
+	// Leaves the slot holding a placeholder that never hits.
+	void clear(std::size_t slot)
+	{
+		m_centerX[slot] = m_centerY[slot] = m_centerZ[slot] = T(0);
+		m_radius2[slot] = std::numeric_limits<T>::quiet_NaN();
+	}
+
+	std::size_t size() const { return m_size; }
+	std::size_t getMemoryFootprint() const { return 4 * m_radius2.capacity() * sizeof(T); }
+
+	const T* centerX() const { return m_centerX.data(); }
+	const T* centerY() const { return m_centerY.data(); }
+	const T* centerZ() const { return m_centerZ.data(); }
+	const T* radius2() const { return m_radius2.data(); }
+
+private:
+	std::size_t m_size = 0;
+	std::vector<T> m_centerX;
+	std::vector<T> m_centerY;
+	std::vector<T> m_centerZ;
+	std::vector<T> m_radius2;
+};
+
+namespace detail
+{
+	// Same operations, in the same order, as intersect(const Sphere<T>&, const Ray<T>&),
+	// so every kernel returns bit-identical distances.
+	template<typename T>
+	T intersectSphereSlot(T cx, T cy, T cz, T radius2, const Ray<T>& ray)
+	{
+		T ocx = ray.origin.x - cx;
+		T ocy = ray.origin.y - cy;
+		T ocz = ray.origin.z - cz;
+
+		T a = ray.direction * ray.direction;
+		T b = (ocx * ray.direction.x + ocy * ray.direction.y + ocz * ray.direction.z) * 2;
+		T c = (ocx * ocx + ocy * ocy + ocz * ocz) - radius2;
+
+		T delta = b * b - T(4) * a * c;
+		if (!(delta >= 0))
+			return NO_INTERSECTION<T>();
+
+		T sqrtDelta = std::sqrt(delta);
+		T k1 = (-b - sqrtDelta) / (T(2) * a);
+		T k2 = (-b + sqrtDelta) / (T(2) * a);
+
+		if (k1 >= 0.)
+			return k1;
+
+		if (k2 >= 0.)
+			return k2;
+
+		return NO_INTERSECTION<T>();
+	}
+
+	template<typename T, typename HitFn>
+	void intersectSpheresScalar(const SphereSoA<T>& spheres, std::uint32_t first, std::uint32_t count, const Ray<T>& ray, T& tMax, HitFn& onHit)
+	{
+		for (std::uint32_t slot = first; slot < first + count; ++slot)
+		{
+			T t = intersectSphereSlot(spheres.centerX()[slot], spheres.centerY()[slot], spheres.centerZ()[slot], spheres.radius2()[slot], ray);
+			if (t != NO_INTERSECTION<T>() && t <= tMax)
+				onHit(slot, t);
+		}
+	}
+
+	template<typename T>
+	void intersectPacketScalar(const Sphere<T>& sphere, const RayPacket<T>& rays, std::size_t first, std::size_t count, T* distances)
+	{
+		for (std::size_t i = first; i < first + count; ++i)
+			distances[i] = intersect(sphere, rays.get(i));
+	}
+
+#if RAYTRACER_SIMD_X86
+#if defined(__GNUC__) && !defined(__clang__)
+	// The generic kernel bodies only ever exist inlined into the ISA-specific entry points below,
+	// so GCC's ABI note about passing AVX vectors, and its false positive on _mm512_undefined_*, do not apply.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+	template<typename Ops, typename T, typename HitFn>
+	void intersectSpheresWide(const SphereSoA<T>& spheres, std::uint32_t first, std::uint32_t count, const Ray<T>& ray, T& tMax, HitFn& onHit)
+	{
+		constexpr int W = Ops::WIDTH;
+
+		T a = ray.direction * ray.direction;
+		const auto fourA = Ops::set1(T(4) * a);
+		const auto twoA = Ops::set1(T(2) * a);
+		const auto two = Ops::set1(T(2));
+		const auto zero = Ops::set1(T(0));
+		const auto ox = Ops::set1(ray.origin.x), oy = Ops::set1(ray.origin.y), oz = Ops::set1(ray.origin.z);
+		const auto dx = Ops::set1(ray.direction.x), dy = Ops::set1(ray.direction.y), dz = Ops::set1(ray.direction.z);
+
+		const std::uint32_t end = first + count;
+		for (std::uint32_t slot = first; slot < end; slot += W)
+		{
+			auto ocx = Ops::sub(ox, Ops::load(spheres.centerX() + slot));
+			auto ocy = Ops::sub(oy, Ops::load(spheres.centerY() + slot));
+			auto ocz = Ops::sub(oz, Ops::load(spheres.centerZ() + slot));
+
+			auto b = Ops::mul(Ops::add(Ops::add(Ops::mul(ocx, dx), Ops::mul(ocy, dy)), Ops::mul(ocz, dz)), two);
+			auto c = Ops::sub(Ops::add(Ops::add(Ops::mul(ocx, ocx), Ops::mul(ocy, ocy)), Ops::mul(ocz, ocz)), Ops::load(spheres.radius2() + slot));
+			auto delta = Ops::sub(Ops::mul(b, b), Ops::mul(fourA, c));
+
+			// Negative or NaN deltas give NaN roots, which fail every comparison below.
+			auto sqrtDelta = Ops::sqrt(delta);
+			auto minusB = Ops::neg(b);
+			auto k1 = Ops::div(Ops::sub(minusB, sqrtDelta), twoA);
+			auto k2 = Ops::div(Ops::add(minusB, sqrtDelta), twoA);
+			auto t = Ops::select(Ops::greaterEqual(k1, zero), k1, k2);
+
+			unsigned bits = Ops::toBits(Ops::maskAnd(Ops::greaterEqual(t, zero), Ops::lessEqual(t, Ops::set1(tMax))));
+			if (end - slot < std::uint32_t(W))
+				bits &= (1u << (end - slot)) - 1u;
+
+			if (bits != 0)
+			{
+				T distances[W];
+				Ops::store(distances, t);
+				while (bits != 0)
+				{
+					int lane = countTrailingZeros(bits);
+					if (distances[lane] <= tMax)
+						onHit(slot + lane, distances[lane]);
+					bits &= bits - 1u;
+				}
+			}
+		}
+	}
+
+	template<typename Ops, typename T>
+	void intersectPacketWide(const Sphere<T>& sphere, const RayPacket<T>& rays, std::size_t first, std::size_t count, T* distances)
+	{
+		constexpr int W = Ops::WIDTH;
+
+		const auto two = Ops::set1(T(2));
+		const auto four = Ops::set1(T(4));
+		const auto zero = Ops::set1(T(0));
+		const auto miss = Ops::set1(NO_INTERSECTION<T>());
+		const auto cx = Ops::set1(sphere.center.x), cy = Ops::set1(sphere.center.y), cz = Ops::set1(sphere.center.z);
+		const auto radius2 = Ops::set1(sphere.radius * sphere.radius);
+
+		std::size_t i = first;
+		for (; i + W <= first + count; i += W)
+		{
+			auto dx = Ops::load(rays.directionX.data() + i), dy = Ops::load(rays.directionY.data() + i), dz = Ops::load(rays.directionZ.data() + i);
+			auto ocx = Ops::sub(Ops::load(rays.originX.data() + i), cx);
+			auto ocy = Ops::sub(Ops::load(rays.originY.data() + i), cy);
+			auto ocz = Ops::sub(Ops::load(rays.originZ.data() + i), cz);
+
+			auto a = Ops::add(Ops::add(Ops::mul(dx, dx), Ops::mul(dy, dy)), Ops::mul(dz, dz));
+			auto b = Ops::mul(Ops::add(Ops::add(Ops::mul(ocx, dx), Ops::mul(ocy, dy)), Ops::mul(ocz, dz)), two);
+			auto c = Ops::sub(Ops::add(Ops::add(Ops::mul(ocx, ocx), Ops::mul(ocy, ocy)), Ops::mul(ocz, ocz)), radius2);
+			auto delta = Ops::sub(Ops::mul(b, b), Ops::mul(Ops::mul(four, a), c));
+
+			auto sqrtDelta = Ops::sqrt(delta);
+			auto minusB = Ops::neg(b);
+			auto twoA = Ops::mul(two, a);
+			auto k1 = Ops::div(Ops::sub(minusB, sqrtDelta), twoA);
+			auto k2 = Ops::div(Ops::add(minusB, sqrtDelta), twoA);
+			auto t = Ops::select(Ops::greaterEqual(k1, zero), k1, k2);
+
+			Ops::store(distances + i, Ops::select(Ops::greaterEqual(t, zero), t, miss));
+		}
+
+		intersectPacketScalar(sphere, rays, i, first + count - i, distances);
+	}
+
+	template<typename T, typename HitFn>
+	void intersectSpheresSSE(const SphereSoA<T>& spheres, std::uint32_t first, std::uint32_t count, const Ray<T>& ray, T& tMax, HitFn& onHit)
+	{
+		intersectSpheresWide<SimdOps<T, SimdIsa::SSE> >(spheres, first, count, ray, tMax, onHit);
+	}
+
+	template<typename T, typename HitFn>
+	RAYTRACER_KERNEL_AVX2 void intersectSpheresAVX2(const SphereSoA<T>& spheres, std::uint32_t first, std::uint32_t count, const Ray<T>& ray, T& tMax, HitFn& onHit)
+	{
+		intersectSpheresWide<SimdOps<T, SimdIsa::AVX2> >(spheres, first, count, ray, tMax, onHit);
+	}
+
+	template<typename T, typename HitFn>
+	RAYTRACER_KERNEL_AVX512 void intersectSpheresAVX512(const SphereSoA<T>& spheres, std::uint32_t first, std::uint32_t count, const Ray<T>& ray, T& tMax, HitFn& onHit)
+	{
+		intersectSpheresWide<SimdOps<T, SimdIsa::AVX512> >(spheres, first, count, ray, tMax, onHit);
+	}
+
+	template<typename T>
+	void intersectPacketSSE(const Sphere<T>& sphere, const RayPacket<T>& rays, std::size_t first, std::size_t count, T* distances)
+	{
+		intersectPacketWide<SimdOps<T, SimdIsa::SSE> >(sphere, rays, first, count, distances);
+	}
+
+	template<typename T>
+	RAYTRACER_KERNEL_AVX2 void intersectPacketAVX2(const Sphere<T>& sphere, const RayPacket<T>& rays, std::size_t first, std::size_t count, T* distances)
+	{
+		intersectPacketWide<SimdOps<T, SimdIsa::AVX2> >(sphere, rays, first, count, distances);
+	}
+
+	template<typename T>
+	RAYTRACER_KERNEL_AVX512 void intersectPacketAVX512(const Sphere<T>& sphere, const RayPacket<T>& rays, std::size_t first, std::size_t count, T* distances)
+	{
+		intersectPacketWide<SimdOps<T, SimdIsa::AVX512> >(sphere, rays, first, count, distances);
+	}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+}
+
+// Tests one ray against spheres [first, first + count). Every hit closer than or at tMax is reported,
+// in slot order, as onHit(slot, distance); onHit may lower tMax to discard farther spheres.
+template<typename T, typename HitFn>
+void intersectSpheres(const SphereSoA<T>& spheres, std::uint32_t first, std::uint32_t count, const Ray<T>& ray, T& tMax, HitFn&& onHit, SimdIsa isa)
+{
+#if RAYTRACER_SIMD_X86
+	switch (isa)
+	{
+	case SimdIsa::SSE:
+		detail::intersectSpheresSSE(spheres, first, count, ray, tMax, onHit);
+		return;
+	case SimdIsa::AVX2:
+		detail::intersectSpheresAVX2(spheres, first, count, ray, tMax, onHit);
+		return;
+	case SimdIsa::AVX512:
+		detail::intersectSpheresAVX512(spheres, first, count, ray, tMax, onHit);
+		return;
+	default:
+		break;
+	}
+#endif
+	(void)isa;
+	detail::intersectSpheresScalar(spheres, first, count, ray, tMax, onHit);
+}
+
+// Tests a packet of rays against one sphere, writing one distance (or NO_INTERSECTION) per ray.
+template<typename T>
+void intersectPacket(const Sphere<T>& sphere, const RayPacket<T>& rays, T* distances, SimdIsa isa)
+{
+#if RAYTRACER_SIMD_X86
+	switch (isa)
+	{
+	case SimdIsa::SSE:
+		detail::intersectPacketSSE(sphere, rays, 0, rays.size(), distances);
+		return;
+	case SimdIsa::AVX2:
+		detail::intersectPacketAVX2(sphere, rays, 0, rays.size(), distances);
+		return;
+	case SimdIsa::AVX512:
+		detail::intersectPacketAVX512(sphere, rays, 0, rays.size(), distances);
+		return;
+	default:
+		break;
+	}
+#endif
+	(void)isa;
+	detail::intersectPacketScalar(sphere, rays, 0, rays.size(), distances);
+}
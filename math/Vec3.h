@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cmath>
+
 template<typename T>
 struct Vec3
 {
@@ -8,9 +10,11 @@ struct Vec3
 	Vec3<T> getNormalized() const
 	{
 		T norm2 = *this * *this;
-		return std::sqrt(1. / norm2) * *this;
+		return std::sqrt(T(1.) / norm2) * *this;
 	}
 
+	const T& operator[](int axis) const { return axis == 0 ? x : (axis == 1 ? y : z); }
+
 	T x;
 	T y;
 	T z;
@@ -79,12 +83,13 @@ T intersect(const Sphere<T>& sphere, const Ray<T>& ray)
 	T b = (ray.origin - sphere.center) * ray.direction * 2;
 	T c = (ray.origin - sphere.center) * (ray.origin - sphere.center) - sphere.radius * sphere.radius;
 
-	T delta = b * b - 4. * a * c;
+	T delta = b * b - T(4) * a * c;
 	if (delta < 0)
 		return NO_INTERSECTION<T>();
 
-	T k1 = -b - std::sqrt(delta) / 2. / a;
-	T k2 = -b + std::sqrt(delta) / 2. / a;
+	T sqrtDelta = std::sqrt(delta);
+	T k1 = (-b - sqrtDelta) / (T(2) * a);
+	T k2 = (-b + sqrtDelta) / (T(2) * a);
 
 	if (k1 >= 0.)
 		return k1;
@@ -0,0 +1,670 @@
+#include <core/AdaptiveSampler.h>
+#include <core/BudgetedRenderer.h>
+#include <core/DistributedRender.h>
+#include <core/FrameResolver.h>
+#include <core/GBuffer.h>
+#include <core/ImageWriter.h>
+#include <core/RenderStats.h>
+#include <core/SceneFile.h>
+#include <core/SceneText.h>
+#include <core/WavefrontRenderer.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+
+namespace
+{
+	double millisecondsSince(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	bool hasExtension(const std::string& path, const char* extension)
+	{
+		const std::size_t length = std::strlen(extension);
+		return path.size() >= length && path.compare(path.size() - length, length, extension) == 0;
+	}
+
+	bool isTextPath(const std::string& path)
+	{
+		return hasExtension(path, ".txt");
+	}
+
+	// Scalar size stored in a binary scene file, or 0 if it cannot be read.
+	std::uint32_t readScalarSize(const std::string& path)
+	{
+		SceneFileHeader header;
+		std::FILE* file = std::fopen(path.c_str(), "rb");
+		if (file == nullptr)
+			return 0;
+		bool ok = std::fread(&header, sizeof(header), 1, file) == 1;
+		std::fclose(file);
+		return ok ? header.scalarSize : 0;
+	}
+
+	template<typename T>
+	bool writeScene(const std::string& path, const SceneFileView<T>& view, bool buildBVH)
+	{
+		std::string error;
+		if (isTextPath(path))
+		{
+			std::ofstream out(path);
+			writeSceneText(out, view);
+			if (!out)
+				error = "cannot write " + path;
+		}
+		else
+		{
+			writeSceneFile(path, view, buildBVH, &error);
+		}
+
+		if (!error.empty())
+			std::fprintf(stderr, "%s\n", error.c_str());
+		return error.empty();
+	}
+
+	template<typename T>
+	int convert(const std::string& input, const std::string& output, bool buildBVH)
+	{
+		std::string error;
+		if (isTextPath(input))
+		{
+			SceneFileContent<T> content;
+			std::ifstream in(input);
+			if (!in || !readSceneText(in, content, &error))
+			{
+				std::fprintf(stderr, "%s: %s\n", input.c_str(), in ? error.c_str() : "cannot open");
+				return 1;
+			}
+			return writeScene(output, content.getView(), buildBVH) ? 0 : 1;
+		}
+
+		MappedSceneFile<T> file;
+		if (!file.open(input, &error))
+		{
+			std::fprintf(stderr, "%s\n", error.c_str());
+			return 1;
+		}
+		return writeScene(output, file.getView(), buildBVH) ? 0 : 1;
+	}
+
+	// Binary PPM with 8-bit channels, the format render writes by default.
+	bool readPpm(const std::string& path, std::uint32_t& width, std::uint32_t& height, std::vector<Texel>& texels, std::string& error)
+	{
+		std::ifstream in(path, std::ios::binary);
+		std::string magic;
+		unsigned maxValue = 0;
+		if (!(in >> magic >> width >> height >> maxValue) || magic != "P6" || maxValue != 255 || width == 0 || height == 0)
+		{
+			error = in ? path + " is not a binary PPM with 8-bit channels" : "cannot open " + path;
+			return false;
+		}
+		in.get();
+
+		std::vector<unsigned char> rgb(std::size_t(width) * height * 3);
+		if (!in.read(reinterpret_cast<char*>(rgb.data()), std::streamsize(rgb.size())))
+		{
+			error = path + " is truncated";
+			return false;
+		}
+		texels.resize(std::size_t(width) * height);
+		for (std::size_t i = 0; i < texels.size(); ++i)
+			texels[i] = Texel{ rgb[3 * i], rgb[3 * i + 1], rgb[3 * i + 2], 255 };
+		return true;
+	}
+
+	int convertTexture(const std::string& input, const std::string& output)
+	{
+		std::string error;
+		std::uint32_t width, height;
+		std::vector<Texel> texels;
+		const auto start = std::chrono::steady_clock::now();
+		if (!readPpm(input, width, height, texels, error) || !writeTextureFile(output, width, height, texels.data(), &error))
+		{
+			std::fprintf(stderr, "%s\n", error.c_str());
+			return 1;
+		}
+		std::printf("%s: %ux%u, %.3f ms\n", output.c_str(), width, height, millisecondsSince(start));
+		return 0;
+	}
+
+	// Same layout as the benchmark scenes: spheres in a cube whose side follows the cube root of their count.
+	template<typename T>
+	int generate(std::size_t sphereCount, const std::string& output, unsigned seed, bool buildBVH, std::size_t lightCount, bool mirrors, const char* texture)
+	{
+		std::mt19937 rng(seed);
+		const T halfExtent = std::max(T(1), std::cbrt(T(sphereCount)));
+		std::uniform_real_distribution<T> position(-halfExtent, halfExtent);
+		std::uniform_real_distribution<T> radius(T(0.2), T(1));
+		std::uniform_real_distribution<T> unit(T(0), T(1));
+
+		SceneFileContent<T> content;
+		for (int i = 0; i < 16; ++i)
+			content.materials.push_back(MaterialRecord<T>{ { unit(rng), unit(rng), unit(rng) }, T(0.2), T(0.8) });
+		for (std::size_t i = 0; mirrors && i < content.materials.size(); ++i)
+		{
+			const std::size_t kind = i * 4 / content.materials.size();
+			content.materialSurfaces.push_back(kind == 0 ? SurfaceRecord<T>{ T(0.8), T(0), T(1) } : kind == 1 ? SurfaceRecord<T>{ T(0.1), T(0.8), T(1.5) }
+				: SurfaceRecord<T>{ T(0), T(0), T(1) });
+		}
+		// The texture wraps once around a sphere of average radius.
+		for (std::size_t i = 0; texture != nullptr && i < content.materials.size(); ++i)
+		{
+			content.materialTextures.push_back(TextureRecord<T>{ T(1.2) * pi<T>(), {} });
+			if (i % 2 == 0)
+				std::strncpy(content.materialTextures.back().path, texture, TEXTURE_RECORD_PATH_SIZE - 1);
+		}
+
+		content.spheres.reserve(sphereCount);
+		content.sphereMaterials.reserve(sphereCount);
+		for (std::size_t i = 0; i < sphereCount; ++i)
+		{
+			content.spheres.push_back(Sphere<T>{ { position(rng), position(rng), position(rng) }, radius(rng) });
+			content.sphereMaterials.push_back(std::uint32_t(rng() % content.materials.size()));
+		}
+
+		// More lights are scattered among the spheres, sharing the power of the single one.
+		if (lightCount <= 1)
+			content.lights.push_back(LightRecord<T>{ { T(0), halfExtent * T(2), T(0) }, { T(1), T(1), T(1) }, T(100) * halfExtent * halfExtent });
+		for (std::size_t i = 0; lightCount > 1 && i < lightCount; ++i)
+		{
+			content.lights.push_back(LightRecord<T>{ { position(rng), position(rng), position(rng) }, { unit(rng), unit(rng), unit(rng) },
+				T(100) * halfExtent * halfExtent / T(lightCount) });
+		}
+		content.cameras.push_back(CameraRecord<T>{ { T(0), T(0), -halfExtent * T(2.5) }, { T(0), T(0), T(1) }, deg_to_rad(T(60)) });
+
+		return writeScene(output, content.getView(), buildBVH) ? 0 : 1;
+	}
+
+	template<typename T>
+	int info(const std::string& input)
+	{
+		std::string error;
+		auto start = std::chrono::steady_clock::now();
+		MappedSceneFile<T> file;
+		if (!file.open(input, &error))
+		{
+			std::fprintf(stderr, "%s\n", error.c_str());
+			return 1;
+		}
+		double openMilliseconds = millisecondsSince(start);
+
+		const SceneFileView<T>& view = file.getView();
+		std::printf("%s: %zu-byte scalars, %zu spheres, %zu materials, %zu lights, %zu cameras, %zu BVH nodes\n",
+			input.c_str(), sizeof(T), view.sphereCount, view.materialCount, view.lightCount, view.cameraCount, view.bvhNodeCount);
+
+		start = std::chrono::steady_clock::now();
+		Scene<T> scene;
+		if (!addToScene(view, scene, &error))
+		{
+			std::fprintf(stderr, "%s\n", error.c_str());
+			return 1;
+		}
+		double addMilliseconds = millisecondsSince(start);
+
+		start = std::chrono::steady_clock::now();
+		scene.compile();
+		double compileMilliseconds = millisecondsSince(start);
+
+		std::printf("open %.3f ms, add to scene %.3f ms, compile %.3f ms (%zu BVH nodes, %zu bytes)\n",
+			openMilliseconds, addMilliseconds, compileMilliseconds, scene.getBVHNodeCount(), scene.getCompiledMemoryFootprint());
+		return 0;
+	}
+
+	// Resolves and writes the frame a band of rows at a time, so that only the viewport is held in full.
+	template<typename T, typename Writer>
+	bool writeResolved(const Viewport<T>& viewport, const ResolveSettings<T>& settings, ThreadPool& pool, Writer& writer)
+	{
+		const int bandRows = 32;
+		FrameResolver<T> resolver(&pool);
+		const ResolveRange<T> range = resolver.computeRange(viewport, settings);
+		std::vector<std::uint8_t> band(4 * std::size_t(viewport.getWidth()) * bandRows);
+		for (int row = 0; row < viewport.getHeight(); row += bandRows)
+		{
+			const int rowEnd = std::min(viewport.getHeight(), row + bandRows);
+			resolver.quantizeRows(viewport, range, row, rowEnd, band.data());
+			if (!writer.writeRows(band.data(), rowEnd - row))
+				return false;
+		}
+		return true;
+	}
+
+	std::vector<std::string> splitList(const char* text)
+	{
+		std::vector<std::string> items;
+		for (const char* begin = text; *begin != '\0';)
+		{
+			const char* end = std::strchr(begin, ',');
+			items.emplace_back(begin, end != nullptr ? end : begin + std::strlen(begin));
+			begin = end != nullptr ? end + 1 : begin + std::strlen(begin);
+		}
+		return items;
+	}
+
+	// all, culled[:THRESHOLD] or sampled[:N[:SPLIT]].
+	bool parseLightSampling(const char* text, LightSamplingSettings& settings)
+	{
+		const char* colon = std::strchr(text, ':');
+		const std::string mode(text, colon != nullptr ? colon : text + std::strlen(text));
+		if (mode == "all" && colon == nullptr)
+			settings.selection = LightSelection::All;
+		else if (mode == "culled")
+		{
+			settings.selection = LightSelection::Culled;
+			if (colon != nullptr)
+				settings.cullThreshold = std::strtof(colon + 1, nullptr);
+		}
+		else if (mode == "sampled")
+		{
+			settings.selection = LightSelection::Sampled;
+			if (colon != nullptr)
+				settings.lightSamples = std::max(1, std::atoi(colon + 1));
+			const char* split = colon != nullptr ? std::strchr(colon + 1, ':') : nullptr;
+			if (split != nullptr)
+				settings.splitDistance = std::max(0.f, std::strtof(split + 1, nullptr));
+		}
+		else
+			return false;
+		return true;
+	}
+
+	// Renders tiles for one coordinator after another.
+	int serveWorker(const std::string& address, unsigned threads)
+	{
+		std::string error;
+		Socket listener;
+		if (!listener.listen(address, &error))
+		{
+			std::fprintf(stderr, "%s\n", error.c_str());
+			return 1;
+		}
+		ThreadPool pool(threads);
+		std::printf("worker listening on %s with %u threads\n", address.c_str(), pool.getThreadCount());
+		std::fflush(stdout);
+
+		Socket connection;
+		while (listener.accept(connection, &error))
+		{
+			if (!runRenderWorker(connection, pool, &error))
+				std::fprintf(stderr, "coordinator dropped: %s\n", error.c_str());
+			connection.close();
+		}
+		std::fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+
+	struct RenderOptions
+	{
+		int width = 800, height = 600;
+		float sampleBudget = 1;
+		const char* statsPath = nullptr;
+		const char* tracePath = nullptr;
+		const char* workers = nullptr;
+		LightSamplingSettings lightSampling;
+		// Negative keeps the scene's default.
+		int bounces = -1;
+		bool wavefront = false;
+		// Bytes; 0 keeps the cache's default.
+		std::size_t textureCache = 0;
+		// When positive, the frame is shaded again from a G-buffer after the lights are scaled by it.
+		float reshadeScale = 0;
+		// When positive, budgetFrames frames are rendered within this many milliseconds each.
+		float budgetMilliseconds = 0;
+		int budgetFrames = 10;
+		FrameBudgetSettings budget;
+	};
+
+	template<typename T>
+	int render(const std::string& input, const std::string& output, const ResolveSettings<T>& settings, const RenderOptions& options)
+	{
+		const int width = options.width, height = options.height;
+		const float sampleBudget = options.sampleBudget;
+		const char* statsPath = options.statsPath;
+		const char* tracePath = options.tracePath;
+		const char* workers = options.workers;
+		// The mapped file backs the scene's spheres, so it stays open until the frame is written.
+		std::string error;
+		SceneFileContent<T> content;
+		MappedSceneFile<T> file;
+		SceneFileView<T> view;
+		if (isTextPath(input))
+		{
+			std::ifstream in(input);
+			if (!in || !readSceneText(in, content, &error))
+			{
+				std::fprintf(stderr, "%s: %s\n", input.c_str(), in ? error.c_str() : "cannot open");
+				return 1;
+			}
+			view = content.getView();
+		}
+		else
+		{
+			if (!file.open(input, &error))
+			{
+				std::fprintf(stderr, "%s\n", error.c_str());
+				return 1;
+			}
+			view = file.getView();
+		}
+
+		const std::vector<Camera<T> > cameras = getCameras(view);
+		if (cameras.empty())
+		{
+			std::fprintf(stderr, "%s has no camera\n", input.c_str());
+			return 1;
+		}
+
+		Scene<T> scene;
+		if (!addToScene(view, scene, &error))
+		{
+			std::fprintf(stderr, "%s\n", error.c_str());
+			return 1;
+		}
+		if (options.textureCache != 0)
+			TextureCache::getInstance().setCapacity(options.textureCache);
+		scene.setLightSampling(options.lightSampling);
+		if (options.bounces >= 0)
+			scene.setMaxBounces(options.bounces);
+		ThreadPool pool;
+		Viewport<T> viewport{ width, height };
+		RenderStats& stats = RenderStats::get();
+		stats.setTracing(tracePath != nullptr);
+		stats.beginFrame();
+		auto start = std::chrono::steady_clock::now();
+		AdaptiveSamplingSettings sampling;
+		sampling.sampleBudget = sampleBudget;
+		AdaptiveSampler<T> sampler{ sampling };
+		WavefrontRenderer<T> wavefront;
+		GBuffer<T> gbuffer;
+		FrameBudgetSettings budget = options.budget;
+		budget.targetMilliseconds = options.budgetMilliseconds;
+		BudgetedRenderer<T> budgeted{ budget };
+		RenderCoordinator<T> coordinator;
+		if (workers != nullptr)
+		{
+			const std::vector<std::string> addresses = splitList(workers);
+			if (coordinator.connect(addresses, &error) != addresses.size())
+				std::fprintf(stderr, "%s\n", error.c_str());
+			coordinator.setScene(view);
+			coordinator.render(cameras[0], viewport);
+		}
+		else if (sampleBudget > 1)
+			sampler.render(scene, cameras[0], viewport, pool);
+		else if (options.wavefront)
+			wavefront.render(scene, cameras[0], viewport, pool);
+		else if (options.reshadeScale > 0)
+			gbuffer.render(scene, cameras[0], viewport, pool);
+		else if (options.budgetMilliseconds > 0)
+		{
+			// The controller settles over the frames; the last one is written.
+			for (int frame = 0; frame < options.budgetFrames; ++frame)
+			{
+				budgeted.render(scene, cameras[0], viewport, pool);
+				const FrameBudgetStats& frameStats = budgeted.getStats();
+				std::printf("frame %d: scale %.3f (%dx%d, %d spp), trace %.3f ms, resample %.3f ms, fovea %.3f ms (%zu tiles, %zu skipped), "
+					"total %.3f ms; tiles %.3f ms mean, %.3f ms max; next scale %.3f\n", frame, frameStats.scale, frameStats.width, frameStats.height,
+					frameStats.samplesPerPixel, frameStats.traceMilliseconds, frameStats.resampleMilliseconds, frameStats.foveaMilliseconds,
+					frameStats.foveaTiles, frameStats.skippedFoveaTiles, frameStats.frameMilliseconds, frameStats.meanTileMilliseconds,
+					frameStats.maxTileMilliseconds, frameStats.nextScale);
+			}
+		}
+		else
+			scene.render(cameras[0], viewport, pool);
+		double renderMilliseconds = millisecondsSince(start);
+
+		double reshadeMilliseconds = 0;
+		if (options.reshadeScale > 0)
+		{
+			for (std::size_t i = 0; i < view.lightCount; ++i)
+			{
+				const LightRecord<T>& light = view.lights[i];
+				scene.setLight(i, new PointLight<T>{ light.position, light.color, T(options.reshadeScale) * light.intensity });
+			}
+			start = std::chrono::steady_clock::now();
+			gbuffer.reshade(scene, viewport, pool);
+			reshadeMilliseconds = millisecondsSince(start);
+		}
+
+		start = std::chrono::steady_clock::now();
+		bool ok;
+		if (hasExtension(output, ".exr"))
+		{
+			ExrWriter writer;
+			ok = writer.open(output, width, height, &error) && writer.writeRows(viewport.getPixels(), height) && writer.close(&error);
+		}
+		else if (hasExtension(output, ".png"))
+		{
+			PngWriter writer;
+			ok = writer.open(output, width, height, &error) && writeResolved(viewport, settings, pool, writer) && writer.close(&error);
+		}
+		else
+		{
+			PpmWriter writer;
+			ok = writer.open(output, width, height, &error) && writeResolved(viewport, settings, pool, writer) && writer.close(&error);
+		}
+		if (!ok)
+		{
+			std::fprintf(stderr, "%s\n", error.empty() ? ("cannot write " + output).c_str() : error.c_str());
+			return 1;
+		}
+
+		std::printf("render %.3f ms, write %.3f ms", renderMilliseconds, millisecondsSince(start));
+		if (sampleBudget > 1)
+			std::printf(", %.2f samples per pixel", double(sampler.getSampleTotal()) / (double(width) * height));
+		std::printf("\n");
+		if (options.reshadeScale > 0)
+		{
+			const GBufferStats& reshaded = gbuffer.getStats();
+			std::printf("reshade %.3f ms: %zu pixels, %zu reused light visibility, %zu traced bounces; G-buffer %zu bytes\n", reshadeMilliseconds,
+				reshaded.pixels, reshaded.reusedVisibility, reshaded.bounced, gbuffer.getMemoryFootprint());
+		}
+		if (workers != nullptr)
+		{
+			const DistributedRenderStats& distributed = coordinator.getStats();
+			std::printf("tiles per worker:");
+			for (std::size_t tiles : distributed.workerTiles)
+				std::printf(" %zu", tiles);
+			std::printf(", %zu reissued, %zu rendered locally, %zu workers failed\n", distributed.reissuedTiles, distributed.localTiles, distributed.failedWorkers);
+		}
+		const TextureCacheStats textureStats = TextureCache::getInstance().getStats();
+		if (textureStats.lookups != 0)
+		{
+			std::printf("texture tiles: %zu lookups, %zu misses, %zu evictions, %zu failed reads, %.1f MiB resident\n", textureStats.lookups,
+				textureStats.misses, textureStats.evictions, textureStats.failedReads, double(textureStats.residentBytes) / double(1 << 20));
+		}
+		if (options.wavefront)
+		{
+			const WavefrontStats& wavefrontStats = wavefront.getStats();
+			for (std::size_t bounce = 0; bounce < wavefrontStats.rays.size(); ++bounce)
+			{
+				std::printf("bounce %zu: %zu rays, %.3f ms, %.2f Mrays/s\n", bounce, wavefrontStats.rays[bounce], wavefrontStats.seconds[bounce] * 1e3,
+					wavefrontStats.seconds[bounce] > 0 ? double(wavefrontStats.rays[bounce]) / wavefrontStats.seconds[bounce] * 1e-6 : 0.);
+			}
+		}
+
+		const FrameStats frameStats = stats.endFrame();
+		if (statsPath != nullptr)
+		{
+			std::ofstream out(statsPath);
+			writeFrameStatsJson(out, frameStats);
+			if (!out)
+			{
+				std::fprintf(stderr, "cannot write %s\n", statsPath);
+				return 1;
+			}
+		}
+		if (tracePath != nullptr)
+		{
+			std::ofstream out(tracePath);
+			stats.writeChromeTrace(out);
+			if (!out)
+			{
+				std::fprintf(stderr, "cannot write %s\n", tracePath);
+				return 1;
+			}
+		}
+		return 0;
+	}
+
+	void printUsage(const char* program)
+	{
+		std::fprintf(stderr,
+			"usage: %s convert <input> <output> [--float] [--no-bvh]\n"
+			"       %s generate <sphereCount> <output> [--seed N] [--lights N] [--mirrors] [--texture FILE] [--float] [--no-bvh]\n"
+			"       %s texture <image.ppm> <output>\n"
+			"       %s info <scene>\n"
+			"       %s render <scene> <image> [--size WxH] [--exposure E] [--adaptive BUDGET] [--lights MODE] [--bounces N] [--wavefront] [--texture-cache MB] [--reshade SCALE] [--budget MS[:FRAMES]] [--fovea RADIUS] [--supersample N] [--workers ADDRESS,...] [--stats file.json] [--trace file.json] [--float]\n"
+			"       %s worker <ADDRESS> [--threads N]\n"
+			"Paths ending in .txt use the text format, anything else the binary one.\n"
+			"Images ending in .png or .exr use those formats, anything else binary PPM. Without --exposure,\n"
+			"the value range of the frame is stretched over the output range; EXR output is never resolved.\n"
+			"--mirrors turns a quarter of the generated materials into mirrors and another quarter into glass,\n"
+			"--texture maps a texture file, made from a PPM image by the texture command, on half of them.\n"
+			"--texture-cache caps the texture tiles kept in memory, 256 MiB by default.\n"
+			"--reshade keeps the frame's hits in a G-buffer, scales every light by SCALE, and writes the frame\n"
+			"shaded again from the G-buffer without tracing its primary rays.\n"
+			"--budget renders FRAMES frames (10 by default) within MS milliseconds each, tracing them at the\n"
+			"resolution that fits and upscaling, and prints the controller's decisions. --fovea sets the radius\n"
+			"around the centre traced at full resolution first, in fractions of half the image height (0.25 by\n"
+			"default, 0 disables it); --supersample allows up to N by N samples per pixel when the frame is cheap.\n"
+			"--adaptive anti-aliases edges with up to BUDGET samples per pixel on average.\n"
+			"--lights all shades each hit with every light, culled[:THRESHOLD] skips lights whose share of the\n"
+			"light reaching it is bounded below THRESHOLD, sampled[:N[:SPLIT]] draws N lights by their contribution,\n"
+			"separately from each group of lights closer than SPLIT times its radius.\n"
+			"--bounces limits reflection and refraction bounces (4 by default); --wavefront traces them\n"
+			"breadth-first, one sorted queue per bounce, and prints the throughput of each bounce.\n"
+			"--stats writes the frame's counters and phase timings, --trace a Chrome trace of it; both are\n"
+			"empty unless built with RAYTRACER_STATS.\n"
+			"--workers renders the tiles on worker processes started with the worker command, which listen on\n"
+			"host:port or unix:path; tiles of workers that fail are rendered by the others, or locally.\n",
+			program, program, program, program, program, program);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 3)
+	{
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	const std::string command = argv[1];
+	bool singlePrecision = false;
+	bool buildBVH = true;
+	unsigned seed = 1;
+	double exposure = 0;
+	RenderOptions options;
+	unsigned threads = 0;
+	std::size_t lightCount = 1;
+	bool mirrors = false;
+	const char* texture = nullptr;
+	int positionalCount = 0;
+	const char* positional[2] = {};
+	for (int i = 2; i < argc; ++i)
+	{
+		if (std::strcmp(argv[i], "--float") == 0)
+			singlePrecision = true;
+		else if (std::strcmp(argv[i], "--no-bvh") == 0)
+			buildBVH = false;
+		else if (std::strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+			seed = unsigned(std::strtoul(argv[++i], nullptr, 10));
+		else if (std::strcmp(argv[i], "--size") == 0 && i + 1 < argc && std::sscanf(argv[i + 1], "%dx%d", &options.width, &options.height) == 2
+			&& options.width > 0 && options.height > 0)
+			++i;
+		else if (std::strcmp(argv[i], "--exposure") == 0 && i + 1 < argc)
+			exposure = std::strtod(argv[++i], nullptr);
+		else if (std::strcmp(argv[i], "--adaptive") == 0 && i + 1 < argc)
+			options.sampleBudget = std::strtof(argv[++i], nullptr);
+		else if (std::strcmp(argv[i], "--stats") == 0 && i + 1 < argc)
+			options.statsPath = argv[++i];
+		else if (std::strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+			options.tracePath = argv[++i];
+		else if (std::strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+			options.workers = argv[++i];
+		else if (std::strcmp(argv[i], "--bounces") == 0 && i + 1 < argc)
+			options.bounces = std::max(0, std::atoi(argv[++i]));
+		else if (std::strcmp(argv[i], "--wavefront") == 0)
+			options.wavefront = true;
+		else if (std::strcmp(argv[i], "--reshade") == 0 && i + 1 < argc)
+			options.reshadeScale = std::strtof(argv[++i], nullptr);
+		else if (std::strcmp(argv[i], "--budget") == 0 && i + 1 < argc && std::sscanf(argv[i + 1], "%f:%d", &options.budgetMilliseconds, &options.budgetFrames) >= 1
+			&& options.budgetMilliseconds > 0 && options.budgetFrames > 0)
+			++i;
+		else if (std::strcmp(argv[i], "--fovea") == 0 && i + 1 < argc)
+			options.budget.foveaRadius = std::strtof(argv[++i], nullptr);
+		else if (std::strcmp(argv[i], "--supersample") == 0 && i + 1 < argc)
+			options.budget.maxSupersampling = std::max(1, std::atoi(argv[++i]));
+		else if (std::strcmp(argv[i], "--mirrors") == 0)
+			mirrors = true;
+		else if (std::strcmp(argv[i], "--texture") == 0 && i + 1 < argc)
+			texture = argv[++i];
+		else if (std::strcmp(argv[i], "--texture-cache") == 0 && i + 1 < argc)
+			options.textureCache = std::size_t(std::max(1.0, std::strtod(argv[++i], nullptr)) * double(1 << 20));
+		else if (std::strcmp(argv[i], "--lights") == 0 && i + 1 < argc && command == "generate")
+			lightCount = std::size_t(std::strtoull(argv[++i], nullptr, 10));
+		else if (std::strcmp(argv[i], "--lights") == 0 && i + 1 < argc && parseLightSampling(argv[i + 1], options.lightSampling))
+			++i;
+		else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			threads = unsigned(std::strtoul(argv[++i], nullptr, 10));
+		else if (positionalCount < 2)
+			positional[positionalCount++] = argv[i];
+		else
+		{
+			printUsage(argv[0]);
+			return 1;
+		}
+	}
+
+	// Binary inputs carry their own precision; --float only matters for text inputs and generated scenes.
+	if ((command == "convert" || command == "info" || command == "render") && positionalCount >= 1 && !isTextPath(positional[0]))
+		singlePrecision = readScalarSize(positional[0]) == sizeof(float);
+
+	if (command == "convert" && positionalCount == 2)
+		return singlePrecision ? convert<float>(positional[0], positional[1], buildBVH) : convert<double>(positional[0], positional[1], buildBVH);
+	if (command == "generate" && positionalCount == 2)
+	{
+		std::size_t sphereCount = std::size_t(std::strtoull(positional[0], nullptr, 10));
+		return singlePrecision ? generate<float>(sphereCount, positional[1], seed, buildBVH, lightCount, mirrors, texture)
+			: generate<double>(sphereCount, positional[1], seed, buildBVH, lightCount, mirrors, texture);
+	}
+	if (command == "texture" && positionalCount == 2)
+		return convertTexture(positional[0], positional[1]);
+	if (command == "info" && positionalCount == 1 && !isTextPath(positional[0]))
+		return singlePrecision ? info<float>(positional[0]) : info<double>(positional[0]);
+	if (command == "worker" && positionalCount == 1)
+		return serveWorker(positional[0], threads);
+
+	if (command == "render" && positionalCount == 2)
+	{
+		if (options.workers != nullptr && (options.sampleBudget > 1 || options.lightSampling.selection != LightSelection::All || options.bounces >= 0
+			|| options.wavefront || options.reshadeScale > 0 || options.budgetMilliseconds > 0))
+		{
+			std::fprintf(stderr, "--adaptive, --lights, --bounces, --wavefront, --reshade and --budget cannot be combined with --workers\n");
+			return 1;
+		}
+		if (int(options.wavefront) + int(options.sampleBudget > 1) + int(options.reshadeScale > 0) + int(options.budgetMilliseconds > 0) > 1)
+		{
+			std::fprintf(stderr, "only one of --adaptive, --wavefront, --reshade and --budget can be used\n");
+			return 1;
+		}
+		ResolveSettings<double> settings;
+		if (exposure > 0)
+		{
+			settings.mode = ResolveMode::Exposure;
+			settings.exposure = exposure;
+		}
+		return singlePrecision ? render<float>(positional[0], positional[1], ResolveSettings<float>{ settings.mode, float(settings.exposure) }, options)
+			: render<double>(positional[0], positional[1], settings, options);
+	}
+
+	printUsage(argv[0]);
+	return 1;
+}
@@ -0,0 +1,137 @@
+#include <math/SphereSoA.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+namespace
+{
+	template<typename T>
+	struct BenchData
+	{
+		std::vector<Sphere<T> > spheres;
+		SphereSoA<T> soa;
+		std::vector<Ray<T> > rays;
+		RayPacket<T> packet;
+	};
+
+	template<typename T>
+	BenchData<T> makeBenchData(std::size_t sphereCount, std::size_t rayCount)
+	{
+		std::mt19937 rng(42);
+		std::uniform_real_distribution<T> position(T(-10), T(10));
+		std::uniform_real_distribution<T> radius(T(0.1), T(2));
+
+		BenchData<T> data;
+		data.soa.resize(sphereCount);
+		for (std::size_t i = 0; i < sphereCount; ++i)
+		{
+			data.spheres.push_back(Sphere<T>{ { position(rng), position(rng), position(rng) }, radius(rng) });
+			data.soa.set(i, data.spheres.back());
+		}
+
+		data.packet.resize(rayCount);
+		for (std::size_t i = 0; i < rayCount; ++i)
+		{
+			Ray<T> ray{ { position(rng), position(rng), T(-20) }, Vec3<T>{ position(rng) / T(20), position(rng) / T(20), T(1) }.getNormalized() };
+			data.rays.push_back(ray);
+			data.packet.set(i, ray);
+		}
+		return data;
+	}
+
+	double secondsSince(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	// One ray against every sphere of the SoA, reporting all hits.
+	template<typename T>
+	void benchOneRayManySpheres(const BenchData<T>& data, SimdIsa isa, const char* precision)
+	{
+		std::size_t mismatches = 0;
+		for (const auto& ray : data.rays)
+		{
+			std::vector<T> expected(data.spheres.size(), NO_INTERSECTION<T>());
+			for (std::size_t i = 0; i < data.spheres.size(); ++i)
+				expected[i] = intersect(data.spheres[i], ray);
+
+			std::vector<T> actual(data.spheres.size(), NO_INTERSECTION<T>());
+			T tMax = std::numeric_limits<T>::infinity();
+			intersectSpheres(data.soa, 0, std::uint32_t(data.spheres.size()), ray, tMax, [&](std::uint32_t slot, T t) { actual[slot] = t; }, isa);
+			if (std::memcmp(expected.data(), actual.data(), expected.size() * sizeof(T)) != 0)
+				++mismatches;
+		}
+
+		std::size_t hits = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (const auto& ray : data.rays)
+		{
+			T tMax = std::numeric_limits<T>::infinity();
+			intersectSpheres(data.soa, 0, std::uint32_t(data.spheres.size()), ray, tMax, [&](std::uint32_t, T t) { tMax = t; ++hits; }, isa);
+		}
+		double seconds = secondsSince(start);
+
+		double tests = double(data.rays.size()) * double(data.spheres.size());
+		std::printf("%-8s %-7s 1 ray x %zu spheres  %10.3f Mrays/s  %8.3f ns/test  mismatches %zu  (hits %zu)\n",
+			getSimdIsaName(isa), precision, data.spheres.size(), double(data.rays.size()) / seconds * 1e-6, seconds / tests * 1e9, mismatches, hits);
+	}
+
+	// The whole ray packet against each sphere in turn.
+	template<typename T>
+	void benchPacketOneSphere(const BenchData<T>& data, SimdIsa isa, const char* precision)
+	{
+		std::vector<T> distances(data.rays.size());
+		std::size_t mismatches = 0;
+		for (const auto& sphere : data.spheres)
+		{
+			intersectPacket(sphere, data.packet, distances.data(), isa);
+			for (std::size_t i = 0; i < data.rays.size(); ++i)
+			{
+				T expected = intersect(sphere, data.rays[i]);
+				if (std::memcmp(&expected, &distances[i], sizeof(T)) != 0)
+					++mismatches;
+			}
+		}
+
+		T checksum = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (const auto& sphere : data.spheres)
+		{
+			intersectPacket(sphere, data.packet, distances.data(), isa);
+			checksum += distances[0];
+		}
+		double seconds = secondsSince(start);
+
+		double tests = double(data.rays.size()) * double(data.spheres.size());
+		std::printf("%-8s %-7s %zu rays x 1 sphere   %10.3f Mrays/s  %8.3f ns/test  mismatches %zu  (checksum %g)\n",
+			getSimdIsaName(isa), precision, data.rays.size(), tests / seconds * 1e-6, seconds / tests * 1e9, mismatches, double(checksum));
+	}
+
+	template<typename T>
+	void benchPrecision(const char* precision)
+	{
+		BenchData<T> data = makeBenchData<T>(4096, 4096);
+		for (SimdIsa isa : { SimdIsa::Scalar, SimdIsa::SSE, SimdIsa::AVX2, SimdIsa::AVX512 })
+		{
+			if (!isSimdIsaSupported(isa))
+			{
+				std::printf("%-8s %-7s not supported on this CPU\n", getSimdIsaName(isa), precision);
+				continue;
+			}
+			benchOneRayManySpheres(data, isa, precision);
+			benchPacketOneSphere(data, isa, precision);
+		}
+	}
+}
+
+int main()
+{
+	std::printf("detected isa: %s\n", getSimdIsaName(detectSimdIsa()));
+	benchPrecision<float>("float");
+	benchPrecision<double>("double");
+	return 0;
+}
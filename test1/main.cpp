@@ -1,62 +1,76 @@
 #include <SFML\Graphics.hpp>
 
+#include <core/BudgetedRenderer.h>
 #include <core/Scene.h>
+#include <core/TemporalRenderer.h>
+#include <core/FrameResolver.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
 
 using RenderType = double;
 
+// The pixel buffer and the texture are kept across frames and only reallocated when the size changes.
 template<typename T>
-sf::Texture viewportToTexture(const Viewport<T>& viewport)
+void updateTexture(const Viewport<T>& viewport, FrameResolver<T>& resolver, std::vector<sf::Uint8>& pixels, sf::Texture& texture)
 {
-    sf::Texture texture;
-    texture.create(viewport.getWidth(), viewport.getHeight());
-    sf::Uint8* pixels = new sf::Uint8[viewport.getWidth() * viewport.getHeight() * 4];
-
-    T min, max;
-    std::tie(min, max) = getMinMaxOnViewport<T>(viewport);
-
-    T factor = ((max - min) == 0) ? 1.0 : 1 / (max - min);
-
-    for (int col = 0; col < viewport.getWidth(); ++col)
-    {
-        for (int row = 0; row < viewport.getHeight(); ++row)
-        {
-            const Color<T>& c = viewport(col, row);
-            pixels[4 * (col + row * viewport.getWidth()) + 0] = sf::Uint8((c.r - min) / (max - min) * 255.0);
-            pixels[4 * (col + row * viewport.getWidth()) + 1] = sf::Uint8((c.g - min) / (max - min) * 255.0);
-            pixels[4 * (col + row * viewport.getWidth()) + 2] = sf::Uint8((c.b - min) / (max - min) * 255.0);
-            pixels[4 * (col + row * viewport.getWidth()) + 3] = sf::Uint8(255);
-        }
-    }
-
-    texture.update(pixels);
-    delete[] pixels;
-    return texture;
+    const unsigned width = unsigned(viewport.getWidth());
+    const unsigned height = unsigned(viewport.getHeight());
+    if (texture.getSize() != sf::Vector2u(width, height))
+        texture.create(width, height);
+
+    pixels.resize(4 * std::size_t(width) * height);
+    resolver.resolve(viewport, pixels.data());
+    texture.update(pixels.data());
 }
 
-Viewport<RenderType> renderScene()
+// Returns the index of the sphere the space bar moves.
+std::uint32_t buildScene(Scene<RenderType>& scene)
 {
-    Camera<RenderType> camera{{0.0, 0.0, 0.0}, {1.0, 0.0, 0.0}, deg_to_rad(90.0)};
-    Viewport<RenderType> viewport{800, 600};
-
-    Scene<RenderType> scene;
-    scene.addObject(new SphereGeometry<RenderType>{ {5.0, 0, 0}, std::sqrt(1) }, new FlatColorizer<RenderType>{ {1.0, 0.0, 0.0} }, new OpticalProperties<RenderType>{});
+    const std::uint32_t moving = scene.addObject(new SphereGeometry<RenderType>{ {5.0, 0, 0}, std::sqrt(1) }, new FlatColorizer<RenderType>{ {1.0, 0.0, 0.0} }, new OpticalProperties<RenderType>{});
     scene.addObject(new SphereGeometry<RenderType>{ {5.0, 1.0, 0}, std::sqrt(0.25) }, new FlatColorizer<RenderType>{ {0.0, 1.0, 0.0} }, new OpticalProperties<RenderType>{});
     scene.addObject(new SphereGeometry<RenderType>{ {5.0, 0, 1.0}, std::sqrt(0.25) }, new FlatColorizer<RenderType>{ {0.0, 0.0, 1.0} }, new OpticalProperties<RenderType>{});
 
     scene.addLight(new PointLight<RenderType>{ {0.0, 0.5, 5.0}, {1.0, 1.0, 1.0}, 1000.0 });
+    return moving;
+}
 
-    scene.render(camera, viewport);
-
-    return viewport;
+Camera<RenderType> makeCamera(RenderType yaw)
+{
+    return Camera<RenderType>{{0.0, 0.0, 0.0}, {std::cos(yaw), 0.0, std::sin(yaw)}, deg_to_rad(90.0)};
 }
 
 int main()
 {
     sf::RenderWindow sfmlWin(sf::VideoMode(1200, 800), "Hello World SFML Window");
 
-    sf::Texture texture = viewportToTexture(renderScene());
+    Scene<RenderType> scene;
+    const std::uint32_t moving = buildScene(scene);
+
+    RenderType yaw = 0.0;
+    bool raised = false;
+    bool edited = false;
+    bool dirty = true;
+    Viewport<RenderType> viewport{800, 600};
+    ThreadPool pool;
+    TemporalRenderer<RenderType> renderer;
+    // Temporal frames are traced on a worker thread, as the first one and those after a resize are
+    // full frames; the window keeps drawing the last one meanwhile. The scene, the viewport and the
+    // pool belong to the worker until it is joined.
+    std::thread worker;
+    std::atomic<bool> frameDone{ false };
+    // B toggles rendering every frame within 30 fps, full resolution around the mouse first.
+    BudgetedRenderer<RenderType> budgeted{ FrameBudgetSettings{} };
+    bool budgetMode = false;
+
+    FrameResolver<RenderType> resolver{ &pool };
+    std::vector<sf::Uint8> pixels;
+    sf::Texture texture;
     sf::Sprite sprite;
-    sprite.setTexture(texture);
+    sf::Clock clock;
 
     while (sfmlWin.isOpen())
     {
@@ -70,12 +84,86 @@ int main()
             case sf::Event::EventType::Closed:
                 sfmlWin.close();
                 break;
+            case sf::Event::EventType::KeyPressed:
+                if (e.key.code == sf::Keyboard::Space)
+                {
+                    // Applied once no frame is in flight.
+                    raised = !raised;
+                    edited = !edited;
+                }
+                else if (e.key.code == sf::Keyboard::B)
+                {
+                    budgetMode = !budgetMode;
+                    dirty = true;
+                }
+                break;
             }
         }
 
+        // Held arrow keys turn the camera at 60 degrees per second.
+        const RenderType elapsed = clock.restart().asSeconds();
+        const bool left = sf::Keyboard::isKeyPressed(sf::Keyboard::Left);
+        const bool right = sf::Keyboard::isKeyPressed(sf::Keyboard::Right);
+        if (left != right)
+        {
+            yaw += deg_to_rad(60.0 * elapsed) * (left ? -1.0 : 1.0);
+            dirty = true;
+        }
+
+        if (worker.joinable() && frameDone)
+        {
+            worker.join();
+            frameDone = false;
+            updateTexture(viewport, resolver, pixels, texture);
+            sprite.setTexture(texture, true);
+        }
+        const bool busy = worker.joinable();
+        if (!busy && edited)
+        {
+            scene.setObjectGeometry(moving, new SphereGeometry<RenderType>{ {5.0, 0, raised ? 0.5 : 0.0}, std::sqrt(1) });
+            edited = false;
+            dirty = true;
+        }
+
+        // Budgeted frames are traced every frame. Otherwise only the pixels the move or the edit
+        // uncovered are traced; the others are reprojected.
+        if (busy)
+        {
+            // Moves and edits wait for the frame in flight.
+        }
+        else if (budgetMode)
+        {
+            FrameBudgetSettings settings = budgeted.getSettings();
+            const sf::Vector2i mouse = sf::Mouse::getPosition(sfmlWin);
+            settings.focusX = std::max(0.f, std::min(1.f, float(mouse.x) / float(viewport.getWidth())));
+            settings.focusY = std::max(0.f, std::min(1.f, float(mouse.y) / float(viewport.getHeight())));
+            budgeted.setSettings(settings);
+            budgeted.render(scene, makeCamera(yaw), viewport, pool);
+            updateTexture(viewport, resolver, pixels, texture);
+            sprite.setTexture(texture, true);
+
+            const FrameBudgetStats& stats = budgeted.getStats();
+            char title[128];
+            std::snprintf(title, sizeof(title), "Budgeted: %dx%d, %.1f ms, %zu/%zu fovea tiles", stats.width, stats.height, stats.frameMilliseconds,
+                stats.foveaTiles, stats.foveaTiles + stats.skippedFoveaTiles);
+            sfmlWin.setTitle(title);
+        }
+        else if (dirty)
+        {
+            const Camera<RenderType> camera = makeCamera(yaw);
+            worker = std::thread([&, camera]
+            {
+                renderer.render(scene, camera, viewport, pool);
+                frameDone = true;
+            });
+            dirty = false;
+        }
+
         sfmlWin.clear();
         sfmlWin.draw(sprite);
         sfmlWin.display();
     }
+    if (worker.joinable())
+        worker.join();
     return 0;
 }